@@ -1,10 +1,16 @@
 /**
  * @file    ble_bind.c
  * @author  Azolla (1228449928@qq.com)
- * @brief   ble mesh绑定的设备信息
+ * @brief   ble mesh节点登记表（绑定信息 + 在线状态 + 能力）
+ *          - 表的大小在启动时确定（NVS中保存的 "nodemax"，没有则用 menuconfig 的 CONFIG_MESH_NODE_MAX，不超过 BIND_TABLE_MAX），放在PSRAM；
+ *          - MAC/单播地址哈希索引，设备名排序索引，绑定/解绑时增量维护，查找不随设备数线性增长；
+ *          - 绑定信息按页（BIND_PAGE_SIZE 条记录一个NVS键）保存，绑定/解绑只重写一页；
+ *          - 写NVS由低优先级任务延时合并后执行，不阻塞mesh处理任务；
+ *          - 在线状态按最后心跳时间排成链表，心跳更新/超时检查都是O(1)，状态变化进队列等待上报；
+ *          - 空闲索引放在空闲栈中，绑定不用扫描整表；整表复制/清除按页分段加锁，不长时间关中断。
  * @version 0.1
  * @date    2023-06-14
- * 
+ *
  * @copyright Copyright (c) 2023
  * */
 
@@ -16,123 +22,841 @@
 #include "nvs_flash.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/queue.h"
- 
+
 
 #include "ble_bind.h"
+#include "ble_mesh.h"
 
 // #define TAG  "ble_bind"
- 
-static mesh_bind_nvs_t nvs_bind;
- 
-void mesh_bind_init(void)
-{  
-    ble_bind_nvs_store(&nvs_bind, sizeof(mesh_bind_nvs_t), NVS_MODE_READ);  
 
-#ifdef TAG    
-    for (uint8_t i = 0; i < BIND_TABLE_SIZE; i++) {
-        if (nvs_bind.node[i].uniaddr > 0) {
-            ESP_LOGI(TAG, "[%d]bind_addr = "MACSTR"|%s, uniaddr = 0x%04x, pid = 0x%02x", i, MAC2STR(nvs_bind.node[i].addr), nvs_bind.node[i].name, nvs_bind.node[i].uniaddr, nvs_bind.node[i].pid);   
+#define BIND_STORE_DELAY    1000   // 合并写NVS的延时/MS（配网/解绑通常是连续的）
+#define BIND_INDEX_NULL     0xFFFF
+
+#define BIND_NODE(i)        (bind_node[i].bind)
+
+static mesh_node_t *bind_node = NULL;   // [bind_size]
+static uint16_t bind_size = 0;          // 表的大小（mesh_bind_init() 确定），0: 还没有初始化
+static uint16_t bind_page_num = 0;
+static portMUX_TYPE bind_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool    *bind_page_dirty = NULL;            // [bind_page_num] 待写入的页
+static bool    *bind_page_stored = NULL;           // [bind_page_num] NVS中已有的页
+static uint16_t *bind_free = NULL;                 // [bind_size] 空闲索引栈（栈顶是最小的空闲索引）
+static uint16_t  bind_free_num = 0;
+static uint32_t bind_legacy_slot = 0;              // 上一版按记录存储的键（bit: 索引），迁移完后删除
+static bool     bind_legacy = false;               // 旧版整表存储，迁移完后删除
+static mesh_bind_stats_t bind_stats = { 0 };
+static TaskHandle_t xBindTask = NULL;
+
+//============================================================================================
+// 索引：MAC/单播地址哈希（开放寻址，线性探测），设备名排序（前缀查找）
+static uint16_t *bind_mac_hash = NULL;       // [bind_hash_mask + 1]
+static uint16_t *bind_uniaddr_hash = NULL;   // [bind_hash_mask + 1]
+static uint16_t *bind_name_sort = NULL;      // [bind_size] 按 (设备名, 索引) 排序
+static uint16_t  bind_name_num = 0;
+static uint16_t  bind_hash_mask = 0;         // 哈希槽数 - 1（槽数是2的幂，至少是表大小的两倍）
+
+static uint16_t mesh_bind_hash_mac(const uint8_t addr[6])
+{
+    uint32_t hash = 2166136261UL;  // FNV-1a
+    for (uint8_t i = 0; i < 6; i++) {
+        hash ^= addr[i];
+        hash *= 16777619UL;
+    }
+    return hash & bind_hash_mask;
+}
+
+static uint16_t mesh_bind_hash_uniaddr(uint16_t uniaddr)
+{
+    return (uniaddr * 40503UL >> 8) & bind_hash_mask;
+}
+
+static uint16_t mesh_bind_home_mac(uint16_t nvs_id)
+{
+    return mesh_bind_hash_mac(BIND_NODE(nvs_id).addr);
+}
+
+static uint16_t mesh_bind_home_uniaddr(uint16_t nvs_id)
+{
+    return mesh_bind_hash_uniaddr(BIND_NODE(nvs_id).uniaddr);
+}
+
+static void mesh_bind_hash_insert(uint16_t *table, uint16_t pos, uint16_t nvs_id)
+{
+    while (table[pos] != BIND_INDEX_NULL) {
+        pos = (pos + 1) & bind_hash_mask;
+    }
+    table[pos] = nvs_id;
+}
+
+// 删除后把后面同一探测链上的表项往前移（不用墓碑标记）
+static void mesh_bind_hash_delete(uint16_t *table, uint16_t nvs_id, uint16_t (*home)(uint16_t))
+{
+    uint16_t pos = home(nvs_id);
+    while (table[pos] != nvs_id) {
+        if (table[pos] == BIND_INDEX_NULL) return;
+        pos = (pos + 1) & bind_hash_mask;
+    }
+
+    uint16_t next = pos;
+    while (1) {
+        table[pos] = BIND_INDEX_NULL;
+        while (1) {
+            next = (next + 1) & bind_hash_mask;
+            if (table[next] == BIND_INDEX_NULL) return;
+            uint16_t ideal = home(table[next]);
+            // ideal 不在 (pos, next] 之间，就可以移到 pos
+            if (((next - ideal) & bind_hash_mask) >= ((next - pos) & bind_hash_mask)) break;
         }
+        table[pos] = table[next];
+        pos = next;
     }
-#endif  
 }
 
-// 根据addr[]找到对应的设备名 
-char *mesh_bind_find_name(uint8_t addr[6])
+static int mesh_bind_name_cmp(uint16_t a, uint16_t b)
+{
+    int cmp = strncmp(BIND_NODE(a).name, BIND_NODE(b).name, sizeof(BIND_NODE(a).name));
+    return (cmp != 0) ? cmp : (a - b);
+}
+
+// 第一个 >= nvs_id 的排序位置
+static uint16_t mesh_bind_name_lower(uint16_t nvs_id)
 {
-    for (uint8_t i = 0; i < BIND_TABLE_SIZE; i++) {
-        if (memcmp(nvs_bind.node[i].addr, addr, 6) == 0) { // 找一样的MAC地址
-            return nvs_bind.node[i].name;
+    uint16_t low = 0, high = bind_name_num;
+    while (low < high) {
+        uint16_t mid = (low + high) / 2;
+        if (mesh_bind_name_cmp(bind_name_sort[mid], nvs_id) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    return NULL;
+    return low;
 }
 
-// 根据name 找到对应的 addr[]
-bool mesh_bind_find_addr(const char *name, uint8_t addr[6])
+// 调用前要持有 bind_lock，且 bind_node[nvs_id] 已写入
+static void mesh_bind_index_insert(uint16_t nvs_id)
+{
+    mesh_bind_hash_insert(bind_mac_hash, mesh_bind_home_mac(nvs_id), nvs_id);
+    mesh_bind_hash_insert(bind_uniaddr_hash, mesh_bind_home_uniaddr(nvs_id), nvs_id);
+
+    uint16_t pos = mesh_bind_name_lower(nvs_id);
+    memmove(&bind_name_sort[pos + 1], &bind_name_sort[pos], (bind_name_num - pos) * sizeof(uint16_t));
+    bind_name_sort[pos] = nvs_id;
+    bind_name_num++;
+}
+
+// 调用前要持有 bind_lock，且 bind_node[nvs_id] 还没清除
+static void mesh_bind_index_delete(uint16_t nvs_id)
 {
-    for (uint8_t i = 0; i < BIND_TABLE_SIZE; i++) {
-        if (strncmp(nvs_bind.node[i].name, name, strlen(name)) == 0) {  
-            memcpy(addr, nvs_bind.node[i].addr, 6);
-            return true;
+    mesh_bind_hash_delete(bind_mac_hash, nvs_id, mesh_bind_home_mac);
+    mesh_bind_hash_delete(bind_uniaddr_hash, nvs_id, mesh_bind_home_uniaddr);
+
+    uint16_t pos = mesh_bind_name_lower(nvs_id);
+    if (pos < bind_name_num && bind_name_sort[pos] == nvs_id) {
+        bind_name_num--;
+        memmove(&bind_name_sort[pos], &bind_name_sort[pos + 1], (bind_name_num - pos) * sizeof(uint16_t));
+    }
+}
+
+static void mesh_bind_index_clear(void)
+{
+    memset(bind_mac_hash, 0xFF, (bind_hash_mask + 1) * sizeof(uint16_t));
+    memset(bind_uniaddr_hash, 0xFF, (bind_hash_mask + 1) * sizeof(uint16_t));
+    bind_name_num = 0;
+}
+
+// return: 索引，bind_size: 没有找到
+static uint16_t mesh_bind_index_mac(const uint8_t addr[6])
+{
+    if (bind_node == NULL) return bind_size;
+    uint16_t pos = mesh_bind_hash_mac(addr);
+    while (bind_mac_hash[pos] != BIND_INDEX_NULL) {
+        uint16_t nvs_id = bind_mac_hash[pos];
+        if (memcmp(BIND_NODE(nvs_id).addr, addr, 6) == 0) return nvs_id;
+        pos = (pos + 1) & bind_hash_mask;
+    }
+    return bind_size;
+}
+
+static uint16_t mesh_bind_index_uniaddr(uint16_t uniaddr)
+{
+    if (bind_node == NULL || uniaddr == 0) return bind_size;
+    uint16_t pos = mesh_bind_hash_uniaddr(uniaddr);
+    while (bind_uniaddr_hash[pos] != BIND_INDEX_NULL) {
+        uint16_t nvs_id = bind_uniaddr_hash[pos];
+        if (BIND_NODE(nvs_id).uniaddr == uniaddr) return nvs_id;
+        pos = (pos + 1) & bind_hash_mask;
+    }
+    return bind_size;
+}
+
+// 设备名以 prefix 开头的第 select 个设备（按设备名排序），return: bind_size: 没有找到
+static uint16_t mesh_bind_index_name(const char *prefix, uint16_t select)
+{
+    if (bind_node == NULL) return bind_size;
+    size_t len = strlen(prefix);
+    uint16_t low = 0, high = bind_name_num;
+    while (low < high) {  // 二分查找第一个 >= prefix 的设备名
+        uint16_t mid = (low + high) / 2;
+        if (strncmp(BIND_NODE(bind_name_sort[mid]).name, prefix, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    return false;
+    low += select;
+    if (low < bind_name_num && strncmp(BIND_NODE(bind_name_sort[low]).name, prefix, len) == 0) {
+        return bind_name_sort[low];
+    }
+    return bind_size;
 }
 
-// 可选择第几个设备
-bool mesh_bind_find_addr_select(const char *name, uint8_t select, uint8_t addr[6])
+//============================================================================================
+// 在线状态：在线节点按最后心跳时间串成链表（最早的在表头），收到心跳包移到表尾，超时检查只看表头
+static uint16_t *bind_seen_prev = NULL;      // [bind_size]
+static uint16_t *bind_seen_next = NULL;      // [bind_size]
+static uint16_t  bind_seen_head = BIND_INDEX_NULL;
+static uint16_t  bind_seen_tail = BIND_INDEX_NULL;
+static uint16_t *bind_change = NULL;         // [bind_size] 在线状态变化的节点（FIFO，每个节点最多排一次）
+static uint16_t  bind_change_head = 0;
+static uint16_t  bind_change_num = 0;
+
+// 以下调用前都要持有 bind_lock
+static void mesh_presence_unlink(uint16_t nvs_id)
+{
+    uint16_t prev = bind_seen_prev[nvs_id];
+    uint16_t next = bind_seen_next[nvs_id];
+    if (prev != BIND_INDEX_NULL) bind_seen_next[prev] = next; else bind_seen_head = next;
+    if (next != BIND_INDEX_NULL) bind_seen_prev[next] = prev; else bind_seen_tail = prev;
+}
+
+static void mesh_presence_link_tail(uint16_t nvs_id)
+{
+    bind_seen_prev[nvs_id] = bind_seen_tail;
+    bind_seen_next[nvs_id] = BIND_INDEX_NULL;
+    if (bind_seen_tail != BIND_INDEX_NULL) bind_seen_next[bind_seen_tail] = nvs_id; else bind_seen_head = nvs_id;
+    bind_seen_tail = nvs_id;
+}
+
+static void mesh_presence_changed(uint16_t nvs_id)
+{
+    if (bind_node[nvs_id].pending) return;  // 已经在队列中，上报时取最新的状态
+    bind_node[nvs_id].pending = true;
+    bind_change[(bind_change_head + bind_change_num) % bind_size] = nvs_id;
+    bind_change_num++;
+}
+
+// 节点清除前调用：从在线链表和变化队列中移除
+static void mesh_presence_reset(uint16_t nvs_id)
 {
-    for (uint8_t i = 0, sel = 0; i < BIND_TABLE_SIZE; i++) {
-        if (strncmp(nvs_bind.node[i].name, name, strlen(name)) == 0) {  
-            if (++sel > select) {
-                memcpy(addr, nvs_bind.node[i].addr, 6);
-                return true;
+    if (bind_node[nvs_id].online) mesh_presence_unlink(nvs_id);
+    if (bind_node[nvs_id].pending) {
+        uint16_t num = 0;
+        for (uint16_t i = 0; i < bind_change_num; i++) {
+            uint16_t id = bind_change[(bind_change_head + i) % bind_size];
+            if (id != nvs_id) bind_change[(bind_change_head + num++) % bind_size] = id;
+        }
+        bind_change_num = num;
+    }
+}
+
+//============================================================================================
+// 通知写NVS任务（不能在临界区内调用）
+static void mesh_bind_store_notify(void)
+{
+    if (xBindTask != NULL) xTaskNotifyGive(xBindTask);
+}
+
+// 调用前要持有 bind_lock
+static void mesh_bind_mark_dirty(uint16_t nvs_id)
+{
+    bind_page_dirty[nvs_id / BIND_PAGE_SIZE] = true;
+}
+
+// 写NVS任务：等待有记录更新，延时合并后逐页写入
+static void mesh_bind_store_task(void *arg)
+{
+    mesh_bind_t page[BIND_PAGE_SIZE];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(BIND_STORE_DELAY));  // 合并这段时间内的更新
+        ulTaskNotifyTake(pdTRUE, 0);
+        bind_stats.flush++;
+
+        bool pending = false;
+        for (uint16_t p = 0; p < bind_page_num; p++) {
+            bool used = false;
+            taskENTER_CRITICAL(&bind_lock);
+            bool dirty = bind_page_dirty[p];
+            bind_page_dirty[p] = false;
+            for (uint16_t i = 0; dirty && i < BIND_PAGE_SIZE; i++) {
+                uint16_t nvs_id = p * BIND_PAGE_SIZE + i;
+                if (nvs_id < bind_size) {
+                    page[i] = BIND_NODE(nvs_id);
+                } else {
+                    memset(&page[i], 0, sizeof(mesh_bind_t));
+                }
+                if (page[i].uniaddr > 0) used = true;
+            }
+            taskEXIT_CRITICAL(&bind_lock);
+            if (dirty == false) continue;
+
+            esp_err_t err = ESP_OK;
+            if (used == true) {
+                err = ble_bind_page_nvs_store(p, page, sizeof(page), NVS_MODE_WRITE);
+                if (err == ESP_OK) {
+                    bind_page_stored[p] = true;
+                    bind_stats.write++;
+                }
+            } else if (bind_page_stored[p] == true) {  // NVS中没有的页不用删
+                err = ble_bind_page_nvs_store(p, page, sizeof(page), NVS_MODE_ERASE);
+                if (err == ESP_OK) {
+                    bind_page_stored[p] = false;
+                    bind_stats.erase++;
+                }
+            }
+            if (err != ESP_OK) {
+                bind_stats.error++;
+                taskENTER_CRITICAL(&bind_lock);
+                bind_page_dirty[p] = true;   // 下次再写
+                taskEXIT_CRITICAL(&bind_lock);
+                pending = true;
+            }
+        }
+
+        if (pending == false) {  // 已全部按页保存，删除旧版的存储
+            for (uint8_t i = 0; i < BIND_LEGACY_SIZE; i++) {
+                if ((bind_legacy_slot >> i) & 1) {
+                    ble_bind_slot_nvs_store(i, page, sizeof(mesh_bind_t), NVS_MODE_ERASE);
+                    bind_stats.erase++;
+                }
+            }
+            bind_legacy_slot = 0;
+            if (bind_legacy == true) {
+                ble_bind_nvs_store(page, sizeof(mesh_bind_nvs_t), NVS_MODE_ERASE);
+                bind_legacy = false;
+                bind_stats.erase++;
             }
         }
+
+        #ifdef TAG
+        ESP_LOGI(TAG, "bind store: write = %ld, erase = %ld, flush = %ld, error = %ld", bind_stats.write, bind_stats.erase, bind_stats.flush, bind_stats.error);
+        #endif
     }
-    return false;
 }
 
-// 添加绑定
-bool mesh_bind_add(mesh_bind_t bind)
+void mesh_bind_get_stats(mesh_bind_stats_t *stats)
+{
+    *stats = bind_stats;
+}
+
+// 读取上一版的存储：按记录（"_BIND_00_"）或整表（"_BIND_KEY_"）
+static void mesh_bind_load_legacy(void)
+{
+    for (uint8_t i = 0; i < BIND_LEGACY_SIZE; i++) {
+        ble_bind_slot_nvs_store(i, &BIND_NODE(i), sizeof(mesh_bind_t), NVS_MODE_READ);
+        if (BIND_NODE(i).uniaddr > 0) bind_legacy_slot |= 1UL << i;
+    }
+    if (bind_legacy_slot != 0) return;
+
+    mesh_bind_nvs_t *nvs_bind = heap_caps_calloc(1, sizeof(mesh_bind_nvs_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (nvs_bind == NULL) return;
+    ble_bind_nvs_store(nvs_bind, sizeof(mesh_bind_nvs_t), NVS_MODE_READ);
+    for (uint8_t i = 0; i < BIND_LEGACY_SIZE; i++) {
+        if (nvs_bind->node[i].uniaddr > 0) {
+            BIND_NODE(i) = nvs_bind->node[i];
+            bind_legacy = true;
+        }
+    }
+    heap_caps_free(nvs_bind);
+}
+
+// 表的大小：NVS中保存的（mesh_bind_set_size()），没有就用 menuconfig 的默认值
+static uint16_t mesh_bind_load_size(void)
+{
+    uint16_t size = 0;
+    ble_bind_size_nvs_store(&size, NVS_READONLY);
+    if (size == 0) size = CONFIG_MESH_NODE_MAX;
+    if (size < BIND_TABLE_MIN) size = BIND_TABLE_MIN;
+    if (size > BIND_TABLE_MAX) size = BIND_TABLE_MAX;
+    return size;
+}
+
+// 释放全部的表（分配失败时调用，bind_node = NULL 后其它接口都直接返回）
+static void mesh_bind_free_all(void)
+{
+    heap_caps_free(bind_node);
+    heap_caps_free(bind_mac_hash);
+    heap_caps_free(bind_uniaddr_hash);
+    heap_caps_free(bind_name_sort);
+    heap_caps_free(bind_seen_prev);
+    heap_caps_free(bind_seen_next);
+    heap_caps_free(bind_change);
+    heap_caps_free(bind_free);
+    heap_caps_free(bind_page_dirty);
+    heap_caps_free(bind_page_stored);
+    bind_node = NULL;
+    bind_mac_hash = NULL;
+    bind_uniaddr_hash = NULL;
+    bind_name_sort = NULL;
+    bind_seen_prev = NULL;
+    bind_seen_next = NULL;
+    bind_change = NULL;
+    bind_free = NULL;
+    bind_page_dirty = NULL;
+    bind_page_stored = NULL;
+    bind_size = 0;
+    bind_page_num = 0;
+}
+
+void mesh_bind_init(void)
+{
+    bind_size = mesh_bind_load_size();
+    bind_page_num = (bind_size + BIND_PAGE_SIZE - 1) / BIND_PAGE_SIZE;
+    uint16_t hash_size = 8;
+    while (hash_size < bind_size * 2) hash_size <<= 1;
+    bind_hash_mask = hash_size - 1;
+
+    bind_node = heap_caps_calloc(bind_size, sizeof(mesh_node_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_mac_hash = heap_caps_malloc(hash_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_uniaddr_hash = heap_caps_malloc(hash_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_name_sort = heap_caps_malloc(bind_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_seen_prev = heap_caps_malloc(bind_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_seen_next = heap_caps_malloc(bind_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_change = heap_caps_malloc(bind_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_free = heap_caps_malloc(bind_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_page_dirty = heap_caps_calloc(bind_page_num, sizeof(bool), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bind_page_stored = heap_caps_calloc(bind_page_num, sizeof(bool), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (bind_node == NULL || bind_mac_hash == NULL || bind_uniaddr_hash == NULL || bind_name_sort == NULL ||
+        bind_seen_prev == NULL || bind_seen_next == NULL || bind_change == NULL || bind_free == NULL ||
+        bind_page_dirty == NULL || bind_page_stored == NULL) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "node table malloc fail, size = %d", bind_size);
+        #endif
+        mesh_bind_free_all();
+        return;
+    }
+    mesh_bind_index_clear();
+
+    bool stored = false;
+    for (uint16_t p = 0; p < bind_page_num; p++) {
+        mesh_bind_t page[BIND_PAGE_SIZE] = { 0 };
+        ble_bind_page_nvs_store(p, page, sizeof(page), NVS_MODE_READ);
+        for (uint16_t i = 0; i < BIND_PAGE_SIZE && p * BIND_PAGE_SIZE + i < bind_size; i++) {
+            if (page[i].uniaddr == 0) continue;
+            BIND_NODE(p * BIND_PAGE_SIZE + i) = page[i];
+            bind_page_stored[p] = true;
+            stored = true;
+        }
+    }
+
+    if (stored == false) {  // 上一版的存储：读出来后按页重新保存
+        mesh_bind_load_legacy();
+    }
+
+    for (uint16_t i = bind_size; i-- > 0; ) {  // 从大到小压栈，先用最小的空闲索引
+        if (BIND_NODE(i).uniaddr == 0) {
+            bind_free[bind_free_num++] = i;
+            continue;
+        }
+        mesh_bind_index_insert(i);
+        if (bind_legacy || bind_legacy_slot) mesh_bind_mark_dirty(i);
+    }
+
+    xTaskCreatePinnedToCore(mesh_bind_store_task, "mesh_bind_store", 3 * 1024, NULL, 2, &xBindTask, APP_CPU_NUM);
+    if (bind_legacy || bind_legacy_slot) xTaskNotifyGive(xBindTask);
+
+#ifdef TAG
+    for (uint16_t i = 0; i < bind_size; i++) {
+        if (BIND_NODE(i).uniaddr > 0) {
+            ESP_LOGI(TAG, "[%d]bind_addr = "MACSTR"|%s, uniaddr = 0x%04x, pid = 0x%02x", i, MAC2STR(BIND_NODE(i).addr), BIND_NODE(i).name, BIND_NODE(i).uniaddr, BIND_NODE(i).pid);
+        }
+    }
+#endif
+}
+
+// 根据addr[]找到对应的设备名（在锁内复制，表项随时可能被删除/改名）
+bool mesh_bind_find_name(const uint8_t addr[6], char *name, uint8_t size)
+{
+    if (name == NULL || size == 0) return false;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_mac(addr);
+    if (nvs_id < bind_size) {
+        strncpy(name, BIND_NODE(nvs_id).name, size - 1);
+        name[size - 1] = '\0';
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+    return (nvs_id < bind_size);
+}
+
+// 根据name（前缀）找到对应的 addr[]
+bool mesh_bind_find_addr(const char *name, uint8_t addr[6])
+{
+    return mesh_bind_find_addr_select(name, 0, addr);
+}
+
+// 根据addr[]找到对应的单播地址
+uint16_t mesh_bind_find_uniaddr(const uint8_t addr[6])
+{
+    uint16_t uniaddr = 0;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_mac(addr);
+    if (nvs_id < bind_size) uniaddr = BIND_NODE(nvs_id).uniaddr;
+    taskEXIT_CRITICAL(&bind_lock);
+    return uniaddr;
+}
+
+// 根据单播地址找到对应的addr[]
+bool mesh_bind_find_mac(uint16_t uniaddr, uint8_t addr[6])
+{
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) memcpy(addr, BIND_NODE(nvs_id).addr, 6);
+    taskEXIT_CRITICAL(&bind_lock);
+    return (nvs_id < bind_size);
+}
+
+// 根据设备名找到对应的单播地址（设备名要完全一致）
+uint16_t mesh_bind_find_uniaddr_name(const char *name)
+{
+    uint16_t uniaddr = 0;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_name(name, 0);  // 完全一致的排在前缀相同的最前面
+    if (nvs_id < bind_size && strcmp(BIND_NODE(nvs_id).name, name) == 0) {
+        uniaddr = BIND_NODE(nvs_id).uniaddr;
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+    return uniaddr;
+}
+
+uint16_t mesh_bind_size(void)
+{
+    return bind_size;
+}
+
+// 修改表的大小（保存到NVS，重启后生效），不能小于已使用的最大索引 + 1
+esp_err_t mesh_bind_set_size(uint16_t size)
+{
+    if (size < BIND_TABLE_MIN || size > BIND_TABLE_MAX) return ESP_ERR_INVALID_ARG;
+    for (uint16_t base = size; base < bind_size; base += BIND_PAGE_SIZE) {
+        bool used = false;
+        taskENTER_CRITICAL(&bind_lock);  // 每次只锁一页
+        for (uint16_t i = base; i < base + BIND_PAGE_SIZE && i < bind_size; i++) {
+            if (BIND_NODE(i).uniaddr > 0) used = true;
+        }
+        taskEXIT_CRITICAL(&bind_lock);
+        if (used) return ESP_ERR_INVALID_SIZE;  // 缩小后这些设备会丢失，先解绑
+    }
+    return ble_bind_size_nvs_store(&size, NVS_READWRITE);
+}
+
+// 复制全部已绑定的设备信息（每次只锁一页，不是原子快照），return: 设备数
+uint16_t mesh_bind_get_all(mesh_bind_t *bind, uint16_t max)
 {
-    uint8_t nvs_id = BIND_TABLE_SIZE;
-    for (uint8_t i = 0; i < BIND_TABLE_SIZE; i++) {
-        if ((nvs_bind.node[i].addr[0] | nvs_bind.node[i].addr[3]) == 0) {  // 该索引没有数据
-            if (nvs_id > i) nvs_id = i;  // 用最小索引
+    uint16_t num = 0;
+    if (bind_node == NULL) return 0;
+    for (uint16_t base = 0; base < bind_size && num < max; base += BIND_PAGE_SIZE) {
+        taskENTER_CRITICAL(&bind_lock);
+        for (uint16_t i = base; i < base + BIND_PAGE_SIZE && i < bind_size && num < max; i++) {
+            if (BIND_NODE(i).uniaddr > 0) bind[num++] = BIND_NODE(i);
         }
-        if (memcmp(nvs_bind.node[i].addr, bind.addr, 6) == 0) { // 找到重复MAC地址了
-            nvs_id = i;  // 更新当前的设备信息，支持重复绑定！
-            break;  // 支持重复绑定！
-            // return false;  // 不支持重复绑定！
-        } 
+        taskEXIT_CRITICAL(&bind_lock);
     }
- 
-    if (nvs_id >= BIND_TABLE_SIZE) {
+    return num;
+}
+
+// 可选择第几个设备（设备名前缀，如 "YiCW"，按设备名排序）
+bool mesh_bind_find_addr_select(const char *name, uint8_t select, uint8_t addr[6])
+{
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_name(name, select);
+    if (nvs_id < bind_size) memcpy(addr, BIND_NODE(nvs_id).addr, 6);
+    taskEXIT_CRITICAL(&bind_lock);
+    return (nvs_id < bind_size);
+}
+
+// 添加绑定
+bool mesh_bind_add(mesh_bind_t bind)
+{
+    if (bind_node == NULL || bind.uniaddr == 0) return false;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_mac(bind.addr);  // 重复MAC地址：更新当前的设备信息，支持重复绑定！
+    if (nvs_id < bind_size) {
+        mesh_bind_index_delete(nvs_id);
+        mesh_presence_reset(nvs_id);
+    } else if (bind_free_num > 0) {
+        nvs_id = bind_free[--bind_free_num];
+    } else {
+        taskEXIT_CRITICAL(&bind_lock);
         return false;  // 没有多余空间了！
     }
- 
-    memcpy(&nvs_bind.node[nvs_id], &bind, sizeof(mesh_bind_t)); 
-    nvs_bind.update = true;   // 绑定更新！
- 
-    #ifdef TAG  
-    ESP_LOGI(TAG, "[%d]bind_addr = "MACSTR"|%s, uniaddr = 0x%04x, pid = 0x%02x", nvs_id, MAC2STR(nvs_bind.node[nvs_id].addr), nvs_bind.node[nvs_id].name, nvs_bind.node[nvs_id].uniaddr, nvs_bind.node[nvs_id].pid);   
+
+    memset(&bind_node[nvs_id], 0, sizeof(mesh_node_t));  // 重新配网：能力/在线状态重新获取
+    BIND_NODE(nvs_id) = bind;
+    mesh_bind_index_insert(nvs_id);
+    mesh_bind_mark_dirty(nvs_id);   // 绑定更新！
+    taskEXIT_CRITICAL(&bind_lock);
+    mesh_bind_store_notify();
+
+    #ifdef TAG
+    ESP_LOGI(TAG, "[%d]bind_addr = "MACSTR"|%s, uniaddr = 0x%04x, pid = 0x%02x", nvs_id, MAC2STR(bind.addr), bind.name, bind.uniaddr, bind.pid);
     #endif
- 
+
     return true;
 }
 
-void mesh_bind_update(void)
+// 删除一条绑定，索引放回空闲栈（调用前要持有 bind_lock）
+static void mesh_bind_delete(uint16_t nvs_id)
 {
-    if (nvs_bind.update == true) { // true: 绑定信息有更新
-        vTaskDelay(1000);
-        nvs_bind.update = false; 
-        ble_bind_nvs_store(&nvs_bind, sizeof(mesh_bind_nvs_t), NVS_MODE_WRITE);       // 更新绑定的设备信息 
-    }
+    mesh_bind_index_delete(nvs_id);
+    mesh_presence_reset(nvs_id);
+    memset(&bind_node[nvs_id], 0, sizeof(mesh_node_t));
+    mesh_bind_mark_dirty(nvs_id);   // 绑定更新！
+    bind_free[bind_free_num++] = nvs_id;
 }
 
-// 绑定全部清空
+// 绑定全部清空：从后往前每次删一页（清空后空闲栈顶还是最小的索引）
 void mesh_bind_remove_all(void)
 {
-    memset(&nvs_bind, 0, sizeof(mesh_bind_nvs_t));
-    ble_bind_nvs_store(&nvs_bind, sizeof(mesh_bind_nvs_t), NVS_MODE_ERASE);    
+    if (bind_node == NULL) return;
+    for (uint16_t p = bind_page_num; p-- > 0; ) {
+        taskENTER_CRITICAL(&bind_lock);
+        for (uint16_t i = BIND_PAGE_SIZE; i-- > 0; ) {
+            uint16_t nvs_id = p * BIND_PAGE_SIZE + i;
+            if (nvs_id < bind_size && BIND_NODE(nvs_id).uniaddr > 0) mesh_bind_delete(nvs_id);
+        }
+        taskEXIT_CRITICAL(&bind_lock);
+    }
+    mesh_bind_store_notify();
 }
 
 bool mesh_bind_remove(uint16_t unicast_addr)
 {
-    for (uint8_t i = 0; i < BIND_TABLE_SIZE; i++) {
-        if (nvs_bind.node[i].uniaddr == unicast_addr) { // 对比是否已经绑定了
-            memset(&nvs_bind.node[i], 0, sizeof(mesh_bind_nvs_t));
-            nvs_bind.update = true;   // 绑定更新！ 
-            #ifdef TAG    
-            // ESP_LOGI(TAG, "[%d]unbind_addr = "MACSTR"|%s, uniaddr = 0x%04x, pid = 0x%02x", i, MAC2STR(nvs_bind.node[i].addr), nvs_bind.node[i].name, nvs_bind.node[i].uniaddr, nvs_bind.node[i].pid);   
-            #endif
-            break;
-        }
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(unicast_addr);
+    if (nvs_id < bind_size) {  // 对比是否已经绑定了
+        mesh_bind_delete(nvs_id);
     }
+    taskEXIT_CRITICAL(&bind_lock);
+    if (nvs_id < bind_size) mesh_bind_store_notify();
     return true;  // 没找到也返回成功
 }
+
+//============================================================================================
+// 节点的运行时数据：能力（Composition Data）、在线状态（心跳包）
+bool mesh_node_get(uint16_t uniaddr, mesh_node_t *node)
+{
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) *node = bind_node[nvs_id];
+    taskEXIT_CRITICAL(&bind_lock);
+    return (nvs_id < bind_size);
+}
+
+// SIG 模型ID => 能力位
+static uint8_t mesh_node_sig_cap(uint16_t model_id)
+{
+    switch (model_id) {
+    case ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_SRV:       return MESH_CAP_ONOFF;
+    case ESP_BLE_MESH_MODEL_ID_GEN_LEVEL_SRV:       return MESH_CAP_LEVEL;
+    case ESP_BLE_MESH_MODEL_ID_LIGHT_LIGHTNESS_SRV: return MESH_CAP_LIGHTNESS;
+    case ESP_BLE_MESH_MODEL_ID_LIGHT_CTL_SRV:       return MESH_CAP_CTL;
+    case ESP_BLE_MESH_MODEL_ID_LIGHT_HSL_SRV:       return MESH_CAP_HSL;
+    default:                                        return 0;
+    }
+}
+
+// Composition Data Page 0: CID(2) PID(2) VID(2) CRPL(2) Features(2) + Elements[Loc(2) NumS(1) NumV(1) SIG(2*NumS) Vendor(4*NumV)]
+void mesh_node_set_comp(uint16_t uniaddr, const uint8_t *data, uint16_t len)
+{
+    if (data == NULL || len < 10) return;
+    uint8_t elem_num = 0;
+    uint8_t caps[MESH_NODE_ELEM_MAX] = { 0 };
+    for (uint16_t offset = 10; offset + 4 <= len; elem_num++) {
+        uint8_t nums = data[offset + 2];
+        uint8_t numv = data[offset + 3];
+        uint16_t end = offset + 4 + nums * 2 + numv * 4;
+        if (end > len) break;  // 数据不完整
+        uint8_t cap = 0;
+        const uint8_t *model = &data[offset + 4];
+        for (uint8_t i = 0; i < nums; i++, model += 2) {
+            cap |= mesh_node_sig_cap(model[0] | (model[1] << 8));
+        }
+        for (uint8_t i = 0; i < numv; i++, model += 4) {  // CID(2) + Model ID(2)
+            uint16_t company_id = model[0] | (model[1] << 8);
+            uint16_t model_id   = model[2] | (model[3] << 8);
+            if (company_id == CID_COMPANY && model_id == GENIE_VENDOR_MODEL_ID_SERVER) cap |= MESH_CAP_VENDOR;
+        }
+        if (elem_num < MESH_NODE_ELEM_MAX) caps[elem_num] = cap;
+        offset = end;
+    }
+
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) {
+        mesh_node_t *node = &bind_node[nvs_id];
+        node->cid  = data[0] | (data[1] << 8);
+        node->pid  = data[2] | (data[3] << 8);
+        node->vid  = data[4] | (data[5] << 8);
+        node->feat = data[8] | (data[9] << 8);
+        node->elem_num = elem_num;
+        memcpy(node->caps, caps, sizeof(node->caps));
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+}
+
+// 元素地址所属节点的登记序号（调用者持有 bind_lock），return: BIND_INDEX_NULL: 不是已知节点的元素
+static uint16_t mesh_node_index_element(uint16_t addr, uint8_t *elem)
+{
+    for (uint8_t i = 0; i < MESH_NODE_ELEM_MAX && i < addr; i++) {
+        uint16_t nvs_id = mesh_bind_index_uniaddr(addr - i);
+        if (nvs_id >= bind_size) continue;
+        if (i == 0 || i < bind_node[nvs_id].elem_num) {
+            *elem = i;
+            return nvs_id;
+        }
+        break;  // 遇到其他节点的主元素就不用再往前找了
+    }
+    return BIND_INDEX_NULL;
+}
+
+int8_t mesh_node_find_element(uint16_t addr, mesh_node_t *node)
+{
+    uint8_t elem = 0;
+    if (bind_node == NULL) return -1;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_node_index_element(addr, &elem);
+    if (nvs_id < bind_size) *node = bind_node[nvs_id];
+    taskEXIT_CRITICAL(&bind_lock);
+    return nvs_id < bind_size ? elem : -1;
+}
+
+// 收到心跳包：更新最后心跳时间，离线的节点上线
+void mesh_node_heartbeat(uint16_t uniaddr, uint8_t hops, uint8_t ttl)
+{
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) {
+        mesh_node_t *node = &bind_node[nvs_id];
+        if (node->online) {
+            mesh_presence_unlink(nvs_id);
+        } else {
+            node->online = true;
+            mesh_presence_changed(nvs_id);
+        }
+        mesh_presence_link_tail(nvs_id);
+        node->last_seen = xTaskGetTickCount();
+        node->hops = hops;
+        node->ttl  = ttl;
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+}
+
+// 周期调用：MESH_PRESENCE_TIMEOUT 没收到心跳包的节点离线（只检查链表头），return: 本次离线的节点数
+uint16_t mesh_node_presence_check(void)
+{
+    uint16_t offline = 0;
+    if (bind_node == NULL) return 0;
+    TickType_t now = xTaskGetTickCount();
+    taskENTER_CRITICAL(&bind_lock);
+    while (bind_seen_head != BIND_INDEX_NULL) {
+        uint16_t nvs_id = bind_seen_head;
+        if (now - bind_node[nvs_id].last_seen < pdMS_TO_TICKS(MESH_PRESENCE_TIMEOUT * 1000)) break;
+        mesh_presence_unlink(nvs_id);
+        bind_node[nvs_id].online = false;
+        mesh_presence_changed(nvs_id);
+        offline++;
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+    return offline;
+}
+
+// 取出在线状态有变化的节点（上报前又变回去的不再上报），return: 取出的个数
+uint16_t mesh_node_presence_poll(mesh_presence_t *evt, uint16_t max)
+{
+    uint16_t num = 0;
+    if (bind_node == NULL) return 0;
+    taskENTER_CRITICAL(&bind_lock);
+    while (bind_change_num > 0 && num < max) {
+        mesh_node_t *node = &bind_node[bind_change[bind_change_head]];
+        bind_change_head = (bind_change_head + 1) % bind_size;
+        bind_change_num--;
+        node->pending = false;
+        if (node->online == node->reported) continue;
+        node->reported = node->online;
+        evt[num].uniaddr = node->bind.uniaddr;
+        evt[num].online  = node->online;
+        evt[num].hops    = node->hops;
+        num++;
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+    return num;
+}
+
+// 链路估计只由发送引擎（ble_mesh_tx_task）写入
+void mesh_node_set_link(uint16_t uniaddr, const mesh_link_t *link)
+{
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) bind_node[nvs_id].link = *link;
+    taskEXIT_CRITICAL(&bind_lock);
+}
+
+// 发到次元素的消息算在节点的主元素上；在锁内直接累加，不复制节点
+void mesh_node_add_stats(uint16_t addr, uint8_t tx, uint8_t ack, uint8_t timeout)
+{
+    uint8_t elem = 0;
+    if (bind_node == NULL) return;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_node_index_element(addr, &elem);
+    if (nvs_id < bind_size) {
+        mesh_node_stats_t *stats = &bind_node[nvs_id].stats;
+        stats->tx += tx;
+        stats->ack += ack;
+        stats->timeout += timeout;
+    }
+    taskEXIT_CRITICAL(&bind_lock);
+}
+
+// 每次只锁一页
+void mesh_node_clear_stats(void)
+{
+    if (bind_node == NULL) return;
+    for (uint16_t base = 0; base < bind_size; base += BIND_PAGE_SIZE) {
+        taskENTER_CRITICAL(&bind_lock);
+        for (uint16_t i = base; i < base + BIND_PAGE_SIZE && i < bind_size; i++) {
+            memset(&bind_node[i].stats, 0, sizeof(mesh_node_stats_t));
+        }
+        taskEXIT_CRITICAL(&bind_lock);
+    }
+}
+
+// 同 mesh_bind_get_all()：每次只锁一页，不是原子快照
+uint16_t mesh_node_get_all(mesh_node_t *node, uint16_t max)
+{
+    uint16_t num = 0;
+    if (bind_node == NULL) return 0;
+    for (uint16_t base = 0; base < bind_size && num < max; base += BIND_PAGE_SIZE) {
+        taskENTER_CRITICAL(&bind_lock);
+        for (uint16_t i = base; i < base + BIND_PAGE_SIZE && i < bind_size && num < max; i++) {
+            if (BIND_NODE(i).uniaddr > 0) node[num++] = bind_node[i];
+        }
+        taskEXIT_CRITICAL(&bind_lock);
+    }
+    return num;
+}
+
+bool mesh_node_online(uint16_t uniaddr)
+{
+    bool online = false;
+    taskENTER_CRITICAL(&bind_lock);
+    uint16_t nvs_id = mesh_bind_index_uniaddr(uniaddr);
+    if (nvs_id < bind_size) online = bind_node[nvs_id].online;
+    taskEXIT_CRITICAL(&bind_lock);
+    return online;
+}
  
\ No newline at end of file
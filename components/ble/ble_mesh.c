@@ -14,6 +14,7 @@
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"  
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_mac.h"
 #include "esp_flash.h"
@@ -35,6 +36,14 @@
 
 
 #include "ble_mesh.h"
+#include "ble_mesh_tx.h"
+#include "ble_mesh_rx.h"
+#include "ble_mesh_pool.h"
+#include "ble_mesh_shadow.h"
+#include "ble_mesh_group.h"
+#include "ble_mesh_prov.h"
+#include "ble_mesh_reset.h"
+#include "ble_mesh_ota.h"
 #include "ble_bind.h"
 
 #define TAG "ble_mesh"
@@ -46,9 +55,17 @@
 
 #define COMP_DATA_PAGE_0    0x00
 
+// 链路估计：超时时间 = SRTT + 4 * RTTVAR（同 TCP RTO）
+#define LINK_TIMEOUT_MIN    400       // 超时时间下限/MS
+#define LINK_TIMEOUT_MAX    5000      // 超时时间上限/MS
+#define LINK_HOP_TIME       400       // 还没有往返时间样本时，按心跳包跳数估算：每跳/MS
+#define LINK_TTL_MAX        7         // 连续超时加大TTL的上限
+#define LINK_FAIL_BACKOFF   2         // 连续超时这么多次后：超时时间加倍，TTL加一
+#define LINK_LOSS_HIGH      64        // 超时率 > 25%：多重发一次
+
 // ble-mesh 心跳包参数说明：https://www.jianshu.com/p/da255b8cdb74
 #define HEARTBEAT_GROUP_ADDR    0xC000    // 0x01–0x11	心跳间隔为2的(n-1)次幂秒  
-#define HEARTBEAT_PUB_PERIOD    0x05      // Heartbeat messages have a publication period of 2^(3-1) = 4 seconds
+#define HEARTBEAT_PUB_PERIOD    0x05      // Heartbeat messages have a publication period of 2^(5-1) = 16 seconds
 #define HEARTBEAT_PUB_TTL       0x02      // Maximum allowed TTL value
 #define HEARTBEAT_PUB_COUNT     0xFF      // Heartbeat messages are being sent indefinitely 
 
@@ -57,8 +74,6 @@
 
 //============================================================================================
 /* FreeRTOS event group to signal when we are connected & ready to make a request */
-static const uint8_t NESH_SEND_COMP_EVT = BIT0;    
-static const uint8_t NESH_SEND_TIMEOUT_EVT = BIT1; 
 static const uint8_t NESH_PROV_START_EVT = BIT2; 
 static const uint8_t NESH_PROV_OPEN_EVT  = BIT3;     
 static const uint8_t NESH_PROV_CLOSE_EVT = BIT4;
@@ -67,7 +82,9 @@ static const uint8_t NESH_PROV_ERROR_EVT = BIT6;
 static const uint8_t NESH_PROV_DELETE_EVT= BIT7;    
  
 static EventGroupHandle_t xEvent = NULL;   
-static QueueHandle_t xQueue = NULL;   
+
+static ble_mesh_callback_t ble_mesh_recv_callback = NULL;
+static ble_mesh_presence_callback_t ble_mesh_presence_callback = NULL;
 
 typedef struct {   
     uint8_t event;          /**< 1:开始配网 ; 2: 正在配网 ；4：配网完成； 0：未配网空闲 */
@@ -76,59 +93,102 @@ typedef struct {
 
 static ble_mesh_bind_prov_t bind_prov = { 0 }; 
 
-typedef struct {
-    uint16_t unicast;
-    bool     check;    // 1: 检测到心跳包
-    bool     online;   // 1: 在线
-} ble_mesh_node_hb_t;
-static ble_mesh_node_hb_t node_hb[CONFIG_BLE_MESH_MAX_PROV_NODES] = { 0 };
-// 心跳包接收处理
-static void ble_mesh_recv_hb(uint16_t hb_src)
+// 心跳包接收处理（在线状态记在节点登记表中）
+static void ble_mesh_recv_hb(uint16_t hb_src, uint8_t hops, uint8_t rx_ttl)
 {
-    /* Judge if the device has been added before */
-    for (uint8_t i = 0; i < ARRAY_SIZE(node_hb); i++) {
-        if (node_hb[i].unicast == hb_src) {
-            node_hb[i].check = true;
-            return;
-        }
+    mesh_node_heartbeat(hb_src, hops, rx_ttl);
+}
+
+// 超时没收到心跳包的节点离线，把合并后的上线/离线变化通知应用层
+static void ble_mesh_check_presence(void)
+{
+    static mesh_presence_t evt[16];
+    uint16_t offline = mesh_node_presence_check();
+    #ifdef TAG
+    if (offline > 0) ESP_LOGW(TAG, "ble_mesh_presence, offline_num = %d", offline);
+    #endif
+    uint16_t num;
+    while ((num = mesh_node_presence_poll(evt, sizeof(evt) / sizeof(evt[0]))) > 0) {
+        if (ble_mesh_presence_callback != NULL) ble_mesh_presence_callback(evt, num);
     }
+}
 
-    for (uint8_t j = 0; j < ARRAY_SIZE(node_hb); j++) {
-        if (node_hb[j].unicast == ESP_BLE_MESH_ADDR_UNASSIGNED) {
-            node_hb[j].unicast = hb_src;
-            node_hb[j].check = true;
-            return;
-        }
+bool ble_mesh_online_status(uint16_t unicast_addr) 
+{
+    return mesh_node_online(unicast_addr);
+}
+
+// 操作码需要的服务端模型，0: 不检查
+static uint8_t ble_mesh_opcode_cap(uint32_t opcode)
+{
+    switch (opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET:
+        return MESH_CAP_ONOFF;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
+        return MESH_CAP_HSL;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
+        return MESH_CAP_CTL;
+    case GENIE_MODEL_OP_ATTR_SET:
+    case GENIE_MODEL_OP_ATTR_GET:
+    case GENIE_MODEL_OP_OTA_START:
+    case GENIE_MODEL_OP_OTA_QUERY:
+    case GENIE_MODEL_OP_OTA_APPLY:
+        return MESH_CAP_VENDOR;
+    default:
+        return 0;
     }
 }
 
-void ble_mesh_check_heartbeat(TimerHandle_t xTimer)
+// 节点上第一个有这个能力的元素（Composition Data 已知），return: -1: 节点没有这个模型
+static int8_t ble_mesh_node_cap_element(const mesh_node_t *node, uint8_t cap)
 {
-    uint8_t mesh_online = 0;
-    for (int i = 0; i < ARRAY_SIZE(node_hb); i++) {
-        if (node_hb[i].unicast != BLE_MESH_ADDR_UNASSIGNED){
-            if (node_hb[i].check) { 
-                node_hb[i].online = true;
-                node_hb[i].check = 0; 
-                mesh_online++;
-            } else {
-                node_hb[i].online = false;
-            }
-        }
+    for (uint8_t i = 0; i < node->elem_num && i < MESH_NODE_ELEM_MAX; i++) {
+        if (node->caps[i] & cap) return i;
     }
-    #ifdef TAG
-    ESP_LOGW(TAG, "\nble_mesh_heartbeat, online_num = %d\n\n", mesh_online);
-    #endif
+    return -1;
 }
 
-bool ble_mesh_online_status(uint16_t unicast_addr) 
+int8_t ble_mesh_cap_element(uint16_t unicast_addr, uint8_t cap)
 {
-    for (int i = 0; i < ARRAY_SIZE(node_hb); i++) {
-        if (node_hb[i].unicast != unicast_addr){
-            return node_hb[i].online;
-        }
+    mesh_node_t node;
+    if (mesh_node_get(unicast_addr, &node) == false || node.elem_num == 0) return 0;  // 能力未知：用主元素
+    return ble_mesh_node_cap_element(&node, cap);
+}
+
+// 按节点能力（Composition Data）检查/路由消息：
+// 发到主元素的消息，主元素没有这个模型时改发到第一个有这个模型的元素；
+// 节点没有这个模型时直接返回失败，不用等 mesh 超时。能力未知（还没收到 Composition Data）时不检查
+esp_err_t ble_mesh_cap_route(mesh_msg_t *msg)
+{
+    uint8_t cap = ble_mesh_opcode_cap(msg->opcode);
+    if (cap == 0 || !ESP_BLE_MESH_ADDR_IS_UNICAST(msg->dst_addr)) return ESP_OK;
+
+    mesh_node_t node;
+    int8_t elem = mesh_node_find_element(msg->dst_addr, &node);
+    if (elem < 0 || node.elem_num == 0 || elem >= MESH_NODE_ELEM_MAX) return ESP_OK;
+    if (node.caps[elem] & cap) return ESP_OK;
+
+    int8_t i = (elem == 0) ? ble_mesh_node_cap_element(&node, cap) : -1;
+    if (i > 0) {  // 路由到有这个模型的元素
+        #ifdef TAG
+        ESP_LOGI(TAG, "route opcode 0x%06lx: 0x%04x => element 0x%04x", msg->opcode, msg->dst_addr, msg->dst_addr + i);
+        #endif
+        msg->dst_addr += i;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+// 把协议栈保存的 Composition Data 同步到节点登记表
+static void ble_mesh_node_comp_sync(uint16_t unicast_addr)
+{
+    esp_ble_mesh_node_t *node = esp_ble_mesh_provisioner_get_node_with_addr(unicast_addr);
+    if (node != NULL && node->comp_data != NULL) {
+        mesh_node_set_comp(unicast_addr, node->comp_data, node->comp_length);
     }
-    return false;
 }
 
 //============================================================================================
@@ -172,6 +232,9 @@ static esp_ble_mesh_cfg_srv_t config_server = {
 static const esp_ble_mesh_client_op_pair_t vnd_op_pair[] = {
     { GENIE_MODEL_OP_ATTR_SET, GENIE_MODEL_OP_ATTR_STATUS },
     { GENIE_MODEL_OP_ATTR_GET, GENIE_MODEL_OP_ATTR_STATUS },
+    { GENIE_MODEL_OP_OTA_START, GENIE_MODEL_OP_OTA_STATUS },
+    { GENIE_MODEL_OP_OTA_QUERY, GENIE_MODEL_OP_OTA_STATUS },
+    { GENIE_MODEL_OP_OTA_APPLY, GENIE_MODEL_OP_OTA_STATUS },
 };
 
 static esp_ble_mesh_client_t hsl_client;
@@ -185,6 +248,7 @@ static esp_ble_mesh_client_t vendor_client = {
 
 static esp_ble_mesh_model_op_t vnd_client_op[] = {
     ESP_BLE_MESH_MODEL_OP(GENIE_MODEL_OP_ATTR_STATUS, 1),
+    ESP_BLE_MESH_MODEL_OP(GENIE_MODEL_OP_OTA_STATUS, 1),
     ESP_BLE_MESH_MODEL_OP_END,
 };
 
@@ -225,21 +289,101 @@ static esp_ble_mesh_prov_t provision = {
 };
 
 // dst_addr: 可以是单播/组播地址
+//============================================================================================
+// 链路估计只由发送引擎更新（单个写入者），读-改-写不需要额外加锁
+void ble_mesh_link_update(uint16_t unicast_addr, uint32_t rtt, bool timeout)
+{
+    mesh_node_t node;
+    if (!ESP_BLE_MESH_ADDR_IS_UNICAST(unicast_addr) || mesh_node_get(unicast_addr, &node) == false) return;
+    mesh_link_t *link = &node.link;
+
+    uint16_t loss = link->loss - (link->loss >> 3) + (timeout ? 32 : 0);  // loss = 7/8 * loss + 1/8 * 255
+    link->loss = (loss > 0xFF) ? 0xFF : loss;
+
+    if (timeout) {
+        if (link->fail < 0xFF) link->fail++;
+    } else {
+        if (rtt > LINK_TIMEOUT_MAX) rtt = LINK_TIMEOUT_MAX;
+        if (link->srtt == 0) {  // 第一个样本
+            link->srtt   = rtt;
+            link->rttvar = rtt / 2;
+        } else {
+            uint32_t err = (rtt > link->srtt) ? (rtt - link->srtt) : (link->srtt - rtt);
+            link->rttvar = (3 * link->rttvar + err) / 4;
+            link->srtt   = (7 * link->srtt + rtt) / 8;
+        }
+        if (link->srtt == 0) link->srtt = 1;  // 0 表示没有样本
+        link->fail = 0;
+    }
+    mesh_node_set_link(unicast_addr, link);
+}
+
+void ble_mesh_link_policy(uint16_t unicast_addr, mesh_link_policy_t *policy)
+{
+    policy->timeout = MSG_TIMEOUT;
+    policy->ttl     = MSG_SEND_TTL;
+    policy->retry   = 1;
+
+    mesh_node_t node;
+    if (!ESP_BLE_MESH_ADDR_IS_UNICAST(unicast_addr) || mesh_node_get(unicast_addr, &node) == false) return;
+    const mesh_link_t *link = &node.link;
+
+    uint32_t timeout = MSG_TIMEOUT;
+    if (link->srtt != 0) {
+        timeout = link->srtt + 4 * link->rttvar;
+    } else if (node.hops > 0) {
+        timeout = LINK_TIMEOUT_MIN + node.hops * LINK_HOP_TIME;
+    }
+
+    uint8_t ttl = MSG_SEND_TTL;
+    if (node.hops + 1 > ttl) ttl = node.hops + 1;  // 心跳包经过的跳数，多留一跳
+    if (link->fail >= LINK_FAIL_BACKOFF) {  // 连续超时：可能是路径变长了
+        timeout *= 2;
+        ttl++;
+    }
+
+    if (timeout < LINK_TIMEOUT_MIN) timeout = LINK_TIMEOUT_MIN;
+    if (timeout > LINK_TIMEOUT_MAX) timeout = LINK_TIMEOUT_MAX;
+    policy->timeout = timeout;
+    policy->ttl     = (ttl > LINK_TTL_MAX) ? LINK_TTL_MAX : ttl;
+
+    if (node.last_seen != 0 && node.online == false) {
+        policy->retry = 0;  // 已经离线的节点不重发，尽快失败
+    } else if (link->loss > LINK_LOSS_HIGH) {
+        policy->retry = 2;
+    }
+}
+
+// 组播发送用的操作码：SET => SET_UNACK（组内节点不逐个响应），其它不变
+static uint32_t ble_mesh_unack_opcode(uint32_t opcode)
+{
+    switch (opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET: return ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET: return ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET: return ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET_UNACK;
+    case GENIE_MODEL_OP_ATTR_SET:             return GENIE_MODEL_OP_ATTR_SET_UNACK;
+    default:                                  return opcode;
+    }
+}
+
 static void ble_mesh_set_msg_common(esp_ble_mesh_client_common_param_t *common, uint16_t dst_addr, 
                                     esp_ble_mesh_model_t *model, uint32_t opcode)
 {
+    mesh_link_policy_t policy;
+    ble_mesh_link_policy(dst_addr, &policy);
+
     common->opcode       = opcode;
     common->model        = model;
     common->ctx.net_idx  = ESP_BLE_MESH_NET_PRIMARY; // 这里配网时使用: 0x0000; 通信使用: prov_key.net_idx;
     common->ctx.app_idx  = prov_key.app_idx; // ESP_BLE_MESH_NET_PRIMARY
     common->ctx.addr     = dst_addr;
-    common->ctx.send_ttl = MSG_SEND_TTL;
+    common->ctx.send_ttl = policy.ttl;
     common->ctx.send_rel = MSG_SEND_REL;
-    common->msg_timeout  = MSG_TIMEOUT;
+    common->msg_timeout  = policy.timeout;
     common->msg_role     = MSG_ROLE;
     if (ESP_BLE_MESH_ADDR_IS_GROUP(dst_addr)) { // 组播地址，不设置超时时间！
         common->msg_timeout = 0x0000; 
-        common->opcode     += 0x0001;  // 设置为OP_UNACK
+        common->opcode      = ble_mesh_unack_opcode(opcode);  // 设置为OP_UNACK（已经是UNACK的不变）
     }  
 }
 
@@ -277,6 +421,7 @@ static esp_err_t prov_complete(uint16_t node_index, const esp_ble_mesh_octet16_t
         return ESP_FAIL;
     }
 
+    bool queued = ble_mesh_prov_queue_complete(uuid, node->unicast_addr);  // 批量配网队列中的设备
     ble_mesh_set_msg_common(&common, node->unicast_addr, config_client.model, ESP_BLE_MESH_MODEL_OP_COMPOSITION_DATA_GET);
     get.comp_data_get.page = COMP_DATA_PAGE_0;
     err = esp_ble_mesh_config_client_get_state(&common, &get);
@@ -286,6 +431,7 @@ static esp_err_t prov_complete(uint16_t node_index, const esp_ble_mesh_octet16_t
         #endif
         return ESP_FAIL;
     }
+    if (queued) return ESP_OK;
     bind_prov.bind.uniaddr = node->unicast_addr;  // 记录下单播地址
     xEventGroupSetBits(xEvent, NESH_PROV_COMP_EVT);    // 配网完成！
     return ESP_OK;
@@ -304,11 +450,22 @@ static void prov_link_close(esp_ble_mesh_prov_bearer_t bearer, uint8_t reason)
     #ifdef TAG
     ESP_LOGI(TAG, "%s link close, reason 0x%02x", bearer == ESP_BLE_MESH_PROV_ADV ? "PB-ADV" : "PB-GATT", reason);
     #endif
+    ble_mesh_prov_queue_link_close(reason == 0x00);  // 0x00: 配网成功后关闭
     xEventGroupSetBits(xEvent, NESH_PROV_CLOSE_EVT);   // 正在配网 
 }
 //==========================================================================================================================
 //==========================================================================================================================
 
+// 配网完成的节点加入绑定表
+bool ble_mesh_prov_bind_node(mesh_bind_t bind)
+{
+    if (bind.uniaddr < provision.prov_start_address) return false;
+    if (mesh_bind_add(bind) == false) return false;
+    ble_mesh_group_node_remove(bind.uniaddr);  // 新节点没有订阅任何分组
+    ble_mesh_node_comp_sync(bind.uniaddr);     // Composition Data 可能已经先收到了
+    return true;
+}
+
 // 配网绑定/添加节点
 // return: bind_prov.bind.uniaddr 节点的单播地址
 uint16_t ble_mesh_prov_bind_add(uint8_t addr[6], const char *name)
@@ -324,50 +481,56 @@ uint16_t ble_mesh_prov_bind_add(uint8_t addr[6], const char *name)
     if (bind_prov.event & NESH_PROV_OPEN_EVT) {  
         /* 2：判断是否配网完成（正常：先NESH_PROV_COMP_EVT，再NESH_PROV_CLOSE_EVT） */
         bind_prov.event = xEventGroupWaitBits(xEvent, NESH_PROV_CLOSE_EVT | NESH_PROV_COMP_EVT, pdTRUE, pdFALSE, 8000);
-        if ((bind_prov.event & NESH_PROV_COMP_EVT) && bind_prov.bind.uniaddr >= provision.prov_start_address) { 
-            if (mesh_bind_add(bind_prov.bind) == true) { // 配网成功！
-                bind_prov.event = 0x00;
-                return bind_prov.bind.uniaddr;
-            }  
+        if ((bind_prov.event & NESH_PROV_COMP_EVT) && ble_mesh_prov_bind_node(bind_prov.bind)) { // 配网成功！
+            bind_prov.event = 0x00;
+            return bind_prov.bind.uniaddr;
         }  
     }  
     bind_prov.event = 0x00;
     return 0x00;
 }
 
-// 解绑/删除节点
+// 删除节点的配网信息（Node Reset 已经响应或者超时），return: false: 不是配网分配的地址
+bool ble_mesh_prov_node_remove(uint16_t unicast_addr)
+{
+    if (unicast_addr < provision.prov_start_address) return false;
+    uint8_t elem_num = ble_mesh_node_element_num(unicast_addr);  // 删除前先取元素数
+    if (elem_num == 0) elem_num = 1;
+    esp_ble_mesh_provisioner_delete_node_with_addr(unicast_addr);
+    mesh_bind_remove(unicast_addr);
+    ble_mesh_shadow_remove(unicast_addr, elem_num);
+    ble_mesh_group_node_remove(unicast_addr);
+    return true;
+}
+
+// 全部节点已经复位：清空绑定表/分组/影子和协议栈的配网信息
+void ble_mesh_prov_node_remove_all(void)
+{
+    mesh_bind_remove_all();
+    ble_mesh_shadow_remove_all();
+    ble_mesh_group_remove_all();
+
+    settings_core_erase(); // 要在初始化前调用！
+}
+
+// 解绑/删除节点：加入解绑流水线（ble_mesh_reset），立即返回，完成后由解绑回调通知
+// return: 0x0000: 不是配网分配的地址或者队列已满
 uint16_t ble_mesh_prov_unbind_delete(uint16_t unicast_addr)
 {
     #ifdef TAG
-    ESP_LOGI(TAG, "<esp_ble_mesh_node_local_reset>, unicast_addr = 0x%x", unicast_addr);
+    ESP_LOGI(TAG, "<ble_mesh_prov_unbind_delete>, unicast_addr = 0x%x", unicast_addr);
     #endif
     if (unicast_addr < provision.prov_start_address) return 0x0000;
-    ble_mesh_node_reset(unicast_addr);  // 复位节点
-    vTaskDelay(400);  // 稍微延时一下
-    esp_ble_mesh_provisioner_delete_node_with_addr(unicast_addr);
-    xEventGroupWaitBits(xEvent, NESH_PROV_DELETE_EVT, pdTRUE, pdFALSE, 2000);
-    mesh_bind_remove(unicast_addr);
-    return unicast_addr;
+    return (ble_mesh_reset_queue_add(unicast_addr) == ESP_OK) ? unicast_addr : 0x0000;
 }
 
+// 全部解绑：同样交给解绑流水线，最后一个节点完成后清空绑定表/分组/影子
 void ble_mesh_prov_unbind_delete_all(void)
 {
-    uint16_t prov_node_num = esp_ble_mesh_provisioner_get_prov_node_count();
+    uint16_t num = ble_mesh_reset_queue_all();
     #ifdef TAG
-    ESP_LOGI(TAG, "ble_mesh_prov_unbind_delete_all = %d", prov_node_num); 
+    ESP_LOGI(TAG, "ble_mesh_prov_unbind_delete_all = %d", num); 
     #endif   
-    if (prov_node_num == 0) return;    
-    const esp_ble_mesh_node_t **mesh_node = esp_ble_mesh_provisioner_get_node_table_entry();
-    if (*mesh_node == NULL) return;   
-    for (uint8_t i = 0; i < prov_node_num; i++) {
-        ble_mesh_node_reset(mesh_node[i]->unicast_addr);  // 复位节点
-        vTaskDelay(500);  // 稍微延时一下
-        esp_ble_mesh_provisioner_delete_node_with_addr(mesh_node[i]->unicast_addr);
-        xEventGroupWaitBits(xEvent, NESH_PROV_DELETE_EVT, pdTRUE, pdFALSE, 3000);
-    }
-    mesh_bind_remove_all();
-
-    settings_core_erase(); // 要在初始化前调用！
 }
 //=======================================================================================================================
 //=======================================================================================================================
@@ -379,6 +542,7 @@ static esp_err_t recv_unprov_adv_pkt(uint8_t dev_uuid[ESP_BLE_MESH_OCTET16_LEN],
      * use this callback to report the devices, whose device UUID starts with 'Y' & 'i',
      * to the application layer.
      */
+    if (ble_mesh_prov_queue_match(dev_uuid, addr, addr_type, oob_info, bearer)) return 0;  // 批量配网队列中的设备
 #if 1  // 根据绑定的设备MAC_ADDR进行过滤绑定
     if (bind_prov.event != NESH_PROV_START_EVT) return 0; 
     ESP_LOG_BUFFER_HEX("recv_unprov_adv_pkt->addr", addr, BD_ADDR_LEN);
@@ -548,7 +712,7 @@ static void ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble
             param->provisioner_recv_heartbeat.hb_dst, param->provisioner_recv_heartbeat.init_ttl, param->provisioner_recv_heartbeat.rx_ttl,
             param->provisioner_recv_heartbeat.hops, param->provisioner_recv_heartbeat.feature, param->provisioner_recv_heartbeat.rssi);
         #endif
-        ble_mesh_recv_hb(param->provisioner_recv_heartbeat.hb_src);
+        ble_mesh_recv_hb(param->provisioner_recv_heartbeat.hb_src, param->provisioner_recv_heartbeat.hops, param->provisioner_recv_heartbeat.rx_ttl);
         break;
     case ESP_BLE_MESH_PROVISIONER_DELETE_NODE_WITH_UUID_COMP_EVT:    /*!< Provisioner delete node with uuid completion event */
         #ifdef TAG 
@@ -655,6 +819,11 @@ static void ble_mesh_config_client_cb(esp_ble_mesh_cfg_client_cb_event_t event,
         return;
     }
 
+    if (opcode == ESP_BLE_MESH_MODEL_OP_NODE_RESET) {  // 批量解绑的 Node Reset
+        ble_mesh_reset_status(addr, event == ESP_BLE_MESH_CFG_CLIENT_TIMEOUT_EVT);
+        return;
+    }
+
     node = esp_ble_mesh_provisioner_get_node_with_addr(addr);
     if (!node) {
         #ifdef TAG 
@@ -663,6 +832,15 @@ static void ble_mesh_config_client_cb(esp_ble_mesh_cfg_client_cb_event_t event,
         return;
     }
 
+    if (opcode == ESP_BLE_MESH_MODEL_OP_MODEL_SUB_ADD || opcode == ESP_BLE_MESH_MODEL_OP_MODEL_SUB_DELETE) {  // 自动分组的订阅配置
+        if (event == ESP_BLE_MESH_CFG_CLIENT_TIMEOUT_EVT) {
+            ble_mesh_group_sub_status(addr, MESH_GROUP_STATUS_TIMEOUT);
+        } else {
+            ble_mesh_group_sub_status(addr, param->status_cb.model_sub_status.status);
+        }
+        return;
+    }
+
 #if 1
     switch (opcode) {
     case ESP_BLE_MESH_MODEL_OP_COMPOSITION_DATA_GET: {
@@ -671,6 +849,7 @@ static void ble_mesh_config_client_cb(esp_ble_mesh_cfg_client_cb_event_t event,
                 param->status_cb.comp_data_status.composition_data->len));
         #endif
         ble_mesh_parse_node_comp_data(param->status_cb.comp_data_status.composition_data->data, param->status_cb.comp_data_status.composition_data->len);
+        mesh_node_set_comp(addr, param->status_cb.comp_data_status.composition_data->data, param->status_cb.comp_data_status.composition_data->len);
 
         err = esp_ble_mesh_provisioner_store_node_comp_data(param->params->ctx.addr,
             param->status_cb.comp_data_status.composition_data->data,
@@ -776,6 +955,7 @@ static void ble_mesh_config_client_cb(esp_ble_mesh_cfg_client_cb_event_t event,
                      param->status_cb.comp_data_status.composition_data->len));
             #endif
             ble_mesh_parse_node_comp_data(param->status_cb.comp_data_status.composition_data->data, param->status_cb.comp_data_status.composition_data->len);
+            mesh_node_set_comp(addr, param->status_cb.comp_data_status.composition_data->data, param->status_cb.comp_data_status.composition_data->len);
 
             err = esp_ble_mesh_provisioner_store_node_comp_data(param->params->ctx.addr,
                 param->status_cb.comp_data_status.composition_data->data,
@@ -891,7 +1071,7 @@ static void ble_mesh_config_client_cb(esp_ble_mesh_cfg_client_cb_event_t event,
         #endif
         switch (param->params->opcode) {
         case ESP_BLE_MESH_MODEL_OP_COMPOSITION_DATA_GET: {
-            if (bind_prov.event == 0x00) return; // 没有在配网中！
+            if (bind_prov.event == 0x00 && ble_mesh_prov_queue_busy() == false) return; // 没有在配网中！
             esp_ble_mesh_cfg_client_get_state_t get = { 0 };
             ble_mesh_set_msg_common(&common, node->unicast_addr, config_client.model, ESP_BLE_MESH_MODEL_OP_COMPOSITION_DATA_GET);
             get.comp_data_get.page = COMP_DATA_PAGE_0;
@@ -931,64 +1111,45 @@ static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t ev
              __func__, param->error_code, event, addr, opcode);
 #endif
 
+    mesh_transfer_t queue = { 0 };  
+    queue.opcode = opcode;
+    queue.unicast_addr = addr;
+
     if (param->error_code != ESP_OK) {
         #ifdef TAG
         ESP_LOGW(TAG, "<ble_mesh_generic_client_cb>, error_code = %d", param->error_code);
         #endif
+        ble_mesh_tx_complete(&queue, ESP_FAIL);  // 通知发送引擎：发送失败
         return;
     } 
  
-    static bool node_onoff = false;
-    mesh_transfer_t queue = { 0 };  
- 
     switch (event) {
     case ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT:
+    case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:  // 节点响应
         switch (opcode) {
-        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET: { 
-            node_onoff = param->status_cb.onoff_status.present_onoff;
+        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET: 
+        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET: { 
             #ifdef TAG
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET, onoff: 0x%02x", node_onoff);
+            ESP_LOGI(TAG, "GEN_ONOFF_GET/SET, onoff: 0x%02x", param->status_cb.onoff_status.present_onoff);
             #endif
-            queue.opcode = opcode;
-            queue.unicast_addr = addr;
             queue.len = 1;
-            queue.data[0] = node_onoff;
-            xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT);   
+            queue.data[0] = param->status_cb.onoff_status.present_onoff;
             break;
         }
         default:
             break;
         }
-        break;
-    case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:
-        switch (opcode) {
-        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET: {
-            node_onoff = param->status_cb.onoff_status.present_onoff;
-            #ifdef TAG
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET onoff: 0x%02x", node_onoff);
-            #endif
-            queue.opcode = opcode;
-            queue.unicast_addr = addr;
-            queue.len = 1;
-            queue.data[0] = node_onoff;
-            xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT);   
-            break;
-        }
-        default:
-            break;
-        }
-        break;
+        ble_mesh_shadow_update(&queue);  // 更新节点状态影子
+        ble_mesh_tx_complete(&queue, ESP_OK);
+        return;
     case ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT:
         switch (opcode) {
         case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS: {
-            node_onoff = param->status_cb.onoff_status.present_onoff;
             #ifdef TAG
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS onoff: 0x%02x", node_onoff);
+            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS onoff: 0x%02x", param->status_cb.onoff_status.present_onoff);
             #endif
-            queue.opcode = opcode;
-            queue.unicast_addr = addr;
             queue.len = 1;
-            queue.data[0] = node_onoff;
+            queue.data[0] = param->status_cb.onoff_status.present_onoff;
             break;
         }
         default:
@@ -999,20 +1160,8 @@ static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t ev
         #ifdef TAG
         ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT opcode: 0x%06lx", opcode);
         #endif
-        /* If failed to receive the responses, these messages will be resend */
-        switch (opcode) {
-        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET: {
-            xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT);   
-            break;
-        }
-        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET: {
-            xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT);   
-            break;
-        }
-        default:
-            break;
-        }
-        break;
+        ble_mesh_tx_complete(&queue, ESP_ERR_TIMEOUT); 
+        return;
     default:
         #ifdef TAG
         ESP_LOGE(TAG, "Not a generic client status message event");
@@ -1020,64 +1169,199 @@ static void ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t ev
         break;
     }
 
-    if (queue.len) {
-        xQueueSend(xQueue, &queue, 0);   
+    if (queue.len) {  // 节点主动上报的数据
+        ble_mesh_shadow_update(&queue);
+        ble_mesh_rx_push(&queue);   
     }
 }
 //=========================================================================================================================
 //========================================================================================================================= 
-bool ble_mesh_send_msg_wait(void)
+static const uint32_t trans_time_resolution[4] = { 100, 1000, 10000, 600000 };
+
+// 渐变时间/MS => Transition Time：低6位步数，高2位步长（100MS/1S/10S/10MIN），超过最大值按最大值
+uint8_t ble_mesh_trans_time_encode(uint32_t ms)
 {
-    xEventGroupClearBits(xEvent, NESH_SEND_COMP_EVT | NESH_SEND_TIMEOUT_EVT);  
-    EventBits_t uxBits = xEventGroupWaitBits(xEvent, NESH_SEND_COMP_EVT | NESH_SEND_TIMEOUT_EVT, pdTRUE, pdFALSE, MSG_TIMEOUT);
-    if (uxBits & NESH_SEND_COMP_EVT) {  
-        return true;
-    }  
-    return false;
+    const uint32_t *resolution = trans_time_resolution;
+    for (uint8_t i = 0; i < 4; i++) {
+        uint32_t steps = (ms + resolution[i] / 2) / resolution[i];  // 四舍五入
+        if (steps <= BLE_MESH_TRANS_TIME_STEP_MAX) return (i << 6) | steps;
+    }
+    return (3 << 6) | BLE_MESH_TRANS_TIME_STEP_MAX;
 }
- 
+
+// Transition Time => 渐变时间/MS（步数 0x3F 是未知，按 0 算）
+uint32_t ble_mesh_trans_time_decode(uint8_t trans_time)
+{
+    uint8_t steps = trans_time & 0x3F;
+    if (steps > BLE_MESH_TRANS_TIME_STEP_MAX) return 0;
+    return steps * trans_time_resolution[trans_time >> 6];
+}
+
+// 发送一条mesh消息，不等待响应；响应/超时由协议栈回调通知发送引擎（ble_mesh_tx_complete）
 // dst_addr: 可以是单播/组播地址
-bool ble_mesh_onoff_set(uint16_t dst_addr, bool onoff)
+esp_err_t ble_mesh_msg_send(const mesh_msg_t *msg)
 {
-    static uint8_t tid = 0;
+    esp_err_t err = ESP_ERR_NOT_SUPPORTED;
     esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_generic_client_set_state_t set_state = { 0 };
-    ble_mesh_set_msg_common(&common, dst_addr, onoff_client.model, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET);
-    common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
-    set_state.onoff_set.op_en = false;
-    set_state.onoff_set.onoff = onoff;
-    set_state.onoff_set.tid   = tid++;
-    set_state.onoff_set.trans_time = 0; /*!< Time to complete state transition (optional) */
-    set_state.onoff_set.delay = 0;      /*!< Indicate message execution delay (C.1) */
-    esp_err_t err = esp_ble_mesh_generic_client_set_state(&common, &set_state);
+
+    switch (msg->opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK: {
+        esp_ble_mesh_generic_client_set_state_t set_state = { 0 };
+        ble_mesh_set_msg_common(&common, msg->dst_addr, onoff_client.model, msg->opcode);
+        common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
+        set_state.onoff_set.op_en = (msg->trans_time > 0 || msg->delay > 0);
+        set_state.onoff_set.onoff = msg->data[0];
+        set_state.onoff_set.tid   = msg->tid;
+        set_state.onoff_set.trans_time = msg->trans_time; /*!< Time to complete state transition (optional) */
+        set_state.onoff_set.delay = msg->delay;           /*!< Indicate message execution delay (C.1) */
+        err = esp_ble_mesh_generic_client_set_state(&common, &set_state);
+        break;
+    }
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET: {
+        esp_ble_mesh_generic_client_get_state_t get_state = { 0 };
+        ble_mesh_set_msg_common(&common, msg->dst_addr, onoff_client.model, msg->opcode);
+        common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
+        err = esp_ble_mesh_generic_client_get_state(&common, &get_state);
+        break;
+    }
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK: {
+        esp_ble_mesh_light_client_set_state_t set_state = { 0 };
+        ble_mesh_set_msg_common(&common, msg->dst_addr, hsl_client.model, msg->opcode);
+        common.ctx.net_idx = prov_key.net_idx;                           /*!< 通信使用: prov_key.net_idx */
+        set_state.hsl_set.op_en = (msg->trans_time > 0 || msg->delay > 0); /*!< Indicate if optional parameters are included */
+        set_state.hsl_set.hsl_hue = BIG_DATA_2_OCTET(msg->data, 0);        /*!< Target value of light hsl hue state */
+        set_state.hsl_set.hsl_saturation = BIG_DATA_2_OCTET(msg->data, 2); /*!< Target value of light hsl saturation state */
+        set_state.hsl_set.hsl_lightness = BIG_DATA_2_OCTET(msg->data, 4);  /*!< Target value of light hsl lightness state */
+        set_state.hsl_set.tid = msg->tid;                                /*!< Transaction ID */
+        set_state.hsl_set.trans_time = msg->trans_time;                  /*!< Time to complete state transition (optional) */
+        set_state.hsl_set.delay = msg->delay;                            /*!< Indicate message execution delay (C.1) */
+        err = esp_ble_mesh_light_client_set_state(&common, &set_state);
+        break;
+    }
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET_UNACK: {
+        esp_ble_mesh_light_client_set_state_t set_state = { 0 };
+        ble_mesh_set_msg_common(&common, msg->dst_addr, ctl_client.model, msg->opcode);
+        common.ctx.net_idx = prov_key.net_idx;                            /*!< 通信使用: prov_key.net_idx */
+        set_state.ctl_set.op_en = (msg->trans_time > 0 || msg->delay > 0); /*!< Indicate if optional parameters are included */
+        set_state.ctl_set.ctl_lightness = BIG_DATA_2_OCTET(msg->data, 0);   /*!< Target value of light ctl lightness state */
+        set_state.ctl_set.ctl_temperatrue = BIG_DATA_2_OCTET(msg->data, 2); /*!< Target value of light ctl temperature state */
+        if (msg->len >= 6) {
+            set_state.ctl_set.ctl_delta_uv = BIG_DATA_2_OCTET(msg->data, 4); /*!< Target value of light ctl delta UV state */
+        }
+        set_state.ctl_set.tid = msg->tid;                                 /*!< Transaction ID */
+        set_state.ctl_set.trans_time = msg->trans_time;                   /*!< Time to complete state transition (optional) */
+        set_state.ctl_set.delay = msg->delay;                             /*!< Indicate message execution delay (C.1) */
+        set_state.ctl_set.ctl_temperatrue += BLE_MESH_TEMPERATURE_MIN;
+        err = esp_ble_mesh_light_client_set_state(&common, &set_state);
+        break;
+    }
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET: {
+        esp_ble_mesh_light_client_get_state_t get_state = { 0 };
+        esp_ble_mesh_model_t *model = (msg->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET) ? hsl_client.model : ctl_client.model;
+        ble_mesh_set_msg_common(&common, msg->dst_addr, model, msg->opcode);
+        common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
+        err = esp_ble_mesh_light_client_get_state(&common, &get_state);
+        break;
+    }
+    case GENIE_MODEL_OP_ATTR_SET: 
+    case GENIE_MODEL_OP_ATTR_SET_UNACK:
+    case GENIE_MODEL_OP_ATTR_GET: 
+    case GENIE_MODEL_OP_OTA_START:
+    case GENIE_MODEL_OP_OTA_QUERY:
+    case GENIE_MODEL_OP_OTA_APPLY: {
+        esp_ble_mesh_msg_ctx_t ctx = { 0 };
+        mesh_link_policy_t policy;
+        ble_mesh_link_policy(msg->dst_addr, &policy);
+        ctx.addr     = msg->dst_addr;     /*!< Remote address. */
+        ctx.net_idx  = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
+        ctx.app_idx  = prov_key.app_idx;  /*!< 通信使用: prov_key.app_idx */ 
+        ctx.send_ttl = policy.ttl;
+        ctx.send_rel = MSG_SEND_REL;
+        uint32_t opcode = ESP_BLE_MESH_ADDR_IS_GROUP(ctx.addr) ? ble_mesh_unack_opcode(msg->opcode) : msg->opcode;
+        bool need_rsp = (opcode != GENIE_MODEL_OP_ATTR_SET_UNACK && !ESP_BLE_MESH_ADDR_IS_GROUP(ctx.addr));  // 组播地址，不等待响应！
+        err = esp_ble_mesh_client_model_send_msg(vendor_client.model, &ctx, opcode, msg->len, mesh_msg_data(msg), 
+                                                 policy.timeout, need_rsp, MSG_ROLE);
+        break;
+    }
+    default:
+        break;
+    }
+
+    #ifdef TAG
     if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: addr 0x%04x, opcode 0x%06lx failed, err = 0x%x", __func__, msg->dst_addr, msg->opcode, err);
+    }
+    #endif
+    return err;
+}
+
+typedef struct {
+    SemaphoreHandle_t sem;
+    esp_err_t err;
+    mesh_transfer_t status;
+} mesh_msg_wait_t;
+
+static void ble_mesh_send_msg_done(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    mesh_msg_wait_t *wait = (mesh_msg_wait_t *)arg;
+    wait->err = err;
+    if (status != NULL) {
+        wait->status = *status;
+        if (status->ext != NULL) {  // 发送引擎回调返回后就释放了，复制一份
+            wait->status.ext = ble_mesh_pool_dup(status->ext, status->len);
+            if (wait->status.ext == NULL) wait->status.len = 0;
+        }
+    }
+    xSemaphoreGive(wait->sem);
+}
+
+// 提交给发送引擎，并等待发送消息完成（在发送引擎的回调中调用会等待自己：直接失败）
+static bool ble_mesh_send_msg_wait(const mesh_msg_t *msg)
+{
+    if (ble_mesh_tx_in_engine()) {
         #ifdef TAG
-        ESP_LOGE(TAG, "%s: Generic OnOff Set failed", __func__);
+        ESP_LOGE(TAG, "%s: called from mesh tx callback, opcode 0x%06lx", __func__, msg->opcode);
         #endif
+        ble_mesh_pool_free(msg->ext);  // 和提交失败一样释放长数据
         return false;
     }
+    StaticSemaphore_t sem_buffer;
+    mesh_msg_wait_t wait = { 0 };
+    wait.sem = xSemaphoreCreateBinaryStatic(&sem_buffer);
+    wait.err = ESP_FAIL;
+    if (ble_mesh_tx_submit(msg, ble_mesh_send_msg_done, &wait) != ESP_OK) return false;
+    xSemaphoreTake(wait.sem, portMAX_DELAY);
+    if (wait.status.len > 0 && ble_mesh_recv_callback != NULL) {  
+        ble_mesh_recv_callback(wait.status);  // 节点响应的数据
+    }
+    ble_mesh_pool_free(wait.status.ext);
+    return wait.err == ESP_OK;
+}
+ 
+// dst_addr: 可以是单播/组播地址
+bool ble_mesh_onoff_set(uint16_t dst_addr, bool onoff)
+{
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET;
+    msg.len      = 1;
+    msg.data[0]  = onoff;
     #ifdef TAG
     ESP_LOGI(TAG, "%s: Generic OnOff Set = %d", __func__, onoff);
     #endif
-    if (common.msg_timeout == 0) return true;
-
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
 
 bool ble_mesh_onoff_get(uint16_t unicast_addr)
 {
-    esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_generic_client_get_state_t get_state = { 0 };
-    ble_mesh_set_msg_common(&common, unicast_addr, onoff_client.model, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET);
-    common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
-    esp_err_t err = esp_ble_mesh_generic_client_get_state(&common, &get_state);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "%s: Generic OnOff Get failed", __func__);
-        #endif
-        return false;
-    }
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = unicast_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET;
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
 
 esp_err_t ble_mesh_node_reset(uint16_t unicast_addr)
@@ -1090,45 +1374,82 @@ esp_err_t ble_mesh_node_reset(uint16_t unicast_addr)
     return err;
 }
 
+// 节点元素的模型订阅/取消订阅组播地址：配置消息发给节点主元素（Config Server），响应交给 ble_mesh_group_sub_status()
+esp_err_t ble_mesh_model_sub_set(uint16_t unicast_addr, uint16_t element_addr, uint16_t group_addr, uint16_t model_id, uint16_t company_id, bool add)
+{
+    esp_ble_mesh_cfg_client_set_state_t set_state = { 0 };
+    esp_ble_mesh_client_common_param_t common = { 0 };
+    uint32_t opcode = add ? ESP_BLE_MESH_MODEL_OP_MODEL_SUB_ADD : ESP_BLE_MESH_MODEL_OP_MODEL_SUB_DELETE;
+    ble_mesh_set_msg_common(&common, unicast_addr, config_client.model, opcode);
+    common.ctx.net_idx = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
+    if (add) {
+        set_state.model_sub_add.element_addr = element_addr;
+        set_state.model_sub_add.sub_addr     = group_addr;
+        set_state.model_sub_add.model_id     = model_id;
+        set_state.model_sub_add.company_id   = company_id;
+    } else {
+        set_state.model_sub_delete.element_addr = element_addr;
+        set_state.model_sub_delete.sub_addr     = group_addr;
+        set_state.model_sub_delete.model_id     = model_id;
+        set_state.model_sub_delete.company_id   = company_id;
+    }
+    return esp_ble_mesh_config_client_set_state(&common, &set_state);
+}
+
 // dst_addr: 可以是单播/组播地址
 // opcode:   GENIE_MODEL_OP_ATTR_SET  / GENIE_MODEL_OP_ATTR_GET
-bool ble_mesh_send_vendor_message(uint16_t dst_addr, uint32_t opcode, uint8_t *data, uint8_t len)
+// len: 超过 VND_DATA_SIZE 时数据放到缓存池，协议栈分包发送（最大 VND_DATA_MAX）
+bool ble_mesh_send_vendor_message(uint16_t dst_addr, uint32_t opcode, uint8_t *data, uint16_t len)
 {
+    if (len > VND_DATA_MAX) return false;
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = opcode;
+    msg.len      = len;
+    if (len > VND_DATA_SIZE) {
+        msg.ext = ble_mesh_pool_dup(data, len);
+        if (msg.ext == NULL) return false;
+    } else {
+        memcpy(msg.data, data, len);
+    }
+    #ifdef TAG
+    ESP_LOGI(TAG, "<ble_mesh_send_vendor_message> addr: 0x%04x, len: %d", dst_addr, len);
+    #endif
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
+}
+
+// 不等待响应，不经过发送引擎：协议栈发出后回调 SEND_COMP_EVT（固件分发据此控制发送节奏）
+esp_err_t ble_mesh_vendor_send_unack(uint16_t dst_addr, uint32_t opcode, const uint8_t *data, uint16_t len)
+{
+    if (len > VND_DATA_MAX) return ESP_ERR_INVALID_SIZE;
     esp_ble_mesh_msg_ctx_t ctx = { 0 };
-    ctx.addr     = dst_addr;          /*!< Remote address. */
+    mesh_link_policy_t policy;
+    ble_mesh_link_policy(dst_addr, &policy);
+    ctx.addr     = dst_addr;
     ctx.net_idx  = prov_key.net_idx;  /*!< 通信使用: prov_key.net_idx */
     ctx.app_idx  = prov_key.app_idx;  /*!< 通信使用: prov_key.app_idx */ 
-    ctx.send_ttl = MSG_SEND_TTL;
+    ctx.send_ttl = policy.ttl;
     ctx.send_rel = MSG_SEND_REL;
-    #ifdef TAG
-    ESP_LOGI(TAG, "<esp_ble_mesh_client_model_send_msg> addr: 0x%04d, data: 0x%02x 0x%02x", ctx.addr, data[0], data[1]);
-    #endif
-
-    bool timeout_enable = true;
-    if (ESP_BLE_MESH_ADDR_IS_GROUP(ctx.addr)) {
-        timeout_enable = false;
-    }
-
-    esp_err_t err = esp_ble_mesh_client_model_send_msg(vendor_client.model, &ctx, opcode, len, data, MSG_TIMEOUT, timeout_enable, MSG_ROLE);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "Failed to send vendor message <addr: 0x%04d>", ctx.addr);
-        #endif
-        return false;
-    }
-
-    if (timeout_enable == false) return true;
-
-    err = ble_mesh_send_msg_wait();  // 等待发送消息完成
-    if (err == true) {  // 正常会先发送成功
-        return ble_mesh_send_msg_wait(); // 再等待一次，看看是否会超时！
-    }
-    return err;
+    return esp_ble_mesh_client_model_send_msg(vendor_client.model, &ctx, opcode, len, (uint8_t *)data, 0, false, MSG_ROLE);
 }
 
 //=========================================================================================================================
 //=========================================================================================================================
 
+// 接收的 vendor 数据：协议栈已经完成分包重组，长数据放到缓存池
+static bool ble_mesh_transfer_fill(mesh_transfer_t *queue, const uint8_t *data, uint16_t len)
+{
+    if (len > VND_DATA_MAX) len = VND_DATA_MAX;
+    if (len > VND_DATA_SIZE) {
+        queue->ext = ble_mesh_pool_dup(data, len);
+        if (queue->ext == NULL) return false;  // 没有空闲块
+    } else {
+        memcpy(queue->data, data, len);
+    }
+    queue->len = len;
+    return true;
+}
+
 static void ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event, esp_ble_mesh_model_cb_param_t *param)
 {
     mesh_transfer_t queue = { 0 };
@@ -1140,28 +1461,35 @@ static void ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event, esp_bl
         // ESP_LOG_BUFFER_HEX("VND_MSG", param->model_operation.msg, param->model_operation.length);
         queue.opcode = param->model_operation.opcode;
         queue.unicast_addr = param->model_operation.ctx->addr;
-        queue.len = param->model_operation.length;
-        if (queue.len > VND_DATA_SIZE) queue.len = VND_DATA_SIZE;
-        memcpy(queue.data, param->model_operation.msg, queue.len);
-        xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT);  
-        break;
+        if (ble_mesh_transfer_fill(&queue, param->model_operation.msg, param->model_operation.length) == false) {
+            ble_mesh_tx_complete(&queue, ESP_ERR_NO_MEM);  // 收到了但放不下，不用等超时重发
+            return;
+        }
+        ble_mesh_shadow_update(&queue);  // 更新节点状态影子
+        ble_mesh_tx_complete(&queue, ESP_OK);  // ext 由发送引擎释放
+        return;
     }
     case ESP_BLE_MESH_MODEL_SEND_COMP_EVT:
         #ifdef TAG
         ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_SEND_COMP_EVT, err_code = %d", param->model_send_comp.err_code);
         #endif
-        if (param->model_send_comp.err_code) {
-            xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT); 
-        } else {
-            xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT);   
+        if (param->model_send_comp.opcode == GENIE_MODEL_OP_OTA_CHUNK) {  // 固件数据块不经过发送引擎
+            ble_mesh_ota_chunk_comp(param->model_send_comp.err_code ? ESP_FAIL : ESP_OK);
+            break;
+        }
+        if (param->model_send_comp.err_code) {  // 发送失败；发送成功则继续等待节点响应
+            queue.opcode = param->model_send_comp.opcode;
+            queue.unicast_addr = param->model_send_comp.ctx->addr;
+            ble_mesh_tx_complete(&queue, ESP_FAIL);
         }
         break;
     case ESP_BLE_MESH_CLIENT_MODEL_SEND_TIMEOUT_EVT:
         #ifdef TAG
         ESP_LOGW(TAG, "Client message 0x%lx timeout", param->client_send_timeout.opcode);
         #endif
-        // param->client_send_timeout.ctx.addr
-        xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT);   
+        queue.opcode = param->client_send_timeout.opcode;
+        queue.unicast_addr = param->client_send_timeout.ctx->addr;
+        ble_mesh_tx_complete(&queue, ESP_ERR_TIMEOUT);
         break;
     case ESP_BLE_MESH_MODEL_PUBLISH_UPDATE_EVT:
         #ifdef TAG
@@ -1174,9 +1502,7 @@ static void ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event, esp_bl
         #endif
         queue.opcode = param->client_recv_publish_msg.opcode;
         queue.unicast_addr = param->client_recv_publish_msg.ctx->addr;
-        queue.len = param->client_recv_publish_msg.length;
-        if (queue.len > VND_DATA_SIZE) queue.len = VND_DATA_SIZE;
-        memcpy(queue.data, param->client_recv_publish_msg.msg, queue.len);
+        ble_mesh_transfer_fill(&queue, param->client_recv_publish_msg.msg, param->client_recv_publish_msg.length);
         break;
     }
     default:
@@ -1187,7 +1513,10 @@ static void ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event, esp_bl
     }
 
     if (queue.len > 0) {
-        xQueueSend(xQueue, &queue, 0); 
+        ble_mesh_shadow_update(&queue);
+        if (ble_mesh_rx_push(&queue) == false) {  // ext 由消费者释放
+            ble_mesh_pool_free(queue.ext);
+        }
     }
 }
 //=========================================================================================================================
@@ -1195,93 +1524,52 @@ static void ble_mesh_custom_model_cb(esp_ble_mesh_model_cb_event_t event, esp_bl
 // dst_addr: 可以是单播/组播地址
 bool ble_mesh_light_hsl_set(uint16_t dst_addr, esp_ble_mesh_state_change_light_hsl_set_t hsl)
 {
-    static uint8_t tid = 0;
-    esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_light_client_set_state_t set_state = { 0 };
-    ble_mesh_set_msg_common(&common, dst_addr, hsl_client.model, ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET);
-    common.ctx.net_idx = prov_key.net_idx;              /*!< 通信使用: prov_key.net_idx */
-    set_state.hsl_set.op_en = false;                    /*!< Indicate if optional parameters are included */
-    set_state.hsl_set.hsl_lightness = hsl.lightness;    /*!< Target value of light hsl lightness state */
-    set_state.hsl_set.hsl_hue = hsl.hue;                /*!< Target value of light hsl hue state */
-    set_state.hsl_set.hsl_saturation = hsl.saturation;  /*!< Target value of light hsl saturation state */
-    set_state.hsl_set.tid = tid++;                      /*!< Transaction ID */
-    set_state.hsl_set.trans_time = 0;                   /*!< Time to complete state transition (optional) */
-    set_state.hsl_set.delay = 0;                        /*!< Indicate message execution delay (C.1) */
-    esp_err_t err = esp_ble_mesh_light_client_set_state(&common, &set_state);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "%s: LIGHT_HSL_SET failed", __func__);
-        #endif
-        return false;
-    }
-    if (common.msg_timeout == 0) return true;
-
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET;
+    msg.len      = 6;
+    msg.data[0]  = hsl.hue >> 8;
+    msg.data[1]  = hsl.hue & 0xFF;
+    msg.data[2]  = hsl.saturation >> 8;
+    msg.data[3]  = hsl.saturation & 0xFF;
+    msg.data[4]  = hsl.lightness >> 8;
+    msg.data[5]  = hsl.lightness & 0xFF;
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
 
 // dst_addr: 是单播地址
 bool ble_mesh_light_hsl_get(uint16_t dst_addr)
 {
-    esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_light_client_get_state_t get_state = { 0 };
-    ble_mesh_set_msg_common(&common, dst_addr, hsl_client.model, ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET);
-    common.ctx.net_idx = prov_key.net_idx;              /*!< 通信使用: prov_key.net_idx */
-    esp_err_t err = esp_ble_mesh_light_client_get_state(&common, &get_state);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "%s: LIGHT_CTL_SET  Set failed", __func__);
-        #endif
-        return false;
-    }
-
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET;
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
 
 
 // dst_addr: 可以是单播/组播地址
 bool ble_mesh_light_ctl_set(uint16_t dst_addr, esp_ble_mesh_state_change_light_ctl_set_t ctl)
 {
-    static uint8_t tid = 0;
-    esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_light_client_set_state_t set_state = { 0 };
-    ble_mesh_set_msg_common(&common, dst_addr, ctl_client.model, ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET);
-    common.ctx.net_idx = prov_key.net_idx;              /*!< 通信使用: prov_key.net_idx */
-    set_state.ctl_set.op_en = false;                    /*!< Indicate if optional parameters are included */
-    set_state.ctl_set.ctl_lightness = ctl.lightness;    /*!< Target value of light ctl lightness state */
-    set_state.ctl_set.ctl_temperatrue = ctl.temperature;/*!< Target value of light ctl temperature state */
-    set_state.ctl_set.ctl_delta_uv = ctl.delta_uv;      /*!< Target value of light ctl delta UV state */
-    set_state.ctl_set.tid = tid++;                      /*!< Transaction ID */
-    set_state.ctl_set.trans_time = 0;                   /*!< Time to complete state transition (optional) */
-    set_state.ctl_set.delay = 0;                        /*!< Indicate message execution delay (C.1) */
-    set_state.ctl_set.ctl_temperatrue += BLE_MESH_TEMPERATURE_MIN;
-    esp_err_t err = esp_ble_mesh_light_client_set_state(&common, &set_state);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "%s: LIGHT_CTL_SET  Set failed", __func__);
-        #endif
-        return false;
-    }
-    if (common.msg_timeout == 0) return true;
-
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET;
+    msg.len      = 6;
+    msg.data[0]  = ctl.lightness >> 8;
+    msg.data[1]  = ctl.lightness & 0xFF;
+    msg.data[2]  = ctl.temperature >> 8;
+    msg.data[3]  = ctl.temperature & 0xFF;
+    msg.data[4]  = ctl.delta_uv >> 8;
+    msg.data[5]  = ctl.delta_uv & 0xFF;
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
  
 // dst_addr: 是单播地址
 bool ble_mesh_light_ctl_get(uint16_t dst_addr)
 {
-    esp_ble_mesh_client_common_param_t common = { 0 };
-    esp_ble_mesh_light_client_get_state_t get_state = { 0 };
-    ble_mesh_set_msg_common(&common, dst_addr, ctl_client.model, ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET);
-    common.ctx.net_idx = prov_key.net_idx;              /*!< 通信使用: prov_key.net_idx */
-    esp_err_t err = esp_ble_mesh_light_client_get_state(&common, &get_state);
-    if (err != ESP_OK) {
-        #ifdef TAG
-        ESP_LOGE(TAG, "%s: LIGHT_CTL_SET  Set failed", __func__);
-        #endif
-        return false;
-    }
-
-    return ble_mesh_send_msg_wait();  // 等待发送消息完成
+    mesh_msg_t msg = { 0 };
+    msg.dst_addr = dst_addr;
+    msg.opcode   = ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET;
+    return ble_mesh_send_msg_wait(&msg);  // 等待发送消息完成
 }
 
 
@@ -1307,14 +1595,46 @@ bool ble_mesh_light_ctl_temp_range_set(uint16_t dst_addr, uint16_t range_min, ui
 }
 
 
+// 灯的状态数据（大端）：HSL: [H, S, L]; CTL: [lightness, temperature]
+static void ble_mesh_light_status_data(const esp_ble_mesh_light_client_status_cb_t *status_cb, mesh_transfer_t *queue)
+{
+    uint16_t value[3];
+    switch (queue->opcode) {
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
+        value[0] = status_cb->hsl_status.hsl_hue;
+        value[1] = status_cb->hsl_status.hsl_saturation;
+        value[2] = status_cb->hsl_status.hsl_lightness;
+        queue->len = 6;
+        break;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_STATUS:
+        value[0] = status_cb->ctl_status.present_ctl_lightness;
+        value[1] = status_cb->ctl_status.present_ctl_temperature;
+        queue->len = 4;
+        break;
+    default:
+        return;
+    }
+    for (uint8_t i = 0; i < queue->len / 2; i++) {
+        queue->data[i * 2]     = value[i] >> 8;
+        queue->data[i * 2 + 1] = value[i] & 0xFF;
+    }
+}
+
 static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event, esp_ble_mesh_light_client_cb_param_t *param)
 {
     mesh_transfer_t queue = { 0 };  
+    queue.opcode = param->params->opcode;
+    queue.unicast_addr = param->params->ctx.addr;
 
     if (param->error_code != ESP_OK) {
         #ifdef TAG
         ESP_LOGW(TAG, "<ble_mesh_light_client_cb>, error_code = %d", param->error_code);
         #endif
+        ble_mesh_tx_complete(&queue, ESP_FAIL);  // 通知发送引擎：发送失败
         return;
     } 
     
@@ -1323,7 +1643,6 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
         #ifdef TAG
         ESP_LOGI(TAG, "ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT, opcode = 0x%lx", param->params->opcode);
         #endif
-        xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT); 
         switch (param->params->opcode) {
         case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET: {
             #ifdef TAG
@@ -1334,12 +1653,7 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
                         param->status_cb.hsl_status.hsl_lightness,
                         param->status_cb.hsl_status.remain_time);
             #endif
-            uint16_t hsl_data[3];
-            hsl_data[0] = param->status_cb.hsl_status.hsl_hue;
-            hsl_data[1] = param->status_cb.hsl_status.hsl_saturation;
-            hsl_data[2] = param->status_cb.hsl_status.hsl_lightness;
-            queue.len = 6;
-            memcpy(queue.data, hsl_data, queue.len);
+            ble_mesh_light_status_data(&param->status_cb, &queue);
             break;
         }
         case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET: {
@@ -1352,40 +1666,40 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
                         param->status_cb.ctl_status.target_ctl_temperature,
                         param->status_cb.ctl_status.remain_time);
             #endif
-            uint16_t ctl_data[2];
-            ctl_data[0] = param->status_cb.ctl_status.present_ctl_lightness;
-            ctl_data[1] = param->status_cb.ctl_status.present_ctl_temperature;
-            queue.len = 4;
-            memcpy(queue.data, ctl_data, queue.len);
+            ble_mesh_light_status_data(&param->status_cb, &queue);
             break;
         }
         default:
             break;
         }
-        
-        break;
+        ble_mesh_shadow_update(&queue);  // 更新节点状态影子
+        ble_mesh_tx_complete(&queue, ESP_OK);  // 节点响应
+        return;
     case ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT:
         #ifdef TAG
         ESP_LOGI(TAG, "ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT, opcode = 0x%lx", param->params->opcode);
         #endif
-        xEventGroupSetBits(xEvent, NESH_SEND_COMP_EVT); 
         switch (param->params->opcode) {
         case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET: {
             #ifdef TAG
             ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET OK...");
             #endif
+            ble_mesh_light_status_data(&param->status_cb, &queue);  // 节点响应的状态
             break;
         }
         case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET: {
             #ifdef TAG
             ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET OK...");
             #endif
+            ble_mesh_light_status_data(&param->status_cb, &queue);  // 节点响应的状态
             break;
         }
         default:
             break;
         }
-        break;
+        ble_mesh_shadow_update(&queue);  // 更新节点状态影子
+        ble_mesh_tx_complete(&queue, ESP_OK);  // 节点响应
+        return;
     case ESP_BLE_MESH_LIGHT_CLIENT_PUBLISH_EVT:  /* 接收: esp_ble_mesh_server_model_send_msg() */
         switch (param->params->opcode) {
         case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
@@ -1397,13 +1711,7 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
                         param->status_cb.hsl_status.hsl_lightness,
                         param->status_cb.hsl_status.remain_time);
             #endif
-            queue.len = 6;
-            queue.data[0] = param->status_cb.hsl_status.hsl_hue >> 8;
-            queue.data[1] = param->status_cb.hsl_status.hsl_hue&0xFF;
-            queue.data[2] = param->status_cb.hsl_status.hsl_saturation >> 8;
-            queue.data[3] = param->status_cb.hsl_status.hsl_saturation&0xFF;
-            queue.data[4] = param->status_cb.hsl_status.hsl_lightness >> 8;
-            queue.data[5] = param->status_cb.hsl_status.hsl_lightness&0xFF;
+            ble_mesh_light_status_data(&param->status_cb, &queue);
             break;
         case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_STATUS:
             #ifdef TAG
@@ -1415,11 +1723,7 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
                         param->status_cb.ctl_status.target_ctl_temperature,
                         param->status_cb.ctl_status.remain_time);
             #endif
-            queue.len = 4;
-            queue.data[0] = param->status_cb.ctl_status.present_ctl_lightness >> 8;
-            queue.data[1] = param->status_cb.ctl_status.present_ctl_lightness&0xFF;
-            queue.data[2] = param->status_cb.ctl_status.present_ctl_temperature >> 8;
-            queue.data[3] = param->status_cb.ctl_status.present_ctl_temperature&0xFF;
+            ble_mesh_light_status_data(&param->status_cb, &queue);
             break;    
         default:
             #ifdef TAG
@@ -1432,32 +1736,15 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
         #ifdef TAG
         ESP_LOGI(TAG, "ESP_BLE_MESH_LIGHT_CLIENT_TIMEOUT_EVT, opcode = 0x%lx, err = %d", param->params->opcode, param->error_code);
         #endif
-        switch (param->params->opcode) {
-        case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
-        case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET: {
-            xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT); 
-            break;
-        }
-        case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
-        case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET: {  
-            xEventGroupSetBits(xEvent, NESH_SEND_TIMEOUT_EVT); 
-            break;
-        }
-        default:
-            #ifdef TAG
-            ESP_LOGI(TAG, "ESP_BLE_MESH_LIGHT_CLIENT_TIMEOUT_EVT, opcode = 0x%lx, err = %d", param->params->opcode, param->error_code);
-            #endif
-            break;
-        }
-        break;
+        ble_mesh_tx_complete(&queue, ESP_ERR_TIMEOUT); 
+        return;
     default:
         break;
     }
 
-    if (queue.len) {
-        queue.opcode = param->params->opcode;
-        queue.unicast_addr = param->params->ctx.addr;
-        xQueueSend(xQueue, &queue, 0);   
+    if (queue.len) {  // 节点主动上报的数据
+        ble_mesh_shadow_update(&queue);
+        ble_mesh_rx_push(&queue);   
     }
 }
 //=========================================================================================================================
@@ -1465,6 +1752,18 @@ static void ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
 // 根据单播地址，找到BLE地址
 uint16_t ble_mesh_provisioner_get_prov_node_addr(uint16_t unicast_addr, uint8_t addr[6])
 {
+    // 已绑定的设备直接查绑定表的索引
+    if (unicast_addr > 0) {
+        if (mesh_bind_find_mac(unicast_addr, addr)) return unicast_addr;
+        esp_ble_mesh_node_t *node = esp_ble_mesh_provisioner_get_node_with_addr(unicast_addr);
+        if (node == NULL) return 0;
+        memcpy(addr, node->addr, 6);
+        return node->unicast_addr;
+    }
+    uint16_t uniaddr = mesh_bind_find_uniaddr(addr);
+    if (uniaddr > 0) return uniaddr;
+
+    // 没有绑定的节点（配网中/绑定失败），再遍历协议栈的节点表
     uint16_t prov_node_num = esp_ble_mesh_provisioner_get_prov_node_count();
     #ifdef TAG
     ESP_LOGI(TAG, "prov_node_num = %d", prov_node_num);    
@@ -1488,25 +1787,54 @@ uint16_t ble_mesh_provisioner_get_prov_node_addr(uint16_t unicast_addr, uint8_t
     return 0;
 }
 
-
-static ble_mesh_callback_t ble_mesh_recv_callback = NULL;
+// 节点的元素数，return: 0: 没有这个节点
+uint8_t ble_mesh_node_element_num(uint16_t unicast_addr)
+{
+    esp_ble_mesh_node_t *node = esp_ble_mesh_provisioner_get_node_with_addr(unicast_addr);
+    return (node != NULL) ? node->element_num : 0;
+}
 
 void ble_mesh_register_callback(ble_mesh_callback_t callback)
 {
     ble_mesh_recv_callback = callback;
 }
 
+void ble_mesh_register_presence_callback(ble_mesh_presence_callback_t callback)
+{
+    ble_mesh_presence_callback = callback;
+}
+
 void ble_mesh_handeler_task(void *arg)
 {
-    mesh_transfer_t receive = { 0 };
+    static mesh_transfer_t receive[MESH_RX_BATCH_SIZE];  // 批量取出，减少任务切换
+    uint32_t rx_drop = 0;
 
     while (1) {
   
-        if (xQueueReceive(xQueue, &receive, 1000) == pdTRUE) {  // portMAX_DELAY
-            ble_mesh_recv_callback(receive);
+        uint8_t num = ble_mesh_rx_pop(receive, MESH_RX_BATCH_SIZE, 1000);
+        for (uint8_t i = 0; i < num; i++) {
+            ble_mesh_recv_callback(receive[i]);
+            ble_mesh_pool_free(receive[i].ext);
         }
+        mesh_transfer_t late;
+        while (ble_mesh_tx_late_pop(&late)) {  // 请求超时后才到的响应：状态不能丢，按主动上报处理
+            ble_mesh_recv_callback(late);
+            ble_mesh_pool_free(late.ext);
+        }
+
+        ble_mesh_check_presence();  // 至少每秒检查一次心跳超时
+        ble_mesh_group_process();   // 自动分组的订阅配置超时重发
+        ble_mesh_prov_queue_process();  // 批量配网：绑定完成的节点，上报结果
+        ble_mesh_reset_process();       // 批量解绑：发送 Node Reset，删除完成的节点
 
-        mesh_bind_update();  // 更新绑定信息
+        mesh_rx_stats_t stats;
+        ble_mesh_rx_get_stats(&stats);
+        if (stats.drop != rx_drop) {  // 有消息被丢弃了
+            rx_drop = stats.drop;
+            #ifdef TAG
+            ESP_LOGW(TAG, "mesh rx: push = %ld, drop = %ld, peak = %d/%d", stats.push, stats.drop, stats.peak, stats.size);
+            #endif
+        }
   
 #if 0 // test...
         static uint16_t timecnt = 3;
@@ -1620,9 +1948,15 @@ static void ble_mesh_init(void)
         .hb_dst = HEARTBEAT_GROUP_ADDR,
     };
     ESP_ERROR_CHECK(esp_ble_mesh_provisioner_set_heartbeat_filter_info(ESP_BLE_MESH_HEARTBEAT_FILTER_ADD, &heartbeat_filter_info));
- 
-    TimerHandle_t timer = xTimerCreate("mesh_hb", pdMS_TO_TICKS(20 * 1000), true, NULL, ble_mesh_check_heartbeat);
-    xTimerStart(timer, portMAX_DELAY);
+
+    /* 协议栈保存了节点的Composition Data，启动时同步到节点登记表 */
+    uint16_t prov_node_num = esp_ble_mesh_provisioner_get_prov_node_count();
+    const esp_ble_mesh_node_t **mesh_node = esp_ble_mesh_provisioner_get_node_table_entry();
+    for (uint16_t i = 0; mesh_node != NULL && i < CONFIG_BLE_MESH_MAX_PROV_NODES && prov_node_num > 0; i++) {
+        if (mesh_node[i] == NULL) continue;
+        ble_mesh_node_comp_sync(mesh_node[i]->unicast_addr);
+        prov_node_num--;
+    }
  
     // ble_mesh_prov_unbind_delete_all();  // 要在初始化前调用！
 
@@ -1633,9 +1967,16 @@ static void ble_mesh_init(void)
 void app_ble_mesh_init(void)
 {   
     xEvent = xEventGroupCreate();
-    xQueue = xQueueCreate(3, sizeof(mesh_transfer_t));
+    ble_mesh_pool_init();  // 长数据缓存池（在收发之前）
+    ble_mesh_rx_init();  // 接收缓存（节点主动上报的数据）
+
+    ble_mesh_shadow_init();  // 节点状态影子
 
     mesh_bind_init();
+
+    ble_mesh_group_init();  // 自动分组（在绑定表之后，都要读NVS）
+
+    ble_mesh_tx_init();  // 发送引擎
     
     /* Initialize the Bluetooth Mesh Subsystem */
     ble_mesh_init();
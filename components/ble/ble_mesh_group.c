@@ -0,0 +1,435 @@
+/**
+ * @file    ble_mesh_group.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 自动分组
+ *          - 多目标 SET 的节点集合（排序后）记在分组表中，下发 MESH_GROUP_LEARN_HITS 次后建立分组；
+ *          - 分组的组播地址是 MESH_GROUP_ADDR_BASE + 表索引，逐个节点、逐个模型发送订阅配置，
+ *            同一时刻只有一条订阅配置在等待响应（协议栈对同一节点同一操作码不能并发）；
+ *          - 全部节点都订阅了某个模型后，该模型的 SET 改成一条 SET_UNACK 组播消息（节点不响应，
+ *            需要确认时用 MESH_GROUP_VERIFY 逐个 GET，或者看状态影子）；
+ *          - 分组表满时淘汰最久没用的分组，先取消订阅再释放组播地址；
+ *          - 分组表保存在NVS，重启后不用重新学习。
+ * @version 0.1
+ * @date    2023-08-16
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "ble_mesh_group.h"
+#include "ble_mesh_nvs.h"
+
+#define TAG "mesh_group"
+
+#define GROUP_JOB_TIMEOUT       10000   // 订阅配置的兜底超时/MS（协议栈正常会先回调超时）
+#define GROUP_JOB_RETRY         2       // 超时重发次数
+
+enum {
+    GROUP_STATE_FREE = 0,
+    GROUP_STATE_LEARN,      // 学习中：统计下发次数
+    GROUP_STATE_SYNC,       // 正在订阅
+    GROUP_STATE_READY,      // 已建立，可以组播
+    GROUP_STATE_REMOVE,     // 正在取消订阅，完成后释放
+};
+
+typedef struct {
+    uint8_t  state;
+    uint8_t  num;
+    uint16_t hits;
+    uint32_t key;                               // 节点集合的哈希值（快速比较）
+    uint32_t tick;                              // 最后使用时间（淘汰用）
+    uint16_t member[MESH_GROUP_MEMBER_MAX];     // 升序
+    uint8_t  sub[MESH_GROUP_MEMBER_MAX];        // bit: 已订阅的模型（group_model[]）
+    uint8_t  done[MESH_GROUP_MEMBER_MAX];       // bit: 已配置过的模型（成功或节点没有该模型）
+} mesh_group_t;
+
+typedef struct {
+    bool       busy;
+    bool       add;
+    uint16_t   node_addr;
+    uint8_t    group;
+    uint8_t    member;
+    uint8_t    model;
+    uint8_t    retry;
+    TickType_t deadline;
+} mesh_group_job_t;
+
+typedef struct {
+    uint16_t model_id;
+    uint16_t company_id;
+    uint32_t opcode;        // 可以组播的 SET
+    uint32_t unack;         // 组播发送用的操作码（节点不响应，不会一起回 STATUS）
+    uint8_t  cap;           // 节点登记表中的能力位（MESH_CAP_*）
+} mesh_group_model_t;
+
+static const mesh_group_model_t group_model[] = {
+    { ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_SRV, ESP_BLE_MESH_CID_NVAL, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK, MESH_CAP_ONOFF  },
+    { ESP_BLE_MESH_MODEL_ID_LIGHT_HSL_SRV, ESP_BLE_MESH_CID_NVAL, ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET, ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK, MESH_CAP_HSL    },
+    { ESP_BLE_MESH_MODEL_ID_LIGHT_CTL_SRV, ESP_BLE_MESH_CID_NVAL, ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET, ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET_UNACK, MESH_CAP_CTL    },
+    { GENIE_VENDOR_MODEL_ID_SERVER,        CID_COMPANY,          GENIE_MODEL_OP_ATTR_SET,             GENIE_MODEL_OP_ATTR_SET_UNACK,             MESH_CAP_VENDOR },
+};
+#define GROUP_MODEL_NUM     (sizeof(group_model) / sizeof(group_model[0]))
+#define GROUP_MODEL_ALL     ((1 << GROUP_MODEL_NUM) - 1)
+
+typedef struct {
+    uint16_t group_addr;
+    uint8_t  num;
+    uint8_t  models;        // 全部节点都订阅了的模型，0: 分组不能用，取消订阅
+} mesh_group_sync_t;        // 订阅配置完成的结果（在临界区外打印）
+
+static mesh_group_t *group = NULL;     // [MESH_GROUP_MAX]
+static mesh_group_job_t group_job = { 0 };
+static bool group_dirty = false;       // 分组表要保存到NVS
+static portMUX_TYPE group_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//============================================================================================
+static int8_t ble_mesh_group_model_index(uint32_t opcode)
+{
+    for (uint8_t i = 0; i < GROUP_MODEL_NUM; i++) {
+        if (group_model[i].opcode == opcode) return i;
+    }
+    return -1;
+}
+
+// 排序去重，return: 节点数
+static uint8_t ble_mesh_group_sort(const uint16_t *uniaddr, uint8_t num, uint16_t *member)
+{
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < num; i++) {
+        uint16_t addr = uniaddr[i];
+        uint8_t pos = n;
+        while (pos > 0 && member[pos - 1] > addr) pos--;
+        if (pos > 0 && member[pos - 1] == addr) continue;
+        memmove(&member[pos + 1], &member[pos], (n - pos) * sizeof(uint16_t));
+        member[pos] = addr;
+        n++;
+    }
+    return n;
+}
+
+static uint32_t ble_mesh_group_key(const uint16_t *member, uint8_t num)
+{
+    uint32_t hash = 2166136261UL;  // FNV-1a
+    for (uint8_t i = 0; i < num; i++) {
+        hash ^= member[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// 以下调用前都要持有 group_lock
+static mesh_group_t *ble_mesh_group_find(const uint16_t *member, uint8_t num, uint32_t key)
+{
+    for (uint8_t i = 0; i < MESH_GROUP_MAX; i++) {
+        mesh_group_t *g = &group[i];
+        if (g->state == GROUP_STATE_FREE || g->key != key || g->num != num) continue;
+        if (memcmp(g->member, member, num * sizeof(uint16_t)) == 0) return g;
+    }
+    return NULL;
+}
+
+// 分组表满了：淘汰最久没用的学习中分组，没有的话淘汰最久没用的已建立分组（先取消订阅）
+static mesh_group_t *ble_mesh_group_alloc(void)
+{
+    mesh_group_t *learn = NULL, *ready = NULL;
+    for (uint8_t i = 0; i < MESH_GROUP_MAX; i++) {
+        mesh_group_t *g = &group[i];
+        if (g->state == GROUP_STATE_FREE) return g;
+        if (g->state == GROUP_STATE_LEARN) {
+            if (learn == NULL || (int32_t)(g->tick - learn->tick) < 0) learn = g;
+        } else if (g->state == GROUP_STATE_READY) {
+            if (ready == NULL || (int32_t)(g->tick - ready->tick) < 0) ready = g;
+        }
+    }
+    if (learn != NULL) return learn;
+    if (ready != NULL) {
+        ready->state = GROUP_STATE_REMOVE;  // 组播地址要等取消订阅后才能再用
+        group_dirty = true;
+    }
+    return NULL;
+}
+
+// 订阅完成：至少有一个模型全部节点都订阅了才能用，否则把已订阅的取消，return: true: 全部配置完了
+static bool ble_mesh_group_sync_check(mesh_group_t *g, mesh_group_sync_t *sync)
+{
+    uint8_t common = GROUP_MODEL_ALL;
+    for (uint8_t m = 0; m < g->num; m++) {
+        if (g->done[m] != GROUP_MODEL_ALL) return false;  // 还没配置完
+        common &= g->sub[m];
+    }
+    g->state = (common != 0) ? GROUP_STATE_READY : GROUP_STATE_REMOVE;
+    group_dirty = true;
+    sync->group_addr = MESH_GROUP_ADDR_BASE + (g - group);
+    sync->num        = g->num;
+    sync->models     = common;
+    return true;
+}
+
+static void ble_mesh_group_sync_log(const mesh_group_sync_t *sync)
+{
+    #ifdef TAG
+    ESP_LOGI(TAG, "group 0x%04x: nodes = %d, models = 0x%02x", sync->group_addr, sync->num, sync->models);
+    #endif
+}
+
+static void ble_mesh_group_remove_check(mesh_group_t *g)
+{
+    for (uint8_t m = 0; m < g->num; m++) {
+        if (g->sub[m] != 0) return;  // 还没取消完
+    }
+    memset(g, 0, sizeof(mesh_group_t));
+    group_dirty = true;
+}
+
+// 下一条要发送的订阅配置，return: false: 没有
+static bool ble_mesh_group_next_job(mesh_group_job_t *job)
+{
+    for (uint8_t i = 0; i < MESH_GROUP_MAX; i++) {
+        mesh_group_t *g = &group[i];
+        if (g->state != GROUP_STATE_SYNC && g->state != GROUP_STATE_REMOVE) continue;
+        for (uint8_t m = 0; m < g->num; m++) {
+            uint8_t todo = (g->state == GROUP_STATE_SYNC) ? (~g->done[m] & GROUP_MODEL_ALL) : g->sub[m];
+            if (todo == 0) continue;
+            job->node_addr = g->member[m];
+            job->group  = i;
+            job->member = m;
+            job->model  = __builtin_ctz(todo);
+            job->add    = (g->state == GROUP_STATE_SYNC);
+            job->retry  = 0;
+            return true;
+        }
+        if (g->state == GROUP_STATE_REMOVE) ble_mesh_group_remove_check(g);
+    }
+    return false;
+}
+
+// 当前订阅配置完成（成功/失败/放弃），return: true: 分组的订阅全部配置完了（sync 在退出临界区后打印）
+static bool ble_mesh_group_job_done(bool success, mesh_group_sync_t *sync)
+{
+    mesh_group_t *g = &group[group_job.group];
+    uint8_t bit = 1 << group_job.model;
+    group_job.busy = false;
+    if (group_job.add) {
+        if (success) g->sub[group_job.member] |= bit;  // 订阅过程中分组被删除了：后面会取消这个订阅
+        if (g->state == GROUP_STATE_SYNC) {
+            g->done[group_job.member] |= bit;
+            return ble_mesh_group_sync_check(g, sync);
+        }
+    } else {
+        g->sub[group_job.member] &= ~bit;  // 取消失败也不再重试（节点可能已经离线或被解绑）
+        ble_mesh_group_remove_check(g);
+    }
+    return false;
+}
+
+static void ble_mesh_group_job_send(const mesh_group_job_t *job)
+{
+    uint16_t node_addr  = job->node_addr;
+    uint16_t group_addr = MESH_GROUP_ADDR_BASE + job->group;
+    const mesh_group_model_t *model = &group_model[job->model];
+    int8_t elem = ble_mesh_cap_element(node_addr, model->cap);  // 模型所在的元素（Genie 厂家模型可能不在主元素）
+    uint16_t element_addr = node_addr + (elem > 0 ? elem : 0);
+    esp_err_t err = ble_mesh_model_sub_set(node_addr, element_addr, group_addr, model->model_id, model->company_id, job->add);
+    #ifdef TAG
+    ESP_LOGI(TAG, "%s 0x%04x: element 0x%04x, model 0x%04x, retry = %d, err = 0x%x", job->add ? "sub add" : "sub delete",
+             group_addr, element_addr, model->model_id, job->retry, err);
+    #endif
+    if (err != ESP_OK) {  // 发送失败：交给 ble_mesh_group_process() 重发
+        taskENTER_CRITICAL(&group_lock);
+        group_job.deadline = xTaskGetTickCount();
+        taskEXIT_CRITICAL(&group_lock);
+    }
+}
+
+// 节点的全部元素都确定没有这个模型（Composition Data 已知）
+static bool ble_mesh_group_model_absent(uint16_t node_addr, uint8_t model)
+{
+    return ble_mesh_cap_element(node_addr, group_model[model].cap) < 0;
+}
+
+// 发送下一条订阅配置（同一时刻只有一条在等待响应）
+static void ble_mesh_group_job_start(void)
+{
+    if (group == NULL) return;
+    while (1) {
+        mesh_group_job_t job;
+        bool start = false;
+        taskENTER_CRITICAL(&group_lock);
+        if (group_job.busy == false && ble_mesh_group_next_job(&group_job)) {
+            group_job.busy = true;
+            group_job.deadline = xTaskGetTickCount() + pdMS_TO_TICKS(GROUP_JOB_TIMEOUT);
+            job = group_job;
+            start = true;
+        }
+        taskEXIT_CRITICAL(&group_lock);
+        if (start == false) return;
+
+        if (job.add && ble_mesh_group_model_absent(job.node_addr, job.model)) {  // 不用发送，直接当作订阅失败
+            mesh_group_sync_t sync;
+            bool synced = false;
+            taskENTER_CRITICAL(&group_lock);
+            if (group_job.busy && group_job.node_addr == job.node_addr) synced = ble_mesh_group_job_done(false, &sync);
+            taskEXIT_CRITICAL(&group_lock);
+            if (synced) ble_mesh_group_sync_log(&sync);
+            continue;
+        }
+        ble_mesh_group_job_send(&job);
+        return;
+    }
+}
+
+//============================================================================================
+uint16_t ble_mesh_group_match(const uint16_t *uniaddr, uint8_t num, uint32_t opcode, uint32_t *group_opcode)
+{
+    uint16_t member[MESH_GROUP_MEMBER_MAX];
+    int8_t model = ble_mesh_group_model_index(opcode);
+    if (group == NULL || model < 0 || num > MESH_GROUP_MEMBER_MAX) return 0;
+    num = ble_mesh_group_sort(uniaddr, num, member);
+    if (num < MESH_GROUP_MEMBER_MIN) return 0;
+    uint32_t key = ble_mesh_group_key(member, num);
+
+    uint16_t group_addr = 0;
+    bool sync = false;
+    taskENTER_CRITICAL(&group_lock);
+    mesh_group_t *g = ble_mesh_group_find(member, num, key);
+    if (g == NULL && (g = ble_mesh_group_alloc()) != NULL) {
+        memset(g, 0, sizeof(mesh_group_t));
+        g->state = GROUP_STATE_LEARN;
+        g->num   = num;
+        g->key   = key;
+        memcpy(g->member, member, num * sizeof(uint16_t));
+    }
+    if (g != NULL && g->state != GROUP_STATE_REMOVE) {
+        g->tick = xTaskGetTickCount();
+        if (g->hits < UINT16_MAX) g->hits++;
+        if (g->state == GROUP_STATE_LEARN && g->hits >= MESH_GROUP_LEARN_HITS) {
+            g->state = GROUP_STATE_SYNC;  // 建立分组：开始订阅
+            sync = true;
+        } else if (g->state == GROUP_STATE_READY) {
+            group_addr = MESH_GROUP_ADDR_BASE + (g - group);
+            for (uint8_t m = 0; m < num; m++) {
+                if ((g->sub[m] & (1 << model)) == 0) group_addr = 0;  // 有节点没有订阅这个模型
+            }
+        }
+    }
+    taskEXIT_CRITICAL(&group_lock);
+
+    if (sync) ble_mesh_group_job_start();
+    if (group_addr != 0) *group_opcode = group_model[model].unack;
+    return group_addr;
+}
+
+void ble_mesh_group_sub_status(uint16_t node_addr, uint8_t status)
+{
+    if (group == NULL) return;
+    mesh_group_sync_t sync;
+    bool synced = false;
+    bool next = false;
+    taskENTER_CRITICAL(&group_lock);
+    if (group_job.busy && group_job.node_addr == node_addr) {
+        if (status != MESH_GROUP_STATUS_TIMEOUT) {
+            synced = ble_mesh_group_job_done(status == 0x00, &sync);  // 0x02: 节点没有这个模型
+            next = true;
+        } else {
+            group_job.deadline = xTaskGetTickCount();  // 交给 ble_mesh_group_process() 重发
+        }
+    }
+    taskEXIT_CRITICAL(&group_lock);
+    if (synced) ble_mesh_group_sync_log(&sync);
+    if (next) ble_mesh_group_job_start();
+}
+
+void ble_mesh_group_node_remove(uint16_t uniaddr)
+{
+    if (group == NULL) return;
+    taskENTER_CRITICAL(&group_lock);
+    for (uint8_t i = 0; i < MESH_GROUP_MAX; i++) {
+        mesh_group_t *g = &group[i];
+        if (g->state == GROUP_STATE_FREE) continue;
+        for (uint8_t m = 0; m < g->num; m++) {
+            if (g->member[m] != uniaddr) continue;
+            g->sub[m] = 0;   // 节点的订阅已经不存在了
+            if (g->state == GROUP_STATE_LEARN) {
+                memset(g, 0, sizeof(mesh_group_t));
+            } else {
+                g->state = GROUP_STATE_REMOVE;
+            }
+            group_dirty = true;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&group_lock);
+    ble_mesh_group_job_start();
+}
+
+void ble_mesh_group_remove_all(void)
+{
+    if (group == NULL) return;
+    taskENTER_CRITICAL(&group_lock);
+    memset(group, 0, MESH_GROUP_MAX * sizeof(mesh_group_t));
+    group_job.busy = false;
+    group_dirty = true;
+    taskEXIT_CRITICAL(&group_lock);
+}
+
+void ble_mesh_group_process(void)
+{
+    if (group == NULL) return;
+    mesh_group_job_t job;
+    mesh_group_sync_t sync;
+    bool synced = false;
+    bool resend = false;
+    taskENTER_CRITICAL(&group_lock);
+    if (group_job.busy && (int32_t)(group_job.deadline - xTaskGetTickCount()) <= 0) {
+        if (group_job.retry < GROUP_JOB_RETRY) {  // 超时：重发
+            group_job.retry++;
+            group_job.deadline = xTaskGetTickCount() + pdMS_TO_TICKS(GROUP_JOB_TIMEOUT);
+            job = group_job;
+            resend = true;
+        } else {  // 重发次数用完：放弃这条
+            synced = ble_mesh_group_job_done(false, &sync);
+        }
+    }
+    bool dirty = group_dirty;
+    group_dirty = false;
+    taskEXIT_CRITICAL(&group_lock);
+
+    if (synced) ble_mesh_group_sync_log(&sync);
+    if (resend) ble_mesh_group_job_send(&job);
+    ble_mesh_group_job_start();
+
+    if (dirty) {  // 分组状态有变化才写NVS
+        mesh_group_t *store = heap_caps_malloc(MESH_GROUP_MAX * sizeof(mesh_group_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (store == NULL) return;
+        taskENTER_CRITICAL(&group_lock);
+        memcpy(store, group, MESH_GROUP_MAX * sizeof(mesh_group_t));
+        taskEXIT_CRITICAL(&group_lock);
+        ble_group_nvs_store(store, MESH_GROUP_MAX * sizeof(mesh_group_t), NVS_MODE_WRITE);
+        heap_caps_free(store);
+    }
+}
+
+void ble_mesh_group_init(void)
+{
+    group = heap_caps_calloc(MESH_GROUP_MAX, sizeof(mesh_group_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (group == NULL) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "group table malloc fail");
+        #endif
+        return;
+    }
+    ble_group_nvs_store(group, MESH_GROUP_MAX * sizeof(mesh_group_t), NVS_MODE_READ);
+    for (uint8_t i = 0; i < MESH_GROUP_MAX; i++) {
+        mesh_group_t *g = &group[i];
+        if (g->state > GROUP_STATE_REMOVE || g->num > MESH_GROUP_MEMBER_MAX) {  // 数据不对（分组表结构变了）
+            memset(group, 0, MESH_GROUP_MAX * sizeof(mesh_group_t));
+            break;
+        }
+        g->tick = 0;
+    }
+}
@@ -0,0 +1,265 @@
+/**
+ * @file    ble_mesh_metrics.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 收发统计
+ *          - 按操作码：发出/重发/响应/超时/失败/影子响应的次数，响应时间直方图和最大值；
+ *          - 按节点：发出/响应/超时的次数记在节点登记表中（mesh_node_t.stats），节点删除时一起清除；
+ *          - 发送队列丢弃的消息数，接收缓存/长数据缓存池的统计来自 ble_mesh_rx/ble_mesh_pool。
+ * @version 0.1
+ * @date    2023-08-25
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "ble_mesh_metrics.h"
+#include "ble_mesh_rx.h"
+#include "ble_mesh_pool.h"
+
+#define TAG "mesh_metrics"
+
+typedef struct {
+    uint32_t send;          // 发出的次数（含重发）
+    uint32_t retry;         // 重发的次数
+    uint32_t ack;           // 收到响应
+    uint32_t timeout;       // 最终超时
+    uint32_t fail;          // 发送失败/不支持
+    uint32_t cache;         // 影子直接响应（没有发出）
+    uint32_t latency_max;   // 最大响应时间/MS
+    uint32_t hist[MESH_METRICS_BUCKET_NUM];
+} mesh_metrics_op_t;
+
+static const uint32_t metrics_opcode[] = {
+    ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET,
+    ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET,
+    GENIE_MODEL_OP_ATTR_SET,
+    GENIE_MODEL_OP_ATTR_GET,
+};
+#define METRICS_OPCODE_NUM  (sizeof(metrics_opcode) / sizeof(metrics_opcode[0]))
+
+static const uint16_t metrics_bucket[MESH_METRICS_BUCKET_NUM - 1] = { 50, 100, 200, 400, 800, 1600, 3200 };
+
+static mesh_metrics_op_t metrics_op[METRICS_OPCODE_NUM + 1];  // 最后一个: 其他操作码
+static uint32_t metrics_drop = 0;                              // 发送队列满丢弃的消息数
+static TickType_t metrics_since = 0;                           // 开始统计的时间
+static portMUX_TYPE metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//============================================================================================
+static mesh_metrics_op_t *ble_mesh_metrics_op(uint32_t opcode)
+{
+    for (uint8_t i = 0; i < METRICS_OPCODE_NUM; i++) {
+        if (metrics_opcode[i] == opcode) return &metrics_op[i];
+    }
+    return &metrics_op[METRICS_OPCODE_NUM];
+}
+
+static uint8_t ble_mesh_metrics_bucket(uint32_t latency)
+{
+    uint8_t i = 0;
+    while (i < MESH_METRICS_BUCKET_NUM - 1 && latency >= metrics_bucket[i]) i++;
+    return i;
+}
+
+// 计入节点统计：由 mesh_node_add_stats() 在锁内把次元素地址归到所属节点
+static void ble_mesh_metrics_node(uint16_t addr, uint8_t tx, uint8_t ack, uint8_t timeout)
+{
+    if (!ESP_BLE_MESH_ADDR_IS_UNICAST(addr)) return;
+    mesh_node_add_stats(addr, tx, ack, timeout);
+}
+
+void ble_mesh_metrics_send(const mesh_msg_t *msg, bool retry)
+{
+    taskENTER_CRITICAL(&metrics_lock);
+    mesh_metrics_op_t *op = ble_mesh_metrics_op(msg->opcode);
+    op->send++;
+    if (retry) op->retry++;
+    taskEXIT_CRITICAL(&metrics_lock);
+    ble_mesh_metrics_node(msg->dst_addr, 1, 0, 0);
+}
+
+void ble_mesh_metrics_done(const mesh_msg_t *msg, esp_err_t err, uint32_t latency)
+{
+    taskENTER_CRITICAL(&metrics_lock);
+    mesh_metrics_op_t *op = ble_mesh_metrics_op(msg->opcode);
+    if (err == ESP_OK) {
+        op->ack++;
+        op->hist[ble_mesh_metrics_bucket(latency)]++;
+        if (latency > op->latency_max) op->latency_max = latency;
+    } else if (err == ESP_ERR_TIMEOUT) {
+        op->timeout++;
+    } else {
+        op->fail++;
+    }
+    taskEXIT_CRITICAL(&metrics_lock);
+    if (err == ESP_OK) ble_mesh_metrics_node(msg->dst_addr, 0, 1, 0);
+}
+
+void ble_mesh_metrics_timeout(const mesh_msg_t *msg)
+{
+    ble_mesh_metrics_node(msg->dst_addr, 0, 0, 1);
+}
+
+void ble_mesh_metrics_cache(const mesh_msg_t *msg)
+{
+    taskENTER_CRITICAL(&metrics_lock);
+    ble_mesh_metrics_op(msg->opcode)->cache++;
+    taskEXIT_CRITICAL(&metrics_lock);
+}
+
+void ble_mesh_metrics_drop(const mesh_msg_t *msg)
+{
+    taskENTER_CRITICAL(&metrics_lock);
+    metrics_drop++;
+    taskEXIT_CRITICAL(&metrics_lock);
+    #ifdef TAG
+    ESP_LOGW(TAG, "tx queue full, drop addr 0x%04x, opcode 0x%06lx", msg->dst_addr, msg->opcode);
+    #endif
+}
+
+void ble_mesh_metrics_reset(void)
+{
+    taskENTER_CRITICAL(&metrics_lock);
+    memset(metrics_op, 0, sizeof(metrics_op));
+    metrics_drop = 0;
+    metrics_since = xTaskGetTickCount();
+    taskEXIT_CRITICAL(&metrics_lock);
+    mesh_node_clear_stats();
+}
+
+//============================================================================================
+static cJSON *ble_mesh_metrics_op_json(const mesh_metrics_op_t *op)
+{
+    cJSON *item = cJSON_CreateObject();
+    if (item == NULL) return NULL;
+    cJSON_AddNumberToObject(item, "send", op->send);
+    cJSON_AddNumberToObject(item, "retry", op->retry);
+    cJSON_AddNumberToObject(item, "ack", op->ack);
+    cJSON_AddNumberToObject(item, "timeout", op->timeout);
+    cJSON_AddNumberToObject(item, "fail", op->fail);
+    cJSON_AddNumberToObject(item, "cache", op->cache);
+    cJSON_AddNumberToObject(item, "max", op->latency_max);
+    int hist[MESH_METRICS_BUCKET_NUM];
+    for (uint8_t i = 0; i < MESH_METRICS_BUCKET_NUM; i++) hist[i] = op->hist[i];
+    cJSON_AddItemToObject(item, "hist", cJSON_CreateIntArray(hist, MESH_METRICS_BUCKET_NUM));
+    return item;
+}
+
+// 按超时次数（再按发出次数）从大到小，只排前 max 个
+static uint16_t ble_mesh_metrics_node_top(mesh_node_t *node, uint16_t num, uint16_t max)
+{
+    if (max > num) max = num;
+    for (uint16_t i = 0; i < max; i++) {
+        uint16_t best = i;
+        for (uint16_t j = i + 1; j < num; j++) {
+            const mesh_node_stats_t *a = &node[j].stats, *b = &node[best].stats;
+            if (a->timeout > b->timeout || (a->timeout == b->timeout && a->tx > b->tx)) best = j;
+        }
+        if (best != i) {
+            mesh_node_t tmp = node[i];
+            node[i] = node[best];
+            node[best] = tmp;
+        }
+    }
+    return max;
+}
+
+static cJSON *ble_mesh_metrics_node_json(uint16_t node_max)
+{
+    mesh_node_t *node = heap_caps_malloc(BIND_TABLE_SIZE * sizeof(mesh_node_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (node == NULL) return NULL;
+    uint16_t num = mesh_node_get_all(node, BIND_TABLE_SIZE);
+    num = ble_mesh_metrics_node_top(node, num, node_max);
+
+    cJSON *nodes = cJSON_CreateObject();
+    for (uint16_t i = 0; nodes != NULL && i < num; i++) {
+        if (node[i].stats.tx == 0) continue;
+        cJSON *item = cJSON_CreateObject();
+        if (item == NULL) break;
+        char addr_str[8];
+        sprintf(addr_str, "0x%04X", node[i].bind.uniaddr);
+        cJSON_AddNumberToObject(item, "tx", node[i].stats.tx);
+        cJSON_AddNumberToObject(item, "ack", node[i].stats.ack);
+        cJSON_AddNumberToObject(item, "timeout", node[i].stats.timeout);
+        if (node[i].link.srtt > 0) cJSON_AddNumberToObject(item, "rtt", node[i].link.srtt);
+        cJSON_AddItemToObject(nodes, addr_str, item);
+    }
+    heap_caps_free(node);
+    return nodes;
+}
+
+// {"since":3600,"bucket":[50,...],"tx_drop":0,"rx":{"push":..,"drop":..,"peak":..},"pool":{"size":16,"used":0,"peak":2,"fail":0},
+//  "op":{"0x8202":{"send":10,"retry":1,"ack":9,"timeout":0,"fail":0,"cache":0,"max":420,"hist":[0,3,4,2,0,0,0,0]}},
+//  "node":{"0x0005":{"tx":10,"ack":9,"timeout":1,"rtt":120}}}
+cJSON *ble_mesh_metrics_json(uint16_t node_max)
+{
+    // 快照：定时上报和云端指令可能在不同的任务中导出
+    mesh_metrics_op_t *op = heap_caps_malloc(sizeof(metrics_op), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (op == NULL) return NULL;
+    taskENTER_CRITICAL(&metrics_lock);
+    memcpy(op, metrics_op, sizeof(metrics_op));
+    uint32_t drop = metrics_drop;
+    TickType_t since = metrics_since;
+    taskEXIT_CRITICAL(&metrics_lock);
+
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        heap_caps_free(op);
+        return NULL;
+    }
+    cJSON_AddNumberToObject(root, "since", (xTaskGetTickCount() - since) / configTICK_RATE_HZ);
+    int bucket[MESH_METRICS_BUCKET_NUM - 1];
+    for (uint8_t i = 0; i < MESH_METRICS_BUCKET_NUM - 1; i++) bucket[i] = metrics_bucket[i];
+    cJSON_AddItemToObject(root, "bucket", cJSON_CreateIntArray(bucket, MESH_METRICS_BUCKET_NUM - 1));
+    cJSON_AddNumberToObject(root, "tx_drop", drop);
+
+    mesh_rx_stats_t stats;
+    ble_mesh_rx_get_stats(&stats);
+    cJSON *rx = cJSON_CreateObject();
+    if (rx != NULL) {
+        cJSON_AddNumberToObject(rx, "push", stats.push);
+        cJSON_AddNumberToObject(rx, "drop", stats.drop);
+        cJSON_AddNumberToObject(rx, "peak", stats.peak);
+        cJSON_AddItemToObject(root, "rx", rx);
+    }
+
+    mesh_pool_stats_t pool_stats;
+    ble_mesh_pool_get_stats(&pool_stats);
+    cJSON *pool = cJSON_CreateObject();
+    if (pool != NULL) {
+        cJSON_AddNumberToObject(pool, "size", pool_stats.size);
+        cJSON_AddNumberToObject(pool, "used", pool_stats.used);
+        cJSON_AddNumberToObject(pool, "peak", pool_stats.peak);
+        cJSON_AddNumberToObject(pool, "fail", pool_stats.fail);
+        cJSON_AddItemToObject(root, "pool", pool);
+    }
+
+    cJSON *ops = cJSON_CreateObject();
+    for (uint8_t i = 0; ops != NULL && i <= METRICS_OPCODE_NUM; i++) {
+        if (op[i].send == 0 && op[i].cache == 0 && op[i].fail == 0) continue;
+        char opcode_str[10];
+        if (i == METRICS_OPCODE_NUM) {
+            strcpy(opcode_str, "other");
+        } else {
+            sprintf(opcode_str, metrics_opcode[i] > 0xFFFF ? "0x%06lX" : "0x%04lX", metrics_opcode[i]);
+        }
+        cJSON_AddItemToObject(ops, opcode_str, ble_mesh_metrics_op_json(&op[i]));
+    }
+    if (ops != NULL) cJSON_AddItemToObject(root, "op", ops);
+    heap_caps_free(op);
+
+    if (node_max > 0) {
+        cJSON *nodes = ble_mesh_metrics_node_json(node_max);
+        if (nodes != NULL) cJSON_AddItemToObject(root, "node", nodes);
+    }
+    return root;
+}
@@ -27,6 +27,34 @@ esp_err_t ble_bind_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode)
     return nvs_blob_handle(value, size, "_BIND_KEY_", nvs_open_mode);
 }
 
+// 上一版每个绑定记录一个键："_BIND_00_" ~ "_BIND_19_"（只用于迁移）
+esp_err_t ble_bind_slot_nvs_store(uint8_t slot, void *value, size_t size, nvs_mode_t nvs_open_mode)
+{
+    char key[16];
+    sprintf(key, "_BIND_%02d_", slot);
+    return nvs_blob_handle(value, size, key, nvs_open_mode);
+}
+
+// 每页 BIND_PAGE_SIZE 个绑定记录："_BIND_P000_"、"_BIND_P001_"...
+esp_err_t ble_bind_page_nvs_store(uint16_t page, void *value, size_t size, nvs_mode_t nvs_open_mode)
+{
+    char key[16];
+    sprintf(key, "_BIND_P%03d_", page);
+    return nvs_blob_handle(value, size, key, nvs_open_mode);
+}
+
+// 登记表的大小（mesh_bind_set_size()），0/没有: 用 menuconfig 的默认值
+esp_err_t ble_bind_size_nvs_store(uint16_t *size, nvs_open_mode_t nvs_open_mode)
+{
+    return nvs_u16_handle(size, "_BIND_SIZE_", nvs_open_mode);
+}
+
+// 自动分组表
+esp_err_t ble_group_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode)
+{
+    return nvs_blob_handle(value, size, "_GROUP_KEY_", nvs_open_mode);
+}
+
 esp_err_t ble_gattc_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode)
 {
     return nvs_blob_handle(value, size, "_GATTC_KEY_", nvs_open_mode);
@@ -0,0 +1,398 @@
+/**
+ * @file    ble_mesh_ota.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 节点固件分发
+ *          - START/QUERY/APPLY 经过发送引擎（等待 OTA_STATUS 响应，超时重发）；
+ *          - 数据块不等待响应，等协议栈 SEND_COMP_EVT 后再发下一块，发送失败时加大间隔；
+ *          - 按窗口推进：最慢的节点所在的窗口，合并这些节点缺少的块一起补发，然后查询；
+ *            多个节点在同一窗口时发到 GENIE_OTA_GROUP_ADDR（节点的 vendor server 需要订阅这个组）；
+ *          - 节点连续 MESH_OTA_STALL_MAX 次查询没有进展就放弃，不拖住其他节点。
+ * @version 0.1
+ * @date    2023-08-28
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "ble_mesh_ota.h"
+#include "ble_mesh_tx.h"
+#include "ble_mesh_pool.h"
+
+#define TAG "mesh_ota"
+
+#define OTA_EVT_CHUNK       BIT0    // 数据块发送完成
+#define OTA_EVT_REPLY       BIT1    // 这一轮请求全部响应/超时
+
+#define OTA_REPLY_TIMEOUT   60000   // 发送引擎没有回调的兜底时间/MS
+
+enum {
+    OTA_TARGET_ACTIVE = 0,  // 正在接收
+    OTA_TARGET_DONE,        // 已经收到全部数据块
+    OTA_TARGET_OK,          // 已经校验并开始升级
+    OTA_TARGET_FAIL,
+};
+
+typedef struct {
+    uint16_t  uniaddr;
+    uint8_t   state;
+    uint8_t   stall;        // 连续没有进展的查询次数
+    uint16_t  window;       // 节点第一个没有收完的窗口
+    uint32_t  missing;      // 这个窗口缺少的块（bit0: 窗口的第一块）
+    /* 最近一次请求的响应（发送引擎回调中在 ota_lock 内填写） */
+    esp_err_t err;
+    uint8_t   status;
+    uint8_t   reply_len;
+    uint16_t  reply_window;
+    uint32_t  reply_missing;
+} mesh_ota_target_t;
+
+static mesh_ota_target_t ota_target[MESH_OTA_TARGET_MAX];
+static uint8_t  ota_target_num = 0;
+static const uint8_t *ota_image = NULL;
+static uint32_t ota_size = 0;
+static uint32_t ota_crc = 0;
+static uint16_t ota_chunk_num = 0;
+static uint16_t ota_window_num = 0;
+static uint16_t ota_pending = 0;
+static uint16_t ota_seq = 0;            // 请求序号：超时结束后迟到的响应序号对不上，直接丢弃
+static uint8_t  ota_plan = 0xFF;        // 上次上报的进度
+static bool     ota_busy = false;
+static volatile esp_err_t ota_chunk_err = ESP_OK;
+static EventGroupHandle_t ota_event = NULL;
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static ble_mesh_ota_progress_t ble_mesh_ota_progress = NULL;
+static ble_mesh_ota_result_t ble_mesh_ota_result = NULL;
+
+//============================================================================================
+void ble_mesh_ota_register_callback(ble_mesh_ota_progress_t progress, ble_mesh_ota_result_t result)
+{
+    ble_mesh_ota_progress = progress;
+    ble_mesh_ota_result = result;
+}
+
+bool ble_mesh_ota_busy(void)
+{
+    return ota_busy;
+}
+
+void ble_mesh_ota_chunk_comp(esp_err_t err)
+{
+    if (ota_event == NULL) return;
+    ota_chunk_err = err;
+    xEventGroupSetBits(ota_event, OTA_EVT_CHUNK);
+}
+
+static void ble_mesh_ota_put_be16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value;
+}
+
+static void ble_mesh_ota_put_be32(uint8_t *buf, uint32_t value)
+{
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+// 窗口中有效的块（最后一个窗口可能不满）
+static uint32_t ble_mesh_ota_window_mask(uint16_t window)
+{
+    uint32_t num = ota_chunk_num - (uint32_t)window * MESH_OTA_WINDOW;
+    return (num >= 32) ? UINT32_MAX : ((1UL << num) - 1);
+}
+
+//============================================================================================
+// 发送引擎回调：只记录响应，由分发任务处理。arg: 请求序号 << 8 | 节点序号
+static void ble_mesh_ota_reply(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    uint16_t seq = (uintptr_t)arg >> 8;
+    mesh_ota_target_t *target = &ota_target[(uintptr_t)arg & 0xFF];
+    uint8_t  reply_status = 0, reply_len = 0;
+    uint16_t reply_window = 0;
+    uint32_t reply_missing = 0;
+    if (err == ESP_OK && status != NULL && status->len >= 1) {
+        const uint8_t *data = mesh_transfer_data(status);
+        reply_status = data[0];
+        reply_len = status->len;
+        if (status->len >= 7) {
+            reply_window  = (data[1] << 8) | data[2];
+            reply_missing = ((uint32_t)data[3] << 24) | ((uint32_t)data[4] << 16) | (data[5] << 8) | data[6];
+        }
+    } else if (err == ESP_OK) {
+        err = ESP_ERR_INVALID_RESPONSE;
+    }
+    bool done = false;
+    taskENTER_CRITICAL(&ota_lock);
+    if (seq == ota_seq && ota_pending > 0) {  // 和 ble_mesh_ota_request() 结束等待在同一把锁里判断
+        target->err = err;
+        target->reply_len = reply_len;
+        if (reply_len >= 1) target->status = reply_status;
+        if (reply_len >= 7) {
+            target->reply_window  = reply_window;
+            target->reply_missing = reply_missing;
+        }
+        if (--ota_pending == 0) done = true;
+    }
+    taskEXIT_CRITICAL(&ota_lock);
+    if (done) xEventGroupSetBits(ota_event, OTA_EVT_REPLY);
+}
+
+/**
+ * @brief  给 state 状态的节点（window != UINT16_MAX 时只发给这个窗口的节点）发送请求，等待全部响应/超时
+ * @return 发送的节点数
+ */
+static uint8_t ble_mesh_ota_request(uint32_t opcode, const uint8_t *data, uint16_t len, uint8_t state, uint16_t window)
+{
+    uint8_t num = 0;
+    xEventGroupClearBits(ota_event, OTA_EVT_REPLY);
+    taskENTER_CRITICAL(&ota_lock);
+    uint16_t seq = ++ota_seq;
+    ota_pending = 1;  // 先占一个，全部提交后再减掉，避免提交中途就全部响应了
+    taskEXIT_CRITICAL(&ota_lock);
+    for (uint8_t i = 0; i < ota_target_num; i++) {
+        mesh_ota_target_t *target = &ota_target[i];
+        if (target->state != state || (window != UINT16_MAX && target->window != window)) continue;
+        mesh_msg_t msg = { 0 };
+        msg.dst_addr = target->uniaddr;
+        msg.opcode   = opcode;
+        msg.len      = len;
+        if (len > VND_DATA_SIZE) {
+            msg.ext = ble_mesh_pool_dup(data, len);
+        } else {
+            memcpy(msg.data, data, len);
+        }
+        target->err = ESP_FAIL;
+        target->reply_len = 0;
+        taskENTER_CRITICAL(&ota_lock);
+        ota_pending++;
+        taskEXIT_CRITICAL(&ota_lock);
+        if ((len > VND_DATA_SIZE && msg.ext == NULL) || ble_mesh_tx_submit(&msg, ble_mesh_ota_reply, (void *)(((uintptr_t)seq << 8) | i)) != ESP_OK) {
+            taskENTER_CRITICAL(&ota_lock);
+            ota_pending--;
+            taskEXIT_CRITICAL(&ota_lock);
+            continue;  // 提交失败：target->err = ESP_FAIL
+        }
+        num++;
+    }
+    bool done = false;
+    taskENTER_CRITICAL(&ota_lock);
+    if (--ota_pending == 0) done = true;
+    taskEXIT_CRITICAL(&ota_lock);
+    if (done == false) {
+        xEventGroupWaitBits(ota_event, OTA_EVT_REPLY, pdTRUE, pdFALSE, pdMS_TO_TICKS(OTA_REPLY_TIMEOUT));
+    }
+    taskENTER_CRITICAL(&ota_lock);  // 结束这一轮：超时后迟到的响应不再写入节点
+    ota_seq++;
+    ota_pending = 0;
+    taskEXIT_CRITICAL(&ota_lock);
+    return num;
+}
+
+static void ble_mesh_ota_fail(mesh_ota_target_t *target, const char *reason)
+{
+    target->state = OTA_TARGET_FAIL;
+    #ifdef TAG
+    ESP_LOGW(TAG, "node 0x%04x fail: %s (window %d, status %d, err 0x%x)", target->uniaddr, reason, target->window, target->status, target->err);
+    #endif
+}
+
+// 处理 START/QUERY 的响应，更新节点的窗口和缺少的块
+static void ble_mesh_ota_update(mesh_ota_target_t *target, bool query)
+{
+    if (target->err != ESP_OK) {
+        if (query == false) {
+            ble_mesh_ota_fail(target, "no response");
+        } else if (++target->stall >= MESH_OTA_STALL_MAX) {
+            ble_mesh_ota_fail(target, "no response");
+        }
+        return;
+    }
+    if (target->status == MESH_OTA_STATUS_BUSY && query) {
+        if (++target->stall >= MESH_OTA_STALL_MAX) ble_mesh_ota_fail(target, "busy");
+        return;
+    }
+    if (target->status != MESH_OTA_STATUS_OK || target->reply_len < 7) {
+        ble_mesh_ota_fail(target, "rejected");
+        return;
+    }
+    uint16_t window = (target->reply_window < ota_window_num) ? target->reply_window : ota_window_num;
+    uint32_t missing = (window < ota_window_num) ? (target->reply_missing & ble_mesh_ota_window_mask(window)) : 0;
+    if (query) {
+        bool progress = (window > target->window) ||
+                        (window == target->window && __builtin_popcount(missing) < __builtin_popcount(target->missing));
+        if (progress) {
+            target->stall = 0;
+        } else if (++target->stall >= MESH_OTA_STALL_MAX) {
+            ble_mesh_ota_fail(target, "stalled");
+            return;
+        }
+    }
+    target->window  = window;
+    target->missing = missing;
+    if (window >= ota_window_num) target->state = OTA_TARGET_DONE;
+}
+
+//============================================================================================
+// 发送一个窗口中缺少的块
+static void ble_mesh_ota_send_window(uint16_t dst_addr, uint16_t window, uint32_t missing, uint32_t *interval)
+{
+    uint8_t buf[2 + MESH_OTA_CHUNK_SIZE];
+    for (uint8_t i = 0; i < MESH_OTA_WINDOW; i++) {
+        if ((missing & (1UL << i)) == 0) continue;
+        uint16_t index = window * MESH_OTA_WINDOW + i;
+        uint32_t offset = (uint32_t)index * MESH_OTA_CHUNK_SIZE;
+        uint16_t len = (ota_size - offset < MESH_OTA_CHUNK_SIZE) ? (ota_size - offset) : MESH_OTA_CHUNK_SIZE;
+        ble_mesh_ota_put_be16(buf, index);
+        memcpy(buf + 2, ota_image + offset, len);
+
+        xEventGroupClearBits(ota_event, OTA_EVT_CHUNK);
+        esp_err_t err = ble_mesh_vendor_send_unack(dst_addr, GENIE_MODEL_OP_OTA_CHUNK, buf, len + 2);
+        if (err == ESP_OK) {
+            EventBits_t bits = xEventGroupWaitBits(ota_event, OTA_EVT_CHUNK, pdTRUE, pdFALSE, pdMS_TO_TICKS(MESH_OTA_CHUNK_TIMEOUT));
+            err = (bits & OTA_EVT_CHUNK) ? ota_chunk_err : ESP_ERR_TIMEOUT;
+        }
+        if (err != ESP_OK) {  // 协议栈忙/发送失败：加大间隔，缺少的块查询后再补发
+            *interval = (*interval * 2 < MESH_OTA_INTERVAL_MAX) ? (*interval * 2) : MESH_OTA_INTERVAL_MAX;
+        } else if (*interval > MESH_OTA_INTERVAL_MIN) {
+            *interval -= (*interval - MESH_OTA_INTERVAL_MIN + 3) / 4;
+        }
+        vTaskDelay(pdMS_TO_TICKS(*interval));
+    }
+}
+
+static void ble_mesh_ota_report(uint16_t window)
+{
+    uint8_t plan = (uint32_t)window * 99 / ota_window_num;  // 100 由结果回调表示
+    if (plan == ota_plan) return;
+    ota_plan = plan;
+    if (ble_mesh_ota_progress != NULL) {
+        ble_mesh_ota_progress(plan);
+    }
+}
+
+static void ble_mesh_ota_task(void *arg)
+{
+    uint8_t buf[10];
+    uint32_t interval = MESH_OTA_INTERVAL_MIN;
+
+    /* 1：START，节点准备好后返回第一个窗口 */
+    ble_mesh_ota_put_be32(buf, ota_size);
+    ble_mesh_ota_put_be32(buf + 4, ota_crc);
+    ble_mesh_ota_put_be16(buf + 8, MESH_OTA_CHUNK_SIZE);
+    ble_mesh_ota_request(GENIE_MODEL_OP_OTA_START, buf, 10, OTA_TARGET_ACTIVE, UINT16_MAX);
+    for (uint8_t i = 0; i < ota_target_num; i++) {
+        ble_mesh_ota_update(&ota_target[i], false);
+    }
+    ble_mesh_ota_report(0);
+
+    /* 2：从最慢的窗口开始补发，直到全部节点收完或放弃 */
+    while (1) {
+        uint16_t window = ota_window_num;
+        for (uint8_t i = 0; i < ota_target_num; i++) {
+            if (ota_target[i].state == OTA_TARGET_ACTIVE && ota_target[i].window < window) window = ota_target[i].window;
+        }
+        if (window >= ota_window_num) break;
+
+        uint8_t  num = 0;
+        uint16_t dst_addr = GENIE_OTA_GROUP_ADDR;
+        uint32_t missing = 0;
+        for (uint8_t i = 0; i < ota_target_num; i++) {
+            if (ota_target[i].state != OTA_TARGET_ACTIVE || ota_target[i].window != window) continue;
+            missing |= ota_target[i].missing;
+            dst_addr = ota_target[i].uniaddr;
+            num++;
+        }
+        if (num > 1) dst_addr = GENIE_OTA_GROUP_ADDR;
+        if (missing == 0) missing = ble_mesh_ota_window_mask(window);  // 节点没有报缺少的块却没有前进，整个窗口重发
+        #ifdef TAG
+        ESP_LOGI(TAG, "window %d/%d, %d nodes, missing 0x%08lx, interval %ld", window, ota_window_num, num, missing, interval);
+        #endif
+        ble_mesh_ota_send_window(dst_addr, window, missing, &interval);
+
+        ble_mesh_ota_put_be16(buf, window);
+        ble_mesh_ota_request(GENIE_MODEL_OP_OTA_QUERY, buf, 2, OTA_TARGET_ACTIVE, window);
+        for (uint8_t i = 0; i < ota_target_num; i++) {
+            if (ota_target[i].state == OTA_TARGET_ACTIVE && ota_target[i].window == window) {
+                ble_mesh_ota_update(&ota_target[i], true);
+            }
+        }
+        ble_mesh_ota_report(window);
+    }
+
+    /* 3：APPLY，节点校验整个固件的 CRC 后升级 */
+    ble_mesh_ota_put_be32(buf, ota_crc);
+    ble_mesh_ota_request(GENIE_MODEL_OP_OTA_APPLY, buf, 4, OTA_TARGET_DONE, UINT16_MAX);
+
+    mesh_ota_result_t result[MESH_OTA_TARGET_MAX];
+    uint8_t ok_num = 0;
+    for (uint8_t i = 0; i < ota_target_num; i++) {
+        mesh_ota_target_t *target = &ota_target[i];
+        if (target->state == OTA_TARGET_DONE) {
+            if (target->err == ESP_OK && target->status == MESH_OTA_STATUS_OK) {
+                target->state = OTA_TARGET_OK;
+            } else {
+                ble_mesh_ota_fail(target, "apply");
+            }
+        }
+        result[i].uniaddr = target->uniaddr;
+        result[i].ok = (target->state == OTA_TARGET_OK);
+        if (result[i].ok) ok_num++;
+    }
+    #ifdef TAG
+    ESP_LOGI(TAG, "ota finish: %d/%d nodes ok", ok_num, ota_target_num);
+    #endif
+    if (ble_mesh_ota_result != NULL) {
+        ble_mesh_ota_result(result, ota_target_num);
+    }
+    ota_image = NULL;
+    ota_busy = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t ble_mesh_ota_start(const uint8_t *image, uint32_t size, const uint16_t *uniaddr, uint8_t num)
+{
+    if (image == NULL || size == 0 || uniaddr == NULL || num == 0 || num > MESH_OTA_TARGET_MAX) return ESP_ERR_INVALID_ARG;
+    if ((size + MESH_OTA_CHUNK_SIZE - 1) / MESH_OTA_CHUNK_SIZE > UINT16_MAX) return ESP_ERR_INVALID_ARG;
+    taskENTER_CRITICAL(&ota_lock);
+    bool busy = ota_busy;
+    ota_busy = true;
+    taskEXIT_CRITICAL(&ota_lock);
+    if (busy) return ESP_ERR_INVALID_STATE;
+
+    if (ota_event == NULL) ota_event = xEventGroupCreate();
+    ota_target_num = 0;
+    for (uint8_t i = 0; i < num; i++) {
+        if (!ESP_BLE_MESH_ADDR_IS_UNICAST(uniaddr[i])) continue;
+        memset(&ota_target[ota_target_num], 0, sizeof(mesh_ota_target_t));
+        ota_target[ota_target_num].uniaddr = uniaddr[i];
+        ota_target_num++;
+    }
+    if (ota_event == NULL || ota_target_num == 0) {
+        ota_busy = false;
+        return (ota_event == NULL) ? ESP_ERR_NO_MEM : ESP_ERR_INVALID_ARG;
+    }
+    ota_image = image;
+    ota_size = size;
+    ota_crc = esp_rom_crc32_le(0, image, size);
+    ota_chunk_num = (size + MESH_OTA_CHUNK_SIZE - 1) / MESH_OTA_CHUNK_SIZE;
+    ota_window_num = (ota_chunk_num + MESH_OTA_WINDOW - 1) / MESH_OTA_WINDOW;
+    ota_plan = 0xFF;
+    #ifdef TAG
+    ESP_LOGI(TAG, "ota start: %ld bytes, crc 0x%08lx, %d chunks, %d nodes", size, ota_crc, ota_chunk_num, ota_target_num);
+    #endif
+    if (xTaskCreatePinnedToCore(ble_mesh_ota_task, "ble_mesh_ota", 4 * 1024, NULL, 5, NULL, APP_CPU_NUM) != pdPASS) {
+        ota_image = NULL;
+        ota_busy = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
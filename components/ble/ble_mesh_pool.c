@@ -0,0 +1,104 @@
+/**
+ * @file    ble_mesh_pool.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 长数据缓存池
+ *          - 块在初始化时一次分配（PSRAM），运行中不再 malloc/free，不会产生碎片；
+ *          - 谁拿到 ext 谁负责释放：接收缓存的消费者、发送引擎（事件/请求完成后）；
+ *          - 空闲块用位图管理，申请/释放加锁后只有几条指令。
+ * @version 0.1
+ * @date    2023-08-26
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "ble_mesh_pool.h"
+
+#define TAG "mesh_pool"
+
+#define POOL_MAP_NUM    ((MESH_POOL_BLOCK_NUM + 31) / 32)
+
+static uint8_t *pool_block = NULL;
+static uint32_t pool_map[POOL_MAP_NUM];  // 1: 正在使用
+static uint16_t pool_used = 0;
+static uint16_t pool_peak = 0;
+static uint32_t pool_fail = 0;
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//============================================================================================
+uint8_t *ble_mesh_pool_alloc(void)
+{
+    uint8_t *buf = NULL;
+    if (pool_block == NULL) return NULL;
+    taskENTER_CRITICAL(&pool_lock);
+    for (uint16_t i = 0; i < MESH_POOL_BLOCK_NUM; i++) {
+        if (pool_map[i / 32] & (1UL << (i % 32))) continue;
+        pool_map[i / 32] |= (1UL << (i % 32));
+        buf = pool_block + i * MESH_POOL_BLOCK_SIZE;
+        if (++pool_used > pool_peak) pool_peak = pool_used;
+        break;
+    }
+    if (buf == NULL) pool_fail++;
+    taskEXIT_CRITICAL(&pool_lock);
+    #ifdef TAG
+    if (buf == NULL) ESP_LOGW(TAG, "pool empty, fail %ld", pool_fail);
+    #endif
+    return buf;
+}
+
+uint8_t *ble_mesh_pool_dup(const uint8_t *data, uint16_t len)
+{
+    if (len > MESH_POOL_BLOCK_SIZE) return NULL;
+    uint8_t *buf = ble_mesh_pool_alloc();
+    if (buf != NULL) memcpy(buf, data, len);
+    return buf;
+}
+
+void ble_mesh_pool_free(uint8_t *buf)
+{
+    if (buf == NULL || pool_block == NULL) return;
+    uint32_t offset = (buf >= pool_block) ? (uint32_t)(buf - pool_block) : UINT32_MAX;
+    if (offset >= MESH_POOL_BLOCK_NUM * MESH_POOL_BLOCK_SIZE || offset % MESH_POOL_BLOCK_SIZE) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "free invalid buffer %p", buf);
+        #endif
+        return;
+    }
+    uint16_t i = offset / MESH_POOL_BLOCK_SIZE;
+    taskENTER_CRITICAL(&pool_lock);
+    if (pool_map[i / 32] & (1UL << (i % 32))) {
+        pool_map[i / 32] &= ~(1UL << (i % 32));
+        pool_used--;
+    }
+    taskEXIT_CRITICAL(&pool_lock);
+}
+
+void ble_mesh_pool_get_stats(mesh_pool_stats_t *stats)
+{
+    taskENTER_CRITICAL(&pool_lock);
+    stats->size = (pool_block != NULL) ? MESH_POOL_BLOCK_NUM : 0;
+    stats->used = pool_used;
+    stats->peak = pool_peak;
+    stats->fail = pool_fail;
+    taskEXIT_CRITICAL(&pool_lock);
+}
+
+void ble_mesh_pool_init(void)
+{
+    pool_block = heap_caps_malloc(MESH_POOL_BLOCK_NUM * MESH_POOL_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (pool_block == NULL) {  // 没有PSRAM时用内部RAM
+        pool_block = heap_caps_malloc(MESH_POOL_BLOCK_NUM * MESH_POOL_BLOCK_SIZE, MALLOC_CAP_8BIT);
+    }
+    #ifdef TAG
+    if (pool_block == NULL) {
+        ESP_LOGE(TAG, "pool malloc fail");
+    } else {
+        ESP_LOGI(TAG, "pool %d x %d bytes", MESH_POOL_BLOCK_NUM, MESH_POOL_BLOCK_SIZE);
+    }
+    #endif
+}
@@ -0,0 +1,214 @@
+/**
+ * @file    ble_mesh_prov.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 批量配网队列
+ *          - 队列中的设备按 MAC 匹配未配网广播，谁先被扫描到谁先配网，不用按提交顺序逐个等待；
+ *          - 同时配网的节点数受协议栈 PB-ADV 链路数限制，链路占满时等下一个广播包再试；
+ *          - 配网完成按 Device UUID 匹配到队列中的设备（链路打开/关闭事件不带设备信息）；
+ *          - 配网失败/超时的设备重新等待广播，直到 MESH_PROV_WAIT_TIMEOUT 才上报失败；
+ *          - 绑定（写NVS）和结果回调在 ble_mesh_handeler_task 中执行，不占用协议栈回调。
+ * @version 0.1
+ * @date    2023-08-22
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_ble_mesh_provisioning_api.h"
+
+#include "ble_mesh_prov.h"
+
+#define TAG "mesh_prov"
+
+enum {
+    PROV_STATE_FREE = 0,
+    PROV_STATE_WAIT,        // 等待未配网广播
+    PROV_STATE_LINK,        // 正在配网
+    PROV_STATE_DONE,        // 配网完成，等待绑定
+};
+
+typedef struct {
+    mesh_bind_t bind;
+    uint8_t    uuid[16];    // 开始配网时记录，配网完成时用来匹配
+    uint8_t    state;
+    uint8_t    tries;       // 开始配网的次数
+    TickType_t deadline;    // PROV_STATE_LINK: 本次配网的超时时间
+    TickType_t expire;      // 上报失败的时间
+} mesh_prov_entry_t;
+
+static mesh_prov_entry_t prov_queue[MESH_PROV_QUEUE_SIZE];
+static uint8_t prov_num = 0;  // 队列中的设备数
+static portMUX_TYPE prov_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static ble_mesh_prov_callback_t ble_mesh_prov_callback = NULL;
+
+static inline bool prov_tick_expired(TickType_t tick, TickType_t now)
+{
+    return (int32_t)(tick - now) <= 0;
+}
+
+//============================================================================================
+void ble_mesh_prov_register_callback(ble_mesh_prov_callback_t callback)
+{
+    ble_mesh_prov_callback = callback;
+}
+
+esp_err_t ble_mesh_prov_queue_add(const uint8_t addr[6], const char *name)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+    mesh_prov_entry_t *entry = NULL;
+    taskENTER_CRITICAL(&prov_lock);
+    for (uint8_t i = 0; i < MESH_PROV_QUEUE_SIZE; i++) {
+        if (prov_queue[i].state == PROV_STATE_FREE) {
+            if (entry == NULL) entry = &prov_queue[i];
+        } else if (memcmp(prov_queue[i].bind.addr, addr, 6) == 0) {
+            entry = &prov_queue[i];  // 已经在队列中：只更新名称
+            break;
+        }
+    }
+    if (entry != NULL) {
+        memset(entry->bind.name, 0, sizeof(entry->bind.name));
+        strncpy(entry->bind.name, name, sizeof(entry->bind.name) - 1);
+        if (entry->state == PROV_STATE_FREE) {
+            memcpy(entry->bind.addr, addr, 6);
+            entry->bind.uniaddr = 0x0000;
+            entry->bind.pid = 0;
+            entry->tries = 0;
+            entry->expire = xTaskGetTickCount() + pdMS_TO_TICKS(MESH_PROV_WAIT_TIMEOUT);
+            entry->state = PROV_STATE_WAIT;
+            prov_num++;
+        }
+        err = ESP_OK;
+    }
+    taskEXIT_CRITICAL(&prov_lock);
+    return err;
+}
+
+bool ble_mesh_prov_queue_busy(void)
+{
+    return (prov_num > 0);
+}
+
+//============================================================================================
+bool ble_mesh_prov_queue_match(const uint8_t dev_uuid[16], const uint8_t addr[6], uint8_t addr_type,
+                               uint16_t oob_info, uint8_t bearer)
+{
+    if (prov_num == 0) return false;
+
+    bool found = false;
+    uint8_t link = 0;
+    mesh_prov_entry_t *entry = NULL;
+    taskENTER_CRITICAL(&prov_lock);
+    for (uint8_t i = 0; i < MESH_PROV_QUEUE_SIZE; i++) {
+        if (prov_queue[i].state == PROV_STATE_LINK) link++;
+        if (prov_queue[i].state == PROV_STATE_FREE || memcmp(prov_queue[i].bind.addr, addr, 6)) continue;
+        found = true;
+        if (prov_queue[i].state == PROV_STATE_WAIT) entry = &prov_queue[i];
+    }
+    if (entry != NULL && link < MESH_PROV_LINK_MAX) {
+        memcpy(entry->uuid, dev_uuid, 16);
+        entry->bind.pid = dev_uuid[2];  // pid
+        entry->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(MESH_PROV_LINK_TIMEOUT);
+        entry->tries++;
+        entry->state = PROV_STATE_LINK;
+    } else {
+        entry = NULL;  // 不是队列中的设备，正在配网，或者链路已占满（等下一个广播包）
+    }
+    taskEXIT_CRITICAL(&prov_lock);
+    if (entry == NULL) return found;
+
+    esp_ble_mesh_unprov_dev_add_t add_dev = { 0 };
+    memcpy(add_dev.addr, addr, BD_ADDR_LEN);
+    add_dev.addr_type = addr_type;
+    memcpy(add_dev.uuid, dev_uuid, ESP_BLE_MESH_OCTET16_LEN);
+    add_dev.oob_info = oob_info;
+    add_dev.bearer = bearer;
+    esp_err_t err = esp_ble_mesh_provisioner_add_unprov_dev(&add_dev, ADD_DEV_RM_AFTER_PROV_FLAG | ADD_DEV_START_PROV_NOW_FLAG | ADD_DEV_FLUSHABLE_DEV_FLAG);
+    if (err != ESP_OK) {  // 协议栈的链路可能被单个配网占用了，等下一个广播包
+        taskENTER_CRITICAL(&prov_lock);
+        if (entry->state == PROV_STATE_LINK) entry->state = PROV_STATE_WAIT;
+        taskEXIT_CRITICAL(&prov_lock);
+    }
+    #ifdef TAG
+    ESP_LOGI(TAG, "start: %02x%02x%02x%02x%02x%02x, tries = %d, err = 0x%x",
+                  addr[0], addr[1], addr[2], addr[3], addr[4], addr[5], entry->tries, err);
+    #endif
+    return true;
+}
+
+bool ble_mesh_prov_queue_complete(const uint8_t dev_uuid[16], uint16_t unicast_addr)
+{
+    bool found = false;
+    if (prov_num == 0) return false;
+    taskENTER_CRITICAL(&prov_lock);
+    for (uint8_t i = 0; i < MESH_PROV_QUEUE_SIZE; i++) {
+        mesh_prov_entry_t *entry = &prov_queue[i];
+        if (entry->state != PROV_STATE_LINK || memcmp(entry->uuid, dev_uuid, 16)) continue;
+        entry->bind.uniaddr = unicast_addr;
+        entry->state = PROV_STATE_DONE;
+        found = true;
+        break;
+    }
+    taskEXIT_CRITICAL(&prov_lock);
+    return found;
+}
+
+// 链路关闭事件不带设备信息：只有一个节点在配网时才能确定是谁失败了，否则等它超时
+void ble_mesh_prov_queue_link_close(bool success)
+{
+    if (success || prov_num == 0) return;
+    mesh_prov_entry_t *entry = NULL;
+    uint8_t link = 0;
+    taskENTER_CRITICAL(&prov_lock);
+    for (uint8_t i = 0; i < MESH_PROV_QUEUE_SIZE; i++) {
+        if (prov_queue[i].state != PROV_STATE_LINK) continue;
+        entry = &prov_queue[i];
+        link++;
+    }
+    if (link == 1) entry->state = PROV_STATE_WAIT;  // 重新等待广播
+    taskEXIT_CRITICAL(&prov_lock);
+}
+
+void ble_mesh_prov_queue_process(void)
+{
+    if (prov_num == 0) return;
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i = 0; i < MESH_PROV_QUEUE_SIZE; i++) {
+        mesh_prov_entry_t entry;
+        bool finish = false;
+        taskENTER_CRITICAL(&prov_lock);
+        mesh_prov_entry_t *item = &prov_queue[i];
+        if (item->state == PROV_STATE_LINK && prov_tick_expired(item->deadline, now)) {
+            item->state = PROV_STATE_WAIT;  // 本次配网超时，重新等待广播
+        }
+        if (item->state == PROV_STATE_DONE) {
+            finish = true;
+        } else if (item->state == PROV_STATE_WAIT && prov_tick_expired(item->expire, now)) {
+            item->bind.uniaddr = 0x0000;
+            finish = true;
+        }
+        if (finish) {
+            entry = *item;
+            item->state = PROV_STATE_FREE;
+            prov_num--;
+        }
+        taskEXIT_CRITICAL(&prov_lock);
+        if (finish == false) continue;
+
+        mesh_prov_result_t result = { .uniaddr = 0x0000 };
+        memcpy(result.addr, entry.bind.addr, 6);
+        if (entry.bind.uniaddr != 0x0000 && ble_mesh_prov_bind_node(entry.bind)) {
+            result.uniaddr = entry.bind.uniaddr;
+        }
+        #ifdef TAG
+        ESP_LOGI(TAG, "result: %02x%02x%02x%02x%02x%02x => 0x%04x, tries = %d", entry.bind.addr[0], entry.bind.addr[1],
+                      entry.bind.addr[2], entry.bind.addr[3], entry.bind.addr[4], entry.bind.addr[5], result.uniaddr, entry.tries);
+        #endif
+        if (ble_mesh_prov_callback != NULL) {
+            ble_mesh_prov_callback(&result);
+        }
+    }
+}
@@ -0,0 +1,229 @@
+/**
+ * @file    ble_mesh_reset.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 批量解绑（Node Reset 流水线）
+ *          - 解绑的节点先排队，最多 MESH_RESET_WINDOW 个节点同时等待 Node Reset 响应；
+ *          - 节点响应（或超时，重发次数按 ble_mesh_link_policy）后才删除配网信息，
+ *            删除前协议栈还需要设备密钥解密响应；
+ *          - 发送/删除/结果回调都在 ble_mesh_handeler_task 中执行，不阻塞云端指令；
+ *          - 全部解绑时，最后一个节点完成后再清空绑定表/分组/影子和协议栈的配网信息。
+ * @version 0.1
+ * @date    2023-08-23
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_ble_mesh_networking_api.h"
+#include "esp_ble_mesh_provisioning_api.h"
+
+#include "ble_mesh_reset.h"
+#include "ble_mesh_rx.h"
+
+#define TAG "mesh_reset"
+
+enum {
+    RESET_STATE_FREE = 0,
+    RESET_STATE_SENT,       // 等待 Node Reset 响应
+    RESET_STATE_ACK,        // 节点已响应
+    RESET_STATE_TIMEOUT,    // 没有响应（重发或者直接删除）
+};
+
+typedef struct {
+    uint16_t   uniaddr;
+    uint8_t    state;
+    uint8_t    retry;       // 已经重发的次数
+    uint8_t    retry_max;
+    TickType_t deadline;    // 兜底超时时间
+} mesh_reset_slot_t;
+
+static mesh_reset_slot_t reset_slot[MESH_RESET_WINDOW];
+static uint16_t reset_queue[MESH_RESET_QUEUE_SIZE];  // 环形队列
+static uint16_t reset_head = 0;
+static uint16_t reset_num  = 0;
+static uint8_t  reset_busy = 0;                      // 正在等待响应的节点数
+static bool     reset_all  = false;                  // 全部解绑：完成后清空
+static portMUX_TYPE reset_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static ble_mesh_reset_callback_t ble_mesh_reset_callback = NULL;
+
+//============================================================================================
+void ble_mesh_reset_register_callback(ble_mesh_reset_callback_t callback)
+{
+    ble_mesh_reset_callback = callback;
+}
+
+static bool ble_mesh_reset_queued(uint16_t unicast_addr)
+{
+    for (uint16_t i = 0; i < reset_num; i++) {
+        if (reset_queue[(reset_head + i) % MESH_RESET_QUEUE_SIZE] == unicast_addr) return true;
+    }
+    for (uint8_t i = 0; i < MESH_RESET_WINDOW; i++) {
+        if (reset_slot[i].state != RESET_STATE_FREE && reset_slot[i].uniaddr == unicast_addr) return true;
+    }
+    return false;
+}
+
+static esp_err_t ble_mesh_reset_push(uint16_t unicast_addr)
+{
+    esp_err_t err = ESP_OK;
+    taskENTER_CRITICAL(&reset_lock);
+    if (ble_mesh_reset_queued(unicast_addr) == false) {
+        if (reset_num < MESH_RESET_QUEUE_SIZE) {
+            reset_queue[(reset_head + reset_num) % MESH_RESET_QUEUE_SIZE] = unicast_addr;
+            reset_num++;
+        } else {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    taskEXIT_CRITICAL(&reset_lock);
+    return err;
+}
+
+esp_err_t ble_mesh_reset_queue_add(uint16_t unicast_addr)
+{
+    mesh_node_t node;
+    if (!ESP_BLE_MESH_ADDR_IS_UNICAST(unicast_addr)) return ESP_ERR_INVALID_ARG;
+    if (esp_ble_mesh_provisioner_get_node_with_addr(unicast_addr) == NULL && mesh_node_get(unicast_addr, &node) == false) {
+        return ESP_ERR_INVALID_ARG;  // 没有配网过
+    }
+    esp_err_t err = ble_mesh_reset_push(unicast_addr);
+    if (err == ESP_OK) ble_mesh_rx_wakeup();
+    return err;
+}
+
+uint16_t ble_mesh_reset_queue_all(void)
+{
+    uint16_t num = 0;
+    uint16_t prov_node_num = esp_ble_mesh_provisioner_get_prov_node_count();
+    const esp_ble_mesh_node_t **mesh_node = esp_ble_mesh_provisioner_get_node_table_entry();
+    for (uint16_t i = 0; i < CONFIG_BLE_MESH_MAX_PROV_NODES && num < prov_node_num; i++) {
+        if (mesh_node == NULL || mesh_node[i] == NULL) continue;
+        if (ble_mesh_reset_push(mesh_node[i]->unicast_addr) == ESP_OK) num++;
+    }
+    reset_all = true;  // 没有节点也要清空绑定表
+    ble_mesh_rx_wakeup();
+    #ifdef TAG
+    ESP_LOGI(TAG, "reset all: %d nodes", num);
+    #endif
+    return num;
+}
+
+bool ble_mesh_reset_busy(void)
+{
+    return (reset_num > 0 || reset_busy > 0 || reset_all);
+}
+
+void ble_mesh_reset_status(uint16_t unicast_addr, bool timeout)
+{
+    bool found = false;
+    taskENTER_CRITICAL(&reset_lock);
+    for (uint8_t i = 0; i < MESH_RESET_WINDOW; i++) {
+        mesh_reset_slot_t *slot = &reset_slot[i];
+        if (slot->state != RESET_STATE_SENT || slot->uniaddr != unicast_addr) continue;
+        slot->state = timeout ? RESET_STATE_TIMEOUT : RESET_STATE_ACK;
+        found = true;
+        break;
+    }
+    taskEXIT_CRITICAL(&reset_lock);
+    if (found) ble_mesh_rx_wakeup();  // 尽快删除并发送下一个
+}
+
+//============================================================================================
+// 先改状态再发送：响应可能在发送函数返回前就到了
+static void ble_mesh_reset_send(mesh_reset_slot_t *slot)
+{
+    taskENTER_CRITICAL(&reset_lock);
+    slot->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(MESH_RESET_GUARD_TIME);
+    slot->state = RESET_STATE_SENT;
+    taskEXIT_CRITICAL(&reset_lock);
+    if (ble_mesh_node_reset(slot->uniaddr) != ESP_OK) {  // 发送失败按超时处理
+        taskENTER_CRITICAL(&reset_lock);
+        if (slot->state == RESET_STATE_SENT) slot->state = RESET_STATE_TIMEOUT;
+        taskEXIT_CRITICAL(&reset_lock);
+    }
+}
+
+static void ble_mesh_reset_finish(mesh_reset_slot_t *slot, bool ack)
+{
+    mesh_reset_result_t result = {
+        .uniaddr = slot->uniaddr,
+        .ack = ack,
+    };
+    ble_mesh_prov_node_remove(slot->uniaddr);
+    taskENTER_CRITICAL(&reset_lock);
+    slot->state = RESET_STATE_FREE;
+    reset_busy--;
+    uint16_t remain = reset_num + reset_busy;
+    taskEXIT_CRITICAL(&reset_lock);
+    #ifdef TAG
+    ESP_LOGI(TAG, "reset 0x%04x %s, remain %d", result.uniaddr, ack ? "ok" : "no ack", remain);
+    #endif
+    if (ble_mesh_reset_callback != NULL) {
+        ble_mesh_reset_callback(&result, remain);
+    }
+}
+
+void ble_mesh_reset_process(void)
+{
+    if (ble_mesh_reset_busy() == false) return;
+
+    /* 1：完成的节点删除配网信息，超时的重发 */
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i = 0; i < MESH_RESET_WINDOW; i++) {
+        mesh_reset_slot_t *slot = &reset_slot[i];
+        taskENTER_CRITICAL(&reset_lock);
+        if (slot->state == RESET_STATE_SENT && (int32_t)(slot->deadline - now) <= 0) {
+            slot->state = RESET_STATE_TIMEOUT;
+        }
+        uint8_t state = slot->state;
+        taskEXIT_CRITICAL(&reset_lock);
+
+        if (state == RESET_STATE_ACK) {
+            ble_mesh_reset_finish(slot, true);
+        } else if (state == RESET_STATE_TIMEOUT) {
+            if (slot->retry < slot->retry_max) {
+                slot->retry++;
+                ble_mesh_reset_send(slot);
+            } else {
+                ble_mesh_reset_finish(slot, false);  // 节点离线：只删除本地配网信息
+            }
+        }
+    }
+
+    /* 2：空闲窗口发送下一个节点的 Node Reset */
+    for (uint8_t i = 0; i < MESH_RESET_WINDOW; i++) {
+        mesh_reset_slot_t *slot = &reset_slot[i];
+        if (slot->state != RESET_STATE_FREE) continue;
+        taskENTER_CRITICAL(&reset_lock);
+        bool pop = (reset_num > 0);
+        if (pop) {
+            slot->uniaddr = reset_queue[reset_head];
+            slot->state = RESET_STATE_TIMEOUT;  // 占用窗口，发送时再改为 RESET_STATE_SENT
+            reset_head = (reset_head + 1) % MESH_RESET_QUEUE_SIZE;
+            reset_num--;
+            reset_busy++;
+        }
+        taskEXIT_CRITICAL(&reset_lock);
+        if (pop == false) break;
+
+        mesh_link_policy_t policy;
+        ble_mesh_link_policy(slot->uniaddr, &policy);
+        slot->retry = 0;
+        slot->retry_max = policy.retry;
+        ble_mesh_reset_send(slot);
+    }
+
+    /* 3：全部解绑：最后一个节点完成后清空 */
+    if (reset_all && reset_num == 0 && reset_busy == 0) {
+        reset_all = false;
+        ble_mesh_prov_node_remove_all();
+        mesh_reset_result_t result = { .uniaddr = 0x0000, .ack = true };
+        if (ble_mesh_reset_callback != NULL) {
+            ble_mesh_reset_callback(&result, 0);
+        }
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file    ble_mesh_rx.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 接收环形缓存
+ *          - 组播指令会让十几个节点几乎同时上报状态，原来3条的队列满了就直接丢；
+ *          - 只有一个生产者（BTC任务）和一个消费者，读写下标各自只被一方修改，不用加锁；
+ *          - 缓存放在PSRAM，大小由 menuconfig 配置，丢弃的消息数可以通过 ble_mesh_rx_get_stats() 查询。
+ * @version 0.1
+ * @date    2023-08-09
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "ble_mesh_rx.h"
+
+#define TAG "mesh_rx"
+
+static mesh_transfer_t *rx_ring = NULL;
+static uint32_t rx_mask = 0;
+static atomic_uint_fast32_t rx_head = 0;     // 写下标（只由生产者修改）
+static atomic_uint_fast32_t rx_tail = 0;     // 读下标（只由消费者修改）
+static TaskHandle_t xRxTask = NULL;          // 等待消息的消费者
+
+static uint32_t rx_push = 0;
+static uint32_t rx_drop = 0;
+static uint16_t rx_peak = 0;
+
+//============================================================================================
+bool ble_mesh_rx_push(const mesh_transfer_t *msg)
+{
+    if (rx_ring == NULL) return false;
+    uint32_t head = atomic_load_explicit(&rx_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&rx_tail, memory_order_acquire);
+    uint32_t used = head - tail;
+    if (used > rx_mask) {
+        rx_drop++;
+        #ifdef TAG
+        ESP_LOGW(TAG, "ring full, drop addr 0x%04x, opcode 0x%06lx, total %ld", msg->unicast_addr, msg->opcode, rx_drop);
+        #endif
+        return false;
+    }
+
+    rx_ring[head & rx_mask] = *msg;
+    atomic_store_explicit(&rx_head, head + 1, memory_order_release);  // 数据写完再发布下标
+    rx_push++;
+    if (used + 1 > rx_peak) rx_peak = used + 1;
+
+    if (xRxTask != NULL) xTaskNotifyGive(xRxTask);
+    return true;
+}
+
+// 没有新消息也让消费者立即返回（处理其他模块的完成事件）
+void ble_mesh_rx_wakeup(void)
+{
+    if (xRxTask != NULL) xTaskNotifyGive(xRxTask);
+}
+
+uint8_t ble_mesh_rx_pop(mesh_transfer_t *msg, uint8_t max, TickType_t wait)
+{
+    if (rx_ring == NULL) {
+        vTaskDelay(wait);
+        return 0;
+    }
+    xRxTask = xTaskGetCurrentTaskHandle();
+
+    uint32_t tail = atomic_load_explicit(&rx_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&rx_head, memory_order_acquire);
+    if (head == tail) {
+        ulTaskNotifyTake(pdTRUE, wait);  // 生产者写入后通知
+        head = atomic_load_explicit(&rx_head, memory_order_acquire);
+    }
+
+    uint8_t num = 0;
+    while (tail != head && num < max) {
+        msg[num++] = rx_ring[tail & rx_mask];
+        tail++;
+    }
+    atomic_store_explicit(&rx_tail, tail, memory_order_release);  // 取完再释放空间
+    return num;
+}
+
+void ble_mesh_rx_get_stats(mesh_rx_stats_t *stats)
+{
+    stats->push = rx_push;
+    stats->drop = rx_drop;
+    stats->size = rx_mask + 1;
+    stats->peak = rx_peak;
+}
+
+void ble_mesh_rx_init(void)
+{
+    uint32_t size = 8;
+    while (size < MESH_RX_RING_SIZE) size <<= 1;
+
+    rx_ring = heap_caps_calloc(size, sizeof(mesh_transfer_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (rx_ring == NULL) {  // 没有PSRAM时用内部RAM
+        rx_ring = heap_caps_calloc(size, sizeof(mesh_transfer_t), MALLOC_CAP_8BIT);
+    }
+    if (rx_ring == NULL) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "ring malloc fail");
+        #endif
+        return;
+    }
+    rx_mask = size - 1;
+
+    #ifdef TAG
+    ESP_LOGI(TAG, "ring size = %ld", size);
+    #endif
+}
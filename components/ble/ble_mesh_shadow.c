@@ -0,0 +1,375 @@
+/**
+ * @file    ble_mesh_shadow.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 节点状态影子
+ *          - 协议栈回调的 GET/SET 响应和节点主动上报的状态都会更新影子；
+ *          - 发送引擎发 GET 前先查影子，在有效期内就直接完成，不占用空口；
+ *          - SET 发出时先让对应状态失效，节点响应后再更新，避免用旧状态响应 GET；
+ *          - 影子表放在PSRAM，按单播地址哈希索引（开放寻址），查找不随节点数线性增长；
+ *          - 表项按最后更新时间串成 LRU 链表，空闲表项另串一条链表，新建/替换都是 O(1)；
+ *          - 要处理整张表的操作（组播失效、全部删除）每次只锁 SHADOW_LOCK_CHUNK 个表项，不长时间关中断。
+ * @version 0.1
+ * @date    2023-08-07
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "ble_mesh_shadow.h"
+
+#define TAG "mesh_shadow"
+
+#define SHADOW_INDEX_NULL   0xFFFF
+#define SHADOW_LOCK_CHUNK   32      // 遍历整张表时每次持有 shadow_lock 处理的表项数
+
+static mesh_shadow_t *shadow = NULL;        // [MESH_SHADOW_SIZE]
+static uint16_t *shadow_hash = NULL;        // 单播地址 => 影子表索引
+static uint16_t  shadow_hash_mask = 0;      // 哈希槽数 - 1（2的幂，至少是表大小的两倍）
+static uint16_t *shadow_prev = NULL;        // [MESH_SHADOW_SIZE] LRU 链表
+static uint16_t *shadow_next = NULL;        // [MESH_SHADOW_SIZE] LRU 链表；空闲表项用它串成空闲链表
+static uint16_t  shadow_lru_head = SHADOW_INDEX_NULL;   // 最久没有更新的
+static uint16_t  shadow_lru_tail = SHADOW_INDEX_NULL;   // 最近更新的
+static uint16_t  shadow_free_head = SHADOW_INDEX_NULL;
+static portMUX_TYPE shadow_lock = portMUX_INITIALIZER_UNLOCKED;
+
+//============================================================================================
+// 以下调用前都要持有 shadow_lock
+static void ble_mesh_shadow_lru_unlink(uint16_t index)
+{
+    uint16_t prev = shadow_prev[index];
+    uint16_t next = shadow_next[index];
+    if (prev != SHADOW_INDEX_NULL) shadow_next[prev] = next; else shadow_lru_head = next;
+    if (next != SHADOW_INDEX_NULL) shadow_prev[next] = prev; else shadow_lru_tail = prev;
+}
+
+static void ble_mesh_shadow_lru_link_tail(uint16_t index)
+{
+    shadow_prev[index] = shadow_lru_tail;
+    shadow_next[index] = SHADOW_INDEX_NULL;
+    if (shadow_lru_tail != SHADOW_INDEX_NULL) shadow_next[shadow_lru_tail] = index; else shadow_lru_head = index;
+    shadow_lru_tail = index;
+}
+
+// 全部表项放回空闲链表
+static void ble_mesh_shadow_list_reset(void)
+{
+    for (uint16_t i = 0; i < MESH_SHADOW_SIZE; i++) {
+        shadow_next[i] = (i + 1 < MESH_SHADOW_SIZE) ? i + 1 : SHADOW_INDEX_NULL;
+    }
+    shadow_free_head = 0;
+    shadow_lru_head  = SHADOW_INDEX_NULL;
+    shadow_lru_tail  = SHADOW_INDEX_NULL;
+}
+
+static uint16_t ble_mesh_shadow_hash(uint16_t unicast_addr)
+{
+    return (unicast_addr * 40503UL >> 8) & shadow_hash_mask;
+}
+
+static void ble_mesh_shadow_hash_insert(uint16_t index)
+{
+    uint16_t pos = ble_mesh_shadow_hash(shadow[index].unicast_addr);
+    while (shadow_hash[pos] != SHADOW_INDEX_NULL) {
+        pos = (pos + 1) & shadow_hash_mask;
+    }
+    shadow_hash[pos] = index;
+}
+
+// 删除后把后面同一探测链上的表项往前移（不用墓碑标记）
+static void ble_mesh_shadow_hash_delete(uint16_t index)
+{
+    uint16_t pos = ble_mesh_shadow_hash(shadow[index].unicast_addr);
+    while (shadow_hash[pos] != index) {
+        if (shadow_hash[pos] == SHADOW_INDEX_NULL) return;
+        pos = (pos + 1) & shadow_hash_mask;
+    }
+
+    uint16_t next = pos;
+    while (1) {
+        shadow_hash[pos] = SHADOW_INDEX_NULL;
+        while (1) {
+            next = (next + 1) & shadow_hash_mask;
+            if (shadow_hash[next] == SHADOW_INDEX_NULL) return;
+            uint16_t ideal = ble_mesh_shadow_hash(shadow[shadow_hash[next]].unicast_addr);
+            if (((next - ideal) & shadow_hash_mask) >= ((next - pos) & shadow_hash_mask)) break;
+        }
+        shadow_hash[pos] = shadow_hash[next];
+        pos = next;
+    }
+}
+
+// 操作码 => SIG状态，return: MESH_SHADOW_SIG_NUM: vendor/不支持
+static uint8_t ble_mesh_shadow_sig_index(uint32_t opcode)
+{
+    switch (opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET:
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK:
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS:
+        return MESH_SHADOW_ONOFF;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
+        return MESH_SHADOW_HSL;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET_UNACK:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_STATUS:
+        return MESH_SHADOW_CTL;
+    default:
+        return MESH_SHADOW_SIG_NUM;
+    }
+}
+
+static bool ble_mesh_shadow_is_vendor(uint32_t opcode)
+{
+    return (opcode == GENIE_MODEL_OP_ATTR_GET || opcode == GENIE_MODEL_OP_ATTR_SET ||
+            opcode == GENIE_MODEL_OP_ATTR_SET_UNACK || opcode == GENIE_MODEL_OP_ATTR_STATUS);
+}
+
+static mesh_shadow_t *ble_mesh_shadow_find(uint16_t unicast_addr)
+{
+    if (shadow == NULL || unicast_addr == ESP_BLE_MESH_ADDR_UNASSIGNED) return NULL;
+    uint16_t pos = ble_mesh_shadow_hash(unicast_addr);
+    while (shadow_hash[pos] != SHADOW_INDEX_NULL) {
+        if (shadow[shadow_hash[pos]].unicast_addr == unicast_addr) return &shadow[shadow_hash[pos]];
+        pos = (pos + 1) & shadow_hash_mask;
+    }
+    return NULL;
+}
+
+static void ble_mesh_shadow_free(uint16_t index)
+{
+    ble_mesh_shadow_hash_delete(index);
+    ble_mesh_shadow_lru_unlink(index);
+    memset(&shadow[index], 0, sizeof(mesh_shadow_t));
+    shadow_next[index] = shadow_free_head;
+    shadow_free_head = index;
+}
+
+// 没有就新建一个，满了就替换最久没有更新的（LRU 表头）；返回的表项已移到 LRU 表尾
+static mesh_shadow_t *ble_mesh_shadow_alloc(uint16_t unicast_addr)
+{
+    mesh_shadow_t *node = ble_mesh_shadow_find(unicast_addr);
+    if (node != NULL) {
+        ble_mesh_shadow_lru_unlink(node - shadow);
+        ble_mesh_shadow_lru_link_tail(node - shadow);
+        return node;
+    }
+    if (shadow == NULL) return NULL;
+
+    if (shadow_free_head == SHADOW_INDEX_NULL) {
+        ble_mesh_shadow_free(shadow_lru_head);
+    }
+    uint16_t index = shadow_free_head;
+    shadow_free_head = shadow_next[index];
+    shadow[index].unicast_addr = unicast_addr;
+    ble_mesh_shadow_hash_insert(index);
+    ble_mesh_shadow_lru_link_tail(index);
+    return &shadow[index];
+}
+
+static bool ble_mesh_shadow_fresh(const mesh_shadow_state_t *state, TickType_t now)
+{
+    return (state->len > 0 && (now - state->tick) <= pdMS_TO_TICKS(MESH_SHADOW_STALE_TIME));
+}
+
+// 同一个vendor属性（mesh_frame_t.opcode）用同一个缓存
+static mesh_shadow_state_t *ble_mesh_shadow_vnd_slot(mesh_shadow_t *node, uint8_t attr)
+{
+    mesh_shadow_state_t *empty  = NULL;
+    mesh_shadow_state_t *oldest = &node->vnd[0];
+    for (uint8_t i = 0; i < MESH_SHADOW_VND_NUM; i++) {
+        if (node->vnd[i].len == 0) {
+            if (empty == NULL) empty = &node->vnd[i];
+        } else if (node->vnd[i].data[0] == attr) {
+            return &node->vnd[i];
+        } else if ((int32_t)(node->vnd[i].tick - oldest->tick) < 0) {
+            oldest = &node->vnd[i];
+        }
+    }
+    return (empty != NULL) ? empty : oldest;
+}
+
+static void ble_mesh_shadow_clear(mesh_shadow_t *node, uint32_t opcode)
+{
+    uint8_t index = ble_mesh_shadow_sig_index(opcode);
+    if (index < MESH_SHADOW_SIG_NUM) {
+        node->sig[index].len = 0;
+    } else if (ble_mesh_shadow_is_vendor(opcode)) {
+        for (uint8_t i = 0; i < MESH_SHADOW_VND_NUM; i++) {
+            node->vnd[i].len = 0;
+        }
+    }
+}
+
+//============================================================================================
+void ble_mesh_shadow_update(const mesh_transfer_t *status)
+{
+    if (status->len == 0 || !ESP_BLE_MESH_ADDR_IS_UNICAST(status->unicast_addr)) return;
+    uint8_t index = ble_mesh_shadow_sig_index(status->opcode);
+    if (index == MESH_SHADOW_SIG_NUM && status->opcode != GENIE_MODEL_OP_ATTR_STATUS) return;
+
+    TickType_t now = xTaskGetTickCount();
+    taskENTER_CRITICAL(&shadow_lock);
+    mesh_shadow_t *node = ble_mesh_shadow_alloc(status->unicast_addr);
+    if (node == NULL) {
+        taskEXIT_CRITICAL(&shadow_lock);
+        return;
+    }
+    const uint8_t *data = mesh_transfer_data(status);
+    if (status->len > VND_DATA_SIZE) {  // 长数据不缓存，清掉这个属性的旧状态（GET 要发到节点）
+        for (uint8_t i = 0; i < MESH_SHADOW_VND_NUM; i++) {
+            if (node->vnd[i].len > 0 && node->vnd[i].data[0] == data[0]) node->vnd[i].len = 0;
+        }
+        taskEXIT_CRITICAL(&shadow_lock);
+        return;
+    }
+    mesh_shadow_state_t *state = (index < MESH_SHADOW_SIG_NUM) ? &node->sig[index] : ble_mesh_shadow_vnd_slot(node, data[0]);
+    state->len  = status->len;
+    state->tick = now;
+    memcpy(state->data, data, status->len);
+    node->tick = now;
+    taskEXIT_CRITICAL(&shadow_lock);
+}
+
+void ble_mesh_shadow_invalidate(uint16_t dst_addr, uint32_t opcode)
+{
+    if (opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET || opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET ||
+        opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET || opcode == GENIE_MODEL_OP_ATTR_GET) return;  // GET 不改变状态
+    if (shadow == NULL) return;
+    if (ESP_BLE_MESH_ADDR_IS_UNICAST(dst_addr)) {
+        taskENTER_CRITICAL(&shadow_lock);
+        mesh_shadow_t *node = ble_mesh_shadow_find(dst_addr);
+        if (node != NULL) ble_mesh_shadow_clear(node, opcode);
+        taskEXIT_CRITICAL(&shadow_lock);
+        return;
+    }
+    for (uint16_t base = 0; base < MESH_SHADOW_SIZE; base += SHADOW_LOCK_CHUNK) {  // 组播：全部节点，每次只锁一段
+        taskENTER_CRITICAL(&shadow_lock);
+        for (uint16_t i = base; i < base + SHADOW_LOCK_CHUNK && i < MESH_SHADOW_SIZE; i++) {
+            if (shadow[i].unicast_addr == ESP_BLE_MESH_ADDR_UNASSIGNED) continue;
+            ble_mesh_shadow_clear(&shadow[i], opcode);
+        }
+        taskEXIT_CRITICAL(&shadow_lock);
+    }
+}
+
+bool ble_mesh_shadow_get(const mesh_msg_t *msg, mesh_transfer_t *status)
+{
+    if (MESH_SHADOW_STALE_TIME == 0 || !ESP_BLE_MESH_ADDR_IS_UNICAST(msg->dst_addr)) return false;
+
+    const mesh_shadow_state_t *state = NULL;
+    uint32_t opcode = msg->opcode;  // SIG: 协议栈响应的是发送的操作码
+    switch (msg->opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
+        break;
+    case GENIE_MODEL_OP_ATTR_GET:   // vendor: 要指定属性
+        if (msg->len == 0) return false;
+        opcode = GENIE_MODEL_OP_ATTR_STATUS;
+        break;
+    default:
+        return false;
+    }
+
+    bool fresh = false;
+    TickType_t now = xTaskGetTickCount();
+    taskENTER_CRITICAL(&shadow_lock);
+    mesh_shadow_t *node = ble_mesh_shadow_find(msg->dst_addr);
+    if (node != NULL) {
+        if (opcode == GENIE_MODEL_OP_ATTR_STATUS) {
+            for (uint8_t i = 0; i < MESH_SHADOW_VND_NUM; i++) {
+                if (node->vnd[i].len > 0 && node->vnd[i].data[0] == msg->data[0]) {
+                    state = &node->vnd[i];
+                    break;
+                }
+            }
+        } else {
+            state = &node->sig[ble_mesh_shadow_sig_index(opcode)];
+        }
+    }
+    if (state != NULL && ble_mesh_shadow_fresh(state, now)) {
+        memset(status, 0, sizeof(mesh_transfer_t));
+        status->unicast_addr = msg->dst_addr;
+        status->opcode = opcode;
+        status->len = state->len;
+        memcpy(status->data, state->data, state->len);
+        fresh = true;
+    }
+    taskEXIT_CRITICAL(&shadow_lock);
+
+    #ifdef TAG
+    if (fresh) ESP_LOGI(TAG, "addr 0x%04x, opcode 0x%06lx from shadow", msg->dst_addr, msg->opcode);
+    #endif
+    return fresh;
+}
+
+bool ble_mesh_shadow_read(uint16_t unicast_addr, mesh_shadow_t *out)
+{
+    taskENTER_CRITICAL(&shadow_lock);
+    mesh_shadow_t *node = ble_mesh_shadow_find(unicast_addr);
+    if (node != NULL) *out = *node;
+    taskEXIT_CRITICAL(&shadow_lock);
+    return (node != NULL);
+}
+
+void ble_mesh_shadow_remove(uint16_t unicast_addr, uint8_t elem_num)
+{
+    taskENTER_CRITICAL(&shadow_lock);
+    for (uint8_t i = 0; i < elem_num; i++) {
+        mesh_shadow_t *node = ble_mesh_shadow_find(unicast_addr + i);
+        if (node != NULL) ble_mesh_shadow_free(node - shadow);
+    }
+    taskEXIT_CRITICAL(&shadow_lock);
+}
+
+// 从 LRU 表头逐个释放，每次只锁 SHADOW_LOCK_CHUNK 个：表在每段之间都是完整的，其他任务可以继续查找/更新
+void ble_mesh_shadow_remove_all(void)
+{
+    if (shadow == NULL) return;
+    bool done = false;
+    for (uint16_t num = 0; done == false && num < MESH_SHADOW_SIZE; num += SHADOW_LOCK_CHUNK) {
+        taskENTER_CRITICAL(&shadow_lock);
+        for (uint16_t i = 0; i < SHADOW_LOCK_CHUNK && shadow_lru_head != SHADOW_INDEX_NULL; i++) {
+            ble_mesh_shadow_free(shadow_lru_head);
+        }
+        done = (shadow_lru_head == SHADOW_INDEX_NULL);
+        taskEXIT_CRITICAL(&shadow_lock);
+    }
+}
+
+void ble_mesh_shadow_init(void)
+{
+    uint16_t hash_size = 8;
+    while (hash_size < MESH_SHADOW_SIZE * 2) hash_size <<= 1;
+    shadow_hash_mask = hash_size - 1;
+
+    shadow_hash = heap_caps_malloc(hash_size * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    shadow_prev = heap_caps_malloc(MESH_SHADOW_SIZE * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    shadow_next = heap_caps_malloc(MESH_SHADOW_SIZE * sizeof(uint16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    shadow = heap_caps_calloc(MESH_SHADOW_SIZE, sizeof(mesh_shadow_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (shadow == NULL || shadow_hash == NULL || shadow_prev == NULL || shadow_next == NULL) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "shadow malloc fail");
+        #endif
+        heap_caps_free(shadow);  // shadow == NULL 时其它接口都直接返回
+        heap_caps_free(shadow_hash);
+        heap_caps_free(shadow_prev);
+        heap_caps_free(shadow_next);
+        shadow = NULL;
+        shadow_hash = NULL;
+        shadow_prev = NULL;
+        shadow_next = NULL;
+        return;
+    }
+    memset(shadow_hash, 0xFF, hash_size * sizeof(uint16_t));
+    ble_mesh_shadow_list_reset();
+}
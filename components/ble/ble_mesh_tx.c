@@ -0,0 +1,394 @@
+/**
+ * @file    ble_mesh_tx.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 异步发送引擎
+ *          - 应用层提交消息后立即返回，响应/超时通过回调通知；
+ *          - 每个单播地址同一时刻只有一条等待响应的消息，响应按 (单播地址, 操作码) 匹配到请求，并且：
+ *            收到的时间要在请求第一次发出之后（之前收到的是上一个请求迟到的响应）；
+ *            vendor 属性消息（mesh_frame_t）不带TID，ATTR_STATUS 的属性类型要和请求的一致；
+ *            节点主动上报（PUBLISH）由协议栈回调直接交给接收队列，不会完成请求；
+ *          - 不同目标地址的消息并发发送，最多 MESH_TX_WINDOW_SIZE 条同时等待响应；
+ *          - 组播消息没有响应，发送成功即完成；
+ *          - 从提交队列取出时按节点能力路由到有对应模型的元素（只路由一次，排队重试时不再路由），
+ *            节点没有这个模型直接失败（ble_mesh_cap_route）；
+ *          - GET 先查节点状态影子（ble_mesh_shadow），在有效期内直接完成；
+ *          - 同步执行的消息（apply_tick）在实际发出时计算 Delay，让各个节点在同一时间执行；
+ *          - 超时时间/TTL/重发次数按节点测到的往返时间和超时率决定（ble_mesh_link_policy），
+ *            完成时更新链路估计（重发过的消息不取往返时间样本，Karn 算法）；
+ *          - 发出/重发/响应/超时/影子响应/丢弃都计入收发统计（ble_mesh_metrics）；
+ *          - 没有匹配到请求的响应（请求超时后才到）不丢弃，由 ble_mesh_handeler_task 按节点上报处理；
+ *          - 长数据（mesh_msg_t.ext / mesh_transfer_t.ext）在缓存池中：请求完成、事件处理完后由本模块释放。
+ * @version 0.1
+ * @date    2023-08-02
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "ble_mesh_tx.h"
+#include "ble_mesh_shadow.h"
+#include "ble_mesh_metrics.h"
+#include "ble_mesh_pool.h"
+#include "ble_mesh_rx.h"
+
+#define TAG "mesh_tx"
+
+typedef struct {
+    mesh_msg_t msg;
+    ble_mesh_tx_callback_t callback;
+    void *arg;
+} mesh_tx_req_t;
+
+typedef struct {
+    mesh_tx_req_t req;
+    uint32_t   ack_opcode;    // 期望的响应操作码
+    TickType_t first;         // 第一次发出的时间（统计响应时间）
+    TickType_t start;         // 本次发出的时间
+    TickType_t deadline;      // 兜底超时时间（协议栈正常会先回调超时）
+    uint8_t    retry;         // 已经重发的次数
+    uint8_t    retry_max;     // 超时后最多重发的次数
+    bool       busy;
+} mesh_tx_slot_t;
+
+typedef struct {
+    mesh_transfer_t status;
+    esp_err_t  err;
+    TickType_t tick;          // 协议栈回调的时间
+} mesh_tx_evt_t;
+
+static QueueHandle_t xReqQueue = NULL;   // 应用层提交的消息
+static QueueHandle_t xEvtQueue = NULL;   // 协议栈回调的响应/超时
+static QueueHandle_t xLateQueue = NULL;  // 没有匹配到请求的响应（迟到的响应）
+static TaskHandle_t  xTxTask   = NULL;
+
+static mesh_tx_slot_t tx_slot[MESH_TX_WINDOW_SIZE];
+static mesh_tx_req_t  tx_backlog[MESH_TX_QUEUE_SIZE];   // 等待发送（目标忙或窗口已满）
+static uint8_t tx_backlog_num = 0;                        // 只在发送引擎任务中修改，修改时持有 tx_backlog_lock
+static portMUX_TYPE tx_backlog_lock = portMUX_INITIALIZER_UNLOCKED;  // ble_mesh_tx_sync_tick() 在其他任务中读
+static uint8_t tx_tid = 0;
+
+//============================================================================================
+// SIG模型：协议栈回调的是发送的操作码；vendor模型：回调的是节点响应的操作码
+static uint32_t ble_mesh_tx_ack_opcode(uint32_t opcode)
+{
+    switch (opcode) {
+    case GENIE_MODEL_OP_ATTR_SET:
+    case GENIE_MODEL_OP_ATTR_GET:
+        return GENIE_MODEL_OP_ATTR_STATUS;
+    case GENIE_MODEL_OP_OTA_START:
+    case GENIE_MODEL_OP_OTA_QUERY:
+    case GENIE_MODEL_OP_OTA_APPLY:
+        return GENIE_MODEL_OP_OTA_STATUS;
+    default:
+        return opcode;
+    }
+}
+
+static void ble_mesh_tx_finish(mesh_tx_req_t *req, esp_err_t err, const mesh_transfer_t *status)
+{
+    #ifdef TAG
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "addr 0x%04x, opcode 0x%06lx, tid %d, err = 0x%x", req->msg.dst_addr, req->msg.opcode, req->msg.tid, err);
+    }
+    #endif
+    if (req->callback != NULL) {
+        req->callback(&req->msg, err, status, req->arg);
+    }
+    ble_mesh_pool_free(req->msg.ext);
+    req->msg.ext = NULL;
+}
+
+// return: NULL: 目标地址正在等待响应，或者窗口已满
+static mesh_tx_slot_t *ble_mesh_tx_get_slot(uint16_t dst_addr)
+{
+    mesh_tx_slot_t *slot = NULL;
+    for (uint8_t i = 0; i < MESH_TX_WINDOW_SIZE; i++) {
+        if (tx_slot[i].busy == false) {
+            if (slot == NULL) slot = &tx_slot[i];
+        } else if (tx_slot[i].req.msg.dst_addr == dst_addr) {
+            return NULL;  // 同一个目标地址，要等上一条消息完成
+        }
+    }
+    return slot;
+}
+
+// 兜底超时：vendor 消息会等待两次超时时间
+static TickType_t ble_mesh_tx_guard_time(uint16_t timeout)
+{
+    return pdMS_TO_TICKS(2 * timeout + MESH_TX_GUARD_TIME);
+}
+
+// 消息完成（响应/最终超时）：更新目标节点的链路估计
+static void ble_mesh_tx_slot_finish(mesh_tx_slot_t *slot, esp_err_t err, const mesh_transfer_t *status)
+{
+    slot->busy = false;
+    TickType_t now = xTaskGetTickCount();
+    if (err == ESP_OK && slot->retry == 0) {
+        ble_mesh_link_update(slot->req.msg.dst_addr, pdTICKS_TO_MS(now - slot->start), false);
+    }
+    ble_mesh_metrics_done(&slot->req.msg, err, pdTICKS_TO_MS(now - slot->first));
+    ble_mesh_tx_finish(&slot->req, err, status);
+}
+
+// 超时：更新超时率，还有重发次数就用同一个TID重发（节点按TID去重，不会重复执行）
+// return: true: 已经重发，继续等待响应
+static bool ble_mesh_tx_retry(mesh_tx_slot_t *slot)
+{
+    ble_mesh_link_update(slot->req.msg.dst_addr, 0, true);
+    ble_mesh_metrics_timeout(&slot->req.msg);
+    if (slot->retry >= slot->retry_max) return false;
+    slot->retry++;
+    mesh_link_policy_t policy;
+    ble_mesh_link_policy(slot->req.msg.dst_addr, &policy);  // 刚更新过超时率，超时时间/TTL可能变大
+    if (ble_mesh_msg_send(&slot->req.msg) != ESP_OK) return false;
+    ble_mesh_metrics_send(&slot->req.msg, true);
+    slot->start = xTaskGetTickCount();
+    slot->deadline = slot->start + ble_mesh_tx_guard_time(policy.timeout);
+    #ifdef TAG
+    ESP_LOGI(TAG, "retry %d: addr 0x%04x, opcode 0x%06lx, tid %d, timeout %d", slot->retry, 
+                  slot->req.msg.dst_addr, slot->req.msg.opcode, slot->req.msg.tid, policy.timeout);
+    #endif
+    return true;
+}
+
+// 从提交队列取出的消息按节点能力路由（每条消息只路由、统计一次），return: false: 节点不支持，已经完成
+static bool ble_mesh_tx_accept(mesh_tx_req_t *req)
+{
+    if (ble_mesh_cap_route(&req->msg) == ESP_OK) return true;
+    ble_mesh_metrics_done(&req->msg, ESP_ERR_NOT_SUPPORTED, 0);
+    ble_mesh_tx_finish(req, ESP_ERR_NOT_SUPPORTED, NULL);
+    return false;
+}
+
+// return: false: 需要继续排队等待（目标忙/窗口满）
+// 同一目标有消息在等待响应时，GET 也要排队，不能用SET完成前的影子响应
+static bool ble_mesh_tx_start(mesh_tx_req_t *req)
+{
+    mesh_tx_slot_t *slot = NULL;
+    if (ESP_BLE_MESH_ADDR_IS_UNICAST(req->msg.dst_addr)) {
+        slot = ble_mesh_tx_get_slot(req->msg.dst_addr);
+        if (slot == NULL) return false;
+    }
+
+    mesh_transfer_t status;
+    if (req->msg.force == 0 && ble_mesh_shadow_get(&req->msg, &status)) {  // 影子还在有效期内，不用发到节点
+        ble_mesh_metrics_cache(&req->msg);
+        ble_mesh_tx_finish(req, ESP_OK, &status);
+        return true;
+    }
+    ble_mesh_shadow_invalidate(req->msg.dst_addr, req->msg.opcode);  // SET 完成前，目标的状态未知
+
+    if (req->msg.apply_tick != 0) {  // 同步执行：剩下的时间让节点延时执行（已经晚了就立即执行）
+        int32_t remain = (int32_t)(req->msg.apply_tick - xTaskGetTickCount());
+        uint32_t ms = (remain > 0) ? pdTICKS_TO_MS(remain) : 0;
+        if (ms > BLE_MESH_DELAY_MAX) ms = BLE_MESH_DELAY_MAX;
+        req->msg.delay = ms / BLE_MESH_DELAY_STEP;
+    }
+
+    req->msg.tid = tx_tid++;
+    esp_err_t err = ble_mesh_msg_send(&req->msg);
+    if (err == ESP_OK) {
+        ble_mesh_metrics_send(&req->msg, false);
+    } else {
+        ble_mesh_metrics_done(&req->msg, err, 0);
+    }
+    if (err != ESP_OK || slot == NULL) {  // 发送失败，或者组播（没有响应）
+        ble_mesh_tx_finish(req, err, NULL);
+        return true;
+    }
+
+    mesh_link_policy_t policy;
+    ble_mesh_link_policy(req->msg.dst_addr, &policy);
+    slot->req = *req;
+    slot->ack_opcode = ble_mesh_tx_ack_opcode(req->msg.opcode);
+    slot->start = xTaskGetTickCount();
+    slot->first = slot->start;
+    slot->deadline = slot->start + ble_mesh_tx_guard_time(policy.timeout);
+    slot->retry = 0;
+    slot->retry_max = policy.retry;
+    slot->busy = true;
+    return true;
+}
+
+static void ble_mesh_tx_backlog_set(uint8_t num)
+{
+    taskENTER_CRITICAL(&tx_backlog_lock);
+    tx_backlog_num = num;
+    taskEXIT_CRITICAL(&tx_backlog_lock);
+}
+
+static void ble_mesh_tx_dispatch(void)
+{
+    uint8_t num = 0;
+    for (uint8_t i = 0; i < tx_backlog_num; i++) {
+        if (ble_mesh_tx_start(&tx_backlog[i]) == false) {
+            tx_backlog[num++] = tx_backlog[i];  // 保持先后顺序
+        }
+    }
+    ble_mesh_tx_backlog_set(num);
+}
+
+// 响应是不是这个请求的：请求第一次发出之前收到的不是；vendor 属性响应的属性类型要一致
+static bool ble_mesh_tx_event_match(const mesh_tx_slot_t *slot, const mesh_tx_evt_t *evt)
+{
+    if (slot->busy == false || slot->req.msg.dst_addr != evt->status.unicast_addr) return false;
+    if (evt->status.opcode != slot->req.msg.opcode && evt->status.opcode != slot->ack_opcode) return false;
+    if (evt->err != ESP_OK) return true;  // 发送失败/超时：协议栈按请求回调
+    if ((int32_t)(evt->tick - slot->first) < 0) return false;
+    if (evt->status.opcode == GENIE_MODEL_OP_ATTR_STATUS && slot->req.msg.len > 0 && evt->status.len > 0) {
+        return mesh_transfer_data(&evt->status)[0] == mesh_msg_data(&slot->req.msg)[0];
+    }
+    return true;
+}
+
+// return: true: evt->status.ext 的所有权已经交出去（放进了接收队列）
+static bool ble_mesh_tx_event_handle(const mesh_tx_evt_t *evt)
+{
+    for (uint8_t i = 0; i < MESH_TX_WINDOW_SIZE; i++) {
+        mesh_tx_slot_t *slot = &tx_slot[i];
+        if (ble_mesh_tx_event_match(slot, evt) == false) continue;
+        if (evt->err == ESP_ERR_TIMEOUT && ble_mesh_tx_retry(slot)) return false;
+        ble_mesh_tx_slot_finish(slot, evt->err, evt->err == ESP_OK ? &evt->status : NULL);
+        return false;
+    }
+    #ifdef TAG
+    ESP_LOGW(TAG, "unmatched event, addr 0x%04x, opcode 0x%06lx", evt->status.unicast_addr, evt->status.opcode);
+    #endif
+    // 迟到的响应（请求已经超时完成）：影子在协议栈回调中已经更新，交给 ble_mesh_handeler_task 按节点上报处理
+    if (evt->err != ESP_OK || evt->status.len == 0) return false;
+    if (xQueueSend(xLateQueue, &evt->status, 0) != pdTRUE) {
+        #ifdef TAG
+        ESP_LOGW(TAG, "late queue full, drop addr 0x%04x", evt->status.unicast_addr);
+        #endif
+        return false;
+    }
+    ble_mesh_rx_wakeup();
+    return true;
+}
+
+static void ble_mesh_tx_check_timeout(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i = 0; i < MESH_TX_WINDOW_SIZE; i++) {
+        mesh_tx_slot_t *slot = &tx_slot[i];
+        if (slot->busy && (int32_t)(slot->deadline - now) <= 0) {
+            if (ble_mesh_tx_retry(slot)) continue;
+            ble_mesh_tx_slot_finish(slot, ESP_ERR_TIMEOUT, NULL);
+        }
+    }
+}
+
+// 距离最近一个兜底超时的时间
+static TickType_t ble_mesh_tx_next_wait(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = portMAX_DELAY;
+    for (uint8_t i = 0; i < MESH_TX_WINDOW_SIZE; i++) {
+        if (tx_slot[i].busy == false) continue;
+        int32_t remain = (int32_t)(tx_slot[i].deadline - now);
+        if (remain <= 0) return 0;
+        if ((TickType_t)remain < wait) wait = remain;
+    }
+    return wait;
+}
+
+static void ble_mesh_tx_task(void *arg)
+{
+    mesh_tx_evt_t evt;
+    TickType_t wait = portMAX_DELAY;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        while (xQueueReceive(xEvtQueue, &evt, 0) == pdTRUE) {
+            if (ble_mesh_tx_event_handle(&evt) == false) {
+                ble_mesh_pool_free(evt.status.ext);  // 回调中用完了
+            }
+        }
+
+        while (tx_backlog_num < MESH_TX_QUEUE_SIZE && xQueueReceive(xReqQueue, &tx_backlog[tx_backlog_num], 0) == pdTRUE) {
+            if (ble_mesh_tx_accept(&tx_backlog[tx_backlog_num])) ble_mesh_tx_backlog_set(tx_backlog_num + 1);
+        }
+
+        ble_mesh_tx_check_timeout();
+        ble_mesh_tx_dispatch();
+        wait = ble_mesh_tx_next_wait();
+    }
+}
+
+//============================================================================================
+// 提交一条消息，立即返回；callback 在发送引擎任务中执行
+esp_err_t ble_mesh_tx_submit(const mesh_msg_t *msg, ble_mesh_tx_callback_t callback, void *arg)
+{
+    if (xReqQueue == NULL) {
+        ble_mesh_pool_free(msg->ext);
+        return ESP_ERR_INVALID_STATE;
+    }
+    mesh_tx_req_t req = {
+        .msg = *msg,
+        .callback = callback,
+        .arg = arg,
+    };
+    if (xQueueSend(xReqQueue, &req, pdMS_TO_TICKS(MESH_TX_SUBMIT_WAIT)) != pdTRUE) {
+        ble_mesh_metrics_drop(msg);
+        ble_mesh_pool_free(msg->ext);
+        return ESP_ERR_TIMEOUT;
+    }
+    xTaskNotifyGive(xTxTask);
+    return ESP_OK;
+}
+
+bool ble_mesh_tx_late_pop(mesh_transfer_t *status)
+{
+    return xLateQueue != NULL && xQueueReceive(xLateQueue, status, 0) == pdTRUE;
+}
+
+bool ble_mesh_tx_in_engine(void)
+{
+    return xTxTask != NULL && xTaskGetCurrentTaskHandle() == xTxTask;
+}
+
+// 同步执行的时间：按发送窗口估算 num 条消息（加上还在排队的）全部发出要多久，不超过 BLE_MESH_DELAY_MAX
+TickType_t ble_mesh_tx_sync_tick(uint16_t num)
+{
+    taskENTER_CRITICAL(&tx_backlog_lock);
+    uint32_t queued = num + tx_backlog_num;
+    taskEXIT_CRITICAL(&tx_backlog_lock);
+    if (xReqQueue != NULL) queued += uxQueueMessagesWaiting(xReqQueue);
+    uint32_t ms = (queued + MESH_TX_WINDOW_SIZE - 1) / MESH_TX_WINDOW_SIZE * MESH_TX_SYNC_SLOT;
+    if (ms > BLE_MESH_DELAY_MAX) ms = BLE_MESH_DELAY_MAX;
+    TickType_t tick = xTaskGetTickCount() + pdMS_TO_TICKS(ms);
+    return (tick != 0) ? tick : 1;  // 0: 不同步
+}
+
+// 协议栈回调中调用：节点响应/发送失败/超时
+void ble_mesh_tx_complete(const mesh_transfer_t *status, esp_err_t err)
+{
+    if (xEvtQueue == NULL) {
+        ble_mesh_pool_free(status->ext);
+        return;
+    }
+    mesh_tx_evt_t evt = {
+        .status = *status,
+        .err = err,
+        .tick = xTaskGetTickCount(),
+    };
+    if (xQueueSend(xEvtQueue, &evt, 0) == pdTRUE) {
+        xTaskNotifyGive(xTxTask);
+    } else {
+        ble_mesh_pool_free(status->ext);
+    }
+}
+
+void ble_mesh_tx_init(void)
+{
+    xReqQueue = xQueueCreate(MESH_TX_QUEUE_SIZE, sizeof(mesh_tx_req_t));
+    xEvtQueue = xQueueCreate(MESH_TX_WINDOW_SIZE * 2, sizeof(mesh_tx_evt_t));
+    xLateQueue = xQueueCreate(MESH_TX_WINDOW_SIZE, sizeof(mesh_transfer_t));
+    xTaskCreatePinnedToCore(ble_mesh_tx_task, "ble_mesh_tx", 4 * 1024, NULL, 11, &xTxTask, PRO_CPU_NUM);
+}
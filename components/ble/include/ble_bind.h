@@ -11,6 +11,7 @@
 #ifndef _BLE_BIND_H_
 #define _BLE_BIND_H_
 
+#include "sdkconfig.h"
 #include "ble_mesh_nvs.h"
 
 /**< device product id. */
@@ -32,30 +33,134 @@ typedef struct {
     char     name[16];       /**< device local name. */
 } mesh_bind_t;  // 设备绑定的基本信息
 
-#define BIND_TABLE_SIZE     20   // 最多存储多少个设备信息
+#define BIND_TABLE_SIZE     mesh_bind_size()       // 最多存储多少个设备信息（启动时确定，见 mesh_bind_set_size()）
+#define BIND_TABLE_MIN      BIND_LEGACY_SIZE       // 至少能放下旧版存储的设备
+#define BIND_LIMIT_MIN(a, b) ((a) < (b) ? (a) : (b))
+// 协议栈能配网/记录重放保护的节点数，以及影子表（ble_mesh_shadow）、解绑队列（ble_mesh_reset）编译时按 CONFIG_MESH_NODE_MAX 的大小，
+// 登记表不能比其中最小的大，否则多出来的节点配不上网，也不在影子表/解绑队列中
+#define BIND_TABLE_MAX      BIND_LIMIT_MIN(CONFIG_MESH_NODE_MAX, BIND_LIMIT_MIN(CONFIG_BLE_MESH_MAX_PROV_NODES, CONFIG_BLE_MESH_CRPL))
+#define BIND_PAGE_SIZE      8                      // 每个NVS键（页）存的设备数
+#define BIND_LEGACY_SIZE    20                     // 旧版存储的设备数（只用于迁移）
 
 typedef struct {
-    mesh_bind_t node[BIND_TABLE_SIZE];  
-    bool update;
-} __attribute__((packed)) mesh_bind_nvs_t;  
+    mesh_bind_t node[BIND_LEGACY_SIZE];  
+    bool update;   
+} __attribute__((packed)) mesh_bind_nvs_t;  // 旧版整表存储的布局（只用于迁移）
+
+typedef struct {
+    uint16_t srtt;           /**< 平滑往返时间/MS，0: 还没有样本 */
+    uint16_t rttvar;         /**< 往返时间的平均偏差/MS */
+    uint8_t  loss;           /**< 超时率（EWMA），255 = 100% */
+    uint8_t  fail;           /**< 连续超时的次数 */
+} mesh_link_t;  // 链路估计：同 TCP 的 RTO 算法
+
+typedef struct {
+    uint32_t tx;             /**< 发出的消息数（含重发） */
+    uint32_t ack;            /**< 收到响应的消息数 */
+    uint32_t timeout;        /**< 超时次数 */
+} mesh_node_stats_t;  // 节点收发统计（ble_mesh_metrics）
+
+#define MESH_NODE_ELEM_MAX  8                      // 登记表记录能力的元素数
+
+/* 元素支持的服务端模型（来自 Composition Data），mesh_node_t.caps[] */
+#define MESH_CAP_ONOFF      (1 << 0)    // Generic OnOff Server
+#define MESH_CAP_LEVEL      (1 << 1)    // Generic Level Server
+#define MESH_CAP_LIGHTNESS  (1 << 2)    // Light Lightness Server
+#define MESH_CAP_CTL        (1 << 3)    // Light CTL Server
+#define MESH_CAP_HSL        (1 << 4)    // Light HSL Server
+#define MESH_CAP_VENDOR     (1 << 5)    // Genie Vendor Model Server
+
+typedef struct {
+    mesh_bind_t bind;        /**< 绑定信息（保存在NVS），bind.uniaddr = 0: 空闲 */
+    /* 以下是运行时数据，不保存 */
+    uint8_t  elem_num;       /**< 元素数（Composition Data），0: 未知 */
+    uint16_t cid;            /**< Company ID */
+    uint16_t pid;            /**< Product ID */
+    uint16_t vid;            /**< Version ID */
+    uint16_t feat;           /**< Features: Relay/Proxy/Friend/Low Power */
+    uint8_t  caps[MESH_NODE_ELEM_MAX];  /**< 每个元素支持的模型（MESH_CAP_*），elem_num = 0 时未知 */
+    mesh_link_t link;        /**< 链路估计（发送引擎更新） */
+    mesh_node_stats_t stats; /**< 收发统计 */
+    uint32_t last_seen;      /**< 最后收到心跳包的时间（tick） */
+    uint8_t  hops;           /**< 心跳包经过的跳数 */
+    uint8_t  ttl;            /**< 心跳包收到时的TTL */
+    bool     online;         /**< 1: 在线 */
+    bool     reported;       /**< 已上报的在线状态 */
+    bool     pending;        /**< 1: 在线状态变化还没上报（在变化队列中） */
+} mesh_node_t;  // 节点登记表：绑定信息 + 在线状态 + 能力
+
+#define MESH_PRESENCE_TIMEOUT   CONFIG_MESH_PRESENCE_TIMEOUT   // 多久没收到心跳包就离线/S
+
+typedef struct {
+    uint16_t uniaddr;
+    bool     online;
+    uint8_t  hops;
+} mesh_presence_t;  // 在线状态变化
+
+typedef struct {
+    uint32_t write;     // 写入的记录数
+    uint32_t erase;     // 删除的记录数
+    uint32_t flush;     // 合并写入的次数
+    uint32_t error;     // 写NVS失败的次数
+} mesh_bind_stats_t;    // NVS写入统计（评估Flash磨损）
 
 //======================================================
 void mesh_bind_init(void);
 
+// 登记表的大小（mesh_bind_init() 之前为0）
+uint16_t mesh_bind_size(void);
+
+// 修改登记表的大小（保存到NVS，重启后生效），return: ESP_ERR_INVALID_SIZE: 比已使用的最大索引还小
+esp_err_t mesh_bind_set_size(uint16_t size);
+
 bool mesh_bind_add(mesh_bind_t bind);
 
 bool mesh_bind_remove(uint16_t unicast_addr);
 
-void mesh_bind_update(void);
-
 void mesh_bind_remove_all(void);
+
+void mesh_bind_get_stats(mesh_bind_stats_t *stats);
+
+bool mesh_node_get(uint16_t uniaddr, mesh_node_t *node);
+
+void mesh_node_set_comp(uint16_t uniaddr, const uint8_t *data, uint16_t len);
+
+// 元素地址所属的节点（主元素地址 <= addr < 主元素地址 + 元素数），return: 元素序号，-1: 不是已知节点的元素
+int8_t mesh_node_find_element(uint16_t addr, mesh_node_t *node);
+
+void mesh_node_heartbeat(uint16_t uniaddr, uint8_t hops, uint8_t ttl);
+
+uint16_t mesh_node_presence_check(void);
+
+uint16_t mesh_node_presence_poll(mesh_presence_t *evt, uint16_t max);
+
+bool mesh_node_online(uint16_t uniaddr);
+
+void mesh_node_set_link(uint16_t uniaddr, const mesh_link_t *link);
+
+// 累加节点的收发统计，addr 可以是节点任一元素的地址（算在所属节点上）
+void mesh_node_add_stats(uint16_t addr, uint8_t tx, uint8_t ack, uint8_t timeout);
+
+void mesh_node_clear_stats(void);
+
+// 复制全部节点的登记信息，return: 节点数
+uint16_t mesh_node_get_all(mesh_node_t *node, uint16_t max);
 //======================================================
 
-char *mesh_bind_find_name(uint8_t addr[6]);
+// 根据addr[]找到对应的设备名，复制到 name（size 至少 sizeof(mesh_bind_t.name) 才不会截断），return: false: 没有找到
+bool mesh_bind_find_name(const uint8_t addr[6], char *name, uint8_t size);
 
 bool mesh_bind_find_addr(const char *name, uint8_t addr[6]);
 
 bool mesh_bind_find_addr_select(const char *name, uint8_t select, uint8_t addr[6]);
 
+uint16_t mesh_bind_find_uniaddr(const uint8_t addr[6]);
+
+bool mesh_bind_find_mac(uint16_t uniaddr, uint8_t addr[6]);
+
+uint16_t mesh_bind_find_uniaddr_name(const char *name);
+
+uint16_t mesh_bind_get_all(mesh_bind_t *bind, uint16_t max);
+
 
 #endif /* _BLE_BIND_H_ end. */
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include "esp_ble_mesh_defs.h"
 #include "esp_ble_mesh_common_api.h"
 #include "esp_ble_mesh_lighting_model_api.h"
+#include "ble_bind.h"
 
 #define PROV_OWN_ADDR                   0x0001
 #define ROOT_OWN_ADDR                   PROV_OWN_ADDR
@@ -32,6 +33,13 @@
 #define GENIE_MODEL_OP_ATTR_SET         ESP_BLE_MESH_MODEL_OP_3(0xD2,   CID_COMPANY)
 #define GENIE_MODEL_OP_ATTR_SET_UNACK   ESP_BLE_MESH_MODEL_OP_3(0xD3,   CID_COMPANY)
 #define GENIE_MODEL_OP_ATTR_STATUS      ESP_BLE_MESH_MODEL_OP_3(0xD4,   CID_COMPANY)
+
+// 节点固件分发（ble_mesh_ota），数据都是大端格式
+#define GENIE_MODEL_OP_OTA_START        ESP_BLE_MESH_MODEL_OP_3(0xE0,   CID_COMPANY)  // [size(4), crc32(4), chunk_size(2)]
+#define GENIE_MODEL_OP_OTA_CHUNK        ESP_BLE_MESH_MODEL_OP_3(0xE1,   CID_COMPANY)  // [index(2), data]，不响应
+#define GENIE_MODEL_OP_OTA_QUERY        ESP_BLE_MESH_MODEL_OP_3(0xE2,   CID_COMPANY)  // [window(2)]
+#define GENIE_MODEL_OP_OTA_APPLY        ESP_BLE_MESH_MODEL_OP_3(0xE3,   CID_COMPANY)  // [crc32(4)]
+#define GENIE_MODEL_OP_OTA_STATUS       ESP_BLE_MESH_MODEL_OP_3(0xE4,   CID_COMPANY)  // [status(1), window(2), missing(4)]
  
 #ifndef ADDRSTR
 #define ADDRSTR      "%02x%02x%02x%02x%02x%02x"
@@ -53,6 +61,11 @@
 #define BLE_MESH_TEMPERATURE_MAX                0x4E20      // 20000
 #define BLE_MESH_TEMPERATURE_UNKNOWN            0xFFFF
 
+/* Generic Default Transition Time / Delay (Mesh Model specification) */
+#define BLE_MESH_TRANS_TIME_STEP_MAX            62          // 6bit步数的最大值（0x3F: 未知）
+#define BLE_MESH_DELAY_STEP                     5           // Delay 的单位/MS
+#define BLE_MESH_DELAY_MAX                      (0xFF * BLE_MESH_DELAY_STEP)   // 最大延时执行时间/MS
+
 typedef struct {
    uint16_t hue;           // Hue 色度 
    uint16_t saturation;    // Saturation 饱和度
@@ -71,24 +84,92 @@ typedef struct {
    uint8_t value[6]; 
 } mesh_frame_t;  // vendor buffer max lenght = 8bytes
 
+#define VND_DATA_SIZE  (8)   /*!< 内联的数据长度，更长的数据放在缓存池（ble_mesh_pool） */
+#define VND_DATA_MAX   (377) /*!< access 层最大 380 字节减去 3 字节 vendor 操作码（分包/重组由协议栈完成） */
+
 typedef struct {
-#define VND_DATA_SIZE  (8) /*!< Rx data max size */  
    uint8_t  addr[6];       /*!< Node device address */
    // uint8_t  dev_uuid[16];  /*!< Device UUID */
    uint16_t unicast_addr;  /*!< Node unicast address */
    uint32_t opcode;        /*!< Rx opcode */
-   uint8_t  data[8];       /*!< Rx data */
-   uint8_t  len;           /*!< Rx data len */
+   uint8_t  data[VND_DATA_SIZE]; /*!< Rx data（len <= VND_DATA_SIZE） */
+   uint16_t len;           /*!< Rx data len */
+   uint8_t  *ext;          /*!< len > VND_DATA_SIZE 时的数据（缓存池的块，由接收方释放），否则为 NULL */
 } mesh_transfer_t;
+
+typedef struct {
+   uint16_t dst_addr;      /*!< 单播/组播地址 */
+   uint32_t opcode;        /*!< 发送的操作码 */
+   uint8_t  tid;           /*!< Transaction ID（由发送引擎分配） */
+   uint8_t  force;         /*!< 1: GET 一定发到节点，不用状态影子响应 */
+   uint8_t  trans_time;    /*!< 渐变时间（Transition Time 编码，见 ble_mesh_trans_time_encode()），0: 立即 */
+   uint8_t  delay;         /*!< 延时执行，单位 BLE_MESH_DELAY_STEP（有 apply_tick 时由发送引擎计算） */
+   uint32_t apply_tick;    /*!< 同步执行：节点在这个时间（tick）执行，0: 不同步 */
+   uint16_t len;           /*!< data 长度 */
+   uint8_t  data[VND_DATA_SIZE]; /*!< 大端格式 ONOFF:[onoff]; HSL:[H,S,L]; CTL:[L,T]; VENDOR:[...] */
+   uint8_t  *ext;          /*!< len > VND_DATA_SIZE 时的数据（缓存池的块，提交后由发送引擎释放），否则为 NULL */
+} mesh_msg_t;
+
+// 消息数据：长数据在缓存池中
+static inline uint8_t *mesh_transfer_data(const mesh_transfer_t *transfer)
+{
+   return (transfer->ext != NULL) ? transfer->ext : (uint8_t *)transfer->data;
+}
+
+static inline uint8_t *mesh_msg_data(const mesh_msg_t *msg)
+{
+   return (msg->ext != NULL) ? msg->ext : (uint8_t *)msg->data;
+}
+
+typedef struct {
+   uint16_t timeout;       /*!< 等待响应的超时时间/MS */
+   uint8_t  ttl;           /*!< 发送的TTL */
+   uint8_t  retry;         /*!< 超时后重发的次数（发送引擎） */
+} mesh_link_policy_t;  // 按节点的链路估计决定的发送参数
  
 // (receive.opcode, receive.addr, receive.data, receive.len);
 typedef void (*ble_mesh_callback_t)(mesh_transfer_t msg);
 void ble_mesh_register_callback(ble_mesh_callback_t callback);
 
+// 节点上线/离线（心跳包超时），evt[num] 是合并后的变化
+typedef void (*ble_mesh_presence_callback_t)(const mesh_presence_t *evt, uint16_t num);
+void ble_mesh_register_presence_callback(ble_mesh_presence_callback_t callback);
+
 void app_ble_mesh_init(void); 
 
 bool ble_mesh_online_status(uint16_t unicast_addr);
 
+esp_err_t ble_mesh_msg_send(const mesh_msg_t *msg);
+
+// 不等待响应的 vendor 消息（不经过发送引擎），比如固件分发的数据块
+esp_err_t ble_mesh_vendor_send_unack(uint16_t dst_addr, uint32_t opcode, const uint8_t *data, uint16_t len);
+
+/**
+ * @brief  按节点能力检查/路由消息（发送引擎取出提交的消息时调用，每条消息一次）
+ *
+ * @param msg ：dst_addr 可能改成支持该操作码的元素地址
+ * @return ESP_OK: 可以发送；ESP_ERR_NOT_SUPPORTED: 节点没有这个模型
+ */
+esp_err_t ble_mesh_cap_route(mesh_msg_t *msg);
+
+// 节点上第一个有这个能力（MESH_CAP_*）的元素序号，return: 0: 主元素或能力未知，-1: 节点没有这个模型
+int8_t ble_mesh_cap_element(uint16_t unicast_addr, uint8_t cap);
+
+uint8_t ble_mesh_trans_time_encode(uint32_t ms);
+uint32_t ble_mesh_trans_time_decode(uint8_t trans_time);
+
+/**
+ * @brief  更新节点的链路估计（发送引擎在消息完成时调用）
+ *
+ * @param unicast_addr ：节点的单播地址
+ * @param rtt ：发送到收到响应的时间/MS（timeout = true 时忽略）
+ * @param timeout ：true: 没有响应
+ */
+void ble_mesh_link_update(uint16_t unicast_addr, uint32_t rtt, bool timeout);
+
+// 按节点测到的往返时间/超时率/跳数得到超时时间、TTL、重发次数（非单播地址或未知节点用默认值）
+void ble_mesh_link_policy(uint16_t unicast_addr, mesh_link_policy_t *policy);
+
 bool ble_mesh_onoff_set(uint16_t unicast_addr, bool onoff);
 bool ble_mesh_onoff_get(uint16_t unicast_addr);
 
@@ -98,13 +179,20 @@ bool ble_mesh_light_hsl_get(uint16_t dst_addr);
 bool ble_mesh_light_ctl_set(uint16_t dst_addr, esp_ble_mesh_state_change_light_ctl_set_t ctl);
 bool ble_mesh_light_ctl_get(uint16_t dst_addr);
 
-bool ble_mesh_send_vendor_message(uint16_t dst_addr, uint32_t opcode, uint8_t *data, uint8_t len);
+bool ble_mesh_send_vendor_message(uint16_t dst_addr, uint32_t opcode, uint8_t *data, uint16_t len);
 
 uint16_t ble_mesh_provisioner_get_prov_node_addr(uint16_t unicast_addr, uint8_t addr[6]);
 
+uint8_t ble_mesh_node_element_num(uint16_t unicast_addr);
+
 esp_err_t ble_mesh_node_reset(uint16_t unicast_addr);
 
+esp_err_t ble_mesh_model_sub_set(uint16_t unicast_addr, uint16_t element_addr, uint16_t group_addr, uint16_t model_id, uint16_t company_id, bool add);
+
 uint16_t ble_mesh_prov_bind_add(uint8_t addr[6], const char *name);
+bool ble_mesh_prov_bind_node(mesh_bind_t bind);
+bool ble_mesh_prov_node_remove(uint16_t unicast_addr);
+void ble_mesh_prov_node_remove_all(void);
 uint16_t ble_mesh_prov_unbind_delete(uint16_t unicast_addr);
 void ble_mesh_prov_unbind_delete_all(void);
 
@@ -0,0 +1,60 @@
+/**
+ * @file    ble_mesh_group.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 自动分组
+ *          经常一起下发指令的一组节点，自动分配组播地址并订阅（Config Model Subscription Add），
+ *          之后同一组节点的 SET 改成一条组播消息发送。
+ * @version 0.1
+ * @date    2023-08-16
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_GROUP_H__
+#define __BLE_MESH_GROUP_H__
+
+#include "ble_mesh.h"
+
+#define MESH_GROUP_MAX              32                          // 分组表大小（学习中 + 已建立）
+#define MESH_GROUP_MEMBER_MAX       20                          // 每组最多的节点数（APP_TARGET_MAX）
+#define MESH_GROUP_MEMBER_MIN       2                           // 少于这个节点数不分组
+#define MESH_GROUP_ADDR_BASE        0xD000                      // 自动分组的组播地址: 0xD000 ~ 0xD000 + MESH_GROUP_MAX - 1
+#define MESH_GROUP_LEARN_HITS       CONFIG_MESH_GROUP_LEARN_HITS  // 同一组节点下发多少次指令后建立分组
+#ifdef CONFIG_MESH_GROUP_VERIFY
+#define MESH_GROUP_VERIFY           1                           // 组播后逐个GET确认节点状态
+#else
+#define MESH_GROUP_VERIFY           0
+#endif
+
+#define MESH_GROUP_STATUS_TIMEOUT   0xFF                        // 订阅配置没有响应
+
+/**
+ * @brief  一组节点下发 SET 前调用：记录这组节点（学习），分组已建立并且全部节点都订阅了
+ *         opcode 对应的模型时返回组播地址
+ *
+ * @param uniaddr ：节点的单播地址（顺序不限）
+ * @param num ：节点数
+ * @param opcode ：要发送的操作码，只有 ONOFF/HSL/CTL/Genie属性 SET 可以组播
+ * @param group_opcode ：返回组播地址时，组播要用的操作码（对应的 SET_UNACK，节点不响应）
+ * @return 组播地址，0: 逐个单播发送
+ */
+uint16_t ble_mesh_group_match(const uint16_t *uniaddr, uint8_t num, uint32_t opcode, uint32_t *group_opcode);
+
+/**
+ * @brief  订阅配置的响应（在 ble_mesh_config_client_cb 中调用）
+ *
+ * @param node_addr ：节点的单播地址
+ * @param status ：Config Model Subscription Status，MESH_GROUP_STATUS_TIMEOUT: 超时
+ */
+void ble_mesh_group_sub_status(uint16_t node_addr, uint8_t status);
+
+// 节点解绑/重新配网：订阅关系已经不存在了，包含该节点的分组删除
+void ble_mesh_group_node_remove(uint16_t uniaddr);
+
+void ble_mesh_group_remove_all(void);
+
+// 周期调用（ble_mesh_handeler_task）：订阅配置超时重发，保存分组表
+void ble_mesh_group_process(void);
+
+void ble_mesh_group_init(void);
+
+#endif /* __BLE_MESH_GROUP_H__ */
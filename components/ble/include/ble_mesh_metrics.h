@@ -0,0 +1,52 @@
+/**
+ * @file    ble_mesh_metrics.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 收发统计：按操作码/节点统计发送、响应、超时、丢弃，响应时间直方图
+ *          只在发送引擎中累加计数（加锁后几条加法），可以一直开着。
+ * @version 0.1
+ * @date    2023-08-25
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_METRICS_H__
+#define __BLE_MESH_METRICS_H__
+
+#include "cJSON.h"
+#include "ble_mesh.h"
+
+#define MESH_METRICS_PERIOD         CONFIG_MESH_METRICS_PERIOD  // 定时上报的周期/S，0: 只按指令上报
+#define MESH_METRICS_BUCKET_NUM     8                           // 响应时间直方图: <50 <100 <200 <400 <800 <1600 <3200 >=3200 MS
+#define MESH_METRICS_NODE_TOP       8                           // 定时上报时只带超时最多的几个节点
+
+// 一条消息发出（retry = true: 超时重发）
+void ble_mesh_metrics_send(const mesh_msg_t *msg, bool retry);
+
+/**
+ * @brief  一条消息完成
+ *
+ * @param msg ：消息
+ * @param err ：ESP_OK: 收到响应；ESP_ERR_TIMEOUT: 超时；其他: 发送失败/不支持
+ * @param latency ：第一次发出到收到响应的时间/MS（err = ESP_OK 时有效）
+ */
+void ble_mesh_metrics_done(const mesh_msg_t *msg, esp_err_t err, uint32_t latency);
+
+// 一次超时（每次超时都计入节点统计，重发后成功也算）
+void ble_mesh_metrics_timeout(const mesh_msg_t *msg);
+
+// GET 由状态影子直接响应
+void ble_mesh_metrics_cache(const mesh_msg_t *msg);
+
+// 发送队列满，提交的消息被丢弃
+void ble_mesh_metrics_drop(const mesh_msg_t *msg);
+
+/**
+ * @brief  导出统计数据
+ *
+ * @param node_max ：最多带多少个节点（按超时次数排序），0: 不带节点
+ * @return cJSON 对象，调用者释放
+ */
+cJSON *ble_mesh_metrics_json(uint16_t node_max);
+
+void ble_mesh_metrics_reset(void);
+
+#endif /* __BLE_MESH_METRICS_H__ */
@@ -28,6 +28,14 @@ esp_err_t ble_mesh_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode)
 
 esp_err_t ble_bind_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode);
 
+esp_err_t ble_bind_slot_nvs_store(uint8_t slot, void *value, size_t size, nvs_mode_t nvs_open_mode);
+
+esp_err_t ble_bind_page_nvs_store(uint16_t page, void *value, size_t size, nvs_mode_t nvs_open_mode);
+
+esp_err_t ble_bind_size_nvs_store(uint16_t *size, nvs_open_mode_t nvs_open_mode);
+
+esp_err_t ble_group_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode);
+
 esp_err_t ble_gattc_nvs_store(void *value, size_t size, nvs_mode_t nvs_open_mode);
  
 #endif /* _BLE_MESH_NVS_H_ */
@@ -0,0 +1,70 @@
+/**
+ * @file    ble_mesh_ota.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 节点固件分发
+ *          网关把下载好的固件分块发给一个或多个节点：数据块不等待响应（多个节点时发到 GENIE_OTA_GROUP_ADDR），
+ *          每发完一个窗口查询一次节点缺少的块，只补发缺少的块，最后节点校验 CRC 后升级。
+ * @version 0.1
+ * @date    2023-08-28
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_OTA_H__
+#define __BLE_MESH_OTA_H__
+
+#include "ble_mesh.h"
+
+#define MESH_OTA_CHUNK_SIZE     256     // 每块的固件数据（加上 2 字节序号，协议栈分包发送）
+#define MESH_OTA_WINDOW         32      // 每个窗口的块数（节点用 32 位的位图上报缺少的块）
+#define MESH_OTA_TARGET_MAX     32      // 同时升级的节点数
+#define MESH_OTA_INTERVAL_MIN   20      // 两个数据块之间的最小间隔/MS
+#define MESH_OTA_INTERVAL_MAX   500     // 发送失败后退避的最大间隔/MS
+#define MESH_OTA_STALL_MAX      5       // 连续多少次查询没有进展就放弃这个节点
+#define MESH_OTA_CHUNK_TIMEOUT  3000    // 协议栈没有回调 SEND_COMP_EVT 的兜底时间/MS
+
+// GENIE_MODEL_OP_OTA_STATUS 的 status
+enum {
+    MESH_OTA_STATUS_OK = 0,
+    MESH_OTA_STATUS_BUSY,           // 节点正在忙（比如正在升级）
+    MESH_OTA_STATUS_FAIL,           // 写入/校验失败
+    MESH_OTA_STATUS_UNSUPPORTED,    // 固件太大或者节点不支持
+};
+
+typedef struct {
+    uint16_t uniaddr;       /**< 节点的单播地址 */
+    bool     ok;            /**< true: 节点已校验固件并开始升级 */
+} mesh_ota_result_t;
+
+/**
+ * @brief  分发进度（在分发任务中执行）
+ * @param plan ：0 ~ 100，按最慢的节点计算
+ */
+typedef void (*ble_mesh_ota_progress_t)(uint8_t plan);
+
+/**
+ * @brief  分发结束（在分发任务中执行），返回后才可以释放固件
+ * @param result ：每个节点的结果
+ * @param num ：节点数
+ */
+typedef void (*ble_mesh_ota_result_t)(const mesh_ota_result_t *result, uint8_t num);
+
+void ble_mesh_ota_register_callback(ble_mesh_ota_progress_t progress, ble_mesh_ota_result_t result);
+
+/**
+ * @brief  开始分发固件，立即返回
+ *
+ * @param image ：固件（在结果回调返回前保持有效）
+ * @param size ：固件大小（块数不超过 65535）
+ * @param uniaddr ：节点的单播地址
+ * @param num ：节点数（不超过 MESH_OTA_TARGET_MAX）
+ * @return ESP_OK: 已开始；ESP_ERR_INVALID_STATE: 正在分发；ESP_ERR_INVALID_ARG: 参数错误
+ */
+esp_err_t ble_mesh_ota_start(const uint8_t *image, uint32_t size, const uint16_t *uniaddr, uint8_t num);
+
+// 是否正在分发
+bool ble_mesh_ota_busy(void);
+
+// 数据块发送完成（在 ble_mesh_custom_model_cb 的 SEND_COMP_EVT 中调用）
+void ble_mesh_ota_chunk_comp(esp_err_t err);
+
+#endif /* __BLE_MESH_OTA_H__ */
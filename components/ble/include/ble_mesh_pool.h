@@ -0,0 +1,43 @@
+/**
+ * @file    ble_mesh_pool.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 长数据缓存池
+ *          超过 VND_DATA_SIZE 的 vendor 数据（分包/重组由协议栈传输层完成）放在固定大小的块中，
+ *          mesh_transfer_t/mesh_msg_t 只带块指针（ext），队列中复制的还是短结构体。
+ * @version 0.1
+ * @date    2023-08-26
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_POOL_H__
+#define __BLE_MESH_POOL_H__
+
+#include "ble_mesh.h"
+
+#define MESH_POOL_BLOCK_NUM     CONFIG_MESH_VND_POOL_SIZE   // 块数
+#define MESH_POOL_BLOCK_SIZE    VND_DATA_MAX                // 每块的大小：access 层最大的 vendor 数据
+
+typedef struct {
+    uint16_t size;          // 块数
+    uint16_t used;          // 正在使用的块数
+    uint16_t peak;          // 最多同时使用的块数
+    uint32_t fail;          // 没有空闲块的次数
+} mesh_pool_stats_t;
+
+/**
+ * @brief  申请一块（协议栈回调/任务中都可以调用，不阻塞）
+ * @return NULL: 没有空闲块（计入 fail）
+ */
+uint8_t *ble_mesh_pool_alloc(void);
+
+// 申请一块并复制 data（len 不超过 MESH_POOL_BLOCK_SIZE）
+uint8_t *ble_mesh_pool_dup(const uint8_t *data, uint16_t len);
+
+// 释放，buf = NULL 时不处理
+void ble_mesh_pool_free(uint8_t *buf);
+
+void ble_mesh_pool_get_stats(mesh_pool_stats_t *stats);
+
+void ble_mesh_pool_init(void);
+
+#endif /* __BLE_MESH_POOL_H__ */
@@ -0,0 +1,67 @@
+/**
+ * @file    ble_mesh_prov.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 批量配网队列
+ *          一次提交多个 MAC/名称，收到其中任意一个的未配网广播就开始配网，
+ *          最多 MESH_PROV_LINK_MAX 个节点同时配网，每个节点的结果通过回调上报。
+ * @version 0.1
+ * @date    2023-08-22
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_PROV_H__
+#define __BLE_MESH_PROV_H__
+
+#include "ble_mesh.h"
+
+#define MESH_PROV_QUEUE_SIZE        32                              // 同时排队等待配网的节点数
+#define MESH_PROV_LINK_MAX          CONFIG_BLE_MESH_PBA_SAME_TIME   // 同时配网的节点数（协议栈 PB-ADV 链路数）
+#define MESH_PROV_LINK_TIMEOUT      30000                           // 一次配网（开始到完成）的超时/MS，超时后重新等待广播
+#define MESH_PROV_WAIT_TIMEOUT      120000                          // 入队后多久没配网成功就上报失败/MS
+
+typedef struct {
+    uint8_t  addr[6];       /**< 设备MAC地址 */
+    uint16_t uniaddr;       /**< 节点的单播地址，0: 配网失败 */
+} mesh_prov_result_t;
+
+// 一个节点配网完成/失败（在 ble_mesh_handeler_task 中执行）
+typedef void (*ble_mesh_prov_callback_t)(const mesh_prov_result_t *result);
+
+void ble_mesh_prov_register_callback(ble_mesh_prov_callback_t callback);
+
+/**
+ * @brief  加入配网队列，立即返回
+ *
+ * @param addr ：设备MAC地址
+ * @param name ：设备名称
+ * @return ESP_OK: 已加入（已经在队列中也返回成功）；ESP_ERR_NO_MEM: 队列已满
+ */
+esp_err_t ble_mesh_prov_queue_add(const uint8_t addr[6], const char *name);
+
+// 队列中是否还有节点（等待广播或正在配网）
+bool ble_mesh_prov_queue_busy(void);
+
+/* 以下在 ble_mesh.c 的配网回调中调用 */
+
+/**
+ * @brief  收到未配网广播：队列中的设备并且还有空闲链路时开始配网
+ *
+ * @return true: 是队列中的设备（已处理）
+ */
+bool ble_mesh_prov_queue_match(const uint8_t dev_uuid[16], const uint8_t addr[6], uint8_t addr_type,
+                               uint16_t oob_info, uint8_t bearer);
+
+/**
+ * @brief  配网完成（按 Device UUID 匹配）
+ *
+ * @return true: 是队列中的设备
+ */
+bool ble_mesh_prov_queue_complete(const uint8_t dev_uuid[16], uint16_t unicast_addr);
+
+// 配网链路关闭，success = false: 配网失败
+void ble_mesh_prov_queue_link_close(bool success);
+
+// 周期调用（ble_mesh_handeler_task）：绑定配网完成的节点，处理超时，上报结果
+void ble_mesh_prov_queue_process(void);
+
+#endif /* __BLE_MESH_PROV_H__ */
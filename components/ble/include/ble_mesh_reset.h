@@ -0,0 +1,59 @@
+/**
+ * @file    ble_mesh_reset.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 批量解绑（Node Reset 流水线）
+ *          多个节点的 Node Reset 并发发送（最多 MESH_RESET_WINDOW 个等待响应），
+ *          收到响应/超时后删除配网信息，每个节点的结果通过回调上报。
+ * @version 0.1
+ * @date    2023-08-23
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_RESET_H__
+#define __BLE_MESH_RESET_H__
+
+#include "ble_mesh.h"
+
+#define MESH_RESET_WINDOW           4                       // 同时等待 Node Reset 响应的节点数
+#define MESH_RESET_QUEUE_SIZE       CONFIG_MESH_NODE_MAX    // 排队等待解绑的节点数
+#define MESH_RESET_GUARD_TIME       10000                   // 协议栈没有回调时的兜底超时/MS
+
+typedef struct {
+    uint16_t uniaddr;       /**< 节点的单播地址，0x0000: 全部解绑完成（已清空绑定表） */
+    bool     ack;           /**< true: 节点响应了复位；false: 没有响应（只删除本地配网信息） */
+} mesh_reset_result_t;
+
+/**
+ * @brief  一个节点解绑完成（在 ble_mesh_handeler_task 中执行）
+ *
+ * @param result ：解绑结果
+ * @param remain ：还没完成的节点数
+ */
+typedef void (*ble_mesh_reset_callback_t)(const mesh_reset_result_t *result, uint16_t remain);
+
+void ble_mesh_reset_register_callback(ble_mesh_reset_callback_t callback);
+
+/**
+ * @brief  加入解绑队列，立即返回
+ *
+ * @return ESP_OK: 已加入（已经在队列中也返回成功）；ESP_ERR_INVALID_ARG: 不是配网分配的地址；ESP_ERR_NO_MEM: 队列已满
+ */
+esp_err_t ble_mesh_reset_queue_add(uint16_t unicast_addr);
+
+/**
+ * @brief  全部节点加入解绑队列，全部完成后清空绑定表/分组/影子和协议栈的配网信息
+ *
+ * @return 入队的节点数
+ */
+uint16_t ble_mesh_reset_queue_all(void);
+
+// 队列中是否还有节点
+bool ble_mesh_reset_busy(void);
+
+// Node Reset 的响应/超时（在 ble_mesh_config_client_cb 中调用）
+void ble_mesh_reset_status(uint16_t unicast_addr, bool timeout);
+
+// 周期调用（ble_mesh_handeler_task）：发送 Node Reset，删除完成的节点，上报结果
+void ble_mesh_reset_process(void);
+
+#endif /* __BLE_MESH_RESET_H__ */
@@ -0,0 +1,48 @@
+/**
+ * @file    ble_mesh_rx.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 接收环形缓存（单生产者/单消费者，无锁）
+ *          生产者：协议栈回调（BTC任务）；消费者：ble_mesh_handeler_task
+ * @version 0.1
+ * @date    2023-08-09
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_RX_H__
+#define __BLE_MESH_RX_H__
+
+#include "freertos/FreeRTOS.h"
+#include "ble_mesh.h"
+
+#define MESH_RX_RING_SIZE       CONFIG_MESH_RX_RING_SIZE    // 缓存的消息数（向上取2的幂）
+#define MESH_RX_BATCH_SIZE      8                           // 消费者一次最多取出的消息数
+
+typedef struct {
+    uint32_t push;          // 写入的消息数
+    uint32_t drop;          // 缓存满丢弃的消息数
+    uint16_t size;          // 缓存大小
+    uint16_t peak;          // 最多同时缓存的消息数
+} mesh_rx_stats_t;
+
+/**
+ * @brief  写入一条消息（只能在协议栈回调中调用，不阻塞）
+ * @return false: 缓存满，消息被丢弃（计入 drop）
+ */
+bool ble_mesh_rx_push(const mesh_transfer_t *msg);
+
+/**
+ * @brief  批量取出消息，没有消息时最多等待 wait
+ *
+ * @param msg ：至少 max 条消息的缓存
+ * @return 取出的消息数
+ */
+uint8_t ble_mesh_rx_pop(mesh_transfer_t *msg, uint8_t max, TickType_t wait);
+
+// 唤醒消费者（ble_mesh_handeler_task），可以在协议栈回调中调用
+void ble_mesh_rx_wakeup(void);
+
+void ble_mesh_rx_get_stats(mesh_rx_stats_t *stats);
+
+void ble_mesh_rx_init(void);
+
+#endif /* __BLE_MESH_RX_H__ */
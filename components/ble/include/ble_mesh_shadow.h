@@ -0,0 +1,76 @@
+/**
+ * @file    ble_mesh_shadow.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 节点状态影子：缓存节点上报/响应的状态，GET 在有效期内直接用缓存响应
+ * @version 0.1
+ * @date    2023-08-07
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_SHADOW_H__
+#define __BLE_MESH_SHADOW_H__
+
+#include "freertos/FreeRTOS.h"
+#include "ble_mesh.h"
+
+#define MESH_SHADOW_SIZE        (CONFIG_MESH_NODE_MAX * 2)             // 元素数（灯 + vendor 两个元素）
+#define MESH_SHADOW_VND_NUM     4       // 每个元素缓存的 vendor 属性数
+#define MESH_SHADOW_STALE_TIME  CONFIG_MESH_SHADOW_STALE_TIME          // 缓存有效期/MS, 0: 不使用缓存
+
+enum {
+    MESH_SHADOW_ONOFF = 0,  // [onoff]
+    MESH_SHADOW_HSL,        // [H, S, L] 大端
+    MESH_SHADOW_CTL,        // [lightness, temperature] 大端
+    MESH_SHADOW_SIG_NUM
+};
+
+typedef struct {
+    TickType_t tick;                // 更新时间
+    uint8_t    len;                 // 0: 没有数据
+    uint8_t    data[VND_DATA_SIZE]; // 与 mesh_transfer_t.data 格式一致
+} mesh_shadow_state_t;
+
+typedef struct {
+    uint16_t   unicast_addr;        // 0: 空闲
+    TickType_t tick;                // 最后更新时间
+    mesh_shadow_state_t sig[MESH_SHADOW_SIG_NUM];
+    mesh_shadow_state_t vnd[MESH_SHADOW_VND_NUM];   // Genie 属性（ATTR_STATUS 数据，按 mesh_frame_t.opcode 区分）
+} mesh_shadow_t;
+
+/**
+ * @brief  用节点的状态消息（GET/SET 响应、主动上报）更新影子
+ */
+void ble_mesh_shadow_update(const mesh_transfer_t *status);
+
+/**
+ * @brief  发出 SET 后，目标的状态未知，先让缓存失效（组播地址：全部节点）
+ */
+void ble_mesh_shadow_invalidate(uint16_t dst_addr, uint32_t opcode);
+
+/**
+ * @brief  用影子响应 GET
+ *
+ * @param msg ：GET 消息
+ * @param status ：与协议栈响应相同格式的状态数据
+ * @return true: 缓存在有效期内；false: 需要发到节点
+ */
+bool ble_mesh_shadow_get(const mesh_msg_t *msg, mesh_transfer_t *status);
+
+/**
+ * @brief  读取一个元素的影子（不管是否过期）
+ */
+bool ble_mesh_shadow_read(uint16_t unicast_addr, mesh_shadow_t *shadow);
+
+/**
+ * @brief  删除节点的影子
+ *
+ * @param unicast_addr ：节点的主元素地址
+ * @param elem_num ：节点的元素数
+ */
+void ble_mesh_shadow_remove(uint16_t unicast_addr, uint8_t elem_num);
+
+void ble_mesh_shadow_remove_all(void);
+
+void ble_mesh_shadow_init(void);
+
+#endif /* __BLE_MESH_SHADOW_H__ */
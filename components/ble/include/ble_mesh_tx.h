@@ -0,0 +1,52 @@
+/**
+ * @file    ble_mesh_tx.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   ble mesh 异步发送引擎（多目标并发，按 地址 + 操作码 匹配响应）
+ * @version 0.1
+ * @date    2023-08-02
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __BLE_MESH_TX_H__
+#define __BLE_MESH_TX_H__
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "ble_mesh.h"
+
+#define MESH_TX_WINDOW_SIZE     8       // 同时等待响应的消息数（每个目标地址最多一条）
+#define MESH_TX_QUEUE_SIZE      32      // 排队等待发送的消息数
+#define MESH_TX_GUARD_TIME      500     // 协议栈没有回调时的兜底超时余量/MS（兜底超时 = 2 * 超时时间 + 余量）
+#define MESH_TX_SUBMIT_WAIT     3500    // 排队已满时提交最多等待的时间/MS
+#define MESH_TX_SYNC_SLOT       200     // 同步执行：估算一个发送窗口的消息发出并响应的时间/MS
+
+/**
+ * @brief  发送完成回调（在发送引擎任务中执行，不要在回调里阻塞太久）
+ *
+ * @param msg ：提交的消息（tid 已由引擎分配）
+ * @param err ：ESP_OK: 成功；ESP_ERR_TIMEOUT: 超时；ESP_ERR_NOT_SUPPORTED: 节点没有这个模型；其他: 发送失败
+ * @param status ：节点响应的数据（组播或无响应数据时为NULL），status->ext 在回调返回后释放，要保留就复制
+ * @param arg ：提交时传入的用户参数
+ */
+typedef void (*ble_mesh_tx_callback_t)(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg);
+
+// msg->ext（长数据，缓存池的块）由发送引擎释放，提交失败也一样
+esp_err_t ble_mesh_tx_submit(const mesh_msg_t *msg, ble_mesh_tx_callback_t callback, void *arg);
+
+// 取出一条迟到的响应（请求已经超时完成），按节点上报处理；status->ext 由调用者释放
+bool ble_mesh_tx_late_pop(mesh_transfer_t *status);
+
+// 是否在发送引擎任务中（完成回调里）：不能同步等待发送完成
+bool ble_mesh_tx_in_engine(void);
+
+/**
+ * @brief  同步执行：给一批 num 条 SET 算一个共同的执行时间（填到 mesh_msg_t.apply_tick）
+ *         发送引擎在每条消息实际发出时用剩下的时间作为 Delay，节点收到后在同一时间执行
+ */
+TickType_t ble_mesh_tx_sync_tick(uint16_t num);
+
+void ble_mesh_tx_complete(const mesh_transfer_t *status, esp_err_t err);
+
+void ble_mesh_tx_init(void);
+
+#endif /* __BLE_MESH_TX_H__ */
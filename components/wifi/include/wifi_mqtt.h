@@ -10,6 +10,7 @@
 #ifndef __WIFI_MQTT_H__
 #define __WIFI_MQTT_H__
 
+#include "esp_err.h"
 #include "cJSON.h"
 
 #include "wifi_nvs.h"
@@ -17,21 +18,100 @@
 #define MQTT_RX_BUFF_SIZE      1024
 #define MQTT_TX_BUFF_SIZE      1024
 
+#define MQTT_RX_MSG_MAX        8192    // 一条订阅消息的最大长度（分片重组后，比如场景配置）
+#define MQTT_RX_POOL_NUM       4       // 接收缓存块数（PSRAM），也是接收队列的长度
+
+#define MQTT_ROUTE_MAX         8       // 主题路由表大小（订阅的主题过滤器数）
+#define MQTT_TOPIC_LEN         64      // 主题/过滤器的最大长度（含'\0'），超长的主题截断后交给回调
+#define MQTT_TOPIC_LEVEL_MAX   8       // 过滤器的最大层数
+
+#define MQTT_CORRELATION_LEN   16      // 收到的 MQTT 5 Correlation Data 的最大长度（含'\0'），云端的"mid"
+
+#define MQTT_V5_TOPIC_ALIAS    1       // MQTT 5：上报主题的别名
+#define MQTT_V5_ALIAS_MAX      4       // MQTT 5：允许服务器给下发主题使用的别名数
+#define MQTT_V5_MESSAGE_EXPIRY 60      // MQTT 5：上报消息的过期时间/S（服务器超时没转发就丢弃）
+#define MQTT_V5_SESSION_EXPIRY 300     // MQTT 5：断开后服务器保留会话的时间/S（期间的指令按云端设置的过期时间丢弃）
+
+#define MQTT_OUTBOX_SIZE       16      // 同时在途（等待 PUBACK）的 QoS1/2 发布数
+#define MQTT_OUTBOX_TIMEOUT    10000   // 等待 PUBACK 的超时/MS（只计入统计，客户端仍会重发，继续等待结果）
+// 超过这个时间还没有结果（PUBLISHED/DELETED），当作客户端已经删除了这条消息：客户端发送缓存的过期时间 + PUBACK 超时
+#ifdef CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS
+#define MQTT_OUTBOX_EXPIRE     (CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS + MQTT_OUTBOX_TIMEOUT)
+#else
+#define MQTT_OUTBOX_EXPIRE     (30000 + MQTT_OUTBOX_TIMEOUT)
+#endif
+
 typedef struct {
     char cloud[26];
     char local[26];
     char sntp[17];
+    char metrics[28];
     uint8_t qos;
 } mqtt_topic_t;
 
 typedef struct {
     uint8_t   *data;
     uint16_t  len;
+    char      *topic;   // 消息的主题（在接收缓存块内，以'\0'结尾）
+    char      *wild;    // 主题中第一个通配符匹配到的部分（到主题末尾），过滤器没有通配符时指向'\0'
+    char      *correlation;  // MQTT 5 的 Correlation Data（以'\0'结尾），没有/太长时为""
+    uint8_t   route;    // 匹配到的路由序号
 } mqtt_data_t;
 
+// data/topic 是接收缓存的块（以'\0'结尾，可以原地修改），回调返回后就释放，要保留就复制
 typedef void (*mqtt_callback_t)(mqtt_data_t);
 
+/**
+ * @brief  主题路由回调（在 MQTT 订阅任务中执行）
+ *
+ * @param data ：消息，data.wild 比如 "yiree/<id>/node/+" 收到 "yiree/<id>/node/0x0005" 时为 "0x0005"
+ * @param arg ：注册时传入的用户参数
+ */
+typedef void (*mqtt_route_handler_t)(mqtt_data_t data, void *arg);
+
+typedef struct {
+    uint32_t msg;       // 收到的完整消息数
+    uint32_t chunk;     // 分片重组的消息数
+    uint32_t drop;      // 丢弃的消息数（没有空闲块/队列已满/分片不完整）
+    uint32_t oversize;  // 超过 MQTT_RX_MSG_MAX 丢弃的消息数
+    uint32_t unroute;   // 没有匹配的路由丢弃的消息数
+    uint16_t peak;      // 最多同时使用的接收缓存块数
+} mqtt_rx_stats_t;
+
+/**
+ * @brief  发布完成回调（一般在 MQTT 事件任务中执行，不要阻塞）
+ *
+ * @param msg_id ：app_mqtt_publish_cloud_async() 返回的消息ID
+ * @param ok ：true: 收到 PUBACK/PUBCOMP（QoS0 放进发送缓存即成功）；
+ *             false: 被客户端删除（过期），或者超过 MQTT_OUTBOX_EXPIRE 没有结果（PUBACK 超时不回调，客户端还在重发）
+ * @param arg ：发布时传入的用户参数
+ */
+typedef void (*mqtt_publish_callback_t)(int msg_id, bool ok, void *arg);
+
+typedef struct {
+    uint32_t publish;   // 放进发送缓存的消息数
+    uint32_t ack;       // 收到 PUBACK 的消息数
+    uint32_t timeout;   // 等待 PUBACK 超时的消息数（客户端仍会重发，之后还会计入 ack/drop）
+    uint32_t drop;      // 被客户端删除/超过 MQTT_OUTBOX_EXPIRE 放弃的消息数
+    uint32_t full;      // 在途已满被拒绝的消息数
+    uint16_t inflight;  // 正在等待 PUBACK 的消息数
+    uint16_t peak;      // 最多同时在途的消息数
+} mqtt_outbox_stats_t;
+
+// 没有注册处理函数的路由（默认的 local/sntp 主题）交给这个回调
 void mqtt_subscribe_register_callback(mqtt_callback_t callback_func);
+
+/**
+ * @brief  注册主题路由：连接成功后订阅过滤器，收到的消息按主题分发给 handler
+ *         过滤器在注册时按层编译（只解析一次），收到消息时只比较各层，不用解析 JSON 判断消息类型；
+ *         同一个过滤器重复注册只更新 handler；多个过滤器匹配同一个主题时按注册顺序取第一个。
+ *
+ * @param filter ："~" 开头表示本网关的主题前缀 "yiree/<client_id>"，支持 '+'/'#' 通配符（需要占满一层）
+ * @param handler ：NULL: 交给 mqtt_subscribe_register_callback() 的回调
+ * @return ESP_OK；ESP_ERR_INVALID_ARG: 过滤器格式错误/太长；ESP_ERR_NO_MEM: 路由表已满；
+ *         ESP_ERR_INVALID_STATE: 在 app_mqtt_init() 之前使用了 "~"
+ */
+esp_err_t app_mqtt_route_register(const char *filter, mqtt_route_handler_t handler, void *arg);
  
 void app_mqtt_init(nvs_mqtt_t *nvs_mqtt);
 
@@ -39,7 +119,26 @@ bool app_mqtt_client_reconnect(nvs_mqtt_t nvs_mqtt);
 
 int app_mqtt_publish_topo(const char *data, uint16_t len);
 
+// 发布到云端主题，不等待发布完成；return: 消息ID（>= 0），< 0: 失败
 int app_mqtt_publish_cloud(const char *data, uint16_t len);
+
+/**
+ * @brief  异步发布到云端主题：放进 MQTT 客户端的发送缓存后立即返回，按消息ID跟踪 PUBACK
+ *
+ * @param mid ：消息ID，MQTT 5 时放在 Correlation Data 中（消息体不用带"mid"），NULL/"0": 没有
+ * @param callback ：发布完成回调，可以为 NULL；返回值 < 0 时不会回调
+ * @return 消息ID（>= 0）；-1: WIFI未连接；-2: MQTT没有连接；-3: 在途已满；-4: 客户端拒绝
+ */
+int app_mqtt_publish_cloud_async(const char *data, uint16_t len, const char *mid, mqtt_publish_callback_t callback, void *arg);
+
+// 当前连接是否使用 MQTT 5（nvs_mqtt_t.protocol 为 MQTT_VERSION_5，并且没有回落到 3.1.1）
+bool app_mqtt_v5_status(void);
+
+void app_mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
+
+void app_mqtt_rx_get_stats(mqtt_rx_stats_t *stats);
+
+int app_mqtt_publish_metrics(const char *data, uint16_t len);
  
 bool mqtt_connect_status(uint32_t wait_time);
 
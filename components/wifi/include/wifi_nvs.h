@@ -31,6 +31,9 @@ typedef struct {
     char  username[32];         /**< MQTT user name. */
     char  userword[16];         /**< MQTT user password. */
     uint8_t qos;                /**< MQTT user qos. */
+#define MQTT_VERSION_311 0x00   // MQTT 3.1.1（旧的配置没有这个字段，为 0）
+#define MQTT_VERSION_5   0x05   // MQTT 5（需要 CONFIG_MQTT_PROTOCOL_5，服务器拒绝时回落到 3.1.1）
+    uint8_t protocol;           /**< MQTT protocol version. */
 } nvs_mqtt_t;
 
 esp_err_t nvs_wifi_handle(nvs_wifi_t *nvs, nvs_open_mode_t nvs_open_mode);
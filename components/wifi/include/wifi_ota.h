@@ -34,6 +34,8 @@ typedef struct {
     uint16_t size;  /**< Size */
     uint8_t  data[OTA_PACKET_SIZE]; /**< Firmware */
 }  __attribute__((packed)) ota_packet_t;
+
+#define OTA_NODE_IMAGE_MAX  (1024 * 1024)  /**< mesh 节点固件的最大长度（下载到 PSRAM） */
  
 void app_get_self_info(self_info_t *self);
  
@@ -49,4 +51,10 @@ uint8_t esp_read_chip_name(const char *dev_name, char *name);
 
 uint8_t *app_get_ota_addr(void);
 
+// mesh 节点的固件（OTA进度为200时下载完成），NULL: 没有
+const uint8_t *wifi_ota_node_image(uint32_t *size);
+
+// 分发完成后释放节点固件，释放前不能开始新的OTA
+void wifi_ota_node_image_release(void);
+
 #endif  /* __WIFI_OTA_H__ END. */
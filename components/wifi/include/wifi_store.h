@@ -0,0 +1,62 @@
+/**
+ * @file    wifi_store.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   离线上报缓存（store-and-forward）
+ *          WIFI/服务器断开时，上报给云端的消息追加写入 SPIFFS 的日志文件，重连后按批限速补发；
+ *          同一个 地址 + 键值名 只补发最新的状态（JSON 对象按成员合并，比如 "online":{"0x0005":1}）；
+ *          每条消息带产生时的序号，比同一个键最后一次在线上报更早的不再补发。
+ * @version 0.1
+ * @date    2023-08-30
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __WIFI_STORE_H__
+#define __WIFI_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WIFI_STORE_LOG_FILE         "/spiffs/uplink.log"    // 离线时追加写入
+#define WIFI_STORE_OLD_FILE         "/spiffs/uplink.old"    // 正在补发的日志（补发完删除，掉电后重新补发）
+#define WIFI_STORE_LOG_MAX          (64 * 1024)             // 日志超过这个大小就合并压缩
+#define WIFI_STORE_LINE_MAX         2048                    // 一条记录的最大长度（键 + JSON）
+#define WIFI_STORE_KEY_SIZE         48                      // 键："地址|键值名"
+#define WIFI_STORE_KEY_ONCE         '!'                     // 以它开头的键不合并（云端指令的应答，每个"mid"都要补发）
+#define WIFI_STORE_KEY_MAX          128                     // 最多保留多少个键的最新状态（超过丢弃最旧的）
+#define WIFI_STORE_REPLAY_BATCH     5                       // 每批补发的消息数
+#define WIFI_STORE_REPLAY_INTERVAL  1000                    // 两批之间的间隔/MS
+#define WIFI_STORE_QUEUE_LEN        16                      // 等待补发任务写入日志的消息数（满了丢弃）
+
+typedef struct {
+    uint32_t append;    // 写入日志的消息数
+    uint32_t replay;    // 补发的消息数
+    uint32_t merge;     // 合并掉的旧状态数（写入 - 补发 - 丢弃）
+    uint32_t stale;     // 比在线上报更早、不再补发的消息数
+    uint32_t drop;      // 超过 WIFI_STORE_KEY_MAX/队列已满/写文件失败丢弃的消息数
+    uint32_t compact;   // 日志合并压缩的次数
+    uint16_t pending;   // 等待补发的消息数
+} wifi_store_stats_t;
+
+/**
+ * @brief  离线时写入一条上报消息：复制后投递给补发任务，由补发任务追加到日志/合并压缩，调用者不等待文件读写
+ *
+ * @param key ：合并用的键，"地址|键值名"；WIFI_STORE_KEY_ONCE 开头的不合并
+ * @param data ：完整的上报 JSON 字符串（一行，不含换行）
+ * @param seq ：消息产生时的序号（wifi_store_supersede() 的返回值），0: 现在产生的
+ */
+void wifi_store_append(const char *key, const char *data, uint32_t seq);
+
+/**
+ * @brief  在线直接上报时调用：同一个键更早的消息不再补发（等待补发的、队列中的、日志中的），避免旧状态覆盖新状态
+ *
+ * @param key ：同 wifi_store_append()；WIFI_STORE_KEY_ONCE 开头的键只分配序号
+ * @return 这条消息的序号（发布最终失败、写入离线缓存时传给 wifi_store_append()）
+ */
+uint32_t wifi_store_supersede(const char *key);
+
+void wifi_store_get_stats(wifi_store_stats_t *stats);
+
+// 在 hal_spiffs_init() 之后调用：创建补发任务，上次没补发完的日志重连后继续补发
+void wifi_store_init(void);
+
+#endif /* __WIFI_STORE_H__ */
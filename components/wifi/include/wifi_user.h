@@ -11,6 +11,7 @@
 #define __WIFI_USER_H__
 
 #include "nvs.h"
+#include "cJSON.h"
  
 #include "wifi_sntp.h"
 
@@ -24,7 +25,11 @@ void app_mwifi_update_time(void);
 
 int app_upper_cloud_write(const char *data, uint16_t len);
 
-bool app_upper_cloud_format(uint16_t dst_addr, const char *mid, const char *opcode, void *value, uint8_t size);
+bool app_upper_cloud_online(void);
+
+bool app_upper_cloud_format(uint16_t dst_addr, const char *mid, const char *opcode, void *value, uint16_t size);
+
+bool app_upper_cloud_object(const char *addr, const char *mid, const char *opcode, cJSON *value);
 
 uint8_t sntp_str_systime(char *timestr);
  
@@ -12,12 +12,16 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_mac.h"
 #include "esp_netif.h"
 #include "mqtt_client.h"
+#ifdef CONFIG_MQTT_PROTOCOL_5
+#include "mqtt5_client.h"
+#endif
 
 #include "wifi_mqtt.h"
 #include "wifi_init.h"
@@ -71,10 +75,8 @@ static esp_mqtt_client_config_t mqtt_cfg = {
 static const uint8_t MQTT_CONNECTED_EVENT     = BIT0;        // MQTT连接成功
 static const uint8_t MQTT_DISCONNECTED_EVENT  = BIT1;        // MQTT断开成功
 static const uint8_t MQTT_RECONNECT_EVENT     = BIT2;        // MQTT使能重连
-static const uint8_t MQTT_PUBLISHED_EVENT     = BIT4;        // MQTT发布成功
 static EventGroupHandle_t xEvent = NULL;
 static QueueHandle_t xQueue = NULL;     
-static mqtt_data_t mqtx = { 0 }; 
 
 static bool mqtt_event_wait(const uint8_t event, uint32_t wait_time)
 {
@@ -109,24 +111,589 @@ static bool esp_mqtt_client_switch(bool status)
     return mqtt_switch;
 }
 
-int app_mqtt_publish_cloud(const char *data, uint16_t len)
+//================================================================================================================
+// MQTT 5：nvs_mqtt_t.protocol = MQTT_VERSION_5 时使用，服务器不支持（CONNACK 拒绝协议版本）时回落到 3.1.1。
+// - 上报主题 QoS0 使用主题别名：每次连接的第一条带完整主题 + 别名，之后主题为空只带别名。别名只在本次连接有效，
+//   所以这些消息直接写到连接上（esp_mqtt_client_publish），不放进发送缓存，不会在下一次连接上重发；
+//   QoS1/2 的消息断线后会重发，始终带完整主题。
+// - "mid" 放在 Correlation Data 中；上报消息设置 Message Expiry；
+// - 会话保留 MQTT_V5_SESSION_EXPIRY，断线期间云端的指令由云端设置的 Message Expiry 决定是否过期丢弃。
+// 发布属性只对下一次发布有效，设置和发布之间不能插入其他任务的发布：MQTT 5 的发布都在 xPublishMutex 中。
+//================================================================================================================
+static bool mqtt_v5 = false;  // 当前配置使用 MQTT 5
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+#define MQTT_V5_REFUSE_PROTOCOL  0x84  // CONNACK: Unsupported Protocol Version
+
+enum {
+    MQTT_ALIAS_NONE = 0,    // 本次连接还没有建立别名：下一条带完整主题
+    MQTT_ALIAS_READY,       // 已经建立：只带别名
+    MQTT_ALIAS_OFF,         // 服务器不支持（本次连接不再使用）
+};
+
+static uint8_t  mqtt_alias_state = MQTT_ALIAS_NONE;
+static uint32_t mqtt_connect_seq = 0;     // 连接次数，别名属于哪一次连接
+static bool     mqtt_v5_fallback = false; // 服务器拒绝了 MQTT 5，等订阅任务回落到 3.1.1
+static SemaphoreHandle_t xPublishMutex = NULL;
+#endif
+
+// 按配置设置协议版本（在 esp_mqtt_client_init()/esp_mqtt_set_config() 之前调用）
+static void mqtt_protocol_config(uint8_t protocol)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    mqtt_v5 = (protocol == MQTT_VERSION_5);
+#else
+    if (protocol == MQTT_VERSION_5) {
+        #ifdef TAG
+        ESP_LOGW(TAG, "CONFIG_MQTT_PROTOCOL_5 not enabled, use MQTT 3.1.1");
+        #endif
+    }
+    mqtt_v5 = false;
+#endif
+    mqtt_cfg.session.protocol_ver = mqtt_v5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+    mqtt_cfg.session.disable_clean_session = mqtt_v5;  // MQTT 5 保留会话（由 Session Expiry 限定时间）
+}
+
+// 连接属性（在 esp_mqtt_client_init()/esp_mqtt_set_config() 之后调用）
+static void mqtt_protocol_connect_property(void)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (mqtt_v5 == false) return;
+    esp_mqtt5_connection_property_config_t property = {
+        .session_expiry_interval = MQTT_V5_SESSION_EXPIRY,
+        .topic_alias_maximum     = MQTT_V5_ALIAS_MAX,  // 下发主题也可以用别名
+        .request_problem_info    = true,
+    };
+    esp_mqtt5_client_set_connect_property(mqtt_handle, &property);
+#endif
+}
+
+bool app_mqtt_v5_status(void)
+{
+    return mqtt_v5;
+}
+
+/**
+ * @brief  发布（MQTT 5 时带上发布属性；上报主题 QoS0 使用主题别名）
+ * @param mid ：消息ID（MQTT 5 的 Correlation Data），NULL/"0": 没有
+ * @return 消息ID，< 0: 失败
+ */
+static int mqtt_publish_topic(const char *topic, const char *data, uint16_t len, uint8_t qos, const char *mid)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (mqtt_v5 == true) {
+        esp_mqtt5_publish_property_config_t property = {
+            .message_expiry_interval = MQTT_V5_MESSAGE_EXPIRY,
+        };
+        if (mid != NULL && strcmp(mid, "0") != 0) {
+            property.correlation_data = mid;
+            property.correlation_data_len = strlen(mid);
+        }
+        int msg_id = -1;
+        xSemaphoreTake(xPublishMutex, portMAX_DELAY);
+        if (qos == 0 && topic == mqtt_topic.cloud && mqtt_alias_state != MQTT_ALIAS_OFF) {
+            uint32_t seq = mqtt_connect_seq;
+            bool ready = (mqtt_alias_state == MQTT_ALIAS_READY);
+            property.topic_alias = MQTT_V5_TOPIC_ALIAS;
+            esp_mqtt5_client_set_publish_property(mqtt_handle, &property);
+            msg_id = esp_mqtt_client_publish(mqtt_handle, ready ? "" : topic, data, len, 0, 0);
+            if (seq == mqtt_connect_seq) {  // 发布期间没有重连
+                if (msg_id >= 0) mqtt_alias_state = MQTT_ALIAS_READY;
+                else if (ready) mqtt_alias_state = MQTT_ALIAS_NONE;  // 下一条重新带完整主题
+                else mqtt_alias_state = MQTT_ALIAS_OFF;  // 带完整主题也失败：服务器不支持别名（重连时复位）
+            }
+            property.topic_alias = 0;
+        }
+        if (msg_id < 0) {  // 不用别名：放进发送缓存
+            esp_mqtt5_client_set_publish_property(mqtt_handle, &property);
+            msg_id = esp_mqtt_client_enqueue(mqtt_handle, topic, data, len, qos, 0, true);
+        }
+        xSemaphoreGive(xPublishMutex);
+        return msg_id;
+    }
+#endif
+    return esp_mqtt_client_enqueue(mqtt_handle, topic, data, len, qos, 0, true);
+}
+
+//================================================================================================================
+// 发布缓存：消息用 esp_mqtt_client_enqueue() 放进客户端的发送缓存（由 MQTT 任务发送），调用者不等待；
+// QoS1/2 按 msg_id 记录在 mqtt_outbox[]，收到 PUBACK（MQTT_EVENT_PUBLISHED）/被删除（MQTT_EVENT_DELETED）后回调；
+// PUBACK 超时只计入统计（客户端还在重发），继续等待，超过 MQTT_OUTBOX_EXPIRE 才放弃。
+// PUBACK 可能在 enqueue 返回、记录 msg_id 之前就到了，先放到 mqtt_early_ack[]，记录时再匹配。
+//================================================================================================================
+#define MQTT_EARLY_ACK_NUM     4
+
+typedef struct {
+    int        msg_id;      // 0: 空闲；-1: 已占用，还没拿到 msg_id
+    TickType_t deadline;    // PUBACK 超时时间；late 之后是放弃的时间
+    bool       late;        // PUBACK 已经超时，客户端还在重发
+    mqtt_publish_callback_t callback;
+    void      *arg;
+} mqtt_outbox_t;
+
+static mqtt_outbox_t mqtt_outbox[MQTT_OUTBOX_SIZE];
+static int mqtt_early_ack[MQTT_EARLY_ACK_NUM];
+static uint8_t mqtt_early_head = 0;
+static mqtt_outbox_stats_t outbox_stats = { 0 };
+static portMUX_TYPE outbox_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static mqtt_outbox_t *mqtt_outbox_alloc(void)
+{
+    mqtt_outbox_t *slot = NULL;
+    taskENTER_CRITICAL(&outbox_lock);
+    for (uint8_t i = 0; i < MQTT_OUTBOX_SIZE; i++) {
+        if (mqtt_outbox[i].msg_id != 0) continue;
+        slot = &mqtt_outbox[i];
+        slot->msg_id = -1;
+        if (++outbox_stats.inflight > outbox_stats.peak) outbox_stats.peak = outbox_stats.inflight;
+        break;
+    }
+    if (slot == NULL) outbox_stats.full++;
+    taskEXIT_CRITICAL(&outbox_lock);
+    return slot;
+}
+
+// 调用者拿到 msg_id 后记录，return: true: PUBACK 已经先到了
+static bool mqtt_outbox_commit(mqtt_outbox_t *slot, int msg_id, mqtt_publish_callback_t callback, void *arg)
+{
+    bool acked = false;
+    taskENTER_CRITICAL(&outbox_lock);
+    outbox_stats.publish++;
+    for (uint8_t i = 0; i < MQTT_EARLY_ACK_NUM; i++) {
+        if (mqtt_early_ack[i] != msg_id) continue;
+        mqtt_early_ack[i] = 0;
+        acked = true;
+        break;
+    }
+    if (acked) {
+        slot->msg_id = 0;
+        outbox_stats.inflight--;
+        outbox_stats.ack++;
+    } else {
+        slot->callback = callback;
+        slot->arg = arg;
+        slot->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(MQTT_OUTBOX_TIMEOUT);
+        slot->late = false;
+        slot->msg_id = msg_id;
+    }
+    taskEXIT_CRITICAL(&outbox_lock);
+    return acked;
+}
+
+static void mqtt_outbox_release(mqtt_outbox_t *slot)
+{
+    taskENTER_CRITICAL(&outbox_lock);
+    slot->msg_id = 0;
+    outbox_stats.inflight--;
+    taskEXIT_CRITICAL(&outbox_lock);
+}
+
+// PUBACK/被丢弃（MQTT 事件任务中调用）
+static void mqtt_outbox_finish(int msg_id, bool ok)
+{
+    mqtt_outbox_t slot = { 0 };
+    taskENTER_CRITICAL(&outbox_lock);
+    for (uint8_t i = 0; i < MQTT_OUTBOX_SIZE; i++) {
+        if (mqtt_outbox[i].msg_id != msg_id) continue;
+        slot = mqtt_outbox[i];
+        mqtt_outbox[i].msg_id = 0;
+        outbox_stats.inflight--;
+        if (ok) outbox_stats.ack++;
+        else outbox_stats.drop++;
+        break;
+    }
+    if (slot.msg_id == 0 && ok) {  // 还没记录（或者已经超时）
+        mqtt_early_ack[mqtt_early_head] = msg_id;
+        mqtt_early_head = (mqtt_early_head + 1) % MQTT_EARLY_ACK_NUM;
+    }
+    taskEXIT_CRITICAL(&outbox_lock);
+    if (slot.msg_id != 0 && slot.callback != NULL) {
+        slot.callback(msg_id, ok, slot.arg);
+    }
+}
+
+// PUBACK 超时只记下来（客户端重连后仍会重发，还会有 PUBLISHED/DELETED）；超过 MQTT_OUTBOX_EXPIRE 才通知调用者失败
+static void mqtt_outbox_check_timeout(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i = 0; i < MQTT_OUTBOX_SIZE; i++) {
+        mqtt_outbox_t slot = { 0 };
+        bool timeout = false;
+        taskENTER_CRITICAL(&outbox_lock);
+        if (mqtt_outbox[i].msg_id > 0 && (int32_t)(mqtt_outbox[i].deadline - now) <= 0) {
+            if (mqtt_outbox[i].late == false) {
+                mqtt_outbox[i].late = true;
+                mqtt_outbox[i].deadline = now + pdMS_TO_TICKS(MQTT_OUTBOX_EXPIRE - MQTT_OUTBOX_TIMEOUT);
+                outbox_stats.timeout++;
+                timeout = true;
+                slot.msg_id = mqtt_outbox[i].msg_id;
+            } else {
+                slot = mqtt_outbox[i];
+                mqtt_outbox[i].msg_id = 0;
+                outbox_stats.inflight--;
+                outbox_stats.drop++;
+            }
+        }
+        taskEXIT_CRITICAL(&outbox_lock);
+        if (slot.msg_id > 0) {
+            #ifdef TAG
+            ESP_LOGW(TAG, "publish msg_id=%d %s", slot.msg_id, timeout ? "timeout" : "expired");
+            #endif
+            if (timeout == false && slot.callback != NULL) slot.callback(slot.msg_id, false, slot.arg);
+        }
+    }
+}
+
+void app_mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats)
+{
+    taskENTER_CRITICAL(&outbox_lock);
+    *stats = outbox_stats;
+    taskEXIT_CRITICAL(&outbox_lock);
+}
+
+static int mqtt_publish_cloud(const char *data, uint16_t len, const char *mid, mqtt_publish_callback_t callback, void *arg)
 {
     if (wifi_connect_status(0) == false) return -1;  // WIFI未连接
     if (mqtt_connect_status(0) == false) return -2;  // MQTT没有连接上
     #if 1 // #ifdef WIFI_MQTT_DEBUG_ENABLE    
     ESP_LOGI(TAG, "app_mqtt_publish_cloud = %s | %d", data, len);
     #endif
-    xEventGroupClearBits(xEvent, MQTT_PUBLISHED_EVENT);
-    esp_mqtt_client_publish(mqtt_handle, mqtt_topic.cloud, data, len, mqtt_topic.qos, 0);
-    return mqtt_event_wait(MQTT_PUBLISHED_EVENT, 300);
+    mqtt_outbox_check_timeout();
+    uint8_t qos = mqtt_topic.qos;
+    if (qos == 0) {  // 没有 PUBACK：放进发送缓存即完成
+        int msg_id = mqtt_publish_topic(mqtt_topic.cloud, data, len, 0, mid);
+        if (msg_id < 0) return -4;
+        taskENTER_CRITICAL(&outbox_lock);
+        outbox_stats.publish++;
+        taskEXIT_CRITICAL(&outbox_lock);
+        if (callback != NULL) callback(msg_id, true, arg);
+        return msg_id;
+    }
+    mqtt_outbox_t *slot = mqtt_outbox_alloc();
+    if (slot == NULL) {
+        #ifdef TAG
+        ESP_LOGW(TAG, "outbox full, inflight %d", MQTT_OUTBOX_SIZE);
+        #endif
+        return -3;
+    }
+    int msg_id = mqtt_publish_topic(mqtt_topic.cloud, data, len, qos, mid);
+    if (msg_id <= 0) {
+        mqtt_outbox_release(slot);
+        return -4;
+    }
+    if (mqtt_outbox_commit(slot, msg_id, callback, arg) && callback != NULL) {
+        callback(msg_id, true, arg);
+    }
+    return msg_id;
+}
+
+int app_mqtt_publish_cloud_async(const char *data, uint16_t len, const char *mid, mqtt_publish_callback_t callback, void *arg)
+{
+    return mqtt_publish_cloud(data, len, mid, callback, arg);
+}
+
+int app_mqtt_publish_cloud(const char *data, uint16_t len)
+{
+    return mqtt_publish_cloud(data, len, NULL, NULL, NULL);
+}
+
+// 收发统计：QOS0，不等待发布完成（丢了等下一个周期）
+int app_mqtt_publish_metrics(const char *data, uint16_t len)
+{
+    if (wifi_connect_status(0) == false) return -1;  // WIFI未连接
+    if (mqtt_connect_status(0) == false) return -2;  // MQTT没有连接上
+    return mqtt_publish_topic(mqtt_topic.metrics, data, len, 0, NULL);
 }
  
  
 
-//================================================================================================================
 //================================================================================================================
 static mqtt_callback_t mqtt_subscribe_callback_func = NULL; 
 
+//================================================================================================================
+// 主题路由：过滤器注册时按层编译（每层的偏移/长度、第一个通配符的层），收到消息的第一个分片时
+// 把主题切一次层，和各个过滤器逐层比较，没有匹配的消息不申请接收缓存。
+//================================================================================================================
+#define MQTT_ROUTE_NO_WILD  0xFF
+
+typedef struct {
+    char     filter[MQTT_TOPIC_LEN];
+    uint8_t  len;
+    uint8_t  start[MQTT_TOPIC_LEVEL_MAX];   // 每层在 filter 中的偏移
+    uint8_t  size[MQTT_TOPIC_LEVEL_MAX];    // 每层的长度
+    uint8_t  level_num;
+    uint8_t  wild;      // 第一个通配符所在的层，MQTT_ROUTE_NO_WILD: 没有通配符（整个主题比较）
+    bool     multi;     // 最后一层是 '#'
+    mqtt_route_handler_t handler;
+    void    *arg;
+} mqtt_route_t;
+
+static mqtt_route_t mqtt_route[MQTT_ROUTE_MAX];
+static uint8_t mqtt_route_num = 0;  // 先写好表项再加一，事件任务只读前 mqtt_route_num 项
+static portMUX_TYPE route_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool mqtt_route_compile(mqtt_route_t *route)
+{
+    const char *f = route->filter;
+    uint8_t s = 0;
+    route->level_num = 0;
+    route->wild  = MQTT_ROUTE_NO_WILD;
+    route->multi = false;
+    for (uint8_t i = 0; i <= route->len; i++) {
+        if (f[i] != '/' && f[i] != '\0') continue;
+        if (route->level_num >= MQTT_TOPIC_LEVEL_MAX || route->multi) return false;  // '#' 只能在最后一层
+        uint8_t n = i - s;
+        bool plus = (n == 1 && f[s] == '+');
+        bool hash = (n == 1 && f[s] == '#');
+        if (plus == false && hash == false && (memchr(f + s, '+', n) != NULL || memchr(f + s, '#', n) != NULL)) {
+            return false;  // 通配符要占满一层
+        }
+        if ((plus || hash) && route->wild == MQTT_ROUTE_NO_WILD) route->wild = route->level_num;
+        route->multi = hash;
+        route->start[route->level_num] = s;
+        route->size[route->level_num]  = n;
+        route->level_num++;
+        s = i + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief  主题匹配路由
+ * @param topic ：主题（不要求'\0'结尾）
+ * @param wild ：返回第一个通配符匹配到的部分在主题中的偏移（没有通配符时为 len）
+ * @return 路由序号，-1: 没有匹配
+ */
+static int8_t mqtt_route_match(const char *topic, uint16_t len, uint16_t *wild)
+{
+    uint16_t start[MQTT_TOPIC_LEVEL_MAX + 2];
+    uint8_t num = 0;  // 层数，超过 MQTT_TOPIC_LEVEL_MAX 时只切到 MQTT_TOPIC_LEVEL_MAX + 1（只有 '#' 能匹配）
+    start[num++] = 0;
+    for (uint16_t i = 0; i < len && num <= MQTT_TOPIC_LEVEL_MAX; i++) {
+        if (topic[i] == '/') start[num++] = i + 1;
+    }
+    start[num] = len + 1;  // 最后一层的结尾
+
+    uint8_t route_num = mqtt_route_num;
+    for (uint8_t r = 0; r < route_num; r++) {
+        const mqtt_route_t *route = &mqtt_route[r];
+        if (route->wild == MQTT_ROUTE_NO_WILD) {
+            if (len == route->len && memcmp(topic, route->filter, len) == 0) {
+                *wild = len;
+                return r;
+            }
+            continue;
+        }
+        if (route->wild == 0 && len > 0 && topic[0] == '$') continue;  // 系统主题不匹配第一层的通配符
+        uint8_t level = route->multi ? route->level_num - 1 : route->level_num;
+        if (route->multi ? (num < level) : (num != level)) continue;
+        uint8_t i = 0;
+        for (; i < level; i++) {
+            if (route->size[i] == 1 && route->filter[route->start[i]] == '+') continue;
+            uint16_t size = start[i + 1] - 1 - start[i];
+            if (size != route->size[i] || memcmp(topic + start[i], route->filter + route->start[i], size) != 0) break;
+        }
+        if (i < level) continue;
+        *wild = (route->wild < num) ? start[route->wild] : len;  // "a/#" 匹配 "a" 时没有通配部分
+        return r;
+    }
+    return -1;
+}
+
+esp_err_t app_mqtt_route_register(const char *filter, mqtt_route_handler_t handler, void *arg)
+{
+    mqtt_route_t route = { 0 };
+    int len = 0;
+    if (filter == NULL) return ESP_ERR_INVALID_ARG;
+    if (filter[0] == '~') {  // 本网关的主题前缀
+        if (mqtt_cfg.credentials.client_id == NULL) return ESP_ERR_INVALID_STATE;
+        len = snprintf(route.filter, sizeof(route.filter), "yiree/%s%s", mqtt_cfg.credentials.client_id, filter + 1);
+    } else {
+        len = snprintf(route.filter, sizeof(route.filter), "%s", filter);
+    }
+    if (len <= 0 || len >= sizeof(route.filter)) return ESP_ERR_INVALID_ARG;
+    route.len = len;
+    if (mqtt_route_compile(&route) == false) return ESP_ERR_INVALID_ARG;
+    route.handler = handler;
+    route.arg = arg;
+
+    for (uint8_t r = 0; r < mqtt_route_num; r++) {
+        if (strcmp(mqtt_route[r].filter, route.filter) != 0) continue;
+        taskENTER_CRITICAL(&route_lock);
+        mqtt_route[r].handler = handler;
+        mqtt_route[r].arg = arg;
+        taskEXIT_CRITICAL(&route_lock);
+        return ESP_OK;
+    }
+    if (mqtt_route_num >= MQTT_ROUTE_MAX) return ESP_ERR_NO_MEM;
+    mqtt_route[mqtt_route_num] = route;
+    taskENTER_CRITICAL(&route_lock);
+    mqtt_route_num++;
+    taskEXIT_CRITICAL(&route_lock);
+    if (mqtt_connect_status(0) == true) {  // 已经连接：马上订阅，之后重连时在 MQTT_EVENT_CONNECTED 中订阅
+        esp_mqtt_client_subscribe(mqtt_handle, route.filter, mqtt_topic.qos);
+    }
+    #ifdef TAG
+    ESP_LOGI(TAG, "route[%d]: %s", mqtt_route_num - 1, route.filter);
+    #endif
+    return ESP_OK;
+}
+
+// 分发一条完整的消息（订阅任务中执行）
+static void mqtt_route_dispatch(mqtt_data_t data)
+{
+    taskENTER_CRITICAL(&route_lock);
+    mqtt_route_handler_t handler = mqtt_route[data.route].handler;
+    void *arg = mqtt_route[data.route].arg;
+    taskEXIT_CRITICAL(&route_lock);
+    if (handler != NULL) {
+        handler(data, arg);
+    } else if (mqtt_subscribe_callback_func != NULL) {
+        mqtt_subscribe_callback_func(data);
+    }
+}
+
+//================================================================================================================
+//================================================================================================================
+// 接收缓存：块在初始化时一次分配（PSRAM）；事件回调申请一块，重组完整后连同所有权一起放进接收队列，
+// mqtt_subscribe_task() 执行完用户回调后释放。同一时刻只有一条消息在重组（客户端按顺序投递分片）。
+// 每块：[主题 MQTT_TOPIC_LEN][Correlation Data MQTT_CORRELATION_LEN][数据 MQTT_RX_MSG_MAX + 1]
+//================================================================================================================
+#define MQTT_RX_HEAD_SIZE   (MQTT_TOPIC_LEN + MQTT_CORRELATION_LEN)
+#define MQTT_RX_BLOCK_SIZE  (MQTT_RX_HEAD_SIZE + MQTT_RX_MSG_MAX + 1)
+
+static uint8_t *rx_block = NULL;
+static uint8_t  rx_used = 0;             // 位图，1: 正在使用
+static mqtt_data_t rx_assemble = { 0 };  // 正在重组的消息，data = NULL: 没有
+static mqtt_rx_stats_t rx_stats = { 0 };
+static portMUX_TYPE rx_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t *mqtt_rx_alloc(void)
+{
+    uint8_t *buf = NULL;
+    taskENTER_CRITICAL(&rx_lock);
+    for (uint8_t i = 0; rx_block != NULL && i < MQTT_RX_POOL_NUM; i++) {
+        if (rx_used & (1 << i)) continue;
+        rx_used |= (1 << i);
+        buf = rx_block + i * MQTT_RX_BLOCK_SIZE;
+        uint8_t used = __builtin_popcount(rx_used);
+        if (used > rx_stats.peak) rx_stats.peak = used;
+        break;
+    }
+    taskEXIT_CRITICAL(&rx_lock);
+    return buf;
+}
+
+static void mqtt_rx_free(uint8_t *buf)
+{
+    if (buf == NULL || rx_block == NULL || buf < rx_block) return;
+    uint32_t i = (buf - rx_block) / MQTT_RX_BLOCK_SIZE;  // 块内任意位置（数据/主题）
+    if (i >= MQTT_RX_POOL_NUM) return;
+    taskENTER_CRITICAL(&rx_lock);
+    rx_used &= ~(1 << i);
+    taskEXIT_CRITICAL(&rx_lock);
+}
+
+static void mqtt_rx_drop(bool oversize)
+{
+    taskENTER_CRITICAL(&rx_lock);
+    if (oversize) rx_stats.oversize++;
+    else rx_stats.drop++;
+    taskEXIT_CRITICAL(&rx_lock);
+}
+
+// 放弃正在重组的消息（新消息开始/断开连接）
+static void mqtt_rx_abort(void)
+{
+    if (rx_assemble.data == NULL) return;
+    mqtt_rx_free(rx_assemble.data);
+    rx_assemble.data = NULL;
+    mqtt_rx_drop(false);
+}
+
+// MQTT_EVENT_DATA：大于 MQTT_RX_BUFF_SIZE 的消息分多次回调（current_data_offset/total_data_len）
+static void mqtt_rx_data(esp_mqtt_event_handle_t event)
+{
+    if (event->current_data_offset == 0) {  // 新消息（只有第一个分片带主题）
+        mqtt_rx_abort();
+        if (event->total_data_len <= 0) return;
+        uint16_t wild = 0;
+        int8_t route = mqtt_route_match(event->topic, event->topic_len, &wild);
+        if (route < 0) {
+            #ifdef TAG
+            ESP_LOGW(TAG, "rx no route: %.*s", event->topic_len, event->topic);
+            #endif
+            taskENTER_CRITICAL(&rx_lock);
+            rx_stats.unroute++;
+            taskEXIT_CRITICAL(&rx_lock);
+            return;
+        }
+        if (event->total_data_len > MQTT_RX_MSG_MAX) {
+            #ifdef TAG
+            ESP_LOGW(TAG, "rx message too large: %d", event->total_data_len);
+            #endif
+            mqtt_rx_drop(true);
+            return;
+        }
+        rx_assemble.data = mqtt_rx_alloc();
+        if (rx_assemble.data == NULL) {
+            #ifdef TAG
+            ESP_LOGW(TAG, "rx pool empty, drop %d bytes", event->total_data_len);
+            #endif
+            mqtt_rx_drop(false);
+            return;
+        }
+        uint16_t topic_len = (event->topic_len < MQTT_TOPIC_LEN) ? event->topic_len : MQTT_TOPIC_LEN - 1;
+        rx_assemble.topic = (char *)rx_assemble.data;
+        memcpy(rx_assemble.topic, event->topic, topic_len);
+        rx_assemble.topic[topic_len] = '\0';
+        rx_assemble.wild  = rx_assemble.topic + ((wild < topic_len) ? wild : topic_len);
+        rx_assemble.route = route;
+        rx_assemble.correlation = rx_assemble.topic + MQTT_TOPIC_LEN;
+        rx_assemble.correlation[0] = '\0';
+        #ifdef CONFIG_MQTT_PROTOCOL_5
+        if (event->property != NULL && event->property->correlation_data != NULL &&
+            event->property->correlation_data_len > 0 && event->property->correlation_data_len < MQTT_CORRELATION_LEN) {
+            memcpy(rx_assemble.correlation, event->property->correlation_data, event->property->correlation_data_len);
+            rx_assemble.correlation[event->property->correlation_data_len] = '\0';
+        }
+        #endif
+        rx_assemble.data += MQTT_RX_HEAD_SIZE;
+        rx_assemble.len = 0;
+    } else if (rx_assemble.data == NULL || event->current_data_offset != rx_assemble.len) {
+        return;  // 丢弃的消息的后续分片，或者分片不连续（已经在开始时计数）
+    }
+    if (event->current_data_offset + event->data_len > event->total_data_len) {
+        mqtt_rx_abort();
+        return;
+    }
+    memcpy(rx_assemble.data + rx_assemble.len, event->data, event->data_len);
+    rx_assemble.len += event->data_len;
+    if (rx_assemble.len < event->total_data_len) return;  // 等待后续分片
+
+    rx_assemble.data[rx_assemble.len] = '\0';
+    bool chunked = (event->data_len < event->total_data_len);
+    if (xQueueSend(xQueue, &rx_assemble, (TickType_t)0) != pdTRUE) {  // 所有权交给 mqtt_subscribe_task()
+        mqtt_rx_free(rx_assemble.data);
+        mqtt_rx_drop(false);
+    } else {
+        taskENTER_CRITICAL(&rx_lock);
+        rx_stats.msg++;
+        if (chunked) rx_stats.chunk++;
+        taskEXIT_CRITICAL(&rx_lock);
+    }
+    rx_assemble.data = NULL;
+}
+
+void app_mqtt_rx_get_stats(mqtt_rx_stats_t *stats)
+{
+    taskENTER_CRITICAL(&rx_lock);
+    *stats = rx_stats;
+    taskEXIT_CRITICAL(&rx_lock);
+}
+
+//================================================================================================================
+//================================================================================================================
 // MQTT订阅接收消息服务回调函数
 void mqtt_subscribe_register_callback(mqtt_callback_t callback_func)
 {
@@ -137,12 +704,7 @@ void mqtt_subscribe_register_callback(mqtt_callback_t callback_func)
   
 void mqtt_subscribe_task(void * arg)
 {
-    mqtx.data = heap_caps_malloc(MQTT_RX_BUFF_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    assert(mqtx.data);
- 
     mqtt_data_t mqrx = { 0 }; 
-    mqrx.data = heap_caps_malloc(MQTT_RX_BUFF_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-    assert(mqrx.data);
  
     while (1) {  // 执行接收任务
 
@@ -157,13 +719,27 @@ void mqtt_subscribe_task(void * arg)
             }
             esp_mqtt_client_switch(wifi_status);  // 根据WIFI连接状态,启停MQTT
         }
+        #ifdef CONFIG_MQTT_PROTOCOL_5
+        if (mqtt_v5_fallback == true && wifi_status == true) {  // 服务器不支持 MQTT 5：回落到 3.1.1（不改 NVS 配置）
+            mqtt_v5_fallback = false;
+            #ifdef TAG
+            ESP_LOGW(TAG, "MQTT 5 refused, fall back to MQTT 3.1.1");
+            #endif
+            esp_mqtt_client_switch(false);
+            mqtt_protocol_config(MQTT_VERSION_311);
+            esp_mqtt_set_config(mqtt_handle, &mqtt_cfg);
+            esp_mqtt_client_switch(true);
+        }
+        #endif
  
         if (wifi_status == true && xQueueReceive(xQueue, &mqrx, 2000) == pdTRUE) {  // portMAX_DELAY 接收数据
             #ifdef WIFI_MQTT_DEBUG_ENABLE    
-            ESP_LOGI(TAG, "xQueue->data: %s | %d", mqrx.data, mqrx.len);
+            ESP_LOGI(TAG, "xQueue->data[%s]: %s | %d", mqrx.topic, mqrx.data, mqrx.len);
             #endif
-            mqtt_subscribe_callback_func(mqrx);  // APP用户回调函数去执行
+            mqtt_route_dispatch(mqrx);           // 按主题交给路由的回调去执行
+            mqtt_rx_free(mqrx.data);             // 回调返回后释放接收缓存
         } 
+        mqtt_outbox_check_timeout();  // 最多 2S 检查一次
     }
     vTaskDelete(NULL);
 }
@@ -187,6 +763,7 @@ bool app_mqtt_client_reconnect(nvs_mqtt_t nvs_mqtt)
 {
     mqtt_topic.qos = nvs_mqtt.qos;
     mqtt_cfg.broker.address.port = nvs_mqtt.port;
+    mqtt_protocol_config(nvs_mqtt.protocol);
     // mqtt_cfg在初始化时，就已经指针指向了nvs_mqtt。所以不用重复赋值！
 #ifdef WIFI_MQTT_DEBUG_ENABLE    
     printf("-----app_mqtt_client_reconnect-------\r\n");
@@ -200,6 +777,7 @@ bool app_mqtt_client_reconnect(nvs_mqtt_t nvs_mqtt)
     app_mqtt_client_disconnect();  // 先断开连接
  
     ESP_ERROR_CHECK( esp_mqtt_set_config(mqtt_handle, &mqtt_cfg) ); 
+    mqtt_protocol_connect_property();
  
     vTaskDelay(1000); // 等待配置完成；同时等待WIFI获取到IP地址，不然会出错!!!
 
@@ -244,8 +822,13 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             #ifdef WIFI_MQTT_DEBUG_ENABLE  
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
             #endif
-            esp_mqtt_client_subscribe(client, mqtt_topic.sntp,  mqtt_topic.qos);
-            esp_mqtt_client_subscribe(client, mqtt_topic.local, mqtt_topic.qos);
+            #ifdef CONFIG_MQTT_PROTOCOL_5
+            mqtt_connect_seq++;
+            mqtt_alias_state = MQTT_ALIAS_NONE;  // 别名只在一次连接中有效
+            #endif
+            for (uint8_t r = 0; r < mqtt_route_num; r++) {  // 订阅所有路由的过滤器（默认有 sntp/local）
+                esp_mqtt_client_subscribe(client, mqtt_route[r].filter, mqtt_topic.qos);
+            }
             xEventGroupSetBits(xEvent, MQTT_CONNECTED_EVENT);
             xEventGroupClearBits(xEvent, MQTT_DISCONNECTED_EVENT);
             break;
@@ -259,6 +842,7 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             }
             xEventGroupSetBits(xEvent, MQTT_DISCONNECTED_EVENT);
             xEventGroupClearBits(xEvent, MQTT_CONNECTED_EVENT);
+            mqtt_rx_abort();  // 没收完的分片不会再来了
             break;      
         case MQTT_EVENT_SUBSCRIBED:   
             #ifdef WIFI_MQTT_DEBUG_ENABLE  
@@ -270,26 +854,35 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             #endif
             break;
-        case MQTT_EVENT_PUBLISHED:  /* 发布消息成功会触发 */
-            xEventGroupSetBits(xEvent, MQTT_PUBLISHED_EVENT);
+        case MQTT_EVENT_PUBLISHED:  /* 发布消息成功会触发（QoS1/2） */
+            mqtt_outbox_finish(event->msg_id, true);
             #ifdef WIFI_MQTT_DEBUG_ENABLE  
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
             #endif
             break;
+        case MQTT_EVENT_DELETED:    /* 发送缓存中的消息过期被删除 */
+            mqtt_outbox_finish(event->msg_id, false);
+            #ifdef TAG
+            ESP_LOGW(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+            #endif
+            break;
             
         case MQTT_EVENT_DATA: { /* 订阅消息成功会触发 */
             #ifdef WIFI_MQTT_DEBUG_ENABLE  
             printf("TOPIC = %.*s\r\n", event->topic_len, event->topic);
             printf("DATA = %.*s\r\n", event->data_len, event->data);
             #endif
-            if (event->data_len <= 0) break;
-            memcpy(mqtx.data, event->data, event->data_len);
-            mqtx.len = event->data_len;
-            mqtx.data[mqtx.len] = '\0';
-            xQueueSend(xQueue, &mqtx, (TickType_t)0);  // 发送队列数据
+            mqtt_rx_data(event);  // 重组分片，完整后发送队列数据
             break;
         }  
         case MQTT_EVENT_ERROR:
+            #ifdef CONFIG_MQTT_PROTOCOL_5
+            if (mqtt_v5 == true && event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+                (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+                 event->error_handle->connect_return_code == MQTT_V5_REFUSE_PROTOCOL)) {
+                mqtt_v5_fallback = true;  // 在订阅任务中重新配置（不能在 MQTT 任务中停止客户端）
+            }
+            #endif
             #ifdef WIFI_MQTT_DEBUG_ENABLE 
             if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
                 ESP_LOGE(TAG, "Last error code reported from esp-tls: 0x%x", event->error_handle->esp_tls_last_esp_err);
@@ -336,10 +929,12 @@ void app_mqtt_init(nvs_mqtt_t *nvs_mqtt)
     esp_read_mac(net_addr, ESP_MAC_BT);     // 读取network addr
     mac_utils_hex2str(net_addr, client_id); // client_id 设置为MAC_ADDR
     mqtt_topic.qos = nvs_mqtt->qos; 
+    mqtt_protocol_config(nvs_mqtt->protocol);
     mqtt_cfg.credentials.client_id = client_id;
     sprintf(mqtt_topic.cloud, "yiree/%s/cloud",  mqtt_cfg.credentials.client_id);   // 发布云端主题
     sprintf(mqtt_topic.local, "yiree/%s/local",  mqtt_cfg.credentials.client_id);   // 订阅设备主题 
     sprintf(mqtt_topic.sntp,  "yiree/sntp/local");   // 获取时间戳的主题！     
+    sprintf(mqtt_topic.metrics, "yiree/%s/metrics", mqtt_cfg.credentials.client_id);  // 发布收发统计主题
     mqtt_cfg.broker.address.port = nvs_mqtt->port;
     mqtt_cfg.credentials.username = nvs_mqtt->username;
     mqtt_cfg.broker.address.hostname = nvs_mqtt->host;
@@ -355,15 +950,24 @@ void app_mqtt_init(nvs_mqtt_t *nvs_mqtt)
     ESP_LOGI(TAG, "mqtt_topic.cloud: %s", mqtt_topic.cloud);
     ESP_LOGI(TAG, "mqtt_topic.local: %s", mqtt_topic.local);
     ESP_LOGI(TAG, "mqtt_topic.sntp: %s", mqtt_topic.sntp);
+    ESP_LOGI(TAG, "mqtt_topic.metrics: %s", mqtt_topic.metrics);
     printf("----------------- MQTT ----------------------\r\n");
 #endif
   
     mqtt_handle = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(mqtt_handle, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    mqtt_protocol_connect_property();
+    #ifdef CONFIG_MQTT_PROTOCOL_5
+    xPublishMutex = xSemaphoreCreateMutex();
+    #endif
     // ESP_ERROR_CHECK( esp_mqtt_client_start(mqtt_handle) );  // 等待wifi连接成功再启动MQTT！ 
 
     xEvent = xEventGroupCreate();
-    xQueue = xQueueCreate(3, sizeof(mqtt_data_t));
+    xQueue = xQueueCreate(MQTT_RX_POOL_NUM, sizeof(mqtt_data_t));
+    rx_block = heap_caps_malloc(MQTT_RX_POOL_NUM * MQTT_RX_BLOCK_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    assert(rx_block);
+    app_mqtt_route_register(mqtt_topic.sntp,  NULL, NULL);  // 默认路由：交给 mqtt_subscribe_register_callback() 的回调
+    app_mqtt_route_register(mqtt_topic.local, NULL, NULL);
     if (nvs_mqtt->status & MQTT_CONFIG_OK) { // 配网过了！
         xEventGroupSetBits(xEvent, MQTT_RECONNECT_EVENT);
     }
@@ -96,6 +96,8 @@ esp_err_t esp_ota_reset_factory(void)
 static uint8_t ota_addr[6];
 static bool  ota_is_init = 0;
 static short ota_update_plan = 0;  // OTA进度
+static uint8_t *node_image = NULL;  // mesh 节点的固件（PSRAM），分发完成后释放
+static uint32_t node_image_size = 0;  // 下载完成后才设置
 // 返回OTA进度
 int wifi_ota_update_plan(void)
 {
@@ -111,6 +113,21 @@ uint8_t *app_get_ota_addr(void)
     return ota_addr;
 }
 
+const uint8_t *wifi_ota_node_image(uint32_t *size)
+{
+    if (node_image_size == 0) return NULL;  // 没有或者还在下载
+    *size = node_image_size;
+    return node_image;
+}
+
+void wifi_ota_node_image_release(void)
+{
+    if (node_image_size == 0) return;  // 还在下载，由 OTA 任务处理
+    free(node_image);
+    node_image = NULL;
+    node_image_size = 0;
+}
+
 // static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
 // portENTER_CRITICAL(&ota_lock);
 // portEXIT_CRITICAL(&ota_lock);
@@ -186,6 +203,22 @@ static void wifi_ota_task(void *arg)
         goto EXIT;
     }
 
+    if (boot_is_upgrade == false) {  // mesh 节点的固件：下载到 PSRAM，由 ble_mesh_ota 分发
+        if (total_size > OTA_NODE_IMAGE_MAX) {
+            #ifdef TAG     
+            ESP_LOGE(TAG, "node image too large: %d", total_size);
+            #endif
+            goto EXIT;
+        }
+        node_image = heap_caps_malloc(total_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (node_image == NULL) {
+            #ifdef TAG     
+            ESP_LOGE(TAG, "node image malloc fail");
+            #endif
+            goto EXIT;
+        }
+    }
+
     /**
      * @brief 3. Read firmware from the server and write it to the flash of the root node
      */
@@ -194,7 +227,15 @@ static void wifi_ota_task(void *arg)
     for (size_t size = 0, recv_size = 0; recv_size < total_size; recv_size += size) {
         size = esp_http_client_read(client, (char *)packet->data, OTA_PACKET_SIZE);
         ota_update_plan = ((float)recv_size / total_size) * 100; // 计算OTA百分比进度！     
-        if (size > 0) { // read ok!
+        if (size > 0 && boot_is_upgrade == false) {  // 节点固件不写 Flash，也不检查网关的固件名
+            if (recv_size + size > total_size) {
+                #ifdef TAG     
+                ESP_LOGE(TAG, "node image overflow");
+                #endif
+                goto EXIT;
+            }
+            memcpy(node_image + recv_size, packet->data, size);
+        } else if (size > 0) { // read ok!
 #if APP_CONFIG_PROJECT_NAME_CHECK || APP_CONFIG_VERSION_CHECK            
             if (image_header_was_checked == false) {
                 esp_app_desc_t new_app_info;
@@ -303,7 +344,8 @@ static void wifi_ota_task(void *arg)
     }
  
     if (boot_is_upgrade == false) {
-        ota_update_plan = 200;  // OTA=200%, 用于区分是不是ROOT节点升级
+        node_image_size = total_size;
+        ota_update_plan = 200;  // OTA=200%, 用于区分是不是ROOT节点升级（开始分发给节点）
     } else {
         ota_update_plan = 100;  // OTA=100%
     }
@@ -318,6 +360,8 @@ EXIT:
         ESP_LOGW(TAG, "\n\nOTA Fail...\n\n");
         #endif
         ota_update_plan = -1;  // OTA失败了
+        free(node_image);
+        node_image = NULL;
     }  
      
     if (update_handle != 0) {
@@ -342,7 +386,7 @@ EXIT:
 
 void app_ota_start(uint8_t addr[6], const char *ota_url)
 {
-    if (ota_is_init == true) return;
+    if (ota_is_init == true || node_image != NULL) return;  // 正在下载/节点固件还在分发
     else ota_is_init = true;
 
     memcpy(ota_addr, addr, 6); 
@@ -0,0 +1,419 @@
+/**
+ * @file    wifi_store.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   离线上报缓存（store-and-forward）
+ *          - 离线时每条消息投递到队列，由补发任务按行追加到 WIFI_STORE_LOG_FILE："键\t序号\tJSON\n"，只追加不改写；
+ *          - 日志超过 WIFI_STORE_LOG_MAX 时（在补发任务中）按键合并后重写（仍然太大就丢掉最旧的键）；
+ *          - WIFI_STORE_KEY_ONCE 开头的键（云端指令的应答）不合并，每条都补发；
+ *          - 重连后把日志改名为 WIFI_STORE_OLD_FILE，合并成每个键一条，按批限速补发，补发完再删除；
+ *          - 每条消息在产生时分配序号（启动后从日志中的最大序号继续），在线上报时记下每个键的序号：
+ *            比它更早的记录不再补发——等待补发的立即删除，队列中的在取出时、日志中的在读入时丢弃；
+ *            同一个键的记录按序号合并，迟到的旧记录不会覆盖新状态。
+ * @version 0.1
+ * @date    2023-08-30
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "cJSON.h"
+
+#include "wifi_user.h"
+#include "wifi_store.h"
+
+#define TAG "wifi_store"
+
+#define WIFI_STORE_TMP_FILE     "/spiffs/uplink.tmp"
+
+static cJSON *store_set = NULL;  // 等待补发：[{"k":"0x0005|onoff","s":12,"v":{...}}, ...]，越靠后越新
+static wifi_store_stats_t store_stats = { 0 };
+static SemaphoreHandle_t xStoreMutex = NULL;
+static SemaphoreHandle_t xMarkMutex = NULL;  // store_mark/store_seq（上报的任务和补发任务都会用），不在持有它时再拿 xStoreMutex
+static QueueHandle_t xStoreQueue = NULL;
+
+typedef struct {
+    char     key[WIFI_STORE_KEY_SIZE];
+    uint32_t seq;
+    char     data[];
+} wifi_store_record_t;
+
+typedef struct {
+    char     key[WIFI_STORE_KEY_SIZE];
+    uint32_t seq;       // 这个键最后一次在线上报的序号，0: 空闲
+} wifi_store_mark_t;
+
+static wifi_store_mark_t *store_mark = NULL;  // [WIFI_STORE_KEY_MAX]，满了替换最旧的
+static uint32_t store_seq = 0;                // 最后分配的序号
+
+//============================================================================================
+// 分配一个序号；key 不为 NULL 时记为这个键最后一次在线上报
+static uint32_t wifi_store_seq_next(const char *key)
+{
+    if (xMarkMutex == NULL) return 0;
+    xSemaphoreTake(xMarkMutex, portMAX_DELAY);
+    uint32_t seq = ++store_seq;
+    if (key != NULL && store_mark != NULL) {
+        wifi_store_mark_t *mark = NULL;
+        wifi_store_mark_t *oldest = &store_mark[0];
+        for (uint16_t i = 0; i < WIFI_STORE_KEY_MAX; i++) {
+            if (store_mark[i].seq != 0 && strcmp(store_mark[i].key, key) == 0) {
+                mark = &store_mark[i];
+                break;
+            }
+            if (store_mark[i].seq < oldest->seq) oldest = &store_mark[i];
+        }
+        if (mark == NULL) {
+            mark = oldest;
+            snprintf(mark->key, sizeof(mark->key), "%s", key);
+        }
+        mark->seq = seq;
+    }
+    xSemaphoreGive(xMarkMutex);
+    return seq;
+}
+
+// 比这个键最后一次在线上报更早的记录，不再补发（没有序号的旧格式记录 seq = 0，也算更早）
+static bool wifi_store_stale(const char *key, uint32_t seq)
+{
+    if (key[0] == WIFI_STORE_KEY_ONCE || store_mark == NULL) return false;
+    bool stale = false;
+    xSemaphoreTake(xMarkMutex, portMAX_DELAY);
+    for (uint16_t i = 0; i < WIFI_STORE_KEY_MAX; i++) {
+        if (store_mark[i].seq != 0 && strcmp(store_mark[i].key, key) == 0) {
+            stale = (seq < store_mark[i].seq);
+            break;
+        }
+    }
+    xSemaphoreGive(xMarkMutex);
+    if (stale) store_stats.stale++;
+    return stale;
+}
+
+//============================================================================================
+static uint32_t wifi_store_item_seq(const cJSON *item)
+{
+    return (uint32_t)cJSON_GetNumberValue(cJSON_GetObjectItem(item, "s"));
+}
+
+static cJSON *wifi_store_find(cJSON *set, const char *key)
+{
+    cJSON *item = NULL;
+    if (key[0] == WIFI_STORE_KEY_ONCE) return NULL;  // 不合并
+    cJSON_ArrayForEach(item, set) {
+        cJSON *k = cJSON_GetObjectItem(item, "k");
+        if (cJSON_IsString(k) && strcmp(k->valuestring, key) == 0) return item;
+    }
+    return NULL;
+}
+
+// 合并一条消息（root 的所有权交给 set）：键值都是 JSON 对象时按成员合并，否则新的覆盖旧的；
+// 按序号决定新旧：更早的消息只补上没有的成员，不覆盖
+static void wifi_store_merge(cJSON *set, const char *key, uint32_t seq, cJSON *root)
+{
+    cJSON *item = wifi_store_find(set, key);
+    if (item != NULL) {
+        cJSON *old = cJSON_GetObjectItem(item, "v");
+        bool newer = (seq >= wifi_store_item_seq(item));
+        const char *opcode = strrchr(key, '|');  // 地址也可能带 '|'
+        cJSON *old_value = (opcode != NULL) ? cJSON_GetObjectItem(old, opcode + 1) : NULL;
+        cJSON *new_value = (opcode != NULL) ? cJSON_GetObjectItem(root, opcode + 1) : NULL;
+        if (cJSON_IsObject(old_value) && cJSON_IsObject(new_value)) {
+            while (new_value->child != NULL) {
+                cJSON *member = cJSON_DetachItemViaPointer(new_value, new_value->child);
+                cJSON *old_member = cJSON_GetObjectItem(old_value, member->string);
+                if (old_member == NULL) {
+                    cJSON_AddItemToObject(old_value, member->string, member);
+                } else if (newer) {
+                    cJSON_ReplaceItemViaPointer(old_value, old_member, member);
+                } else {
+                    cJSON_Delete(member);
+                }
+            }
+            cJSON *mid = newer ? cJSON_DetachItemFromObject(root, "mid") : NULL;
+            if (mid != NULL) cJSON_ReplaceItemInObject(old, "mid", mid);
+            cJSON_Delete(root);
+        } else if (newer) {
+            cJSON_ReplaceItemInObject(item, "v", root);
+        } else {
+            cJSON_Delete(root);
+        }
+        if (newer) {
+            cJSON_ReplaceItemInObject(item, "s", cJSON_CreateNumber(seq));
+            cJSON_AddItemToArray(set, cJSON_DetachItemViaPointer(set, item));  // 移到最后（最新）
+        }
+        store_stats.merge++;
+        return;
+    }
+    if (cJSON_GetArraySize(set) >= WIFI_STORE_KEY_MAX) {  // 丢掉最旧的键
+        cJSON_DeleteItemFromArray(set, 0);
+        store_stats.drop++;
+    }
+    item = cJSON_CreateObject();
+    if (item == NULL) {
+        cJSON_Delete(root);
+        store_stats.drop++;
+        return;
+    }
+    cJSON_AddStringToObject(item, "k", key);
+    cJSON_AddNumberToObject(item, "s", seq);
+    cJSON_AddItemToObject(item, "v", root);
+    cJSON_AddItemToArray(set, item);
+}
+
+// 一行记录："键\t序号\tJSON"，旧格式 "键\tJSON" 的序号当作 0；line 中的 '\t' 改成 '\0'，return: NULL: 格式错误
+static char *wifi_store_parse(char *line, uint32_t *seq)
+{
+    char *tab = strchr(line, '\t');
+    if (tab == NULL || tab - line >= WIFI_STORE_KEY_SIZE) return NULL;
+    *tab = '\0';
+    char *data = tab + 1;
+    *seq = 0;
+    if (data[0] != '{') {
+        char *end = NULL;
+        *seq = strtoul(data, &end, 10);
+        if (end == data || *end != '\t') return NULL;
+        data = end + 1;
+    }
+    return data;
+}
+
+// 读日志文件合并到 set（比在线上报更早的记录丢弃），set = NULL 时只找最大序号，return: 读到的记录数
+static uint16_t wifi_store_load(cJSON *set, const char *path, uint32_t *max_seq)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+    char *line = heap_caps_malloc(WIFI_STORE_LINE_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (line == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    uint16_t num = 0;
+    while (fgets(line, WIFI_STORE_LINE_MAX, fp) != NULL) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) {  // 太长的记录（或者掉电写了一半）：跳过这一行
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n');
+            continue;
+        }
+        *end = '\0';
+        uint32_t seq;
+        char *data = wifi_store_parse(line, &seq);
+        if (data == NULL) continue;
+        if (max_seq != NULL && seq > *max_seq) *max_seq = seq;
+        if (set == NULL) continue;
+        if (wifi_store_stale(line, seq)) continue;
+        cJSON *root = cJSON_Parse(data);
+        if (root == NULL) continue;
+        wifi_store_merge(set, line, seq, root);
+        num++;
+    }
+    free(line);
+    fclose(fp);
+    return num;
+}
+
+// 日志太大：合并成每个键一条重写，仍然太大就丢掉最旧的键
+static void wifi_store_compact(void)
+{
+    cJSON *set = cJSON_CreateArray();
+    if (set == NULL) return;
+    wifi_store_load(set, WIFI_STORE_LOG_FILE, NULL);
+    uint32_t size = 0;
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, set) {  // 估算每条记录的长度，从最新的往前保留
+        char *data = cJSON_PrintUnformatted(cJSON_GetObjectItem(item, "v"));
+        item->valueint = (data != NULL) ? strlen(data) + WIFI_STORE_KEY_SIZE : 0;
+        size += item->valueint;
+        cJSON_free(data);
+    }
+    while (size > WIFI_STORE_LOG_MAX / 2 && set->child != NULL) {
+        size -= set->child->valueint;
+        cJSON_DeleteItemFromArray(set, 0);
+        store_stats.drop++;
+    }
+    FILE *fp = fopen(WIFI_STORE_TMP_FILE, "w");
+    if (fp != NULL) {
+        cJSON_ArrayForEach(item, set) {
+            char *data = cJSON_PrintUnformatted(cJSON_GetObjectItem(item, "v"));
+            if (data == NULL) continue;
+            fprintf(fp, "%s\t%lu\t%s\n", cJSON_GetObjectItem(item, "k")->valuestring,
+                    (unsigned long)wifi_store_item_seq(item), data);
+            cJSON_free(data);
+        }
+        fclose(fp);
+        unlink(WIFI_STORE_LOG_FILE);
+        rename(WIFI_STORE_TMP_FILE, WIFI_STORE_LOG_FILE);
+    }
+    store_stats.compact++;
+    #ifdef TAG
+    ESP_LOGI(TAG, "compact: %d keys, %ld bytes", cJSON_GetArraySize(set), size);
+    #endif
+    cJSON_Delete(set);
+}
+
+// 追加到日志（只在补发任务中调用，日志文件只有这个任务读写）
+static void wifi_store_write(const char *key, uint32_t seq, const char *data)
+{
+    long size = -1;
+    FILE *fp = fopen(WIFI_STORE_LOG_FILE, "a");
+    if (fp != NULL) {
+        if (fprintf(fp, "%s\t%lu\t%s\n", key, (unsigned long)seq, data) > 0) size = ftell(fp);
+        fclose(fp);
+    }
+    if (size < 0) {
+        store_stats.drop++;
+        #ifdef TAG
+        ESP_LOGW(TAG, "append fail: %s", key);
+        #endif
+    } else {
+        store_stats.append++;
+        if (size > WIFI_STORE_LOG_MAX) wifi_store_compact();
+    }
+}
+
+void wifi_store_append(const char *key, const char *data, uint32_t seq)
+{
+    size_t len = strlen(data);
+    if (xStoreQueue == NULL || strlen(key) >= WIFI_STORE_KEY_SIZE || strlen(key) + len + 13 > WIFI_STORE_LINE_MAX) {
+        store_stats.drop++;
+        return;
+    }
+    wifi_store_record_t *record = heap_caps_malloc(sizeof(wifi_store_record_t) + len + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (record == NULL) {
+        store_stats.drop++;
+        return;
+    }
+    strcpy(record->key, key);
+    record->seq = (seq != 0) ? seq : wifi_store_seq_next(NULL);
+    memcpy(record->data, data, len + 1);
+    if (xQueueSend(xStoreQueue, &record, 0) != pdTRUE) {
+        heap_caps_free(record);
+        store_stats.drop++;
+        #ifdef TAG
+        ESP_LOGW(TAG, "queue full: %s", key);
+        #endif
+    }
+}
+
+uint32_t wifi_store_supersede(const char *key)
+{
+    bool once = (key[0] == WIFI_STORE_KEY_ONCE);
+    uint32_t seq = wifi_store_seq_next(once ? NULL : key);  // 先记下序号：之后读入/取出的旧记录都会丢弃
+    if (once || xStoreMutex == NULL || store_set == NULL || store_set->child == NULL) return seq;
+    xSemaphoreTake(xStoreMutex, portMAX_DELAY);
+    cJSON *item = wifi_store_find(store_set, key);
+    if (item != NULL) {
+        cJSON_Delete(cJSON_DetachItemViaPointer(store_set, item));
+        store_stats.stale++;
+    }
+    xSemaphoreGive(xStoreMutex);
+    return seq;
+}
+
+void wifi_store_get_stats(wifi_store_stats_t *stats)
+{
+    if (xStoreMutex != NULL) xSemaphoreTake(xStoreMutex, portMAX_DELAY);
+    *stats = store_stats;
+    stats->pending = (store_set != NULL) ? cJSON_GetArraySize(store_set) : 0;
+    if (xStoreMutex != NULL) xSemaphoreGive(xStoreMutex);
+}
+
+//============================================================================================
+// 补发一批，return: false: 发送失败（又离线了）
+static bool wifi_store_replay_batch(void)
+{
+    char *data[WIFI_STORE_REPLAY_BATCH] = { NULL };
+    char *key[WIFI_STORE_REPLAY_BATCH] = { NULL };
+    uint32_t seq[WIFI_STORE_REPLAY_BATCH];
+    uint8_t num = 0;
+    xSemaphoreTake(xStoreMutex, portMAX_DELAY);
+    while (num < WIFI_STORE_REPLAY_BATCH && store_set->child != NULL) {
+        cJSON *item = cJSON_DetachItemViaPointer(store_set, store_set->child);
+        data[num] = cJSON_PrintUnformatted(cJSON_GetObjectItem(item, "v"));
+        key[num] = strdup(cJSON_GetObjectItem(item, "k")->valuestring);
+        seq[num] = wifi_store_item_seq(item);
+        cJSON_Delete(item);
+        if (data[num] != NULL && key[num] != NULL) num++;
+        else {
+            cJSON_free(data[num]);
+            free(key[num]);
+        }
+    }
+    xSemaphoreGive(xStoreMutex);
+
+    bool ok = true;
+    for (uint8_t i = 0; i < num; i++) {
+        if (ok && app_upper_cloud_write(data[i], strlen(data[i])) >= 0) {
+            store_stats.replay++;
+        } else {  // 没发出去的写回日志，下次重连再补发
+            ok = false;
+            wifi_store_write(key[i], seq[i], data[i]);
+        }
+        cJSON_free(data[i]);
+        free(key[i]);
+    }
+    return ok;
+}
+
+// 写入投递过来的消息；每 WIFI_STORE_REPLAY_INTERVAL 检查一次补发
+static void wifi_store_task(void *arg)
+{
+    TickType_t replay_tick = xTaskGetTickCount();
+    while (true) {
+        TickType_t elapsed = xTaskGetTickCount() - replay_tick;
+        TickType_t wait = (elapsed < pdMS_TO_TICKS(WIFI_STORE_REPLAY_INTERVAL)) ? pdMS_TO_TICKS(WIFI_STORE_REPLAY_INTERVAL) - elapsed : 0;
+        wifi_store_record_t *record = NULL;
+        if (xQueueReceive(xStoreQueue, &record, wait) == pdTRUE) {
+            if (wifi_store_stale(record->key, record->seq) == false) {  // 排队期间已经在线上报了更新的状态
+                wifi_store_write(record->key, record->seq, record->data);
+            }
+            heap_caps_free(record);
+        }
+        if (xTaskGetTickCount() - replay_tick < pdMS_TO_TICKS(WIFI_STORE_REPLAY_INTERVAL)) continue;
+        replay_tick = xTaskGetTickCount();
+        if (app_upper_cloud_online() == false) continue;
+
+        xSemaphoreTake(xStoreMutex, portMAX_DELAY);
+        if (store_set->child == NULL) {
+            struct stat st;
+            unlink(WIFI_STORE_OLD_FILE);  // 上一轮已经补发完
+            if (stat(WIFI_STORE_LOG_FILE, &st) == 0 && rename(WIFI_STORE_LOG_FILE, WIFI_STORE_OLD_FILE) == 0) {
+                uint16_t num = wifi_store_load(store_set, WIFI_STORE_OLD_FILE, NULL);
+                #ifdef TAG
+                ESP_LOGI(TAG, "replay: %d records -> %d messages", num, cJSON_GetArraySize(store_set));
+                #endif
+            }
+        }
+        bool pending = (store_set->child != NULL);
+        xSemaphoreGive(xStoreMutex);
+
+        if (pending) wifi_store_replay_batch();
+    }
+    vTaskDelete(NULL);
+}
+
+void wifi_store_init(void)
+{
+    store_set = cJSON_CreateArray();
+    xStoreMutex = xSemaphoreCreateMutex();
+    xMarkMutex = xSemaphoreCreateMutex();
+    store_mark = heap_caps_calloc(WIFI_STORE_KEY_MAX, sizeof(wifi_store_mark_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (store_set == NULL || xStoreMutex == NULL || xMarkMutex == NULL || store_mark == NULL) return;
+    xStoreQueue = xQueueCreate(WIFI_STORE_QUEUE_LEN, sizeof(wifi_store_record_t *));
+    if (xStoreQueue == NULL) return;
+    uint16_t num = wifi_store_load(store_set, WIFI_STORE_OLD_FILE, &store_seq);  // 掉电前没补发完的
+    wifi_store_load(NULL, WIFI_STORE_LOG_FILE, &store_seq);  // 序号从日志中的最大序号继续
+    #ifdef TAG
+    ESP_LOGI(TAG, "store init, %d records pending", num);
+    #endif
+    xTaskCreatePinnedToCore(wifi_store_task, "wifi_store", 4 * 1024, NULL, 3, NULL, APP_CPU_NUM);
+}
@@ -22,6 +22,9 @@
 #include "wifi_sock.h"
 #include "wifi_init.h"
 #include "wifi_mqtt.h"
+#include "wifi_store.h"
+
+#include "esp_heap_caps.h"
 
 #include "wifi_user.h"
 
@@ -36,6 +39,118 @@ int app_upper_cloud_write(const char *data, uint16_t len)
     #endif
 }
 
+// 云端是否连接
+bool app_upper_cloud_online(void)
+{
+    #if APP_CONFIG_MQTT_ENABLE
+    return mqtt_connect_status(0);
+    #else 
+    return tcp_client_connect_status();
+    #endif
+}
+
+#if APP_CONFIG_MQTT_ENABLE
+// 异步发布的消息：发布完成前保留一份，被客户端删除时写入离线缓存（PUBACK 超时客户端还在重发，不写）
+typedef struct {
+    char key[WIFI_STORE_KEY_SIZE];
+    uint32_t seq;   // 离线缓存的序号（wifi_store_supersede()）
+    bool has_mid;
+    char data[];    // 消息体，has_mid 时 '\0' 之后是 Correlation Data 中的"mid"
+} cloud_publish_t;
+
+// 离线缓存按原格式保存"mid"（补发时可能已经回落到 MQTT 3.1.1）：{"mid":"<mid>",<消息体的其余部分>
+static void app_upper_cloud_store(cloud_publish_t *pub)
+{
+    if (pub->has_mid == false) {
+        wifi_store_append(pub->key, pub->data, pub->seq);
+        return;
+    }
+    const char *mid = pub->data + strlen(pub->data) + 1;
+    size_t size = strlen(pub->data) + strlen(mid) + 16;
+    char *data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (data == NULL) return;
+    snprintf(data, size, "{\"mid\":\"%s\",%s", mid, pub->data + 1);
+    wifi_store_append(pub->key, data, pub->seq);
+    heap_caps_free(data);
+}
+
+// 发布完成回调（MQTT 事件任务）：被客户端删除（没有送达）的写入离线缓存，重连后补发
+static void app_upper_cloud_publish_cb(int msg_id, bool ok, void *arg)
+{
+    cloud_publish_t *pub = (cloud_publish_t *)arg;
+    if (ok == false) app_upper_cloud_store(pub);
+    heap_caps_free(pub);
+}
+
+static cloud_publish_t *app_upper_cloud_publish_new(const char *key, const char *data, uint16_t len, const char *mid)
+{
+    size_t mid_size = (mid != NULL) ? strlen(mid) + 1 : 0;
+    cloud_publish_t *pub = heap_caps_malloc(sizeof(cloud_publish_t) + len + 1 + mid_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (pub == NULL) return NULL;
+    snprintf(pub->key, sizeof(pub->key), "%s", key);
+    memcpy(pub->data, data, len + 1);
+    pub->has_mid = (mid != NULL);
+    if (mid != NULL) memcpy(pub->data + len + 1, mid, mid_size);
+    return pub;
+}
+#endif
+
+// 在线异步发送（MQTT 时被客户端删除的也写入离线缓存）；离线/发送失败写入离线缓存（wifi_store），重连后补发。
+// 主动上报的状态（mid 为 NULL/"0"）按 "地址|键值名" 合并，只补发最新的；云端指令的应答每条都补发。root 由本函数释放
+static bool app_upper_cloud_send(const char *addr, const char *mid_value, const char *opcode, cJSON *root)
+{
+    char key[WIFI_STORE_KEY_SIZE];
+    if (mid_value == NULL || mid_value[0] == '\0' || strcmp(mid_value, "0") == 0) {
+        snprintf(key, sizeof(key), "%s|%s", addr, opcode);
+    } else {
+        snprintf(key, sizeof(key), "%c%s|%s", WIFI_STORE_KEY_ONCE, addr, opcode);
+    }
+    bool online = app_upper_cloud_online();
+    uint32_t seq = 0;  // 离线缓存的序号，0: 写入时分配
+    cJSON *mid = NULL;
+    #if APP_CONFIG_MQTT_ENABLE
+    if (online && app_mqtt_v5_status()) {  // MQTT 5："mid"放在 Correlation Data 中，不占消息体
+        mid = cJSON_DetachItemFromObject(root, "mid");
+    }
+    #endif
+    char *cjson_data = cJSON_PrintUnformatted(root);
+    if (cjson_data == NULL) {
+        cJSON_Delete(mid);
+        cJSON_Delete(root);
+        return 0; 
+    }
+    uint16_t data_len = strlen(cjson_data);
+
+    if (online) {
+        #ifdef APP_USER_DEBUG_ENABLE     
+        ESP_LOGI(TAG, "app_wifi_sock_write = %s | %d", cjson_data, data_len);
+        #endif   
+        seq = wifi_store_supersede(key);  // 更早的状态不再补发
+        #if APP_CONFIG_MQTT_ENABLE
+        const char *mid_str = cJSON_IsString(mid) ? mid->valuestring : NULL;
+        cloud_publish_t *pub = app_upper_cloud_publish_new(key, cjson_data, data_len, mid_str);
+        if (pub != NULL) pub->seq = seq;
+        online = (pub != NULL && app_mqtt_publish_cloud_async(cjson_data, data_len, mid_str, app_upper_cloud_publish_cb, pub) >= 0);
+        if (online == false) heap_caps_free(pub);  // 没有放进发送缓存：不会回调
+        #else
+        online = (app_upper_cloud_write(cjson_data, data_len) >= 0);
+        #endif
+    }
+    if (online == false) {
+        if (mid != NULL) {  // 离线缓存按原格式保存"mid"（补发时可能已经回落到 MQTT 3.1.1）
+            cJSON_AddItemToObject(root, "mid", mid);
+            mid = NULL;
+            cJSON_free(cjson_data);
+            cjson_data = cJSON_PrintUnformatted(root);
+        }
+        if (cjson_data != NULL) wifi_store_append(key, cjson_data, seq);
+    }
+    cJSON_free(cjson_data);
+    cJSON_Delete(mid);
+    cJSON_Delete(root);
+    return online;
+}
+
 
 /**
  * @brief  发送给云端的JSON格式
@@ -47,14 +162,8 @@ int app_upper_cloud_write(const char *data, uint16_t len)
  * @return true 
  * @return false 
  */
-bool app_upper_cloud_format(uint16_t dst_addr, const char *mid, const char *opcode, void *value, uint8_t size)
+bool app_upper_cloud_format(uint16_t dst_addr, const char *mid, const char *opcode, void *value, uint16_t size)
 {
-    #if APP_CONFIG_MQTT_ENABLE
-    if (mqtt_connect_status(0) == false) return 0;   
-    #else 
-    if (tcp_client_connect_status() == false) return 0;
-    #endif
-
     /* 2、拼接成JSON {"addr":<MAC>,"opcode":<DATA>} */ 
     cJSON *root = cJSON_CreateObject(); 
     if (root == NULL) return 0;
@@ -66,32 +175,41 @@ bool app_upper_cloud_format(uint16_t dst_addr, const char *mid, const char *opco
     cJSON_AddItemToObject(root, "mid", cJSON_CreateString(mid) );
     #endif
  
-    #define ARR_SIZE   8 
-    if (size > 0 && size < ARR_SIZE) {  // 数组格式
-        int arrint[ARR_SIZE];
-        for (uint8_t i = 0; i < size; i++) {
-            arrint[i] = ((uint8_t *)value)[i];  // 把uint8_t 转成 int 类型
+    if (size > 0) {  // 数组格式（vendor 长数据可以到 VND_DATA_MAX 字节）
+        cJSON *array = cJSON_AddArrayToObject(root, opcode);
+        for (uint16_t i = 0; array != NULL && i < size; i++) {
+            cJSON_AddItemToArray(array, cJSON_CreateNumber(((uint8_t *)value)[i]));
         }
-        cJSON_AddItemToObject(root, opcode, cJSON_CreateIntArray(arrint, size));
     } else {  // 字符串格式
         cJSON_AddItemToObject(root, opcode, cJSON_CreateString((char *)value) );
     } 
  
-    char *cjson_data = cJSON_PrintUnformatted(root);
-    if (cjson_data == NULL) return 0; 
-    uint16_t data_len = strlen(cjson_data);
-
-    #ifdef APP_USER_DEBUG_ENABLE     
-    ESP_LOGI(TAG, "app_wifi_sock_write = %s | %d", cjson_data, data_len);
-    #endif   
- 
-    app_upper_cloud_write(cjson_data, data_len);
+    return app_upper_cloud_send(uniaddr, mid, opcode, root);
+}
 
-    cJSON_free(cjson_data);
-    cJSON_Delete(root);
-    root = NULL;
+/**
+ * @brief  发送给云端的JSON格式（键值为JSON对象，比如：多目标指令的汇总结果）
+ * 
+ * @param addr ： 设备地址字符串，比如："6055f990634a|0x0005"
+ * @param opcode ： 键值名
+ * @param value ：键值，调用后由本函数释放
+ * @return true 
+ * @return false 
+ */
+bool app_upper_cloud_object(const char *addr, const char *mid, const char *opcode, cJSON *value)
+{
+    cJSON *root = cJSON_CreateObject(); 
+    if (root == NULL) {
+        cJSON_Delete(value);
+        return 0;
+    }
+    cJSON_AddItemToObject(root, "addr", cJSON_CreateString(addr) );
+    #if APP_CONFIG_MQTT_ENABLE
+    cJSON_AddItemToObject(root, "mid", cJSON_CreateString(mid) );
+    #endif
+    cJSON_AddItemToObject(root, opcode, value);
 
-    return 1;
+    return app_upper_cloud_send(addr, mid, opcode, root);
 }
  
 void app_wifi_user_init(void)
@@ -0,0 +1,353 @@
+/**
+ * @file    app_cmd.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   云端指令解码
+ *          - 只针对云端指令的格式："addr"、"mid"、"srun" 情景、"tt"/"sync" 执行方式、操作码/系统指令键名；
+ *          - 单次遍历，键名/字符串/数组值都解码到 app_cmd_t 自带的缓存中，不分配堆内存；
+ *          - 其他类型的值（对象/布尔/null）直接跳过，只保留键名。
+ * @version 0.1
+ * @date    2023-08-04
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#include "esp_log.h"
+
+#include "app_cmd.h"
+
+#define TAG "app_cmd"
+
+#define APP_CMD_STRING_MIN      16      // 系统指令会原地改写字符串（如 sntp_handler 的 value[11]），短字符串至少占这么多字节
+
+typedef struct {
+    const char *p;
+    const char *end;
+    app_cmd_t  *cmd;
+} app_cmd_reader_t;
+
+//============================================================================================
+static void app_cmd_skip_ws(app_cmd_reader_t *r)
+{
+    while (r->p < r->end && isspace((int)*r->p)) r->p++;
+}
+
+static bool app_cmd_peek(app_cmd_reader_t *r, char c)
+{
+    app_cmd_skip_ws(r);
+    return (r->p < r->end && *r->p == c);
+}
+
+static bool app_cmd_expect(app_cmd_reader_t *r, char c)
+{
+    if (app_cmd_peek(r, c) == false) return false;
+    r->p++;
+    return true;
+}
+
+static bool app_cmd_peek_number(app_cmd_reader_t *r)
+{
+    app_cmd_skip_ws(r);
+    return (r->p < r->end && (*r->p == '-' || isdigit((int)*r->p)));
+}
+
+static uint8_t app_cmd_hex(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0xFF;
+}
+
+// 解码字符串（处理转义）到缓存，return: NULL: 格式错误或缓存不够
+static char *app_cmd_read_string(app_cmd_reader_t *r)
+{
+    app_cmd_t *cmd = r->cmd;
+    if (app_cmd_expect(r, '"') == false) return NULL;
+
+    char *str = cmd->arena + cmd->arena_used;
+    char *out = str;
+    const char *limit = cmd->arena + APP_CMD_ARENA_SIZE - 1;  // 留一个'\0'
+    while (r->p < r->end && *r->p != '"') {
+        char c = *r->p++;
+        if (c == '\\') {
+            if (r->p >= r->end) return NULL;
+            c = *r->p++;
+            switch (c) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {  // \uXXXX 转成UTF-8（代理对不处理）
+                if (r->end - r->p < 4 || limit - out < 3) return NULL;
+                uint16_t code = 0;
+                for (uint8_t i = 0; i < 4; i++) {
+                    uint8_t hex = app_cmd_hex(*r->p++);
+                    if (hex == 0xFF) return NULL;
+                    code = (code << 4) | hex;
+                }
+                if (code < 0x80) {
+                    *out++ = code;
+                } else if (code < 0x800) {
+                    *out++ = 0xC0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3F);
+                } else {
+                    *out++ = 0xE0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3F);
+                    *out++ = 0x80 | (code & 0x3F);
+                }
+                continue;
+            }
+            default: break;  // '"' '\\' '/'
+            }
+        }
+        if (out >= limit) return NULL;
+        *out++ = c;
+    }
+    if (r->p >= r->end) return NULL;
+    r->p++;  // '"'
+    *out++ = '\0';
+    while (out - str < APP_CMD_STRING_MIN && out < cmd->arena + APP_CMD_ARENA_SIZE) {
+        *out++ = '\0';
+    }
+    cmd->arena_used = out - cmd->arena;
+    return str;
+}
+
+// 整数（小数/指数部分丢弃，与cJSON valueint 取整一致）
+static bool app_cmd_read_number(app_cmd_reader_t *r, int32_t *value)
+{
+    if (app_cmd_peek_number(r) == false) return false;
+    bool neg = (*r->p == '-');
+    if (neg) r->p++;
+    if (r->p >= r->end || !isdigit((int)*r->p)) return false;
+
+    uint32_t temp = 0;
+    while (r->p < r->end && isdigit((int)*r->p)) {
+        temp = temp * 10 + (*r->p++ - '0');
+    }
+    while (r->p < r->end && (isdigit((int)*r->p) || *r->p == '.' || *r->p == 'e' || *r->p == 'E' || *r->p == '+' || *r->p == '-')) {
+        r->p++;
+    }
+    *value = neg ? -(int32_t)temp : (int32_t)temp;
+    return true;
+}
+
+// 跳过一个任意的值（对象/数组/字符串/数字/true/false/null）
+static bool app_cmd_skip_value(app_cmd_reader_t *r)
+{
+    uint8_t depth = 0;
+    do {
+        app_cmd_skip_ws(r);
+        if (r->p >= r->end) return false;
+        char c = *r->p;
+        if (c == '"') {
+            for (r->p++; r->p < r->end && *r->p != '"'; r->p++) {
+                if (*r->p == '\\') r->p++;
+            }
+            if (r->p >= r->end) return false;
+            r->p++;
+        } else if (c == '{' || c == '[') {
+            depth++;
+            r->p++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) return false;
+            depth--;
+            r->p++;
+        } else if (c == ',' || c == ':') {
+            if (depth == 0) return false;
+            r->p++;
+        } else {
+            const char *start = r->p;
+            while (r->p < r->end && (isalnum((int)*r->p) || *r->p == '-' || *r->p == '+' || *r->p == '.')) r->p++;
+            if (r->p == start) return false;
+        }
+    } while (depth > 0);
+    return true;
+}
+
+// [1,2,3]：数组值直接放在缓存中
+static bool app_cmd_read_array(app_cmd_reader_t *r, app_cmd_item_t *item)
+{
+    app_cmd_t *cmd = r->cmd;
+    if (app_cmd_expect(r, '[') == false) return false;
+    item->type  = APP_CMD_TYPE_ARRAY;
+    item->array = (uint8_t *)cmd->arena + cmd->arena_used;
+    item->size  = 0;
+    if (app_cmd_expect(r, ']')) return true;
+    do {
+        int32_t value = 0;
+        if (app_cmd_peek_number(r)) {
+            if (app_cmd_read_number(r, &value) == false) return false;
+        } else if (app_cmd_skip_value(r) == false) {  // 不是数字的元素按0处理
+            return false;
+        }
+        if (cmd->arena_used >= APP_CMD_ARENA_SIZE) return false;
+        cmd->arena[cmd->arena_used++] = (uint8_t)value;
+        item->size++;
+    } while (app_cmd_expect(r, ','));
+    return app_cmd_expect(r, ']');
+}
+
+static bool app_cmd_read_value(app_cmd_reader_t *r, app_cmd_item_t *item)
+{
+    app_cmd_skip_ws(r);
+    if (r->p >= r->end) return false;
+    if (*r->p == '"') {
+        item->type = APP_CMD_TYPE_STRING;
+        item->str  = app_cmd_read_string(r);
+        return (item->str != NULL);
+    } else if (*r->p == '[') {
+        return app_cmd_read_array(r, item);
+    } else if (app_cmd_peek_number(r)) {
+        item->type = APP_CMD_TYPE_NUMBER;
+        return app_cmd_read_number(r, &item->number);
+    }
+    item->type = APP_CMD_TYPE_NULL;
+    return app_cmd_skip_value(r);
+}
+
+static bool app_cmd_read_scene(app_cmd_reader_t *r);
+
+// "tt":500 渐变时间/MS、"sync":1 同步执行（不是指令，键名不用保留），return: false: 格式错误
+static bool app_cmd_read_exec(app_cmd_reader_t *r, char *key, uint32_t *tt, bool *sync)
+{
+    bool is_tt = (strcmp(key, "tt") == 0);
+    r->cmd->arena_used = key - r->cmd->arena;
+    if (app_cmd_peek_number(r) == false) return app_cmd_skip_value(r);
+    int32_t value = 0;
+    if (app_cmd_read_number(r, &value) == false) return false;
+    if (is_tt) {
+        *tt = (value > 0) ? value : 0;
+    } else {
+        *sync = (value != 0);
+    }
+    return true;
+}
+
+// 一个动作：{"addr":"0x0005","0x8202":[1]}；top: 顶层对象，还要解析"mid"和"srun"
+static bool app_cmd_read_action(app_cmd_reader_t *r, app_cmd_action_t *action, bool top)
+{
+    app_cmd_t *cmd = r->cmd;
+    if (app_cmd_expect(r, '{') == false) return false;
+    memset(action, 0, sizeof(app_cmd_action_t));
+    action->item_start = cmd->item_num;
+    if (app_cmd_expect(r, '}')) return true;
+    do {
+        char *key = app_cmd_read_string(r);
+        if (key == NULL || app_cmd_expect(r, ':') == false) return false;
+
+        if (strcmp(key, "addr") == 0) {
+            int32_t value = 0;
+            if (app_cmd_peek(r, '"')) {
+                action->addr = app_cmd_read_string(r);
+                if (action->addr == NULL) return false;
+                action->has_addr = true;
+            } else if (app_cmd_peek_number(r)) {
+                if (app_cmd_read_number(r, &value) == false) return false;
+                action->addr_num = value;
+                action->has_addr = true;
+            } else if (app_cmd_skip_value(r) == false) {
+                return false;
+            }
+        } else if (top && strcmp(key, "mid") == 0) {
+            int32_t value = 0;
+            cmd->arena_used = key - cmd->arena;  // 键名不用保留
+            if (app_cmd_peek(r, '"')) {
+                char *mid = app_cmd_read_string(r);
+                if (mid == NULL) return false;
+                snprintf(cmd->mid, sizeof(cmd->mid), "%s", mid);
+                cmd->arena_used = mid - cmd->arena;
+            } else if (app_cmd_peek_number(r)) {
+                if (app_cmd_read_number(r, &value) == false) return false;
+                snprintf(cmd->mid, sizeof(cmd->mid), "%" PRId32, value);
+            } else if (app_cmd_skip_value(r) == false) {
+                return false;
+            }
+        } else if (top && strcmp(key, "srun") == 0) {  // 有情景时，顶层的其他指令都不执行
+            if (app_cmd_read_scene(r) == false) return false;
+        } else if (strcmp(key, "tt") == 0 || strcmp(key, "sync") == 0) {
+            if (app_cmd_read_exec(r, key, &action->tt, &action->sync) == false) return false;
+        } else {
+            if (cmd->item_num >= APP_CMD_ITEM_MAX) return false;
+            app_cmd_item_t *item = &cmd->item[cmd->item_num++];
+            memset(item, 0, sizeof(app_cmd_item_t));
+            item->key = key;
+            if (app_cmd_read_value(r, item) == false) return false;
+            action->item_num++;
+        }
+    } while (app_cmd_expect(r, ','));
+    return app_cmd_expect(r, '}');
+}
+
+// "srun":{"dtime":"1687228356","sync":1,"tt":500,"action":[{...},{...}]}
+// 情景的"tt"/"sync"作用于全部动作（动作里有"tt"的用动作自己的）
+static bool app_cmd_read_scene(app_cmd_reader_t *r)
+{
+    app_cmd_t *cmd = r->cmd;
+    uint32_t tt = 0;
+    bool sync = false;
+    cmd->scene = true;
+    if (app_cmd_peek(r, '{') == false) return app_cmd_skip_value(r);  // 格式不对，不执行任何动作
+    r->p++;
+    if (app_cmd_expect(r, '}')) return true;
+    do {
+        char *key = app_cmd_read_string(r);
+        if (key == NULL || app_cmd_expect(r, ':') == false) return false;
+
+        if (strcmp(key, "dtime") == 0 && app_cmd_peek(r, '"')) {
+            cmd->dtime = app_cmd_read_string(r);
+            if (cmd->dtime == NULL) return false;
+        } else if (strcmp(key, "action") == 0 && app_cmd_peek(r, '[')) {
+            r->p++;
+            if (app_cmd_expect(r, ']')) continue;
+            do {
+                if (app_cmd_peek(r, '{') == false) {  // 不是对象的动作跳过
+                    if (app_cmd_skip_value(r) == false) return false;
+                    continue;
+                }
+                if (cmd->action_num >= APP_CMD_ACTION_MAX) return false;
+                if (app_cmd_read_action(r, &cmd->action[cmd->action_num++], false) == false) return false;
+            } while (app_cmd_expect(r, ','));
+            if (app_cmd_expect(r, ']') == false) return false;
+        } else if (strcmp(key, "tt") == 0 || strcmp(key, "sync") == 0) {
+            if (app_cmd_read_exec(r, key, &tt, &sync) == false) return false;
+        } else if (app_cmd_skip_value(r) == false) {
+            return false;
+        }
+    } while (app_cmd_expect(r, ','));
+
+    for (uint8_t i = 0; i < cmd->action_num; i++) {
+        if (cmd->action[i].tt == 0) cmd->action[i].tt = tt;
+        if (sync) cmd->action[i].sync = true;
+    }
+    return app_cmd_expect(r, '}');
+}
+
+//============================================================================================
+bool app_cmd_decode(const char *data, uint16_t len, app_cmd_t *cmd)
+{
+    app_cmd_reader_t reader = {
+        .p   = data,
+        .end = data + len,
+        .cmd = cmd,
+    };
+    strcpy(cmd->mid, "0");
+    cmd->dtime      = NULL;
+    cmd->scene      = false;
+    cmd->action_num = 0;
+    cmd->item_num   = 0;
+    cmd->arena_used = 0;
+
+    if (app_cmd_read_action(&reader, &cmd->root, true) == false) {
+        #ifdef TAG
+        ESP_LOGE(TAG, "decode error at %d, arena %d, item %d", (int)(reader.p - data), cmd->arena_used, cmd->item_num);
+        #endif
+        return false;
+    }
+    return true;
+}
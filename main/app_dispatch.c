@@ -0,0 +1,137 @@
+/**
+ * @file    app_dispatch.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   指令分发
+ *          - 处理表还是静态常量表，初始化时按 FNV-1a 哈希建立开放寻址索引；
+ *          - 索引槽数至少是表项数的两倍，查找一般只需一次哈希 + 一次比较，增加处理函数不会增加每条消息的开销。
+ * @version 0.1
+ * @date    2023-08-05
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "app_dispatch.h"
+
+#define TAG "app_dispatch"
+
+#define APP_DISPATCH_SLOT_NULL  0xFF
+
+//============================================================================================
+static uint32_t app_dispatch_hash_name(const char *name)
+{
+    uint32_t hash = 2166136261UL;  // FNV-1a
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static uint32_t app_dispatch_hash_opcode(uint32_t opcode)
+{
+    opcode ^= opcode >> 16;
+    opcode *= 0x45D9F3BUL;
+    opcode ^= opcode >> 16;
+    return opcode;
+}
+
+static const void *app_dispatch_entry(const app_dispatch_t *dispatch, uint8_t index)
+{
+    return (const uint8_t *)dispatch->table + index * dispatch->stride;
+}
+
+static uint32_t app_dispatch_entry_hash(const app_dispatch_t *dispatch, uint8_t index)
+{
+    const void *entry = app_dispatch_entry(dispatch, index);
+    if (dispatch->opcode) {
+        return app_dispatch_hash_opcode(*(const uint32_t *)entry);
+    }
+    return app_dispatch_hash_name(*(const char * const *)entry);
+}
+
+static bool app_dispatch_init(app_dispatch_t *dispatch, const void *table, uint16_t stride, uint8_t num, bool opcode)
+{
+    memset(dispatch, 0, sizeof(app_dispatch_t));
+    memset(dispatch->slot, APP_DISPATCH_SLOT_NULL, sizeof(dispatch->slot));
+    if (num > APP_DISPATCH_NUM_MAX) {  // 不截断：截掉的表项会变成"未知指令"，宁可整张表不可用并报错
+        #ifdef TAG
+        ESP_LOGE(TAG, "table too large: %d > %d", num, APP_DISPATCH_NUM_MAX);
+        #endif
+        return false;
+    }
+
+    uint8_t size = 8;
+    while (size < num * 2) size <<= 1;
+
+    dispatch->table  = table;
+    dispatch->stride = stride;
+    dispatch->num    = num;
+    dispatch->mask   = size - 1;
+    dispatch->opcode = opcode;
+
+    for (uint8_t i = 0; i < num; i++) {
+        uint8_t pos = app_dispatch_entry_hash(dispatch, i) & dispatch->mask;
+        while (dispatch->slot[pos] != APP_DISPATCH_SLOT_NULL) {
+            pos = (pos + 1) & dispatch->mask;  // 线性探测
+        }
+        dispatch->slot[pos] = i;
+    }
+    return true;
+}
+
+//============================================================================================
+bool app_dispatch_name_init(app_dispatch_t *dispatch, const void *table, uint16_t stride, uint8_t num)
+{
+    return app_dispatch_init(dispatch, table, stride, num, false);
+}
+
+bool app_dispatch_opcode_init(app_dispatch_t *dispatch, const void *table, uint16_t stride, uint8_t num)
+{
+    return app_dispatch_init(dispatch, table, stride, num, true);
+}
+
+const void *app_dispatch_name_find(const app_dispatch_t *dispatch, const char *name)
+{
+    if (dispatch->table == NULL || name == NULL) return NULL;
+    uint8_t pos = app_dispatch_hash_name(name) & dispatch->mask;
+    while (dispatch->slot[pos] != APP_DISPATCH_SLOT_NULL) {
+        const void *entry = app_dispatch_entry(dispatch, dispatch->slot[pos]);
+        if (strcmp(*(const char * const *)entry, name) == 0) return entry;
+        pos = (pos + 1) & dispatch->mask;
+    }
+    return NULL;
+}
+
+const void *app_dispatch_opcode_find(const app_dispatch_t *dispatch, uint32_t opcode)
+{
+    if (dispatch->table == NULL) return NULL;
+    uint8_t pos = app_dispatch_hash_opcode(opcode) & dispatch->mask;
+    while (dispatch->slot[pos] != APP_DISPATCH_SLOT_NULL) {
+        const void *entry = app_dispatch_entry(dispatch, dispatch->slot[pos]);
+        if (*(const uint32_t *)entry == opcode) return entry;
+        pos = (pos + 1) & dispatch->mask;
+    }
+    return NULL;
+}
+
+bool app_dispatch_parse_opcode(const char *key, uint32_t *opcode)
+{
+    if (key == NULL || key[0] != '0' || (key[1] != 'x' && key[1] != 'X')) return false;
+    uint32_t value = 0;
+    uint8_t  len = 0;
+    for (key += 2; *key; key++, len++) {
+        char c = *key;
+        if (len >= 8) return false;
+        if (c >= '0' && c <= '9') c -= '0';
+        else if (c >= 'a' && c <= 'f') c -= 'a' - 10;
+        else if (c >= 'A' && c <= 'F') c -= 'A' - 10;
+        else return false;
+        value = (value << 4) | c;
+    }
+    if (len == 0) return false;
+    *opcode = value;
+    return true;
+}
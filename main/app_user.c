@@ -8,6 +8,7 @@
  * @copyright Copyright (c) 2022
  * */
 #include <stdio.h>
+#include <ctype.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
@@ -16,11 +17,20 @@
 #include "nvs_flash.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_heap_caps.h"
 #include "mbedtls/base64.h"
 
 #include "ble_gatts.h"
 #include "ble_gattc.h"
 #include "ble_mesh.h"
+#include "ble_mesh_tx.h"
+#include "ble_mesh_shadow.h"
+#include "ble_mesh_group.h"
+#include "ble_mesh_prov.h"
+#include "ble_mesh_reset.h"
+#include "ble_mesh_ota.h"
+#include "ble_mesh_metrics.h"
+#include "ble_mesh_pool.h"
 #include "ble_bind.h"
 
 #include "wifi_init.h"
@@ -29,8 +39,11 @@
 #include "wifi_user.h"
 #include "wifi_ota.h"
 #include "wifi_mqtt.h"
+#include "wifi_store.h"
  
 #include "app_user.h"
+#include "app_cmd.h"
+#include "app_dispatch.h"
 
 #define APP_CONFIG_MQTT_ENABLE    1 // 1: 使能MQTT; 0: TCP/UDP 
 #define APP_USER_DEBUG_ENABLE     1
@@ -59,10 +72,23 @@ static SemaphoreHandle_t  xSemap = NULL;
 
 static char mid_value[14];      // 消息ID字符串值；10位时间戳 + 3位编码
 static char mid_ota_value[14];  // OTA时的消息ID值
+static bool ota_node_all = false;  // "url|all": 升级和目标节点同型号（pid）的全部节点
+static char mid_bind_value[14]; // 批量配网时的消息ID值
+static char mid_unbind_value[14];  // 解绑时的消息ID值
+static uint16_t unbind_single = 0x0000;  // 单个解绑的节点：完成后按原格式回复
  
 //==============================================================================================================
 //==============================================================================================================
 static char *clear_handler(app_parse_data_t item);
+static char *state_handler(app_parse_data_t item);
+static char *metrics_handler(app_parse_data_t item);
+static char *nodemax_handler(app_parse_data_t item);
+static void state_refresh_task(void);
+static void mesh_batch_verify_task(void);
+static void app_mesh_ota_start(void);
+#if APP_CONFIG_MQTT_ENABLE
+static void metrics_publish_task(void);
+#endif
 
 //==============================================================================================================
 //==============================================================================================================
@@ -164,6 +190,24 @@ static void app_user_task(void *arg)
         //=============================================================================
         key_scan_task();
 
+        //=============================================================================
+        /* 后台刷新过期的设备状态 */
+        state_refresh_task();
+
+        //=============================================================================
+        /* 自动分组组播后的确认GET（等节点执行完） */
+        mesh_batch_verify_task();
+
+        //=============================================================================
+        /* 定时上报收发统计 */
+        #if APP_CONFIG_MQTT_ENABLE && MESH_METRICS_PERIOD > 0
+        static uint32_t metrics_timecnt = 0;
+        if (++metrics_timecnt >= MESH_METRICS_PERIOD * 10) {
+            metrics_timecnt = 0;
+            metrics_publish_task();
+        }
+        #endif
+
         //=============================================================================
         /* UDP定时广播 */
         #if !APP_CONFIG_MQTT_ENABLE
@@ -180,6 +224,8 @@ static void app_user_task(void *arg)
                 ota_timecnt = 0;
                 if (ota_plan_last == 0)  {  
                     audio_voice = VOICE_COMM_OTA;  // 提示OTA开始
+                } else if (ota_plan == 200) {  // 节点固件下载完成，网关不复位
+                    app_mesh_ota_start();
                 } else if (ota_plan >= 100) {
                     audio_voice = VOICE_COMM_OTA_OK;
                     sys_reset_enable = true;  // 使能软复位
@@ -337,9 +383,32 @@ static char *clear_handler(app_parse_data_t item)
     return "ok";
 }
 
+// {"nodemax":"64"} ==>> "ok"，保存后重启，按新的大小分配登记表；"used": 要缩掉的部分还有设备，先解绑；
+// "fail": 不在 BIND_TABLE_MIN ~ BIND_TABLE_MAX（协议栈配网节点数/影子表/解绑队列的上限）之间
+// {"nodemax":"get"} ==>> 当前的大小，如 "128"
+static char *nodemax_handler(app_parse_data_t item)
+{
+    static char size_str[8];
+    char *value = (char *)item.value;
+    if (value == NULL || item.size > 0) return "fail";  // 要字符串格式
+    if (strcmp(value, "get") == 0) {
+        sprintf(size_str, "%d", BIND_TABLE_SIZE);
+        return size_str;
+    }
+    esp_err_t err = mesh_bind_set_size(atoi(value));
+    if (err == ESP_ERR_INVALID_SIZE) return "used";
+    if (err != ESP_OK) return "fail";
+    sys_reset_enable = true;   // 使能软复位
+    return "ok";
+}
+
 static char *ota_handler(app_parse_data_t item)
 {
+    if (ble_mesh_ota_busy()) return "busy";  // 节点固件还在分发
     strcpy(mid_ota_value, mid_value);  // 复制OTA的消息ID
+    char *all = strstr((char *)item.value, "|all");
+    ota_node_all = (all != NULL);
+    if (all != NULL) *all = '\0';
     app_ota_start(item.addr, (char *)item.value);  // 启动OTA
     return NULL;
 }
@@ -354,11 +423,34 @@ static char *sntp_handler(app_parse_data_t item)
     return NULL;
 }
 
+// 批量配网：逐个加入配网队列，return: 入队的设备数
+static uint8_t bind_queue_handler(char *value)
+{
+    uint8_t num = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(value, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        if (strlen(token) < 13 || token[12] != '|') continue;
+        token[12] = '\0';
+        uint8_t addr[6];
+        mac_utils_str2hex(token, addr);
+        if (ble_mesh_prov_queue_add(addr, token + 13) == ESP_OK) num++;
+    }
+    strcpy(mid_bind_value, mid_value);  // 复制批量配网的消息ID
+    return num;
+}
+
 // {"bind":"<MAC>|<NAME>"} 
 // {"bind":"ok/fail"}    
+// {"bind":"<MAC>|<NAME>,<MAC>|<NAME>,..."}: 批量配网 ==>> {"bind":"3"}（入队的设备数），
+// 之后每个设备配网完成/失败上报一次 {"addr":"0x0001","mid":"...","bind":{"<MAC>":"0x0005"}}，失败："fail"
 static char *bind_handler(app_parse_data_t item)
 {
     char *value = (char *)item.value;
+
+    if (strchr(value, ',') != NULL || ble_mesh_prov_queue_busy()) {  // 批量配网（队列忙时单个设备也要排队）
+        sprintf(value, "%d", bind_queue_handler(value));
+        return value;
+    }
  
     value[12] = '\0';  // '|' ===>>> '\0'
     uint8_t addr[6];
@@ -373,54 +465,72 @@ static char *bind_handler(app_parse_data_t item)
     }
 }
 
+// 解绑都在后台流水线执行（ble_mesh_reset），不阻塞指令处理：
+// {"unbind":"0x0005"} ==>> 完成后回复 {"unbind":"0x0005"}，失败立即回复 "fail"
+// {"unbind":"0x0005|0x0006|..."} 或 {"unbind":"all"} ==>> 立即回复入队的节点数 {"unbind":"2"}，
+// 之后每个节点完成上报一次 {"unbind":{"0x0005":"ok","remain":1}}（"offline": 节点没有响应，只删除了配网信息），
+// 全部解绑最后再上报 {"unbind":"all"}
 static char *unbind_handler(app_parse_data_t item)
 {
     char *value = (char *)item.value;
 
+    strcpy(mid_unbind_value, mid_value);  // 复制解绑的消息ID
     if (strcmp(value, "all") == 0) {  // 全部解绑
-        ble_mesh_prov_unbind_delete_all();  // 全部解绑
+        sprintf(value, "%d", ble_mesh_reset_queue_all());
+    } else if (strchr(value, '|') != NULL) {  // 批量解绑
+        uint16_t num = 0;
+        char *save = NULL;
+        for (char *token = strtok_r(value, "|", &save); token != NULL; token = strtok_r(NULL, "|", &save)) {
+            if (ble_mesh_reset_queue_add(strtol(token, NULL, 16)) == ESP_OK) num++;
+        }
+        sprintf(value, "%d", num);
     } else {
         uint16_t uniaddr = strtol(value, NULL, 16);
-        uniaddr = ble_mesh_prov_unbind_delete(uniaddr);  // 删除绑定设备
-        if (uniaddr == 0) strcpy(value, "fail");
+        if (ble_mesh_reset_queue_add(uniaddr) != ESP_OK) return "fail";
+        unbind_single = uniaddr;
+        return NULL;  // 完成后回复
     }
     return value;
 }
  
-uint8_t app_json_parse(cJSON *jroot);
+uint8_t app_json_parse(app_cmd_t *cmd, app_cmd_action_t *action);
+
+static uint32_t scene_apply_tick = 0;  // 情景同步执行：全部动作共用一个执行时间
+
+// 一个动作要发的mesh消息数（目标数 x 指令数）
+static uint16_t app_action_msg_num(const app_cmd_action_t *action)
+{
+    uint16_t num = 1;
+    for (const char *p = action->addr; p != NULL && *p != '\0'; p++) {
+        if (*p == '|') num++;
+    }
+    return num * action->item_num;
+}
+
 // 在线情景模式运行
-static void scene_run_handler(cJSON *jroot)
+static void scene_run_handler(app_cmd_t *cmd)
 {
-    cJSON *dtime_item = cJSON_GetObjectItem(jroot, "dtime");
-    if (dtime_item != NULL) {
+    if (cmd->dtime != NULL) {
         #ifdef TAG  // debug
-        ESP_LOGI(TAG, "dtime = %s", dtime_item->valuestring);
+        ESP_LOGI(TAG, "dtime = %s", cmd->dtime);
         #endif
     }
 
-    cJSON *action_item = cJSON_GetObjectItem(jroot, "action");
-    if (action_item == NULL) {
-        #ifdef TAG  // debug
-        ESP_LOGE(TAG, "action_item error");
-        #endif
-        return;
+    uint16_t sync_num = 0;
+    for (uint8_t index = 0; index < cmd->action_num; index++) {
+        if (cmd->action[index].sync) sync_num += app_action_msg_num(&cmd->action[index]);
     }
-    if (action_item->type != cJSON_Array) return;  // 不是数组类型
+    scene_apply_tick = (sync_num > 0) ? ble_mesh_tx_sync_tick(sync_num) : 0;
 
-    uint8_t jSize = cJSON_GetArraySize(action_item);
-    for (uint8_t size = 0; size < jSize; size++) {
-        cJSON *arr_item = cJSON_GetArrayItem(action_item, size);  // 遍历
-        if (cJSON_IsNull(arr_item))  break; // 为空
-        if (arr_item->type != cJSON_Object) continue;
+    for (uint8_t index = 0; index < cmd->action_num; index++) {
         #ifdef TAG 
-        char *data = cJSON_PrintUnformatted(arr_item);
-        ESP_LOGI(TAG, "action[%d] = %s", size, data);
-        cJSON_free(data);
+        ESP_LOGI(TAG, "action[%d]: items = %d", index, cmd->action[index].item_num);
         #endif
         //===========================================================================
-        uint8_t ret = app_json_parse(arr_item);  // 解析JSON数据
+        uint8_t ret = app_json_parse(cmd, &cmd->action[index]);  // 解析JSON数据
         if (ret == APP_PARSE_EXIT || ret == APP_PARSE_NULL) break;
     }
+    scene_apply_tick = 0;
 }
 
 
@@ -436,6 +546,9 @@ static const json_handler_t sys_handler_table[] = {
     { "ota",        ota_handler         },
     { "bind",       bind_handler        },
     { "unbind",     unbind_handler      },
+    { "state",      state_handler       },
+    { "metrics",    metrics_handler     },
+    { "nodemax",    nodemax_handler     },
 #if SCENE_LOCAL_ENABLE
     /* scene 情景 */
     { "srun",       srun_handler        },
@@ -446,171 +559,849 @@ static const json_handler_t sys_handler_table[] = {
 }; 
 
 #define SYS_TABLE_SIZE    (sizeof(sys_handler_table) / sizeof(json_handler_t))
+APP_DISPATCH_TABLE_CHECK(sys_handler_table);
+
+static app_dispatch_t sys_dispatch;   // 系统指令键名索引
 //========================================================================================
  
-// mesh云端数据处理
-static bool mesh_cloud_handler(app_parse_data_t item)
+// mesh云端指令的异步上下文：发送引擎回调时再响应云端，所以消息ID要单独保存
+typedef struct {
+    bool       busy;
+    char       mid[14];                 // 消息ID
+    char       key[12];                 // 云端下发的键名, 如: "0x8202"
+    uint16_t   addr;                    // 云端下发的目标地址（发送引擎可能路由到其他元素）
+    uint8_t    size;
+    ARRAY_TYPE value[VND_DATA_SIZE];
+} mesh_cloud_req_t;
+
+static mesh_cloud_req_t mesh_cloud_req[MESH_TX_QUEUE_SIZE];
+static portMUX_TYPE mesh_cloud_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static mesh_cloud_req_t *mesh_cloud_req_alloc(void)
 {
-    bool ret = false;
-    ARRAY_TYPE *value = (ARRAY_TYPE *)item.value;  // 数组格式
-    const char *opcode = NULL;
+    mesh_cloud_req_t *req = NULL;
+    taskENTER_CRITICAL(&mesh_cloud_lock);
+    for (uint8_t i = 0; i < MESH_TX_QUEUE_SIZE; i++) {
+        if (mesh_cloud_req[i].busy == false) {
+            mesh_cloud_req[i].busy = true;
+            req = &mesh_cloud_req[i];
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&mesh_cloud_lock);
+    return req;
+}
+
+static void mesh_cloud_req_free(mesh_cloud_req_t *req)
+{
+    taskENTER_CRITICAL(&mesh_cloud_lock);
+    req->busy = false;
+    taskEXIT_CRITICAL(&mesh_cloud_lock);
+}
 
-    switch (item.opcode) {
+// mesh操作码 => 上报云端的键名
+static const char *mesh_status_opcode_str(uint32_t opcode)
+{
+    switch (opcode) {
     case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
-        ESP_LOGI(TAG, "GEN_ONOFF_SET: ONOFF: %d", value[0]);
-        ret = ble_mesh_onoff_set(item.dst_addr, value[0]);
-        if (ret) opcode = "0x8204";
-        break;
     case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET:
-        ESP_LOGI(TAG, "GEN_ONOFF_GET: ONOFF");
-        ret = ble_mesh_onoff_get(item.dst_addr);
-        break;
-    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET: {
-        esp_ble_mesh_state_change_light_hsl_set_t hsl;
-        hsl.hue = BIG_DATA_2_OCTET(value, 0);
-        hsl.saturation = BIG_DATA_2_OCTET(value, 2);
-        hsl.lightness  = BIG_DATA_2_OCTET(value, 4);
-        ret = ble_mesh_light_hsl_set(item.dst_addr, hsl);
-        if (ret) opcode = "0x8278";
-        ESP_LOGI(TAG, "LIGHT_HSL_SET: HSL: %d %d %d", hsl.hue, hsl.saturation, hsl.lightness);
-        break;
-    }
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS: 
+        return "0x8204";
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
     case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET:
-        ESP_LOGI(TAG, "LIGHT_HSL_GET");
-        ret = ble_mesh_light_hsl_get(item.dst_addr);
-        break;
-    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET: {
-        esp_ble_mesh_state_change_light_ctl_set_t ctl;
-        ctl.lightness = BIG_DATA_2_OCTET(value, 0);
-        ctl.temperature = BIG_DATA_2_OCTET(value, 2);
-        ctl.delta_uv = 0;
-        ret = ble_mesh_light_ctl_set(item.dst_addr, ctl);
-        if (ret) opcode = "0x8260";
-        ESP_LOGI(TAG, "LIGHT_CTL_SET: lightness %d, temperature %d", ctl.lightness, ctl.temperature); 
-        break;
-    }
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
+        return "0x8278";
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET:
     case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
-        ESP_LOGI(TAG, "LIGHT_CTL_GET");
-        ret = ble_mesh_light_ctl_get(item.dst_addr);
-        break;
-    case GENIE_MODEL_OP_ATTR_SET:    
-    case GENIE_MODEL_OP_ATTR_GET:   
-        esp_log_buffer_hex("GENIE_MODEL_OP_ATTR_SET", (ARRAY_TYPE *)item.value, item.size);   
-        ret = ble_mesh_send_vendor_message(item.dst_addr, item.opcode, (ARRAY_TYPE *)item.value, item.size); 
-        break;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_STATUS:
+        return "0x8260";
+    case GENIE_MODEL_OP_ATTR_SET:
+    case GENIE_MODEL_OP_ATTR_GET:
+    case GENIE_MODEL_OP_ATTR_STATUS:
+        return "0xD402E5";
     default:
-        break;
+        return NULL;
     }
+}
 
-    if (ret == true) {
-        if (opcode != NULL) {
+// 发送引擎回调：每条指令收到自己的响应后立即应答云端
+static void mesh_cloud_ack_callback(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    mesh_cloud_req_t *req = (mesh_cloud_req_t *)arg;
+
+    if (err == ESP_ERR_NOT_SUPPORTED) {  // 节点没有这个模型（按 Composition Data 本地判断）
+        app_upper_cloud_format(req->addr, req->mid, req->key, (char *)"unsupported", 0);
+    } else if (err != ESP_OK) {  // 错误、超时
+        app_upper_cloud_format(req->addr, req->mid, req->key, (char *)"fail", 0);
+    } else {
+        switch (msg->opcode) {
+        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
+        case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:
+        case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET: {  // 设置成功，响应设置的值
+            const char *opcode = mesh_status_opcode_str(msg->opcode);
             ESP_LOGI(TAG, "ack mesh_set_opcode = %s", opcode);
-            app_upper_cloud_format(item.dst_addr, mid_value, opcode, item.value, item.size);
+            app_upper_cloud_format(req->addr, req->mid, opcode, req->value, req->size);
+            break;
         }
-    } 
+        default: {  // GET/vendor，响应节点的状态数据
+            const char *opcode = status ? mesh_status_opcode_str(status->opcode) : NULL;
+            if (opcode != NULL && status->len > 0) {
+                app_upper_cloud_format(status->unicast_addr, req->mid, opcode, mesh_transfer_data(status), status->len);
+            }
+            break;
+        }
+        }
+    }
 
-    return ret;
+    mesh_cloud_req_free(req);
+}
+ 
+// 云端支持的mesh操作码
+#define MESH_CLOUD_LEN_VAR   0xFF   // 数据长度等于云端数组长度
+typedef struct {
+    uint32_t    opcode;
+    const char *name;
+    uint8_t     min_size;   // 云端数组最少的长度
+    uint8_t     len;        // mesh消息的数据长度
+} mesh_cloud_op_t;
+
+static const mesh_cloud_op_t mesh_cloud_op_table[] = {
+    { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET,  "GEN_ONOFF_SET",  1, 1                  },  // [onoff]
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET,  "LIGHT_HSL_SET",  6, 6                  },  // [H, S, L] 大端
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET,  "LIGHT_CTL_SET",  4, 4                  },  // [lightness, temperature] 大端
+    { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET,  "GEN_ONOFF_GET",  0, 0                  },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET,  "LIGHT_HSL_GET",  0, 0                  },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET,  "LIGHT_CTL_GET",  0, 0                  },
+    { GENIE_MODEL_OP_ATTR_SET,              "GENIE_ATTR_SET", 0, MESH_CLOUD_LEN_VAR },
+    { GENIE_MODEL_OP_ATTR_GET,              "GENIE_ATTR_GET", 0, MESH_CLOUD_LEN_VAR },
+};
+APP_DISPATCH_TABLE_CHECK(mesh_cloud_op_table);
+
+static app_dispatch_t mesh_cloud_dispatch;   // mesh操作码索引
+
+// 云端指令 => mesh消息
+static bool mesh_cloud_msg_build(app_parse_data_t item, mesh_msg_t *msg)
+{
+    ARRAY_TYPE *value = (ARRAY_TYPE *)item.value;  // 数组格式
+    memset(msg, 0, sizeof(mesh_msg_t));
+    msg->dst_addr = item.dst_addr;
+    msg->opcode   = item.opcode;
+
+    const mesh_cloud_op_t *op = app_dispatch_opcode_find(&mesh_cloud_dispatch, item.opcode);
+    if (op == NULL || item.size < op->min_size) return false;  // 不支持的操作码，或者数据不够
+    msg->len = (op->len == MESH_CLOUD_LEN_VAR) ? item.size : op->len;
+    if (msg->len > VND_DATA_MAX) return false;
+
+    ESP_LOGI(TAG, "%s: dst_addr = 0x%04x", op->name, msg->dst_addr);
+    if (msg->len > 0) esp_log_buffer_hex(op->name, value, msg->len);
+    if (msg->len > VND_DATA_SIZE) {  // 长数据放到缓存池，协议栈分包发送
+        msg->ext = ble_mesh_pool_dup(value, msg->len);
+        if (msg->ext == NULL) return false;
+    } else {
+        memcpy(msg->data, value, msg->len);
+    }
+    msg->trans_time = item.trans_time;
+    msg->apply_tick = item.apply_tick;
+    return true;
+}
+
+// mesh云端数据处理：提交给发送引擎后立即返回，响应在 mesh_cloud_ack_callback() 中上报
+static bool mesh_cloud_handler(app_parse_data_t item)
+{
+    mesh_msg_t msg;
+    if (mesh_cloud_msg_build(item, &msg) == false) return false;
+
+    mesh_cloud_req_t *req = mesh_cloud_req_alloc();
+    if (req == NULL) {  // 正在处理的指令太多了
+        ble_mesh_pool_free(msg.ext);
+        return false;
+    }
+    strcpy(req->mid, mid_value);
+    snprintf(req->key, sizeof(req->key), "%s", item.name);
+    req->addr = msg.dst_addr;
+    req->size = (msg.ext == NULL) ? msg.len : 0;  // 只有 SIG SET 要响应设置的值（都是短数据）
+    memcpy(req->value, msg.data, req->size);
+
+    if (ble_mesh_tx_submit(&msg, mesh_cloud_ack_callback, req) != ESP_OK) {
+        mesh_cloud_req_free(req);
+        return false;
+    }
+    return true;
 }      
 
+//========================================================================================
+// 多目标指令：{"addr":"6055f990634a|0x0005|YiCW29608","0x8202":[1],"mid":"1687228356002"}
+// 同一个指令并发发给全部目标，全部完成后汇总成一条消息响应云端：
+// {"addr":"6055f990634a|0x0005|YiCW29608","mid":"1687228356002","0x8204":{"6055f990634a":[1],"0x0005":[1],"YiCW29608":"fail"}}
+// 加上 "tt":800 渐变800MS，"sync":1 全部目标同一时间执行（按发送排队时间算每条消息的 Delay）
+// 改成自动分组组播（SET_UNACK）时，不验证的目标响应 "unverified"（节点没有确认收到）
+typedef struct {
+    app_target_t target;
+    void        *batch;                 // 所属的 mesh_batch_t
+    esp_err_t    err;
+    uint16_t     len;
+    uint8_t      data[VND_DATA_SIZE];   // 节点响应的数据
+    uint8_t     *ext;                   // 节点响应的长数据（缓存池，汇总上报后释放）
+} mesh_batch_item_t;
+
+typedef struct mesh_batch {
+    struct mesh_batch *next;            // 等待确认GET的链表
+    TickType_t verify_tick;             // 节点执行完的时间（渐变+延时），之后再发确认GET
+    bool     grouped;                   // 已改成自动分组组播
+    uint8_t  num;                       // 目标数
+    uint8_t  pending;                   // 还没完成的目标数（提交过程中多持有一个）
+    uint32_t opcode;
+    char     mid[14];
+    char     key[12];                   // 云端下发的键名
+    char     addr[APP_ADDR_STR_MAX];    // 云端下发的原始"addr"
+    uint8_t  size;
+    uint8_t  value[VND_DATA_SIZE];      // 设置的值
+    mesh_batch_item_t item[APP_TARGET_MAX];
+} mesh_batch_t;
+
+static cJSON *app_json_int_array(const uint8_t *data, uint16_t len)
+{
+    cJSON *array = cJSON_CreateArray();
+    for (uint16_t i = 0; array != NULL && i < len; i++) {
+        cJSON_AddItemToArray(array, cJSON_CreateNumber(data[i]));
+    }
+    return array;
+}
+
+static void mesh_batch_report(mesh_batch_t *batch)
+{
+    cJSON *result = cJSON_CreateObject();
+    if (result == NULL) return;
+    for (uint8_t i = 0; i < batch->num; i++) {
+        mesh_batch_item_t *item = &batch->item[i];
+        cJSON *value = NULL;
+        if (item->err != ESP_OK) {
+            value = cJSON_CreateString("fail");
+        } else if (batch->grouped && !MESH_GROUP_VERIFY) {  // 组播 SET_UNACK：只知道发出去了
+            value = cJSON_CreateString("unverified");
+        } else if (batch->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET ||
+                   batch->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET ||
+                   batch->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET) {  // 设置成功，响应设置的值
+            value = app_json_int_array(batch->value, batch->size);
+        } else if (item->len > 0) {  // GET/vendor，响应节点的状态数据
+            value = app_json_int_array(item->ext ? item->ext : item->data, item->len);
+        } else {  // 组播地址，没有响应数据
+            value = cJSON_CreateString("ok");
+        }
+        cJSON_AddItemToObject(result, item->target.name, value);
+    }
+
+    const char *opcode = mesh_status_opcode_str(batch->opcode);
+    app_upper_cloud_object(batch->addr, batch->mid, opcode ? opcode : batch->key, result);
+}
+
+static void mesh_batch_release(mesh_batch_t *batch)
+{
+    taskENTER_CRITICAL(&mesh_cloud_lock);
+    uint8_t pending = --batch->pending;
+    taskEXIT_CRITICAL(&mesh_cloud_lock);
+    if (pending == 0) {  // 全部目标都完成了
+        mesh_batch_report(batch);
+        for (uint8_t i = 0; i < batch->num; i++) {
+            ble_mesh_pool_free(batch->item[i].ext);
+        }
+        heap_caps_free(batch);
+    }
+}
+
+static void mesh_batch_callback(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    mesh_batch_item_t *item = (mesh_batch_item_t *)arg;
+    item->err = err;
+    if (err == ESP_OK && status != NULL) {
+        if (status->ext != NULL) {  // 发送引擎回调返回后就释放了，复制一份
+            item->ext = ble_mesh_pool_dup(status->ext, status->len);
+            if (item->ext == NULL) item->err = ESP_ERR_NO_MEM;
+        } else {
+            memcpy(item->data, status->data, status->len);
+        }
+        item->len = status->len;
+    }
+    mesh_batch_release((mesh_batch_t *)item->batch);
+}
+
+#if MESH_GROUP_VERIFY
+static mesh_batch_t *mesh_batch_verify_list = NULL;  // 等待确认GET的批量指令，由 mesh_cloud_lock 保护
+#endif
+
+// 组播发送完成（没有响应数据）：验证时等节点执行完再逐个GET，否则全部目标用组播的结果
+static void mesh_batch_group_callback(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    mesh_batch_t *batch = (mesh_batch_t *)arg;
+    #if MESH_GROUP_VERIFY
+    if (err == ESP_OK) {  // 组播消息持有的计数交给 mesh_batch_verify_task()
+        uint32_t ms = msg->delay * BLE_MESH_DELAY_STEP + ble_mesh_trans_time_decode(msg->trans_time);
+        batch->verify_tick = xTaskGetTickCount() + pdMS_TO_TICKS(ms);
+        taskENTER_CRITICAL(&mesh_cloud_lock);
+        batch->next = mesh_batch_verify_list;
+        mesh_batch_verify_list = batch;
+        taskEXIT_CRITICAL(&mesh_cloud_lock);
+        return;
+    }
+    #endif
+    for (uint8_t i = 0; i < batch->num; i++) {
+        batch->item[i].err = err;
+        mesh_batch_release(batch);
+    }
+    mesh_batch_release(batch);
+}
+
+#if MESH_GROUP_VERIFY
+// 确认GET的状态是否就是组播设置的目标状态（都是大端格式，见 mesh_msg_t.data）
+static bool mesh_batch_state_match(const mesh_batch_t *batch, const mesh_transfer_t *status)
+{
+    const uint8_t *data = mesh_transfer_data(status);
+    switch (batch->opcode) {
+    case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:  // [onoff]
+        return status->len >= 1 && batch->size >= 1 && data[0] == batch->value[0];
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET:  // [H, S, L]
+        return status->len >= 6 && batch->size >= 6 && memcmp(data, batch->value, 6) == 0;
+    case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET: {  // [lightness, temperature]，SET 的色温是相对 BLE_MESH_TEMPERATURE_MIN 的值
+        if (status->len < 4 || batch->size < 4) return false;
+        uint16_t temperature = (uint16_t)(BIG_DATA_2_OCTET(batch->value, 2) + BLE_MESH_TEMPERATURE_MIN);
+        return memcmp(data, batch->value, 2) == 0 && BIG_DATA_2_OCTET(data, 2) == temperature;
+    }
+    default:  // vendor: [属性类型, 长度, 值...]
+        return status->len >= batch->size && memcmp(data, batch->value, batch->size) == 0;
+    }
+}
+
+// 组播后的确认GET：节点要响应，并且状态要等于设置的目标状态
+static void mesh_batch_verify_callback(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    mesh_batch_item_t *item = (mesh_batch_item_t *)arg;
+    if (err == ESP_OK && (status == NULL || mesh_batch_state_match((mesh_batch_t *)item->batch, status) == false)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    mesh_batch_callback(msg, err, status, arg);
+}
+
+// 逐个目标提交确认GET（不用状态影子）
+static void mesh_batch_verify_send(mesh_batch_t *batch)
+{
+    static const uint32_t verify_opcode[][2] = {
+        { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET },
+        { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET, ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET },
+        { ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_SET, ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET },
+        { GENIE_MODEL_OP_ATTR_SET,             GENIE_MODEL_OP_ATTR_GET },
+    };
+    mesh_msg_t get = { 0 };
+    get.force = 1;
+    for (uint8_t i = 0; i < sizeof(verify_opcode) / sizeof(verify_opcode[0]); i++) {
+        if (verify_opcode[i][0] == batch->opcode) get.opcode = verify_opcode[i][1];
+    }
+    if (get.opcode == GENIE_MODEL_OP_ATTR_GET) {  // 按属性GET: [属性类型]
+        get.len = (batch->size < 2) ? batch->size : 2;
+        memcpy(get.data, batch->value, get.len);
+    }
+    for (uint8_t i = 0; i < batch->num; i++) {
+        mesh_batch_item_t *item = &batch->item[i];
+        get.dst_addr = item->target.uniaddr;
+        if (ble_mesh_tx_submit(&get, mesh_batch_verify_callback, item) != ESP_OK) {
+            item->err = ESP_FAIL;
+            mesh_batch_release(batch);
+        }
+    }
+    mesh_batch_release(batch);  // 组播消息持有的计数
+}
+#endif
+
+// 在 app_user_task() 中调用：节点执行完（渐变+延时）的组播，提交确认GET
+static void mesh_batch_verify_task(void)
+{
+    #if MESH_GROUP_VERIFY
+    while (1) {
+        mesh_batch_t *batch = NULL;
+        TickType_t now = xTaskGetTickCount();
+        taskENTER_CRITICAL(&mesh_cloud_lock);
+        for (mesh_batch_t **p = &mesh_batch_verify_list; *p != NULL; p = &(*p)->next) {
+            if ((int32_t)(now - (*p)->verify_tick) >= 0) {
+                batch = *p;
+                *p = batch->next;
+                break;
+            }
+        }
+        taskEXIT_CRITICAL(&mesh_cloud_lock);
+        if (batch == NULL) return;
+        mesh_batch_verify_send(batch);
+    }
+    #endif
+}
+
+// 全部目标都已绑定，并且已经建立了自动分组：改成一条组播消息，return: false: 逐个单播发送
+static bool mesh_batch_group_send(mesh_batch_t *batch, const mesh_msg_t *msg)
+{
+    uint16_t uniaddr[APP_TARGET_MAX];
+    for (uint8_t i = 0; i < batch->num; i++) {
+        uniaddr[i] = batch->item[i].target.uniaddr;
+        if (uniaddr[i] == 0) return false;
+    }
+    uint32_t group_opcode = 0;
+    uint16_t group_addr = ble_mesh_group_match(uniaddr, batch->num, msg->opcode, &group_opcode);
+    if (group_addr == 0) return false;
+
+    mesh_msg_t group_msg = *msg;
+    group_msg.dst_addr = group_addr;
+    group_msg.opcode   = group_opcode;  // SET_UNACK：组内节点不逐个响应
+    batch->pending++;  // 组播消息持有一个
+    batch->grouped = true;
+    if (ble_mesh_tx_submit(&group_msg, mesh_batch_group_callback, batch) != ESP_OK) {
+        batch->pending--;  // 还没有回调，不会并发修改
+        batch->grouped = false;
+        return false;
+    }
+    #ifdef APP_USER_DEBUG_ENABLE
+    ESP_LOGI(TAG, "mesh batch => group 0x%04x, num = %d", group_addr, batch->num);
+    #endif
+    return true;
+}
+
+// 多目标mesh云端数据处理
+static bool mesh_batch_handler(app_parse_data_t parse)
+{
+    const app_target_list_t *list = parse.target;
+    mesh_msg_t msg;
+    if (mesh_cloud_msg_build(parse, &msg) == false) return false;
+    if (msg.ext != NULL) {  // 多目标指令只支持短数据（一份数据要提交给多个目标）
+        ble_mesh_pool_free(msg.ext);
+        return false;
+    }
+
+    mesh_batch_t *batch = heap_caps_calloc(1, sizeof(mesh_batch_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (batch == NULL) return false;
+    batch->num     = list->num;
+    batch->pending = list->num + 1;
+    batch->opcode  = msg.opcode;
+    batch->size    = msg.len;
+    memcpy(batch->value, msg.data, msg.len);
+    strcpy(batch->mid, mid_value);
+    snprintf(batch->key, sizeof(batch->key), "%s", parse.name);
+    snprintf(batch->addr, sizeof(batch->addr), "%s", list->addr);
+
+    for (uint8_t i = 0; i < list->num; i++) {
+        batch->item[i].target = list->target[i];
+        batch->item[i].batch  = batch;
+    }
+    if (mesh_batch_group_send(batch, &msg)) {  // 自动分组：一条组播代替逐个单播
+        mesh_batch_release(batch);  // 全部提交完成
+        return true;
+    }
+
+    for (uint8_t i = 0; i < list->num; i++) {
+        mesh_batch_item_t *item = &batch->item[i];
+        if (item->target.uniaddr == 0) {  // 没有绑定的设备
+            item->err = ESP_ERR_NOT_FOUND;
+            mesh_batch_release(batch);
+            continue;
+        }
+        msg.dst_addr = item->target.uniaddr;
+        if (ble_mesh_tx_submit(&msg, mesh_batch_callback, item) != ESP_OK) {
+            item->err = ESP_FAIL;
+            mesh_batch_release(batch);
+        }
+    }
+
+    mesh_batch_release(batch);  // 全部提交完成
+    return true;
+}
+
+//========================================================================================
+// 全部设备的状态快照（来自节点状态影子，不用发到节点）：
+// {"addr":"<MAC>","state":"all"} ==>>
+// {"addr":"0x0001","mid":"...","state":{"0x0005":{"age":3,"mac":"6055f990634a","name":"YiCW29608","pid":2,"0x8204":[1]},"0x0006":{"age":3,"0xD402E5":[[1,0]]}}}
+// age: 距离最后一次更新的秒数，-1: 没有缓存
+// rtt: 节点的平滑往返时间/MS，loss: 超时率/%（发送引擎测到的链路估计）
+// {"addr":"<MAC>","state":"stale|60"}: 同上，并在后台逐个GET超过60秒没有更新的状态（默认：影子有效期），结果按普通状态上报
+#define STATE_REFRESH_MAX       (MESH_SHADOW_SIZE * 2)
+#define STATE_REFRESH_INTERVAL  3       // 后台GET的间隔（x100ms）
+
+typedef struct {
+    char        mid[14];
+    uint16_t    num;
+    uint16_t    index;
+    mesh_msg_t *msg;    // [STATE_REFRESH_MAX]，第一次刷新时从PSRAM分配
+} state_refresh_t;
+
+static state_refresh_t state_refresh;   // 由 xSemap 保护
+
+static const uint32_t state_get_opcode[MESH_SHADOW_SIG_NUM] = {
+    ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET,
+    ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET,
+};
+
+static void state_refresh_add(uint16_t addr, uint32_t opcode, const uint8_t *data, uint8_t len)
+{
+    if (state_refresh.msg == NULL) {
+        state_refresh.msg = heap_caps_malloc(STATE_REFRESH_MAX * sizeof(mesh_msg_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (state_refresh.msg == NULL || state_refresh.num >= STATE_REFRESH_MAX) return;
+    mesh_msg_t *msg = &state_refresh.msg[state_refresh.num++];
+    memset(msg, 0, sizeof(mesh_msg_t));
+    msg->dst_addr = addr;
+    msg->opcode   = opcode;
+    msg->force    = 1;  // 一定要发到节点
+    msg->len      = len;
+    if (len > 0) memcpy(msg->data, data, len);
+}
+
+// arg: 提交时复制的 mid（state_refresh.mid 会被下一个刷新请求覆盖），在这里释放
+static void state_refresh_callback(const mesh_msg_t *msg, esp_err_t err, const mesh_transfer_t *status, void *arg)
+{
+    const char *opcode = (err == ESP_OK && status != NULL && status->len > 0) ? mesh_status_opcode_str(status->opcode) : NULL;
+    if (opcode != NULL) {
+        app_upper_cloud_format(status->unicast_addr, (char *)arg, opcode, mesh_transfer_data(status), status->len);
+    }
+    free(arg);
+}
+
+// 在 app_user_task() 中调用，每次最多提交一个GET
+static void state_refresh_task(void)
+{
+    static uint8_t refresh_time = 0;
+    if (state_refresh.index >= state_refresh.num || ++refresh_time < STATE_REFRESH_INTERVAL) return;
+    refresh_time = 0;
+    if (xSemaphoreTake(xSemap, 0) != pdTRUE) return;  // 正在解析云端指令，下次再发
+    if (state_refresh.index < state_refresh.num) {
+        mesh_msg_t *msg = &state_refresh.msg[state_refresh.index++];
+        char *mid = malloc(sizeof(state_refresh.mid));
+        if (mid != NULL) {
+            strcpy(mid, state_refresh.mid);
+            if (ble_mesh_tx_submit(msg, state_refresh_callback, mid) != ESP_OK) free(mid);  // 提交失败不会回调
+        }
+    }
+    xSemaphoreGive(xSemap);
+}
+
+// 一个元素的快照，stale > 0: 把超过 stale 没有更新的状态加入后台刷新
+static cJSON *state_snapshot_element(uint16_t addr, TickType_t stale)
+{
+    mesh_shadow_t shadow;
+    if (ble_mesh_shadow_read(addr, &shadow) == false) return NULL;
+
+    TickType_t now = xTaskGetTickCount();
+    cJSON *elem = cJSON_CreateObject();
+    if (elem == NULL) return NULL;
+    cJSON_AddNumberToObject(elem, "age", (now - shadow.tick) / configTICK_RATE_HZ);
+    for (uint8_t i = 0; i < MESH_SHADOW_SIG_NUM; i++) {
+        const mesh_shadow_state_t *state = &shadow.sig[i];
+        if (state->len == 0) continue;  // 没有缓存，或者正在SET
+        cJSON_AddItemToObject(elem, mesh_status_opcode_str(state_get_opcode[i]), app_json_int_array(state->data, state->len));
+        if (stale > 0 && (now - state->tick) > stale) {
+            state_refresh_add(addr, state_get_opcode[i], NULL, 0);
+        }
+    }
+
+    cJSON *vnd = NULL;
+    for (uint8_t i = 0; i < MESH_SHADOW_VND_NUM; i++) {
+        const mesh_shadow_state_t *state = &shadow.vnd[i];
+        if (state->len == 0) continue;
+        if (vnd == NULL) vnd = cJSON_CreateArray();
+        cJSON_AddItemToArray(vnd, app_json_int_array(state->data, state->len));
+        if (stale > 0 && (now - state->tick) > stale) {
+            state_refresh_add(addr, GENIE_MODEL_OP_ATTR_GET, state->data, 1);  // 按属性GET
+        }
+    }
+    if (vnd != NULL) {
+        cJSON_AddItemToObject(elem, mesh_status_opcode_str(GENIE_MODEL_OP_ATTR_STATUS), vnd);
+    }
+    return elem;
+}
+
+static char *state_handler(app_parse_data_t item)
+{
+    char *value = (char *)item.value;
+    if (value == NULL || item.size > 0) return "fail";  // 要字符串格式
+
+    TickType_t stale = 0;
+    if (strncmp(value, "stale", 5) == 0) {
+        uint32_t second = (value[5] == '|') ? atoi(value + 6) : MESH_SHADOW_STALE_TIME / 1000;
+        stale = pdMS_TO_TICKS(second * 1000);
+        if (stale == 0) stale = 1;  // "stale|0": 全部刷新
+        state_refresh.num   = 0;    // 新的刷新请求替换还没发完的
+        state_refresh.index = 0;
+        strcpy(state_refresh.mid, mid_value);
+    } else if (strcmp(value, "all") != 0) {
+        return "fail";
+    }
+
+    mesh_bind_t *bind = heap_caps_malloc(BIND_TABLE_SIZE * sizeof(mesh_bind_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    cJSON *snapshot = cJSON_CreateObject();
+    if (bind == NULL || snapshot == NULL) {
+        heap_caps_free(bind);
+        cJSON_Delete(snapshot);
+        return "fail";
+    }
+    uint16_t num = mesh_bind_get_all(bind, BIND_TABLE_SIZE);
+
+    char addr_str[7];
+    char mac_str[13];
+    for (uint16_t i = 0; i < num; i++) {
+        uint8_t elem_num = ble_mesh_node_element_num(bind[i].uniaddr);
+        if (elem_num == 0) elem_num = 1;
+        for (uint8_t e = 0; e < elem_num; e++) {
+            uint16_t addr = bind[i].uniaddr + e;
+            cJSON *elem = state_snapshot_element(addr, stale);
+            if (e == 0) {  // 主元素：带上绑定信息
+                if (elem == NULL) {
+                    elem = cJSON_CreateObject();
+                    if (elem == NULL) break;
+                    cJSON_AddNumberToObject(elem, "age", -1);
+                    if (stale > 0) state_refresh_add(addr, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET, NULL, 0);
+                }
+                cJSON_AddStringToObject(elem, "mac", mac_utils_hex2str(bind[i].addr, mac_str));
+                cJSON_AddStringToObject(elem, "name", bind[i].name);
+                cJSON_AddNumberToObject(elem, "pid", bind[i].pid);
+                mesh_node_t node;
+                if (mesh_node_get(bind[i].uniaddr, &node)) {
+                    cJSON_AddNumberToObject(elem, "online", node.online);
+                    if (node.last_seen > 0) {  // 收到过心跳包
+                        cJSON_AddNumberToObject(elem, "seen", (xTaskGetTickCount() - node.last_seen) / configTICK_RATE_HZ);
+                        cJSON_AddNumberToObject(elem, "hops", node.hops);
+                    }
+                    if (node.link.srtt > 0) {  // 测到过往返时间
+                        cJSON_AddNumberToObject(elem, "rtt", node.link.srtt);
+                        cJSON_AddNumberToObject(elem, "loss", node.link.loss * 100 / 0xFF);
+                    }
+                }
+            }
+            if (elem == NULL) continue;
+            sprintf(addr_str, "0x%04X", addr);
+            cJSON_AddItemToObject(snapshot, addr_str, elem);
+        }
+    }
+    heap_caps_free(bind);
+
+    #ifdef APP_USER_DEBUG_ENABLE
+    ESP_LOGI(TAG, "state: nodes = %d, refresh = %d", num, state_refresh.num);
+    #endif
+    sprintf(addr_str, "0x%04X", ROOT_OWN_ADDR);
+    app_upper_cloud_object(addr_str, mid_value, item.name, snapshot);
+    return NULL;
+}
+
+#if APP_CONFIG_MQTT_ENABLE
+// 云端发布缓存/接收缓存/离线缓存的统计：
+// "mqtt":{"publish":..,"ack":..,"timeout":..,"drop":..,"full":..,"inflight":..,"peak":..,"rx":{"msg":..,"chunk":..,"drop":..,"oversize":..,"unroute":..,"peak":..},
+//         "store":{"append":..,"replay":..,"merge":..,"stale":..,"drop":..,"compact":..,"pending":..}}
+static void metrics_add_mqtt(cJSON *metrics)
+{
+    mqtt_outbox_stats_t stats;
+    mqtt_rx_stats_t rx_stats;
+    wifi_store_stats_t store_stats;
+    app_mqtt_outbox_get_stats(&stats);
+    app_mqtt_rx_get_stats(&rx_stats);
+    wifi_store_get_stats(&store_stats);
+    cJSON *mqtt = cJSON_CreateObject();
+    if (mqtt == NULL) return;
+    cJSON_AddNumberToObject(mqtt, "publish", stats.publish);
+    cJSON_AddNumberToObject(mqtt, "ack", stats.ack);
+    cJSON_AddNumberToObject(mqtt, "timeout", stats.timeout);
+    cJSON_AddNumberToObject(mqtt, "drop", stats.drop);
+    cJSON_AddNumberToObject(mqtt, "full", stats.full);
+    cJSON_AddNumberToObject(mqtt, "inflight", stats.inflight);
+    cJSON_AddNumberToObject(mqtt, "peak", stats.peak);
+    cJSON *rx = cJSON_AddObjectToObject(mqtt, "rx");
+    if (rx != NULL) {
+        cJSON_AddNumberToObject(rx, "msg", rx_stats.msg);
+        cJSON_AddNumberToObject(rx, "chunk", rx_stats.chunk);
+        cJSON_AddNumberToObject(rx, "drop", rx_stats.drop);
+        cJSON_AddNumberToObject(rx, "oversize", rx_stats.oversize);
+        cJSON_AddNumberToObject(rx, "unroute", rx_stats.unroute);
+        cJSON_AddNumberToObject(rx, "peak", rx_stats.peak);
+    }
+    cJSON *store = cJSON_AddObjectToObject(mqtt, "store");
+    if (store != NULL) {
+        cJSON_AddNumberToObject(store, "append", store_stats.append);
+        cJSON_AddNumberToObject(store, "replay", store_stats.replay);
+        cJSON_AddNumberToObject(store, "merge", store_stats.merge);
+        cJSON_AddNumberToObject(store, "stale", store_stats.stale);
+        cJSON_AddNumberToObject(store, "drop", store_stats.drop);
+        cJSON_AddNumberToObject(store, "compact", store_stats.compact);
+        cJSON_AddNumberToObject(store, "pending", store_stats.pending);
+    }
+    cJSON_AddItemToObject(metrics, "mqtt", mqtt);
+}
+#endif
+
+// {"addr":"000000000000","metrics":"all"}: 导出全部统计；"reset": 清零
+static char *metrics_handler(app_parse_data_t item)
+{
+    char *value = (char *)item.value;
+    if (value == NULL || item.size > 0) return "fail";  // 要字符串格式
+    if (strcmp(value, "reset") == 0) {
+        ble_mesh_metrics_reset();
+        return "ok";
+    }
+    if (strcmp(value, "all") != 0) return "fail";
+
+    cJSON *metrics = ble_mesh_metrics_json(BIND_TABLE_SIZE);
+    if (metrics == NULL) return "fail";
+    #if APP_CONFIG_MQTT_ENABLE
+    metrics_add_mqtt(metrics);
+    #endif
+    char addr_str[7];
+    sprintf(addr_str, "0x%04X", ROOT_OWN_ADDR);
+    app_upper_cloud_object(addr_str, mid_value, item.name, metrics);
+    return NULL;
+}
+
+#if APP_CONFIG_MQTT_ENABLE
+// 在 app_user_task() 中定时调用：只带超时最多的几个节点，发到统计主题（不占用云端主题）
+static void metrics_publish_task(void)
+{
+    if (mqtt_connect_status(0) == false) return;
+    cJSON *metrics = ble_mesh_metrics_json(MESH_METRICS_NODE_TOP);
+    if (metrics == NULL) return;
+    metrics_add_mqtt(metrics);
+    char *metrics_str = cJSON_PrintUnformatted(metrics);
+    cJSON_Delete(metrics);
+    if (metrics_str == NULL) return;
+    app_mqtt_publish_metrics(metrics_str, strlen(metrics_str));
+    cJSON_free(metrics_str);
+}
+#endif
+
 //========================================================================================
 //========================================================================================
 //========================================================================================
  
-// 解析设备指令集
-static uint8_t app_parse_handler(app_parse_data_t parse, cJSON *item)
+// 解析设备指令集（数组/字符串值都在 app_cmd_t 的缓存中，不用再分配内存）
+static uint8_t app_parse_handler(app_parse_data_t parse, app_cmd_item_t *item)
 {
     // 系统指令集（注意：mesh设备也支持OTA!）
-    if (parse.dst_addr == ROOT_OWN_ADDR) {
-        for (uint8_t i = 0; i < SYS_TABLE_SIZE; i++) {  // 遍历键名
-            if (strcmp(item->string, sys_handler_table[i].name) == 0) {
-                switch (item->type) {   
-                case cJSON_String:
-                    parse.size  = 0;  // 字符串类似长度为0
-                    parse.value = item->valuestring;
-                    parse.name  = item->string;
-                    #ifdef APP_USER_DEBUG_ENABLE  
-                    ESP_LOGI(TAG, "%s_handler: %s", sys_handler_table[i].name, (char *)parse.value);
-                    #endif
-                    break;
-                case cJSON_Array:   
-                    parse.size  = cJSON_GetArraySize(item);
-                    parse.value = (ARRAY_TYPE *)malloc(parse.size * sizeof(ARRAY_TYPE));
-                    for (uint8_t i = 0; i < parse.size; i++) {
-                        cJSON *aitem = cJSON_GetArrayItem(item, i);  // 取值
-                        ((ARRAY_TYPE *)parse.value)[i] = aitem->valueint;
-                    }
-                    ESP_LOGI(TAG, "%s_handler: %d", sys_handler_table[i].name, ((ARRAY_TYPE *)parse.value)[0]);
-                    break;
-                case cJSON_Object:  
-                    break;
-                default:  // error type
-                    break;
-                }    
- 
-                const char *result = sys_handler_table[i].handler(parse);
-                if (result != NULL) {  // 有数据就响应！
-                    #ifdef APP_USER_DEBUG_ENABLE     
-                    ESP_LOGI(TAG, "result = %s", result);
-                    #endif
-                    app_upper_cloud_format(parse.dst_addr, mid_value, item->string, (char *)result, 0);
-                }
-                if (item->type == cJSON_Array) {  /** 是数组类型记得释放内存!!! */
-                    free(parse.value);  // 记得释放内存
-                }
+    if (parse.target == NULL && parse.dst_addr == ROOT_OWN_ADDR) {
+        const json_handler_t *sys = app_dispatch_name_find(&sys_dispatch, item->key);  // 查找键名
+        if (sys != NULL) {
+            switch (item->type) {   
+            case APP_CMD_TYPE_STRING:
+                parse.size  = 0;  // 字符串类似长度为0
+                parse.value = item->str;
+                parse.name  = item->key;
+                #ifdef APP_USER_DEBUG_ENABLE  
+                ESP_LOGI(TAG, "%s_handler: %s", sys->name, (char *)parse.value);
+                #endif
+                break;
+            case APP_CMD_TYPE_ARRAY:   
+                parse.size  = item->size;
+                parse.value = item->array;
+                if (parse.size > 0) ESP_LOGI(TAG, "%s_handler: %d", sys->name, ((ARRAY_TYPE *)parse.value)[0]);
+                break;
+            default:  // error type
                 break;
+            }    
+ 
+            const char *result = sys->handler(parse);
+            if (result != NULL) {  // 有数据就响应！
+                #ifdef APP_USER_DEBUG_ENABLE     
+                ESP_LOGI(TAG, "result = %s", result);
+                #endif
+                app_upper_cloud_format(parse.dst_addr, mid_value, item->key, (char *)result, 0);
             }
         }
         return APP_PARSE_ROOT;
     }   
  
-    if (item->type != cJSON_Array) return APP_PARSE_NULL;  // 数据类型不对
+    if (item->type != APP_CMD_TYPE_ARRAY) return APP_PARSE_NULL;  // 数据类型不对
 
-    parse.size  = cJSON_GetArraySize(item);
-    parse.value = (ARRAY_TYPE *)malloc(parse.size * sizeof(ARRAY_TYPE));
-    for (uint8_t i = 0; i < parse.size; i++) {
-        cJSON *aitem = cJSON_GetArrayItem(item, i);  // 取值
-        ((ARRAY_TYPE *)parse.value)[i] = aitem->valueint;
-    }
-    // ESP_LOGI(TAG, "%s_handler: %d", app_handler_table[i].name, ((ARRAY_TYPE *)parse.value)[0]);
-    parse.opcode = strtol(item->string, NULL, 16); // 解析出操作码
+    parse.size   = item->size;
+    parse.value  = item->array;
+    parse.name   = item->key;
+    app_dispatch_parse_opcode(item->key, &parse.opcode);  // 解析出操作码（不是操作码时为0，响应"fail"）
 
-    bool ret = mesh_cloud_handler(parse);  // mesh云端数据处理！
-    if (ret == false) {  // 错误、超时
-        app_upper_cloud_format(parse.dst_addr, mid_value, item->string, (char *)"fail", 0);
+    if (parse.target != NULL) {  // 多个目标
+        if (mesh_batch_handler(parse) == false) {  // 不支持的指令，或者提交失败
+            app_upper_cloud_object(parse.target->addr, mid_value, item->key, cJSON_CreateString("fail"));
+        }
+    } else if (mesh_cloud_handler(parse) == false) {  // mesh云端数据处理！（异步响应）
+        app_upper_cloud_format(parse.dst_addr, mid_value, item->key, (char *)"fail", 0);  // 不支持的指令，或者提交失败
     }
-
-    free(parse.value);  // 记得释放内存
  
     return APP_PARSE_NODE;
 }
 
-// 解析MQTT服务器下发的JSON数据
-uint8_t app_json_parse(cJSON *jroot)
+// 解析单个目标: "0x0005" / MAC地址"6055f990634a" / 绑定的设备名
+// return: 单播/组地址，0: 没有找到绑定的设备
+static uint16_t app_target_resolve(const char *target, uint8_t addr[6])
+{
+    if (target[0] == '0' && target[1] == 'x') {  // "0x0001"
+        return strtol(target, NULL, 16);
+    }
+
+    uint8_t len = strlen(target);
+    bool is_mac = (len == 12);
+    for (uint8_t i = 0; is_mac && i < len; i++) {
+        is_mac = isxdigit((int)target[i]);
+    }
+    if (is_mac) {
+        mac_utils_str2hex(target, addr);
+        return mesh_bind_find_uniaddr(addr);
+    }
+    return mesh_bind_find_uniaddr_name(target);
+}
+
+// 解析多个目标（用'|'分隔），会修改addr_str
+static uint8_t app_target_parse(char *addr_str, app_target_list_t *list)
+{
+    uint8_t addr[6];
+    char *saveptr = NULL;
+    snprintf(list->addr, sizeof(list->addr), "%s", addr_str);
+    list->num = 0;
+    char *temp = strtok_r(addr_str, "|", &saveptr);
+    while (temp != NULL && list->num < APP_TARGET_MAX) {
+        app_target_t *target = &list->target[list->num++];
+        snprintf(target->name, sizeof(target->name), "%s", temp);
+        target->uniaddr = app_target_resolve(temp, addr);
+        #ifdef APP_USER_DEBUG_ENABLE
+        ESP_LOGI(TAG, "target[%d] = %s, uniaddr = 0x%04x", list->num - 1, target->name, target->uniaddr);
+        #endif
+        temp = strtok_r(NULL, "|", &saveptr);
+    }
+    return list->num;
+}
+
+// 解析MQTT服务器下发的一个动作
+uint8_t app_json_parse(app_cmd_t *cmd, app_cmd_action_t *action)
 {
     uint8_t ret = 0;
     app_parse_data_t parse = { 0 };
-
-    cJSON *addr_item = cJSON_GetObjectItem(jroot, "addr");
-    if (addr_item != NULL) {
-        if (addr_item->type == cJSON_String) {  // 单播/组地址
-            if (addr_item->valuestring[1] == 'x') {  // "0x0001"
-                parse.dst_addr = strtol(addr_item->valuestring, NULL, 16);
-            } else {  // 其他地址，都为根节点地址
-                parse.dst_addr = ROOT_OWN_ADDR;
+    static app_target_list_t target_list;  // 多目标列表（只在云端解析任务中使用，放栈上太大了）
+
+    if (action->has_addr == true) {
+        if (action->addr != NULL) {  // 单播/组地址
+            if (strchr(action->addr, '|') != NULL) {  // 多个目标
+                if (app_target_parse(action->addr, &target_list) > 0) {
+                    parse.target = &target_list;
+                    parse.dst_addr = target_list.target[0].uniaddr;
+                }
+            } else if (action->addr[0] != '\0' && action->addr[1] == 'x') {  // "0x0001"
+                parse.dst_addr = strtol(action->addr, NULL, 16);
+            } else {  // MAC地址/设备名：先找绑定的设备，其他地址都为根节点地址
+                parse.dst_addr = app_target_resolve(action->addr, parse.addr);
+                if (parse.dst_addr == 0) parse.dst_addr = ROOT_OWN_ADDR;
             }
-        } else if (addr_item->type == cJSON_Number) { 
-            parse.dst_addr = addr_item->valueint;
+        } else { 
+            parse.dst_addr = action->addr_num;
         }
-        if (parse.dst_addr > 0) {
+        if (parse.dst_addr > 0 || parse.target != NULL) {
             ESP_LOGI(TAG, "parse.dst_addr = 0x%04x", parse.dst_addr);
-            cJSON_DeleteItemFromObject(jroot, "addr"); // 删除"addr"节点
         }
     }  
+
+    parse.trans_time = ble_mesh_trans_time_encode(action->tt);
+    if (action->sync) {  // 全部目标同一时间执行（情景的全部动作共用一个时间）
+        uint16_t num = (parse.target != NULL ? parse.target->num : 1) * action->item_num;
+        parse.apply_tick = (scene_apply_tick != 0) ? scene_apply_tick : ble_mesh_tx_sync_tick(num);
+    }
  
     /* ***************************** 功能指令集解析 ************************* */
-    for (uint8_t index = 0; (parse.dst_addr > 0 && index < cJSON_GetArraySize(jroot)); index++) {
-        cJSON *item = cJSON_GetArrayItem(jroot, index);
-        if (cJSON_IsNull(item))  break; // 为空
+    for (uint8_t index = 0; ((parse.dst_addr > 0 || parse.target != NULL) && index < action->item_num); index++) {
+        app_cmd_item_t *item = &cmd->item[action->item_start + index];
  
         /********************************************************************/
         if (xSemaphoreTake(xSemap, portMAX_DELAY) == pdTRUE) {  // 等待获取互斥信号量
@@ -622,53 +1413,72 @@ uint8_t app_json_parse(cJSON *jroot)
     return ret;
 }
 
-// 解析云端数据任务
-static void app_parse_cloud_task(char *data)
+// 解析云端数据任务；addr: 指令没有"addr"时的目标（节点主题的地址），NULL: 没有
+// mid: 指令没有"mid"时的消息ID（MQTT 5 的 Correlation Data），NULL/"": 没有
+static void app_parse_cloud_task(const char *data, uint16_t len, char *addr, const char *mid)
 {
+    static app_cmd_t cmd;  // 解码结果（只在MQTT/Sock接收任务中使用，放栈上太大了）
+
     led_banlk = 2;  // 接收到MQTT数据时，指示灯闪烁一次
 
-    cJSON *jroot = cJSON_Parse(data);    
-    if (jroot == NULL) {  // ERROR!!!
+    if (app_cmd_decode(data, len, &cmd) == false) {  // ERROR!!!
         #ifdef APP_USER_DEBUG_ENABLE  // debug
-        ESP_LOGE(TAG, "Sock cJSON_Parse error");
+        ESP_LOGE(TAG, "Sock app_cmd_decode error");
         #endif
         return;
     }
+    if (addr != NULL && cmd.root.has_addr == false) {
+        cmd.root.addr = addr;
+        cmd.root.has_addr = true;
+    }
  
 #if APP_CONFIG_MQTT_ENABLE
-    cJSON *mid_item = cJSON_GetObjectItem(jroot, "mid");
-    if (mid_item != NULL) {  
-        strcpy(mid_value, mid_item->valuestring);  // 得到消息ID
-        cJSON_DeleteItemFromObject(jroot, "mid");   // 删除"mid"节点
+    if (strcmp(cmd.mid, "0") == 0 && mid != NULL && mid[0] != '\0') {
+        snprintf(mid_value, sizeof(mid_value), "%s", mid);  // 消息ID在 Correlation Data 中
     } else {
-        mid_value[0] = '0';
-        mid_value[1] = '\0';
+        strcpy(mid_value, cmd.mid);  // 得到消息ID
     }
 #endif
     
 #if !SCENE_LOCAL_ENABLE  //  在线情景执行
-    cJSON *scene_item = cJSON_GetObjectItem(jroot, "srun");
-    if (scene_item != NULL) {
-        scene_run_handler(scene_item);  // 执行情景模式
+    if (cmd.scene == true) {
+        scene_run_handler(&cmd);  // 执行情景模式
     } else {
-        app_json_parse(jroot);  // 解析JSON数据
+        app_json_parse(&cmd, &cmd.root);  // 解析JSON数据
     }
 #endif
-
-    /* Remember to free memory */
-    cJSON_Delete(jroot);  
-    jroot = NULL;
 }
  
 #if APP_CONFIG_MQTT_ENABLE
-// MQTT 接收任务 {O}
+// MQTT 接收任务 {O}：设备主题 "yiree/<id>/local"
 static void mqtt_subscribe_callback(mqtt_data_t info)
 { 
     #ifdef APP_USER_DEBUG_ENABLE  // debug
     // ESP_LOGI(TAG, "Free heap, current: %d, minimum: %d", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());  // 打印内存
-    ESP_LOGI(TAG, "mqtt_subscribe_callback->data: %s | %d", info.data, info.len);
+    ESP_LOGI(TAG, "mqtt_subscribe_callback[%s]: %s | %d", info.topic, info.data, info.len);
     #endif
-    app_parse_cloud_task((char *)info.data);  
+    app_parse_cloud_task((char *)info.data, info.len, NULL, info.correlation);  
+}
+
+// 节点主题 "yiree/<id>/node/<addr>"：{"0x8202":[1]}，目标地址在主题中（"0x0005"/MAC/多个目标"|"分隔）
+static void mqtt_node_route_handler(mqtt_data_t info, void *arg)
+{
+    #ifdef APP_USER_DEBUG_ENABLE  // debug
+    ESP_LOGI(TAG, "mqtt_node_route_handler[%s]: %s | %d", info.wild, info.data, info.len);
+    #endif
+    if (info.wild[0] == '\0') return;
+    app_parse_cloud_task((char *)info.data, info.len, info.wild, info.correlation);
+}
+
+// 时间戳主题 "yiree/sntp/local"：{"addr":"000000000000","sntp":"1680161030"}，只取时间戳，不用解码整条指令
+static void mqtt_sntp_route_handler(mqtt_data_t info, void *arg)
+{
+    char *value = strstr((char *)info.data, "\"sntp\"");
+    if (value == NULL) return;
+    value += strlen("\"sntp\"");
+    while (*value != '\0' && (*value < '0' || *value > '9')) value++;  // 跳过 ':' 和 '"'
+    if (*value == '\0') return;
+    sntp_sync_time_custom( strtol(value, NULL, 10) + 1 ); // 校准时间（+1s网关延时）
 }
 #else  
 static void wifi_sock_recv_callback(sock_data_t info)
@@ -677,7 +1487,7 @@ static void wifi_sock_recv_callback(sock_data_t info)
     ESP_LOGI(TAG, "Socket Received[%d] : %s | %d", info.sock, info.data, info.len); 
     #endif
 
-    app_parse_cloud_task((char *)info.data);  
+    app_parse_cloud_task((char *)info.data, info.len, NULL, NULL);  
 }
 #endif
 
@@ -727,12 +1537,14 @@ static char *wifi_handler(char *data)
     }
 }
 
-// {"mqtt":"<HOST>|<PORT>|<USERNAME>|<USERPASSWORD>|<QOS>"} 
+// {"mqtt":"<HOST>|<PORT>|<USERNAME>|<USERPASSWORD>|<QOS>[|<VERSION>]"} 
 // 比如：{"mqtt":"iot.yiree.com.cn|1883|YiRoot|b0f7eb1accf6|0"}
+// <VERSION>：5: MQTT 5（服务器不支持时回落到 3.1.1）；没有/其他: MQTT 3.1.1
 // {"mqtt":"ok/fail"}
 #if APP_CONFIG_MQTT_ENABLE 
 static char *mqtt_handler(char *data)
 {
+    nvs_mqtt.protocol = MQTT_VERSION_311;
     char *temp = strtok(data, separator);
     for (uint8_t index = 0; temp != NULL; index++) {
         uint8_t len = strlen(temp); 
@@ -758,6 +1570,9 @@ static char *mqtt_handler(char *data)
         case 4:  // <QOS> = atoi(temp); 
             nvs_mqtt.qos = temp[0] - '0';
             break;
+        case 5:  // <VERSION>
+            nvs_mqtt.protocol = (atoi(temp) == 5) ? MQTT_VERSION_5 : MQTT_VERSION_311;
+            break;
         default:
             break;
         }
@@ -791,6 +1606,9 @@ static const ble_gatts_handler_t ble_gatts_handler_table[] = {
 }; 
 
 #define BLE_GATTS_TABLE_SIZE    (sizeof(ble_gatts_handler_table) / sizeof(ble_gatts_handler_t))
+APP_DISPATCH_TABLE_CHECK(ble_gatts_handler_table);
+
+static app_dispatch_t ble_gatts_dispatch;   // BLE配网指令键名索引
 
 // BLE_GATTS接收回调函数
 void ble_gatts_recv_callback(uint8_t idx, uint8_t *data, uint8_t len)
@@ -808,10 +1626,10 @@ void ble_gatts_recv_callback(uint8_t idx, uint8_t *data, uint8_t len)
         return;
     }
 
-    for (uint8_t i = 0; i < BLE_GATTS_TABLE_SIZE; i++) {
-        cJSON *item = cJSON_GetObjectItem(jroot, ble_gatts_handler_table[i].name);
-        if (item != NULL) { 
-            const char *result = ble_gatts_handler_table[i].handler(item->valuestring);
+    for (cJSON *item = jroot->child; item != NULL; item = item->next) {
+        const ble_gatts_handler_t *gatts = app_dispatch_name_find(&ble_gatts_dispatch, item->string);
+        if (gatts != NULL && cJSON_IsString(item)) { 
+            const char *result = gatts->handler(item->valuestring);
             if (result != NULL) {  // 有数据就响应！
                 cJSON_ReplaceItemInObject(jroot, item->string, cJSON_CreateString(result));
                 char *cjson_data = cJSON_PrintUnformatted(jroot);
@@ -838,7 +1656,7 @@ void ble_mesh_recv_callback(mesh_transfer_t param)
     ESP_LOGI(TAG, "<ble_mesh_recv_callback> unicast_addr = 0x%04x, opcode = 0x%06lx", param.unicast_addr, param.opcode);
     #endif
     const char *opcode = NULL;
-    uint16_t *data = (uint16_t *)param.data;
+    uint8_t *data = mesh_transfer_data(&param);  // 大端格式
  
     switch (param.opcode) {
     case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET:
@@ -852,28 +1670,145 @@ void ble_mesh_recv_callback(mesh_transfer_t param)
     case ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS:
         opcode = "0x8278";
         #ifdef APP_USER_DEBUG_ENABLE
-        ESP_LOGI(TAG, "LIGHT_HSL_GET: HSL: %d %d %d", data[0], data[1], data[2]);
+        ESP_LOGI(TAG, "LIGHT_HSL_GET: HSL: %d %d %d", BIG_DATA_2_OCTET(data, 0), BIG_DATA_2_OCTET(data, 2), BIG_DATA_2_OCTET(data, 4));
         #endif
         break;
     case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_GET:
     case ESP_BLE_MESH_MODEL_OP_LIGHT_CTL_STATUS:
         opcode = "0x8260"; 
         #ifdef APP_USER_DEBUG_ENABLE
-        ESP_LOGI(TAG, "LIGHT_CTL_GET: lightness %d, temperature %d", data[0], data[1]);
+        ESP_LOGI(TAG, "LIGHT_CTL_GET: lightness %d, temperature %d", BIG_DATA_2_OCTET(data, 0), BIG_DATA_2_OCTET(data, 2));
         #endif
         break;
     case GENIE_MODEL_OP_ATTR_GET:     // 响应
     case GENIE_MODEL_OP_ATTR_STATUS:  // 接收 
         opcode = "0xD402E5";
         #ifdef APP_USER_DEBUG_ENABLE
-        esp_log_buffer_hex("ble_mesh data", param.data, param.len);   
+        esp_log_buffer_hex("ble_mesh data", data, param.len);   
         #endif
         break;
     default:
         break;
     }
     if (opcode == NULL) return;
-    app_upper_cloud_format(param.unicast_addr, mid_value, opcode, param.data, param.len);
+    app_upper_cloud_format(param.unicast_addr, mid_value, opcode, data, param.len);
+}
+
+// 批量配网：每个设备的结果 "bind":{"<MAC>":"0x0005"}
+static void ble_mesh_prov_callback(const mesh_prov_result_t *result)
+{
+    cJSON *bind = cJSON_CreateObject();
+    if (bind == NULL) return;
+    char mac_str[13], addr_str[8];
+    mac_utils_hex2str(result->addr, mac_str);
+    if (result->uniaddr > 0) {
+        sprintf(addr_str, "0x%04X", result->uniaddr);
+        cJSON_AddStringToObject(bind, mac_str, addr_str);
+    } else {
+        cJSON_AddStringToObject(bind, mac_str, "fail");
+    }
+    sprintf(addr_str, "0x%04X", ROOT_OWN_ADDR);
+    app_upper_cloud_object(addr_str, mid_bind_value, "bind", bind);
+}
+
+// 解绑进度：单个解绑回复单播地址，批量解绑上报每个节点的结果
+static void ble_mesh_reset_callback(const mesh_reset_result_t *result, uint16_t remain)
+{
+    char addr_str[8], root_str[8];
+    sprintf(root_str, "0x%04X", ROOT_OWN_ADDR);
+    if (result->uniaddr == 0x0000) {  // 全部解绑完成
+        app_upper_cloud_format(ROOT_OWN_ADDR, mid_unbind_value, "unbind", (char *)"all", 0);
+        return;
+    }
+    sprintf(addr_str, "0x%04X", result->uniaddr);
+    if (result->uniaddr == unbind_single) {
+        unbind_single = 0x0000;
+        app_upper_cloud_format(ROOT_OWN_ADDR, mid_unbind_value, "unbind", addr_str, 0);
+        return;
+    }
+    cJSON *unbind = cJSON_CreateObject();
+    if (unbind == NULL) return;
+    cJSON_AddStringToObject(unbind, addr_str, result->ack ? "ok" : "offline");
+    cJSON_AddNumberToObject(unbind, "remain", remain);
+    app_upper_cloud_object(root_str, mid_unbind_value, "unbind", unbind);
+}
+
+// 节点固件分发进度："ota":{"plan":50}
+static void ble_mesh_ota_progress_callback(uint8_t plan)
+{
+    char root_str[8];
+    sprintf(root_str, "0x%04X", ROOT_OWN_ADDR);
+    cJSON *ota = cJSON_CreateObject();
+    if (ota == NULL) return;
+    cJSON_AddNumberToObject(ota, "plan", plan);
+    app_upper_cloud_object(root_str, mid_ota_value, "ota", ota);
+}
+
+// 节点固件分发结束："ota":{"0x0005":"ok","0x0007":"fail"}，然后释放固件
+static void ble_mesh_ota_result_callback(const mesh_ota_result_t *result, uint8_t num)
+{
+    char addr_str[8], root_str[8];
+    sprintf(root_str, "0x%04X", ROOT_OWN_ADDR);
+    cJSON *ota = cJSON_CreateObject();
+    if (ota != NULL) {
+        for (uint8_t i = 0; i < num; i++) {
+            sprintf(addr_str, "0x%04X", result[i].uniaddr);
+            cJSON_AddStringToObject(ota, addr_str, result[i].ok ? "ok" : "fail");
+        }
+        app_upper_cloud_object(root_str, mid_ota_value, "ota", ota);
+    }
+    wifi_ota_node_image_release();
+}
+
+// 节点固件下载完成（OTA进度200），分发给目标节点
+static void app_mesh_ota_start(void)
+{
+    uint32_t size = 0;
+    const uint8_t *image = wifi_ota_node_image(&size);
+    if (image == NULL) return;
+
+    uint16_t uniaddr[MESH_OTA_TARGET_MAX];
+    uint8_t num = 0;
+    mesh_node_t target;
+    uint16_t addr = mesh_bind_find_uniaddr(app_get_ota_addr());
+    if (addr != 0 && mesh_node_get(addr, &target)) {
+        uniaddr[num++] = addr;
+        mesh_node_t *node = ota_node_all ? heap_caps_malloc(sizeof(mesh_node_t) * BIND_TABLE_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : NULL;
+        if (node != NULL) {
+            uint16_t node_num = mesh_node_get_all(node, BIND_TABLE_SIZE);
+            for (uint16_t i = 0; i < node_num && num < MESH_OTA_TARGET_MAX; i++) {
+                if (node[i].bind.uniaddr != addr && node[i].bind.pid == target.bind.pid) {
+                    uniaddr[num++] = node[i].bind.uniaddr;
+                }
+            }
+            heap_caps_free(node);
+        }
+    }
+    esp_err_t err = (num > 0) ? ble_mesh_ota_start(image, size, uniaddr, num) : ESP_ERR_NOT_FOUND;
+    #ifdef APP_USER_DEBUG_ENABLE  // debug
+    ESP_LOGI(TAG, "mesh ota: %d nodes, err = 0x%x", num, err);
+    #endif
+    if (err != ESP_OK) {
+        wifi_ota_node_image_release();
+        app_upper_cloud_format(ROOT_OWN_ADDR, mid_ota_value, "ota", (char *)"-1", 0);  // 没有可以升级的节点
+    }
+}
+
+// 节点上线/离线：只上报有变化的节点，如 "online":{"0x0005":1,"0x0007":0}
+void ble_mesh_presence_callback(const mesh_presence_t *evt, uint16_t num)
+{
+    cJSON *online = cJSON_CreateObject();
+    if (online == NULL) return;
+    char addr_str[7];
+    for (uint16_t i = 0; i < num; i++) {
+        #ifdef APP_USER_DEBUG_ENABLE
+        ESP_LOGI(TAG, "<ble_mesh_presence_callback> unicast_addr = 0x%04x, online = %d, hops = %d", evt[i].uniaddr, evt[i].online, evt[i].hops);
+        #endif
+        sprintf(addr_str, "0x%04X", evt[i].uniaddr);
+        cJSON_AddNumberToObject(online, addr_str, evt[i].online);
+    }
+    sprintf(addr_str, "0x%04X", ROOT_OWN_ADDR);
+    app_upper_cloud_object(addr_str, "0", "online", online);
 }
 
 //===================================================================================================================
@@ -936,6 +1871,10 @@ void app_ble_init_task(void *arg)
             }
             app_ble_mesh_init();         // 再初始化BLE MESH
             ble_mesh_register_callback(ble_mesh_recv_callback);
+            ble_mesh_register_presence_callback(ble_mesh_presence_callback);
+            ble_mesh_prov_register_callback(ble_mesh_prov_callback);
+            ble_mesh_reset_register_callback(ble_mesh_reset_callback);
+            ble_mesh_ota_register_callback(ble_mesh_ota_progress_callback, ble_mesh_ota_result_callback);
             #if 0  // 使能GATTC
             vTaskDelay(500);
             app_ble_gattc_init(); 
@@ -978,6 +1917,11 @@ void app_user_init(void)
 {
     ESP_LOGI(TAG, "app_user_init...");
     mid_value[0] = '0';
+    // 表项数已由 APP_DISPATCH_TABLE_CHECK() 在编译期检查，这里返回 false 只可能是表被改成了运行时生成
+    bool dispatch_ok = app_dispatch_name_init(&sys_dispatch, sys_handler_table, sizeof(json_handler_t), SYS_TABLE_SIZE);
+    dispatch_ok &= app_dispatch_name_init(&ble_gatts_dispatch, ble_gatts_handler_table, sizeof(ble_gatts_handler_t), BLE_GATTS_TABLE_SIZE);
+    dispatch_ok &= app_dispatch_opcode_init(&mesh_cloud_dispatch, mesh_cloud_op_table, sizeof(mesh_cloud_op_t), APP_DISPATCH_TABLE_SIZE(mesh_cloud_op_table));
+    ESP_ERROR_CHECK(dispatch_ok ? ESP_OK : ESP_ERR_INVALID_SIZE);
     xSemap = xSemaphoreCreateMutex();      // 创建互斥量
     app_get_self_info(&self);  // 读设备自己的信息 
     nvs_wifi_handle(&nvs_wifi, NVS_READONLY);   // 先读WIFI信息
@@ -987,6 +1931,7 @@ void app_user_init(void)
     hal_uart_init(uart_recv_callback);
     hal_voice_init();
     hal_spiffs_init();      // partitions.csv -> spiffs
+    wifi_store_init();      // 离线上报缓存（放在 spiffs）
     // hal_usb_msc_init();  // partitions.csv -> storage
     spiffs_print_files();
     xTaskCreatePinnedToCore(app_user_task, "app_user", 4 * 1024, NULL, 5, NULL, APP_CPU_NUM);
@@ -1006,7 +1951,9 @@ void app_user_init(void)
 #if APP_CONFIG_MQTT_ENABLE
     nvs_mqtt_handle(&nvs_mqtt, NVS_READONLY);   
     app_mqtt_init(&nvs_mqtt);  
-    mqtt_subscribe_register_callback(mqtt_subscribe_callback);
+    mqtt_subscribe_register_callback(mqtt_subscribe_callback);  // "~/local"（默认路由）
+    app_mqtt_route_register("yiree/sntp/local", mqtt_sntp_route_handler, NULL);
+    app_mqtt_route_register("~/node/+", mqtt_node_route_handler, NULL);
 #else // TCP/UDP
     wifi_sock_init();
     wifi_sock_register_callback(wifi_sock_recv_callback);  
@@ -0,0 +1,70 @@
+/**
+ * @file    app_cmd.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   云端指令解码（单次遍历，不分配堆内存）
+ * @version 0.1
+ * @date    2023-08-04
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __APP_CMD_H__
+#define __APP_CMD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APP_CMD_ACTION_MAX      16      // 情景"action"最多的动作数
+#define APP_CMD_ITEM_MAX        32      // 一条消息最多的键值对（全部动作加起来）
+#define APP_CMD_ARENA_SIZE      1536    // 键名/字符串/数组值的缓存
+#define APP_CMD_MID_LEN         14      // 消息ID：10位时间戳 + 3位编码
+
+enum {
+    APP_CMD_TYPE_NULL = 0,  // 不支持的类型（对象/布尔/null），只保留键名
+    APP_CMD_TYPE_STRING,
+    APP_CMD_TYPE_NUMBER,
+    APP_CMD_TYPE_ARRAY,     // 整数数组，每个元素按uint8_t截取（与cJSON valueint 强转一致）
+};
+
+typedef struct {
+    char    *key;       // 键名
+    char    *str;       // APP_CMD_TYPE_STRING: 可写的字符串（系统指令会原地修改）
+    uint8_t *array;     // APP_CMD_TYPE_ARRAY
+    uint16_t size;      // 数组长度
+    int32_t  number;    // APP_CMD_TYPE_NUMBER
+    uint8_t  type;
+} app_cmd_item_t;
+
+typedef struct {
+    char    *addr;          // "addr"为字符串时
+    uint16_t addr_num;      // "addr"为数字时
+    bool     has_addr;
+    bool     sync;          // "sync":1 全部目标同一时间执行
+    uint32_t tt;            // "tt" 渐变时间/MS，0: 立即
+    uint8_t  item_start;    // 在 app_cmd_t.item[] 中的位置
+    uint8_t  item_num;
+} app_cmd_action_t;
+
+typedef struct {
+    char     mid[APP_CMD_MID_LEN];  // 没有"mid"时为"0"
+    char    *dtime;                 // 情景"dtime"
+    bool     scene;                 // 有"srun"：执行 action[]，忽略 root
+    app_cmd_action_t root;          // 顶层的"addr"和指令
+    uint8_t  action_num;
+    app_cmd_action_t action[APP_CMD_ACTION_MAX];
+    uint8_t  item_num;
+    app_cmd_item_t item[APP_CMD_ITEM_MAX];
+    uint16_t arena_used;
+    char     arena[APP_CMD_ARENA_SIZE];
+} app_cmd_t;
+
+/**
+ * @brief  解码云端下发的JSON指令
+ *
+ * @param data ：JSON数据（不要求以'\0'结尾，不会被修改）
+ * @param len ：数据长度
+ * @param cmd ：解码结果，字符串/数组都放在 cmd->arena 中
+ * @return true: 成功；false: JSON格式错误或超出缓存
+ */
+bool app_cmd_decode(const char *data, uint16_t len, app_cmd_t *cmd);
+
+#endif /* __APP_CMD_H__ */
@@ -0,0 +1,65 @@
+/**
+ * @file    app_dispatch.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   指令分发：键名/操作码 => 处理表项，哈希索引 O(1) 查找
+ *          云端、BLE-GATTS（以及以后的局域网）入口共用
+ * @version 0.1
+ * @date    2023-08-05
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __APP_DISPATCH_H__
+#define __APP_DISPATCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APP_DISPATCH_SLOT_MAX   64      // 哈希槽数（2的幂），表项数不超过一半
+#define APP_DISPATCH_NUM_MAX    (APP_DISPATCH_SLOT_MAX / 2)   // 一张处理表最多的表项数
+
+typedef struct {
+    const void *table;      // 处理表首地址
+    uint16_t    stride;     // 每个表项的大小
+    uint8_t     num;        // 表项数
+    uint8_t     mask;       // 槽数 - 1
+    bool        opcode;     // true: 表项第一个成员为 uint32_t 操作码；false: 为 const char *name
+    uint8_t     slot[APP_DISPATCH_SLOT_MAX];   // 表项下标，0xFF: 空
+} app_dispatch_t;
+
+#define APP_DISPATCH_TABLE_SIZE(table)   (sizeof(table) / sizeof(table[0]))
+
+// 编译期检查处理表的表项数，超过 APP_DISPATCH_NUM_MAX 时编译报错（而不是运行时截断）
+#define APP_DISPATCH_TABLE_CHECK(table)  \
+    _Static_assert(APP_DISPATCH_TABLE_SIZE(table) <= APP_DISPATCH_NUM_MAX, #table " too large for app_dispatch")
+
+/**
+ * @brief  建立键名索引（表项第一个成员必须是 const char *name）
+ * @return false: 表项数超过 APP_DISPATCH_NUM_MAX，索引为空（查找都返回 NULL）
+ */
+bool app_dispatch_name_init(app_dispatch_t *dispatch, const void *table, uint16_t stride, uint8_t num);
+
+/**
+ * @brief  建立操作码索引（表项第一个成员必须是 uint32_t opcode）
+ * @return false: 表项数超过 APP_DISPATCH_NUM_MAX，索引为空（查找都返回 NULL）
+ */
+bool app_dispatch_opcode_init(app_dispatch_t *dispatch, const void *table, uint16_t stride, uint8_t num);
+
+/**
+ * @brief  按键名查找表项
+ * @return NULL: 没有找到
+ */
+const void *app_dispatch_name_find(const app_dispatch_t *dispatch, const char *name);
+
+/**
+ * @brief  按操作码查找表项
+ * @return NULL: 没有找到
+ */
+const void *app_dispatch_opcode_find(const app_dispatch_t *dispatch, uint32_t opcode);
+
+/**
+ * @brief  解析云端的操作码键名，如: "0x8202"、"0xD102E5"
+ * @return false: 不是操作码
+ */
+bool app_dispatch_parse_opcode(const char *key, uint32_t *opcode);
+
+#endif /* __APP_DISPATCH_H__ */
@@ -20,6 +20,21 @@
 #define APP_PARSE_NODE  0x02
 #define APP_PARSE_EXIT  0xFF   // 退出 
 
+#define APP_TARGET_MAX       20     // 一条指令最多的目标数（同 MESH_GROUP_MEMBER_MAX）
+#define APP_TARGET_NAME_LEN  17     // 目标名：MAC地址 / 设备名 / "0x0005"
+#define APP_ADDR_STR_MAX     (APP_TARGET_MAX * APP_TARGET_NAME_LEN)
+
+typedef struct {
+    char     name[APP_TARGET_NAME_LEN];  // 云端下发的目标
+    uint16_t uniaddr;                    // 0: 没有找到绑定的设备
+} app_target_t;
+
+typedef struct {
+    uint8_t      num;
+    app_target_t target[APP_TARGET_MAX];
+    char         addr[APP_ADDR_STR_MAX];   // 云端下发的原始"addr"
+} app_target_list_t;  // 多目标列表: "addr":"6055f990634a|0x0005|YiCW29608"
+
 typedef struct {
 #define ARRAY_TYPE  uint8_t     /* 定义[void *value] 为数组类型时的数据类型 */
     uint8_t addr[6];     // mesh mac_addr
@@ -29,6 +44,9 @@ typedef struct {
     void    *value;
     cJSON   *json;       // 存放原始JSON的
     uint16_t size;
+    const app_target_list_t *target;  // 多目标列表（NULL: 单个目标）
+    uint8_t  trans_time; // mesh 渐变时间（Transition Time 编码）
+    uint32_t apply_tick; // mesh 同步执行的时间（tick），0: 不同步
 } app_parse_data_t;
  
 void app_user_init(void); 
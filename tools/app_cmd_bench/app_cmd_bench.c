@@ -0,0 +1,176 @@
+/**
+ * @file    app_cmd_bench.c
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   主机上的云端指令解码基准测试
+ *          - app_cmd_decode()：单次遍历，解码到 app_cmd_t，不分配堆内存；
+ *          - 原来的 cJSON 路径（APP_CMD_BENCH_CJSON）：cJSON_Parse()、按键名查找/删除"mid"/"addr"、
+ *            逐个取数组元素并为每个数组值 malloc()，和 app_user.c 以前的写法一致；
+ *          - 每条样例先比较两条路径解出的动作数/键值对数，再分别计时，输出每条消息的耗时和堆分配次数。
+ * @version 0.1
+ * @date    2023-08-04
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "app_cmd.h"
+#ifdef APP_CMD_BENCH_CJSON
+#include "cJSON.h"
+#endif
+
+#define BENCH_LOOP      200000
+
+typedef struct {
+    const char *name;
+    const char *json;
+} bench_sample_t;
+
+static const bench_sample_t bench_sample[] = {
+    { "onoff",  "{\"addr\":\"0x0005\",\"mid\":\"1680161030001\",\"0x8202\":[1]}" },
+    { "hsl",    "{\"addr\":\"6055f990634a\",\"mid\":\"1680161030002\",\"tt\":500,\"0x8276\":[255,255,0,128,0,64]}" },
+    { "vendor", "{\"addr\":\"0x0007\",\"mid\":\"1680161030003\",\"0xD1\":[1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,"
+                "17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32]}" },
+    { "multi",  "{\"addr\":\"0x0005|0x0007|0x0009|6055f990634a\",\"mid\":\"1680161030004\",\"sync\":1,\"0x8202\":[0]}" },
+    { "sntp",   "{\"addr\":\"000000000000\",\"sntp\":\"1680161030\"}" },
+    { "scene",  "{\"mid\":\"1680161030005\",\"srun\":{\"dtime\":\"1687228356\",\"sync\":1,\"tt\":500,\"action\":["
+                "{\"addr\":\"0x0005\",\"0x8202\":[1]},{\"addr\":\"0x0007\",\"0x8202\":[1]},"
+                "{\"addr\":\"0x0009\",\"0x8276\":[255,255,0,128,0,64]},{\"addr\":\"0x000B\",\"0x825E\":[100,0,32,78]},"
+                "{\"addr\":\"0x000D\",\"0x8202\":[0]},{\"addr\":\"0x000F\",\"0xD1\":[1,2,3,4]},"
+                "{\"addr\":\"0x0011\",\"0x8202\":[1]},{\"addr\":\"0x0013\",\"0x8202\":[1]}]}}" },
+};
+
+static volatile uint32_t bench_sink = 0;  // 防止编译器优化掉解码结果
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//============================================================================================
+static app_cmd_t cmd;  // 和 app_parse_cloud_task() 一样放在静态区
+
+// return: 动作数 << 8 | 键值对数，< 0: 解码失败
+static int bench_decode(const char *json, uint16_t len)
+{
+    if (app_cmd_decode(json, len, &cmd) == false) return -1;
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < cmd.item_num; i++) {
+        if (cmd.item[i].type == APP_CMD_TYPE_ARRAY && cmd.item[i].size > 0) sum += cmd.item[i].array[0];
+    }
+    bench_sink += sum;
+    return ((cmd.scene ? cmd.action_num : 1) << 8) | cmd.item_num;
+}
+
+#ifdef APP_CMD_BENCH_CJSON
+static uint32_t bench_malloc_num = 0;
+
+static void *bench_malloc(size_t size)
+{
+    bench_malloc_num++;
+    return malloc(size);
+}
+
+// 原来 app_parse_handler() 的取值：数组值复制到 malloc() 的缓存
+static uint16_t bench_cjson_action(cJSON *jroot)
+{
+    uint16_t num = 0;
+    cJSON *addr_item = cJSON_GetObjectItem(jroot, "addr");
+    if (addr_item != NULL) {
+        cJSON_DeleteItemFromObject(jroot, "addr");
+    }
+    for (uint8_t index = 0; index < cJSON_GetArraySize(jroot); index++) {
+        cJSON *item = cJSON_GetArrayItem(jroot, index);
+        if (cJSON_IsNull(item)) break;
+        if (strcmp(item->string, "tt") == 0 || strcmp(item->string, "sync") == 0) continue;  // 执行方式，不是指令
+        num++;
+        if (item->type != cJSON_Array) continue;
+        uint8_t size = cJSON_GetArraySize(item);
+        uint8_t *value = bench_malloc(size);
+        for (uint8_t i = 0; i < size; i++) {
+            value[i] = cJSON_GetArrayItem(item, i)->valueint;
+        }
+        if (size > 0) bench_sink += value[0];
+        free(value);
+    }
+    return num;
+}
+
+// 原来的 app_parse_cloud_task()/scene_run_handler()；return: 同 bench_decode()
+static int bench_cjson(const char *json)
+{
+    static char mid_value[APP_CMD_MID_LEN];
+    cJSON *jroot = cJSON_Parse(json);
+    if (jroot == NULL) return -1;
+    cJSON *mid_item = cJSON_GetObjectItem(jroot, "mid");
+    if (mid_item != NULL) {
+        snprintf(mid_value, sizeof(mid_value), "%s", mid_item->valuestring);
+        cJSON_DeleteItemFromObject(jroot, "mid");
+    }
+    int ret = 0;
+    cJSON *scene_item = cJSON_GetObjectItem(jroot, "srun");
+    if (scene_item != NULL) {
+        uint16_t num = 0;
+        cJSON *action_item = cJSON_GetObjectItem(scene_item, "action");
+        uint8_t size = cJSON_GetArraySize(action_item);
+        for (uint8_t i = 0; i < size; i++) {
+            cJSON *arr_item = cJSON_GetArrayItem(action_item, i);
+            if (arr_item->type != cJSON_Object) continue;
+            num += bench_cjson_action(arr_item);
+        }
+        ret = (size << 8) | num;
+    } else {
+        ret = (1 << 8) | bench_cjson_action(jroot);
+    }
+    cJSON_Delete(jroot);
+    return ret;
+}
+#endif
+
+//============================================================================================
+int main(void)
+{
+#ifdef APP_CMD_BENCH_CJSON
+    cJSON_Hooks hooks = { .malloc_fn = bench_malloc, .free_fn = free };
+    cJSON_InitHooks(&hooks);
+    printf("%-8s %6s %12s %12s %8s %12s\n", "sample", "bytes", "decode ns", "cJSON ns", "speedup", "cJSON mallocs");
+#else
+    printf("cJSON not found (CJSON_DIR), app_cmd_decode() only\n");
+    printf("%-8s %6s %12s\n", "sample", "bytes", "decode ns");
+#endif
+    int fail = 0;
+    for (size_t s = 0; s < sizeof(bench_sample) / sizeof(bench_sample[0]); s++) {
+        const char *json = bench_sample[s].json;
+        uint16_t len = strlen(json);
+        int result = bench_decode(json, len);
+        if (result < 0) {
+            printf("%-8s decode fail\n", bench_sample[s].name);
+            fail++;
+            continue;
+        }
+        double start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_LOOP; i++) bench_decode(json, len);
+        double decode_ns = (bench_now_ns() - start) / BENCH_LOOP;
+
+#ifdef APP_CMD_BENCH_CJSON
+        if (bench_cjson(json) != result) {  // 两条路径解出的动作数/键值对数要一致
+            printf("%-8s result mismatch: decode 0x%x, cJSON 0x%x\n", bench_sample[s].name, result, bench_cjson(json));
+            fail++;
+            continue;
+        }
+        bench_malloc_num = 0;
+        start = bench_now_ns();
+        for (uint32_t i = 0; i < BENCH_LOOP; i++) bench_cjson(json);
+        double cjson_ns = (bench_now_ns() - start) / BENCH_LOOP;
+        printf("%-8s %6d %12.0f %12.0f %7.1fx %12.1f\n", bench_sample[s].name, len, decode_ns, cjson_ns,
+               cjson_ns / decode_ns, (double)bench_malloc_num / BENCH_LOOP);
+#else
+        printf("%-8s %6d %12.0f\n", bench_sample[s].name, len, decode_ns);
+#endif
+    }
+    return fail ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+/**
+ * @file    esp_log.h
+ * @author  Azolla (1228449928@qq.com)
+ * @brief   主机上编译 app_cmd.c 用的日志桩（不输出）
+ * @version 0.1
+ * @date    2023-08-04
+ *
+ * @copyright Copyright (c) 2023
+ * */
+#ifndef __ESP_LOG_H__
+#define __ESP_LOG_H__
+
+#define ESP_LOGE(tag, format, ...)  ((void)0)
+#define ESP_LOGW(tag, format, ...)  ((void)0)
+#define ESP_LOGI(tag, format, ...)  ((void)0)
+
+#endif /* __ESP_LOG_H__ */